@@ -0,0 +1,235 @@
+#include "ExecutionProfile.hh"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <phosg/Encoding.hh>
+#include <phosg/Strings.hh>
+#include <unordered_set>
+#include <vector>
+
+#include "M68KEmulator.hh"
+#include "PPC32Emulator.hh"
+
+using namespace std;
+
+
+
+// the longest run of instructions shown for each block in the report
+static const size_t MAX_BLOCK_REPORT_INSTRUCTIONS = 32;
+
+
+
+// each profile's sample delays are different, so that many short runs of the
+// same code (e.g. decompressing many small resources) aren't all sampled at
+// the same points
+static atomic<uint64_t> next_profile_number(1);
+
+ExecutionProfile::ExecutionProfile(ExecutionTrace::Architecture arch,
+    shared_ptr<MemoryContext> mem, uint64_t sample_interval)
+  : arch(arch),
+    mem(mem),
+    sample_interval(sample_interval),
+    random_state(next_profile_number++ * 0x9E3779B97F4A7C15),
+    total_count(0),
+    current_block(nullptr),
+    current_block_next_pc(0) { }
+
+ExecutionTrace::Architecture ExecutionProfile::architecture() const {
+  return this->arch;
+}
+
+ExecutionProfile::InstructionStats& ExecutionProfile::stats_for_instruction(
+    uint32_t pc) {
+  auto& stats = this->instructions[pc];
+  if (stats.count == 0) {
+    // 68K instructions are up to 10 bytes long, but there may not be that
+    // many bytes after pc
+    size_t size = (this->arch == ExecutionTrace::Architecture::M68K)
+        ? ExecutionTrace::MAX_OPCODE_SIZE : 4;
+    while ((size > 0) && !this->mem->exists(pc, size)) {
+      size -= 2;
+    }
+    stats.opcode.assign(reinterpret_cast<const char*>(this->mem->at(pc, size)), size);
+  }
+  return stats;
+}
+
+void ExecutionProfile::on_instruction(uint32_t pc, uint32_t next_pc) {
+  this->stats_for_instruction(pc).count++;
+  if (!this->current_block || (pc != this->current_block_next_pc)) {
+    this->current_block = &this->blocks[pc];
+    this->current_block->entries++;
+  }
+  this->current_block->instructions++;
+  this->current_block_next_pc = next_pc;
+  this->total_count++;
+}
+
+void ExecutionProfile::on_sample(uint32_t pc) {
+  this->stats_for_instruction(pc).count++;
+  this->total_count++;
+}
+
+uint64_t ExecutionProfile::next_sample_delay() {
+  // xorshift64; the delay is uniformly distributed around sample_interval
+  this->random_state ^= this->random_state << 13;
+  this->random_state ^= this->random_state >> 7;
+  this->random_state ^= this->random_state << 17;
+  return this->sample_interval - (this->sample_interval / 2) +
+      (this->random_state % this->sample_interval);
+}
+
+void ExecutionProfile::add(const ExecutionProfile& other) {
+  if ((other.arch != this->arch) ||
+      (other.is_sampling() != this->is_sampling())) {
+    throw invalid_argument("profiles are for different architectures or modes");
+  }
+  for (const auto& it : other.instructions) {
+    auto& stats = this->instructions[it.first];
+    if (stats.count == 0) {
+      stats.opcode = it.second.opcode;
+    }
+    stats.count += it.second.count;
+  }
+  for (const auto& it : other.blocks) {
+    auto& stats = this->blocks[it.first];
+    stats.entries += it.second.entries;
+    stats.instructions += it.second.instructions;
+  }
+  this->total_count += other.total_count;
+}
+
+// Returns the disassembly of one instruction, and sets size to its length and
+// mnemonic to the instruction's mnemonic (e.g. "move.l" or "addi")
+static string disassemble_instruction(ExecutionTrace::Architecture arch,
+    uint32_t pc, const string& opcode, size_t* size, string* mnemonic) {
+  // this happens if the instruction wasn't in valid memory
+  if (opcode.empty() ||
+      ((arch == ExecutionTrace::Architecture::PPC32) && (opcode.size() < 4))) {
+    *size = (arch == ExecutionTrace::Architecture::M68K) ? 2 : 4;
+    *mnemonic = ".incomplete";
+    return " .incomplete";
+  }
+
+  if (arch == ExecutionTrace::Architecture::M68K) {
+    StringReader r(opcode.data(), opcode.size());
+    unordered_set<uint32_t> branch_target_addresses;
+    string ret = M68KEmulator::disassemble_one(r, pc, branch_target_addresses);
+    *size = r.where();
+
+    // the disassembly starts with the opcode's words in hex
+    size_t offset = 0;
+    for (size_t x = 0; x < ((*size + 1) / 2) + 1; x++) {
+      offset = ret.find_first_not_of(' ', offset);
+      size_t end_offset = ret.find(' ', offset);
+      *mnemonic = ret.substr(offset, end_offset - offset);
+      offset = end_offset;
+    }
+    return ret;
+  }
+
+  uint32_t op = bswap32(*reinterpret_cast<const uint32_t*>(opcode.data()));
+  string disassembly = PPC32Emulator::disassemble(pc, op);
+  *size = 4;
+  *mnemonic = disassembly.substr(0, disassembly.find(' '));
+  return string_printf(" %08" PRIX32 "  ", op) + disassembly;
+}
+
+template <typename KeyT, typename StatsT, typename FnT>
+static vector<pair<KeyT, const StatsT*>> most_frequent(
+    const unordered_map<KeyT, StatsT>& m, size_t max_entries, FnT get_count) {
+  vector<pair<KeyT, const StatsT*>> ret;
+  for (const auto& it : m) {
+    ret.emplace_back(it.first, &it.second);
+  }
+  sort(ret.begin(), ret.end(), [&](const auto& a, const auto& b) {
+    uint64_t a_count = get_count(*a.second);
+    uint64_t b_count = get_count(*b.second);
+    return (a_count != b_count) ? (a_count > b_count) : (a.first < b.first);
+  });
+  if (ret.size() > max_entries) {
+    ret.resize(max_entries);
+  }
+  return ret;
+}
+
+void ExecutionProfile::print_report(FILE* stream, size_t max_entries) const {
+  const char* arch_name = (this->arch == ExecutionTrace::Architecture::M68K)
+      ? "68K" : "PowerPC";
+  if (this->is_sampling()) {
+    fprintf(stream, "%s profile: %" PRIu64 " samples, about one every %" PRIu64
+        " cycles\n", arch_name, this->total_count, this->sample_interval);
+  } else {
+    fprintf(stream, "%s profile: %" PRIu64 " instructions\n", arch_name,
+        this->total_count);
+  }
+  if (this->total_count == 0) {
+    return;
+  }
+  double total = this->total_count;
+
+  // disassemble every instruction once; this also gives the mnemonics
+  struct InstructionInfo {
+    string disassembly;
+    size_t size;
+  };
+  unordered_map<uint32_t, InstructionInfo> infos;
+  unordered_map<string, InstructionStats> mnemonic_stats;
+  for (const auto& it : this->instructions) {
+    auto& info = infos[it.first];
+    string mnemonic;
+    info.disassembly = disassemble_instruction(this->arch, it.first,
+        it.second.opcode, &info.size, &mnemonic);
+    mnemonic_stats[mnemonic].count += it.second.count;
+  }
+
+  auto get_count = [](const InstructionStats& stats) -> uint64_t {
+    return stats.count;
+  };
+
+  fprintf(stream, "\nmost frequent instructions:\n");
+  fprintf(stream, "           COUNT       %%  ADDRESS  DISASSEMBLY\n");
+  for (const auto& it : most_frequent(this->instructions, max_entries, get_count)) {
+    fprintf(stream, "%16" PRIu64 " %6.2f%%  %08" PRIX32 " %s\n",
+        it.second->count, (it.second->count * 100) / total, it.first,
+        infos.at(it.first).disassembly.c_str());
+  }
+
+  fprintf(stream, "\nmost frequent kinds of instructions:\n");
+  fprintf(stream, "           COUNT       %%  MNEMONIC\n");
+  for (const auto& it : most_frequent(mnemonic_stats, max_entries, get_count)) {
+    fprintf(stream, "%16" PRIu64 " %6.2f%%  %s\n", it.second->count,
+        (it.second->count * 100) / total, it.first.c_str());
+  }
+
+  if (this->blocks.empty()) {
+    return;
+  }
+  fprintf(stream, "\nblocks that ran the most instructions:\n");
+  auto get_block_count = [](const BlockStats& stats) -> uint64_t {
+    return stats.instructions;
+  };
+  for (const auto& it : most_frequent(this->blocks, max_entries, get_block_count)) {
+    fprintf(stream, "block at %08" PRIX32 ": %" PRIu64
+        " instructions (%.2f%%), entered %" PRIu64 " times\n", it.first,
+        it.second->instructions, (it.second->instructions * 100) / total,
+        it.second->entries);
+
+    // the block continues until the next instruction that's also the start
+    // of a block, or one that never ran
+    uint32_t pc = it.first;
+    for (size_t x = 0; x < MAX_BLOCK_REPORT_INSTRUCTIONS; x++) {
+      auto inst_it = this->instructions.find(pc);
+      if ((inst_it == this->instructions.end()) ||
+          ((x > 0) && this->blocks.count(pc))) {
+        break;
+      }
+      const auto& info = infos.at(pc);
+      fprintf(stream, "%16" PRIu64 "          %08" PRIX32 " %s\n",
+          inst_it->second.count, pc, info.disassembly.c_str());
+      pc += info.size;
+    }
+  }
+}
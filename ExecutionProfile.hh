@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "ExecutionTrace.hh"
+#include "MemoryContext.hh"
+
+
+// Collects statistics about the code an emulator runs: how many times each
+// instruction ran, how many times each kind of instruction (by mnemonic) ran,
+// and which blocks of code ran the most instructions. A block here is a run
+// of instructions that starts where execution arrived by a branch (or any
+// other non-sequential jump) and continues until the next one.
+//
+// There are two modes. In counting mode, every instruction is counted; like a
+// debug hook, this makes the emulators run one instruction at a time. In
+// sampling mode, the emulator records the address of the next instruction
+// about once every sample_interval cycles (the interval is randomized a bit,
+// so loops don't always get sampled at the same point) using an
+// InterruptManager call, so the emulators run at full speed. Sampling mode
+// doesn't record blocks.
+class ExecutionProfile {
+public:
+  static constexpr uint64_t DEFAULT_SAMPLE_INTERVAL = 1000;
+
+  // If sample_interval is zero, every instruction is counted. mem is used to
+  // read the opcodes of the instructions as they're counted, so that the
+  // report doesn't depend on what's in memory afterward; it may be null for a
+  // profile that only collects other profiles with add().
+  ExecutionProfile(ExecutionTrace::Architecture arch,
+      std::shared_ptr<MemoryContext> mem, uint64_t sample_interval = 0);
+  ExecutionProfile(const ExecutionProfile&) = delete;
+  ExecutionProfile& operator=(const ExecutionProfile&) = delete;
+  ~ExecutionProfile() = default;
+
+  ExecutionTrace::Architecture architecture() const;
+  inline bool is_sampling() const {
+    return this->sample_interval != 0;
+  }
+
+  // These are called by the emulators. In counting mode, on_instruction is
+  // called just before each instruction runs; next_pc is the address just
+  // after the instruction (where execution continues if it doesn't branch). In
+  // sampling mode, on_sample is called with the address of the instruction
+  // about to run, and next_sample_delay returns the number of cycles until
+  // the next sample should be taken.
+  void on_instruction(uint32_t pc, uint32_t next_pc);
+  void on_sample(uint32_t pc);
+  uint64_t next_sample_delay();
+
+  // Adds another profile's counts to this one. Both profiles must be for the
+  // same architecture and mode.
+  void add(const ExecutionProfile& other);
+
+  // Prints the max_entries most frequently run instructions, kinds of
+  // instructions, and blocks, with disassembly.
+  void print_report(FILE* stream, size_t max_entries = 20) const;
+
+private:
+  struct InstructionStats {
+    uint64_t count;
+    std::string opcode;
+  };
+  struct BlockStats {
+    uint64_t entries;
+    uint64_t instructions;
+  };
+
+  InstructionStats& stats_for_instruction(uint32_t pc);
+
+  ExecutionTrace::Architecture arch;
+  std::shared_ptr<MemoryContext> mem;
+  uint64_t sample_interval;
+  uint64_t random_state;
+
+  // Instructions in counting mode; samples in sampling mode
+  uint64_t total_count;
+  std::unordered_map<uint32_t, InstructionStats> instructions;
+  // Blocks by start address; these are only recorded in counting mode
+  std::unordered_map<uint32_t, BlockStats> blocks;
+  BlockStats* current_block;
+  uint32_t current_block_next_pc;
+};
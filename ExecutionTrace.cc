@@ -0,0 +1,298 @@
+#include "ExecutionTrace.hh"
+
+#include <string.h>
+
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+
+
+// A serialized trace is this header, then the initial register values, then
+// the records from oldest to newest. Each record is:
+// - u16 record size in bytes (including this field)
+// - u32 pc
+// - u8 opcode size, u8 register change count, u8 memory write count
+// - opcode bytes
+// - for each register change: u8 register index, u32 new value
+// - for each memory write: u32 address, u16 size, u8 has data, data bytes
+static const uint32_t SERIALIZED_TRACE_MAGIC = 0x45545243; // 'ETRC'
+
+struct SerializedTraceHeader {
+  uint32_t magic;
+  uint8_t arch;
+  uint8_t num_registers;
+  uint16_t unused;
+  uint64_t first_index;
+  uint64_t num_records;
+};
+
+static const size_t RECORD_HEADER_SIZE = 9;
+static const size_t MIN_BUFFER_SIZE = 0x10000;
+static const size_t MAX_RECORD_SIZE = RECORD_HEADER_SIZE +
+    ExecutionTrace::MAX_OPCODE_SIZE + 0x100 * 5 +
+    ExecutionTrace::MAX_MEMORY_WRITES * (7 + ExecutionTrace::MAX_WRITE_DATA_SIZE);
+
+
+
+ExecutionTrace::ExecutionTrace(Architecture arch,
+    shared_ptr<MemoryContext> mem, size_t capacity)
+  : arch(arch),
+    mem(mem),
+    base_regs(register_count(arch), 0),
+    prev_regs(register_count(arch), 0),
+    has_current(false),
+    capacity(capacity),
+    start_offset(0),
+    used_bytes(0),
+    first_index(0),
+    next_index(0) {
+  if (capacity < MAX_RECORD_SIZE) {
+    throw invalid_argument("trace capacity is too small");
+  }
+}
+
+ExecutionTrace::ExecutionTrace(const string& data)
+  : has_current(false),
+    start_offset(0) {
+  StringReader r(data);
+  const auto& header = r.get<SerializedTraceHeader>();
+  if (header.magic != SERIALIZED_TRACE_MAGIC) {
+    throw runtime_error("data is not an execution trace");
+  }
+  this->arch = static_cast<Architecture>(header.arch);
+  if (header.num_registers != register_count(this->arch)) {
+    throw runtime_error("trace has incorrect register count");
+  }
+  this->base_regs.resize(header.num_registers);
+  r.readx(this->base_regs.data(), header.num_registers * sizeof(uint32_t));
+  this->prev_regs = this->base_regs;
+  this->buffer = r.read(r.remaining());
+  this->capacity = this->buffer.size();
+  this->used_bytes = this->buffer.size();
+  this->first_index = header.first_index;
+  this->next_index = header.first_index + header.num_records;
+}
+
+size_t ExecutionTrace::register_count(Architecture arch) {
+  switch (arch) {
+    case Architecture::M68K:
+      return 17;
+    case Architecture::PPC32:
+      return 101;
+  }
+  throw invalid_argument("unknown architecture");
+}
+
+string ExecutionTrace::register_name(Architecture arch, uint8_t index) {
+  if (arch == Architecture::M68K) {
+    if (index < 8) {
+      return string_printf("D%hhu", index);
+    } else if (index < 16) {
+      return string_printf("A%hhu", static_cast<uint8_t>(index - 8));
+    } else if (index == 16) {
+      return "SR";
+    }
+  } else if (arch == Architecture::PPC32) {
+    static const char* special_names[5] = {"cr", "fpscr", "xer", "lr", "ctr"};
+    if (index < 32) {
+      return string_printf("r%hhu", index);
+    } else if (index < 96) {
+      return string_printf("f%d.%s", (index - 32) >> 1, (index & 1) ? "lo" : "hi");
+    } else if (index < 101) {
+      return special_names[index - 96];
+    }
+  }
+  throw out_of_range("invalid register index");
+}
+
+void ExecutionTrace::on_instruction(const uint32_t* regs, uint32_t pc,
+    const void* opcode, size_t opcode_size) {
+  if (this->has_current) {
+    this->complete_record(regs);
+  } else {
+    if (this->used_bytes == 0) {
+      memcpy(this->base_regs.data(), regs, this->base_regs.size() * sizeof(uint32_t));
+    }
+    memcpy(this->prev_regs.data(), regs, this->prev_regs.size() * sizeof(uint32_t));
+    this->pending_writes.clear();
+  }
+
+  if (opcode_size > MAX_OPCODE_SIZE) {
+    opcode_size = MAX_OPCODE_SIZE;
+  }
+  this->current_pc = pc;
+  this->current_opcode_size = opcode_size;
+  memcpy(this->current_opcode, opcode, opcode_size);
+  this->has_current = true;
+}
+
+void ExecutionTrace::finish(const uint32_t* regs) {
+  if (this->has_current) {
+    this->complete_record(regs);
+    this->has_current = false;
+  }
+}
+
+void ExecutionTrace::complete_record(const uint32_t* regs) {
+  string& w = this->scratch;
+  w.resize(RECORD_HEADER_SIZE);
+  w.append(reinterpret_cast<const char*>(this->current_opcode),
+      this->current_opcode_size);
+
+  uint8_t num_register_changes = 0;
+  for (size_t x = 0; x < this->prev_regs.size(); x++) {
+    if (regs[x] != this->prev_regs[x]) {
+      this->prev_regs[x] = regs[x];
+      w.push_back(static_cast<char>(x));
+      w.append(reinterpret_cast<const char*>(&regs[x]), sizeof(uint32_t));
+      num_register_changes++;
+    }
+  }
+
+  for (const auto& it : this->pending_writes) {
+    uint32_t addr = it.first;
+    uint16_t size = (it.second > 0xFFFF) ? 0xFFFF : it.second;
+    uint8_t has_data = (size <= MAX_WRITE_DATA_SIZE) && this->mem->exists(addr, size);
+    w.append(reinterpret_cast<const char*>(&addr), sizeof(addr));
+    w.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    w.push_back(has_data);
+    if (has_data) {
+      w.append(reinterpret_cast<const char*>(this->mem->at(addr, size)), size);
+    }
+  }
+
+  uint16_t record_size = w.size();
+  memcpy(&w[0], &record_size, sizeof(record_size));
+  memcpy(&w[2], &this->current_pc, sizeof(this->current_pc));
+  w[6] = this->current_opcode_size;
+  w[7] = num_register_changes;
+  w[8] = this->pending_writes.size();
+  this->pending_writes.clear();
+
+  this->append_record(w);
+}
+
+void ExecutionTrace::append_record(const string& data) {
+  // the buffer starts out small and grows up to the capacity, so short runs
+  // don't have to allocate the whole thing
+  if ((this->used_bytes + data.size() > this->buffer.size()) &&
+      (this->buffer.size() < this->capacity)) {
+    string new_buffer = this->linearize();
+    new_buffer.resize(min<size_t>(this->capacity,
+        max<size_t>(this->buffer.size() * 2, MIN_BUFFER_SIZE)));
+    this->buffer.swap(new_buffer);
+    this->start_offset = 0;
+  }
+  while (this->used_bytes + data.size() > this->buffer.size()) {
+    this->drop_oldest_record();
+  }
+  this->write_ring((this->start_offset + this->used_bytes) % this->buffer.size(),
+      data.data(), data.size());
+  this->used_bytes += data.size();
+  this->next_index++;
+}
+
+void ExecutionTrace::drop_oldest_record() {
+  // The dropped record's register changes are folded into base_regs, so the
+  // register values are still known at every remaining record
+  uint8_t header[RECORD_HEADER_SIZE];
+  this->read_ring(this->start_offset, header, RECORD_HEADER_SIZE);
+  uint16_t record_size;
+  memcpy(&record_size, header, sizeof(record_size));
+  size_t offset = this->start_offset + RECORD_HEADER_SIZE + header[6];
+  for (size_t x = 0; x < header[7]; x++, offset += 5) {
+    uint8_t change[5];
+    this->read_ring(offset % this->buffer.size(), change, 5);
+    memcpy(&this->base_regs.at(change[0]), &change[1], sizeof(uint32_t));
+  }
+
+  this->start_offset = (this->start_offset + record_size) % this->buffer.size();
+  this->used_bytes -= record_size;
+  this->first_index++;
+}
+
+void ExecutionTrace::read_ring(size_t offset, void* data, size_t size) const {
+  size_t first_size = min<size_t>(size, this->buffer.size() - offset);
+  memcpy(data, this->buffer.data() + offset, first_size);
+  memcpy(reinterpret_cast<uint8_t*>(data) + first_size, this->buffer.data(),
+      size - first_size);
+}
+
+void ExecutionTrace::write_ring(size_t offset, const void* data, size_t size) {
+  size_t first_size = min<size_t>(size, this->buffer.size() - offset);
+  memcpy(&this->buffer[offset], data, first_size);
+  memcpy(&this->buffer[0], reinterpret_cast<const uint8_t*>(data) + first_size,
+      size - first_size);
+}
+
+string ExecutionTrace::linearize() const {
+  string ret(this->used_bytes, '\0');
+  if (this->used_bytes) {
+    this->read_ring(this->start_offset, &ret[0], this->used_bytes);
+  }
+  return ret;
+}
+
+ExecutionTrace::Architecture ExecutionTrace::architecture() const {
+  return this->arch;
+}
+
+uint64_t ExecutionTrace::first_record_index() const {
+  return this->first_index;
+}
+
+const vector<uint32_t>& ExecutionTrace::initial_registers() const {
+  return this->base_regs;
+}
+
+vector<ExecutionTrace::Record> ExecutionTrace::records() const {
+  string data = this->linearize();
+  StringReader r(data);
+
+  vector<Record> ret;
+  ret.reserve(this->next_index - this->first_index);
+  for (uint64_t index = this->first_index; index < this->next_index; index++) {
+    size_t record_start = r.where();
+    uint16_t record_size = r.get<uint16_t>();
+    Record& rec = ret.emplace_back();
+    rec.index = index;
+    rec.pc = r.get<uint32_t>();
+    uint8_t opcode_size = r.get_u8();
+    uint8_t num_register_changes = r.get_u8();
+    uint8_t num_memory_writes = r.get_u8();
+    rec.opcode = r.readx(opcode_size);
+    for (size_t x = 0; x < num_register_changes; x++) {
+      uint8_t reg_index = r.get_u8();
+      rec.register_changes.emplace_back(reg_index, r.get<uint32_t>());
+    }
+    for (size_t x = 0; x < num_memory_writes; x++) {
+      auto& mw = rec.memory_writes.emplace_back();
+      mw.addr = r.get<uint32_t>();
+      mw.size = r.get<uint16_t>();
+      if (r.get_u8()) {
+        mw.data = r.readx(mw.size);
+      }
+    }
+    if (r.where() != record_start + record_size) {
+      throw runtime_error("trace record is corrupt");
+    }
+  }
+  return ret;
+}
+
+string ExecutionTrace::serialize() const {
+  SerializedTraceHeader header;
+  header.magic = SERIALIZED_TRACE_MAGIC;
+  header.arch = static_cast<uint8_t>(this->arch);
+  header.num_registers = this->base_regs.size();
+  header.unused = 0;
+  header.first_index = this->first_index;
+  header.num_records = this->next_index - this->first_index;
+
+  string ret(reinterpret_cast<const char*>(&header), sizeof(header));
+  ret.append(reinterpret_cast<const char*>(this->base_regs.data()),
+      this->base_regs.size() * sizeof(uint32_t));
+  ret += this->linearize();
+  return ret;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MemoryContext.hh"
+
+
+// Records a compact binary trace of the instructions an emulator executes.
+// Each record has the instruction's address and opcode bytes, the registers it
+// changed, and the memory it wrote. Records are kept in a fixed-size ring
+// buffer, so during a long run only the most recent instructions are kept.
+// This is much cheaper than printing the CPU state at every instruction, so it
+// can be left on and the trace saved only if something goes wrong. Saved
+// traces can be printed or compared with trace_dasm.
+class ExecutionTrace {
+public:
+  enum class Architecture : uint8_t {
+    M68K = 0,
+    PPC32 = 1,
+  };
+
+  struct MemoryWrite {
+    uint32_t addr;
+    uint16_t size;
+    // The data after the instruction ran. This is empty if the write was
+    // larger than MAX_WRITE_DATA_SIZE or the memory wasn't allocated (for
+    // example, if the write failed).
+    std::string data;
+  };
+
+  struct Record {
+    // The number of instructions traced before this one, including those that
+    // were dropped from the ring buffer
+    uint64_t index;
+    uint32_t pc;
+    // For 68K instructions, this is the first MAX_OPCODE_SIZE bytes at pc,
+    // which may include the following instructions
+    std::string opcode;
+    // (register index, new value); see register_name()
+    std::vector<std::pair<uint8_t, uint32_t>> register_changes;
+    std::vector<MemoryWrite> memory_writes;
+  };
+
+  static constexpr size_t DEFAULT_CAPACITY = 0x1000000;
+  static constexpr size_t MAX_OPCODE_SIZE = 10;
+  static constexpr size_t MAX_MEMORY_WRITES = 64;
+  static constexpr size_t MAX_WRITE_DATA_SIZE = 0x100;
+
+  // Creates an empty trace for recording. capacity is the size of the ring
+  // buffer in bytes.
+  ExecutionTrace(Architecture arch, std::shared_ptr<MemoryContext> mem,
+      size_t capacity = DEFAULT_CAPACITY);
+  // Parses a trace produced by serialize(). The result can't be recorded into.
+  explicit ExecutionTrace(const std::string& data);
+  ExecutionTrace(const ExecutionTrace&) = delete;
+  ExecutionTrace& operator=(const ExecutionTrace&) = delete;
+  ~ExecutionTrace() = default;
+
+  // The emulators represent their registers as an array of
+  // register_count(arch) 32-bit values. For the 68K, these are D0-D7, A0-A7,
+  // and SR; for the PowerPC, r0-r31, f0-f31 (each as two values, high half
+  // first), CR, FPSCR, XER, LR, and CTR.
+  static size_t register_count(Architecture arch);
+  static std::string register_name(Architecture arch, uint8_t index);
+
+  // These are called by the emulators. on_instruction is called just before
+  // each instruction runs; the registers at that point are also the results of
+  // the previous instruction, so this completes the previous instruction's
+  // record. finish() completes the last record after execution stops, even if
+  // it stops because an instruction failed. Registers changed between calls
+  // to execute() (while no instruction is running) aren't recorded.
+  void on_instruction(const uint32_t* regs, uint32_t pc, const void* opcode,
+      size_t opcode_size);
+  inline void on_memory_write(uint32_t addr, uint32_t size) {
+    if (this->pending_writes.size() < MAX_MEMORY_WRITES) {
+      this->pending_writes.emplace_back(addr, size);
+    }
+  }
+  void finish(const uint32_t* regs);
+
+  Architecture architecture() const;
+  // The index of the oldest record still in the ring buffer, and the register
+  // values just before it ran
+  uint64_t first_record_index() const;
+  const std::vector<uint32_t>& initial_registers() const;
+  std::vector<Record> records() const;
+
+  // The serialized form is in host byte order.
+  std::string serialize() const;
+
+private:
+  void complete_record(const uint32_t* regs);
+  void append_record(const std::string& data);
+  void drop_oldest_record();
+  void read_ring(size_t offset, void* data, size_t size) const;
+  void write_ring(size_t offset, const void* data, size_t size);
+  std::string linearize() const;
+
+  Architecture arch;
+  std::shared_ptr<MemoryContext> mem;
+
+  // Registers before the oldest record in the buffer, and after the last
+  // completed record
+  std::vector<uint32_t> base_regs;
+  std::vector<uint32_t> prev_regs;
+
+  // The instruction that's currently running, whose record hasn't been
+  // completed yet
+  bool has_current;
+  uint32_t current_pc;
+  uint8_t current_opcode_size;
+  uint8_t current_opcode[MAX_OPCODE_SIZE];
+  // (addr, size)
+  std::vector<std::pair<uint32_t, uint32_t>> pending_writes;
+  std::string scratch;
+
+  size_t capacity;
+  std::string buffer;
+  size_t start_offset;
+  size_t used_bytes;
+  uint64_t first_index;
+  uint64_t next_index;
+};
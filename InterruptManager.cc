@@ -1,57 +1,74 @@
 #include "InterruptManager.hh"
 
+#include <algorithm>
+
 using namespace std;
 
 
 
-InterruptManager::InterruptManager() : cycle_count(0) { }
+InterruptManager::InterruptManager()
+  : cycle_count(0), next_call_cycle_count(UINT64_MAX), next_sequence(0) { }
+
 
 
+static bool call_is_later(
+    const shared_ptr<InterruptManager::PendingCall>& a,
+    const shared_ptr<InterruptManager::PendingCall>& b) {
+  if (a->at_cycle_count != b->at_cycle_count) {
+    return a->at_cycle_count > b->at_cycle_count;
+  }
+  return a->sequence > b->sequence;
+}
 
 shared_ptr<InterruptManager::PendingCall> InterruptManager::add(
     uint64_t after_cycles, function<bool()> fn) {
   shared_ptr<PendingCall> ret(new PendingCall());
   ret->at_cycle_count = this->cycle_count + after_cycles;
+  ret->sequence = this->next_sequence++;
   ret->canceled = false;
   ret->completed = false;
   ret->fn = move(fn);
 
-  if (!this->head.get()) {
-    this->head = ret;
-  } else {
-    if (ret->at_cycle_count < this->head->at_cycle_count) {
-      ret->next = this->head;
-      this->head = ret;
-    } else {
-      shared_ptr<PendingCall> prev = this->head;
-      shared_ptr<PendingCall> next = this->head->next;
-      while (next.get() && next->at_cycle_count < ret->at_cycle_count) {
-        prev = next;
-        next = next->next;
-      }
-      ret->next = next;
-      prev->next = ret;
-    }
-  }
+  this->pending_calls.emplace_back(ret);
+  push_heap(this->pending_calls.begin(), this->pending_calls.end(), call_is_later);
+  this->next_call_cycle_count = this->pending_calls.front()->at_cycle_count;
 
   return ret;
 }
 
-bool InterruptManager::on_cycle_start() {
-  this->cycle_count++;
-
+bool InterruptManager::make_due_calls() {
   bool cont = true;
-  while (this->head.get() && (this->head->at_cycle_count <= this->cycle_count) && cont) {
-    shared_ptr<PendingCall> c = this->head;
-    this->head = c->next;
+  while (!this->pending_calls.empty() &&
+         (this->pending_calls.front()->at_cycle_count <= this->cycle_count) &&
+         cont) {
+    pop_heap(this->pending_calls.begin(), this->pending_calls.end(), call_is_later);
+    shared_ptr<PendingCall> c = move(this->pending_calls.back());
+    this->pending_calls.pop_back();
     if (!c->canceled) {
       cont = !c->fn();
     }
     c->completed = true;
   }
+
+  this->next_call_cycle_count = this->pending_calls.empty()
+      ? UINT64_MAX : this->pending_calls.front()->at_cycle_count;
   return cont;
 }
 
+uint64_t InterruptManager::cycles_until_next_call() const {
+  if (this->next_call_cycle_count == UINT64_MAX) {
+    return UINT64_MAX;
+  }
+  if (this->next_call_cycle_count <= this->cycle_count + 1) {
+    return 0;
+  }
+  return this->next_call_cycle_count - this->cycle_count - 1;
+}
+
 uint64_t InterruptManager::cycles() const {
   return this->cycle_count;
 }
+
+void InterruptManager::skip_cycles(uint64_t count) {
+  this->cycle_count += count;
+}
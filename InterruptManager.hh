@@ -5,6 +5,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 
 class InterruptManager {
@@ -13,8 +14,8 @@ public:
   ~InterruptManager() = default;
 
   struct PendingCall {
-    std::shared_ptr<PendingCall> next;
     uint64_t at_cycle_count;
+    uint64_t sequence;
     bool canceled;
     bool completed;
     std::function<bool()> fn;
@@ -24,13 +25,41 @@ public:
     }
   };
 
+  // Schedules fn to be called at the start of the cycle after_cycles cycles
+  // from now. Calls scheduled for the same cycle are made in the order they
+  // were added. If fn returns true, the CPU stops executing.
   std::shared_ptr<PendingCall> add(uint64_t cycle_count, std::function<bool()> fn);
 
-  bool on_cycle_start();
+  // Advances to the next cycle and makes any calls that are due. This is
+  // called by the CPU emulators before every instruction, so the common case
+  // (no calls due) is inline and only compares two integers.
+  inline bool on_cycle_start() {
+    if (++this->cycle_count < this->next_call_cycle_count) {
+      return true;
+    }
+    return this->make_due_calls();
+  }
+
+  // Returns the number of cycles that can start before any pending call
+  // becomes due, or UINT64_MAX if there are no pending calls. Canceled calls
+  // are only removed when they become due, so this may underestimate.
+  uint64_t cycles_until_next_call() const;
 
   uint64_t cycles() const;
 
+  // Advances the cycle count as if on_cycle_start() had been called count
+  // times, without making any calls. The CPU emulators use this when they run
+  // several instructions' worth of work at once; count must not be greater
+  // than cycles_until_next_call().
+  void skip_cycles(uint64_t count);
+
 protected:
+  bool make_due_calls();
+
   uint64_t cycle_count;
-  std::shared_ptr<PendingCall> head;
+  uint64_t next_call_cycle_count;
+  uint64_t next_sequence;
+  // Binary heap ordered by (at_cycle_count, sequence), with the earliest call
+  // at the front
+  std::vector<std::shared_ptr<PendingCall>> pending_calls;
 };
@@ -3,7 +3,9 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <deque>
+#include <map>
 #include <utility>
 #include <phosg/Encoding.hh>
 #include <unordered_map>
@@ -192,35 +194,48 @@ uint32_t M68KRegisters::get_reg_value(bool is_a_reg, uint8_t reg_num) {
   }
 }
 
-void M68KRegisters::set_ccr_flags(int64_t x, int64_t n, int64_t z, int64_t v,
-    int64_t c) {
-  uint8_t mask = 0xFF;
-  uint8_t replace = 0x00;
+void M68KRegisters::compute_pending_ccr() {
+  uint8_t size = this->pending_ccr.size;
+  int32_t left_value = sign_extend(this->pending_ccr.left_value, size);
+  int32_t right_value = sign_extend(this->pending_ccr.right_value, size);
 
-  int64_t values[5] = {c, v, z, n, x};
-  for (size_t x = 0; x < 5; x++) {
-    if (values[x] == 0) {
-      mask &= ~(1 << x);
-    } else if (values[x] > 0) {
-      mask &= ~(1 << x);
-      replace |= (1 << x);
-    }
+  int32_t result;
+  bool overflow, carry;
+  if (this->pending_ccr.op == PendingCCROp::ADD) {
+    // the arithmetic is done unsigned, since signed overflow is undefined
+    result = sign_extend(static_cast<uint32_t>(left_value) + static_cast<uint32_t>(right_value), size);
+    overflow = (((left_value > 0) && (right_value > 0) && (result < 0)) ||
+         ((left_value < 0) && (right_value < 0) && (result > 0)));
+
+    // this looks kind of dumb, but it's necessary to force the compiler not to
+    // sign-extend the 32-bit ints when converting to 64-bit
+    uint64_t left_value_c = static_cast<uint32_t>(left_value);
+    uint64_t right_value_c = static_cast<uint32_t>(right_value);
+    carry = (left_value_c + right_value_c) > 0xFFFFFFFF;
+
+  } else {
+    result = sign_extend(static_cast<uint32_t>(left_value) - static_cast<uint32_t>(right_value), size);
+    overflow = (((left_value > 0) && (right_value < 0) && (result < 0)) ||
+         ((left_value < 0) && (right_value > 0) && (result > 0)));
+    carry = (static_cast<uint32_t>(left_value) < static_cast<uint32_t>(right_value));
   }
 
-  this->ccr = (this->ccr & mask) | replace;
+  this->pending_ccr.op = PendingCCROp::NONE;
+  this->set_ccr_flags(this->pending_ccr.x_from_c ? carry : -1, (result < 0),
+      (result == 0), overflow, carry);
 }
 
-void M68KRegisters::set_ccr_flags_integer_add(int32_t left_value,
+// these are the original (eager) implementations, which compute the flags
+// separately from compute_pending_ccr so each can be checked against the other
+void M68KRegisters::set_ccr_flags_integer_add_eager(int32_t left_value,
     int32_t right_value, uint8_t size) {
   left_value = sign_extend(left_value, size);
   right_value = sign_extend(right_value, size);
-  int32_t result = sign_extend(left_value + right_value, size);
+  int32_t result = sign_extend(static_cast<uint32_t>(left_value) + static_cast<uint32_t>(right_value), size);
 
   bool overflow = (((left_value > 0) && (right_value > 0) && (result < 0)) ||
        ((left_value < 0) && (right_value < 0) && (result > 0)));
 
-  // this looks kind of dumb, but it's necessary to force the compiler not to
-  // sign-extend the 32-bit ints when converting to 64-bit
   uint64_t left_value_c = static_cast<uint32_t>(left_value);
   uint64_t right_value_c = static_cast<uint32_t>(right_value);
   bool carry = (left_value_c + right_value_c) > 0xFFFFFFFF;
@@ -228,11 +243,11 @@ void M68KRegisters::set_ccr_flags_integer_add(int32_t left_value,
   this->set_ccr_flags(-1, (result < 0), (result == 0), overflow, carry);
 }
 
-void M68KRegisters::set_ccr_flags_integer_subtract(int32_t left_value,
+void M68KRegisters::set_ccr_flags_integer_subtract_eager(int32_t left_value,
     int32_t right_value, uint8_t size) {
   left_value = sign_extend(left_value, size);
   right_value = sign_extend(right_value, size);
-  int32_t result = sign_extend(left_value - right_value, size);
+  int32_t result = sign_extend(static_cast<uint32_t>(left_value) - static_cast<uint32_t>(right_value), size);
 
   bool overflow = (((left_value > 0) && (right_value < 0) && (result < 0)) ||
        ((left_value < 0) && (right_value > 0) && (result > 0)));
@@ -259,7 +274,15 @@ M68KEmulator::M68KEmulator(shared_ptr<MemoryContext> mem) : should_exit(false),
   &M68KEmulator::exec_9D,
   &M68KEmulator::exec_E,
   &M68KEmulator::exec_F,
-} { }
+}, instruction_cache(INSTRUCTION_CACHE_SIZE),
+    instruction_cache_generation(1),
+    instruction_cache_start_addr(0xFFFFFFFF),
+    instruction_cache_end_addr(0),
+    differential_mode(false),
+    log_writes(false),
+    fetch_page_addr(0),
+    fetch_page_size(mem->get_page_size()),
+    fetch_page_host(nullptr) { }
 
 shared_ptr<MemoryContext> M68KEmulator::memory() {
   return this->mem;
@@ -269,13 +292,12 @@ void M68KEmulator::print_state_header(FILE* stream) {
   fprintf(stream, "\
 ---D0---/---D1---/---D2---/---D3---/---D4---/---D5---/---D6---/---D7--- \
 ---A0---/---A1---/---A2---/---A3---/---A4---/---A5---/---A6---/-A7--SP- \
-CBITS -RDADDR-=>-WRADDR- ---PC--- = INSTRUCTION\n");
+CBITS ---PC--- = INSTRUCTION\n");
 }
 
 void M68KEmulator::print_state(FILE* stream) {
   uint8_t pc_data[16];
   size_t pc_data_available = 0;
-  uint32_t orig_debug_read = this->regs.debug.read_addr;
   for (; pc_data_available < 16; pc_data_available++) {
     try {
       pc_data[pc_data_available] = this->read(this->regs.pc + pc_data_available, SIZE_BYTE);
@@ -283,22 +305,21 @@ void M68KEmulator::print_state(FILE* stream) {
       break;
     }
   }
-  this->regs.debug.read_addr = orig_debug_read;
 
   string disassembly = this->disassemble_one(pc_data, pc_data_available, this->regs.pc);
+  uint16_t sr = this->regs.get_sr();
 
   fprintf(stream, "\
 %08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 " \
 %08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 "/%08" PRIX32 " \
-%c%c%c%c%c %08" PRIX32 "=>%08" PRIX32 " %08" PRIX32 " =%s\n",
+%c%c%c%c%c %08" PRIX32 " =%s\n",
       this->regs.d[0].u, this->regs.d[1].u, this->regs.d[2].u, this->regs.d[3].u,
       this->regs.d[4].u, this->regs.d[5].u, this->regs.d[6].u, this->regs.d[7].u,
       this->regs.a[0], this->regs.a[1], this->regs.a[2], this->regs.a[3],
       this->regs.a[4], this->regs.a[5], this->regs.a[6], this->regs.a[7],
-      ((this->regs.sr & 0x10) ? 'x' : '-'), ((this->regs.sr & 0x08) ? 'n' : '-'),
-      ((this->regs.sr & 0x04) ? 'z' : '-'), ((this->regs.sr & 0x02) ? 'v' : '-'),
-      ((this->regs.sr & 0x01) ? 'c' : '-'), this->regs.debug.read_addr,
-      this->regs.debug.write_addr, this->regs.pc, disassembly.c_str());
+      ((sr & 0x10) ? 'x' : '-'), ((sr & 0x08) ? 'n' : '-'),
+      ((sr & 0x04) ? 'z' : '-'), ((sr & 0x02) ? 'v' : '-'),
+      ((sr & 0x01) ? 'c' : '-'), this->regs.pc, disassembly.c_str());
 }
 
 
@@ -332,13 +353,11 @@ uint32_t M68KEmulator::read(const ResolvedAddress& addr, uint8_t size) {
   } else if (addr.location == ResolvedAddress::Location::MEMORY) {
     return this->read(addr.addr, size);
   } else { // Location::SR
-    return this->regs.sr;
+    return this->regs.get_sr();
   }
 }
 
 uint32_t M68KEmulator::read(uint32_t addr, uint8_t size) {
-  this->regs.debug.read_addr = addr;
-
   if (size == SIZE_BYTE) {
     return this->mem->read_u8(addr);
   } else if (size == SIZE_WORD) {
@@ -374,12 +393,29 @@ void M68KEmulator::write(const ResolvedAddress& addr, uint32_t value, uint8_t si
   } else if (addr.location == ResolvedAddress::Location::MEMORY) {
     this->write(addr.addr, value, size);
   } else { // Location::SR
-    this->regs.sr = value;
+    this->regs.set_sr(value);
   }
 }
 
+// this is only used in differential mode and when tracing, so keep it out of
+// the normal write path. only differential mode needs the old value; when
+// tracing, reading it could fail (and change where execution stops) if the
+// address isn't readable.
+__attribute__((noinline)) void M68KEmulator::log_write(
+    uint32_t addr, uint32_t value, uint8_t size) {
+  uint32_t old_value = this->differential_mode ? this->read(addr, size) : 0;
+  this->write_log.emplace_back(LoggedWrite{addr, old_value, value, size});
+}
+
 void M68KEmulator::write(uint32_t addr, uint32_t value, uint8_t size) {
-  this->regs.debug.write_addr = addr;
+  if ((static_cast<uint64_t>(addr) + 4 > this->instruction_cache_start_addr) &&
+      (addr < this->instruction_cache_end_addr)) {
+    this->invalidate_instruction_cache();
+  }
+
+  if (this->log_writes) {
+    this->log_write(addr, value, size);
+  }
 
   if (size == SIZE_BYTE) {
     this->mem->write_u8(addr, value);
@@ -392,6 +428,31 @@ void M68KEmulator::write(uint32_t addr, uint32_t value, uint8_t size) {
   }
 }
 
+template <typename T>
+inline T M68KEmulator::read_instruction_data(uint32_t addr) {
+  uint32_t offset = addr - this->fetch_page_addr;
+  if (!this->fetch_page_host || (offset > this->fetch_page_size - sizeof(T))) {
+    if (!this->update_fetch_page(addr, sizeof(T))) {
+      // the data is unallocated (so this throws) or spans two pages
+      return this->mem->read<T>(addr);
+    }
+    offset = addr - this->fetch_page_addr;
+  }
+  return *reinterpret_cast<const T*>(this->fetch_page_host + offset);
+}
+
+__attribute__((noinline)) bool M68KEmulator::update_fetch_page(uint32_t addr, size_t size) {
+  uint32_t page_addr = addr & ~(this->fetch_page_size - 1);
+  if (((addr - page_addr) + size > this->fetch_page_size) ||
+      !this->mem->exists(page_addr, this->fetch_page_size)) {
+    return false;
+  }
+  this->fetch_page_addr = page_addr;
+  this->fetch_page_host = reinterpret_cast<const uint8_t*>(
+      this->mem->at(page_addr, this->fetch_page_size));
+  return true;
+}
+
 uint16_t M68KEmulator::fetch_instruction_word(bool advance) {
   return this->fetch_instruction_data(SIZE_WORD, advance);
 }
@@ -402,17 +463,17 @@ int16_t M68KEmulator::fetch_instruction_word_signed(bool advance) {
 
 uint32_t M68KEmulator::fetch_instruction_data(uint8_t size, bool advance) {
   if (size == SIZE_BYTE) {
-    uint32_t ret = this->mem->read<uint8_t>(this->regs.pc);
+    uint32_t ret = this->read_instruction_data<uint8_t>(this->regs.pc);
     this->regs.pc += (1 * advance);
     return ret;
 
   } else if (size == SIZE_WORD) {
-    uint32_t ret = bswap16(this->mem->read<uint16_t>(this->regs.pc));
+    uint32_t ret = bswap16(this->read_instruction_data<uint16_t>(this->regs.pc));
     this->regs.pc += (2 * advance);
     return ret;
 
   } else if (size == SIZE_LONG) {
-    uint32_t ret = bswap32(this->mem->read<uint32_t>(this->regs.pc));
+    uint32_t ret = bswap32(this->read_instruction_data<uint32_t>(this->regs.pc));
     this->regs.pc += (4 * advance);
     return ret;
   }
@@ -853,40 +914,42 @@ string M68KEmulator::dasm_address(StringReader& r, uint32_t opcode_start_address
 
 
 bool M68KEmulator::check_condition(uint8_t condition) {
-  // bits in the ccr are xnzvc so e.g. 0x16 means x, z, and v are set
+  // bits in the ccr are xnzvc so e.g. 0x16 means x, z, and v are set. true
+  // and false don't depend on the flags, so don't compute them for those
+  uint8_t ccr = (condition > 0x01) ? this->regs.get_ccr() : 0;
   switch (condition) {
     case 0x00: // true
       return true;
     case 0x01: // false
       return false;
     case 0x02: // hi (high, unsigned greater; c=0 and z=0)
-      return (this->regs.ccr & 0x05) == 0;
+      return (ccr & 0x05) == 0;
     case 0x03: // ls (low or same, unsigned less or equal; c=1 or z=1)
-      return (this->regs.ccr & 0x05) != 0;
+      return (ccr & 0x05) != 0;
     case 0x04: // cc (carry clear; c=0)
-      return (this->regs.ccr & 0x01) == 0;
+      return (ccr & 0x01) == 0;
     case 0x05: // cs (carry set; c=1)
-      return (this->regs.ccr & 0x01) != 0;
+      return (ccr & 0x01) != 0;
     case 0x06: // ne (not equal; z=0)
-      return (this->regs.ccr & 0x04) == 0;
+      return (ccr & 0x04) == 0;
     case 0x07: // eq (equal; z=1)
-      return (this->regs.ccr & 0x04) != 0;
+      return (ccr & 0x04) != 0;
     case 0x08: // vc (overflow clear; v=0)
-      return (this->regs.ccr & 0x02) == 0;
+      return (ccr & 0x02) == 0;
     case 0x09: // vs (overflow set; v=1)
-      return (this->regs.ccr & 0x02) != 0;
+      return (ccr & 0x02) != 0;
     case 0x0A: // pl (plus; n=0)
-      return (this->regs.ccr & 0x08) == 0;
+      return (ccr & 0x08) == 0;
     case 0x0B: // mi (minus; n=1)
-      return (this->regs.ccr & 0x08) != 0;
+      return (ccr & 0x08) != 0;
     case 0x0C: // ge (greater or equal; n=v)
-      return ((this->regs.ccr & 0x0A) == 0x00) || ((this->regs.ccr & 0x0A) == 0x0A);
+      return ((ccr & 0x0A) == 0x00) || ((ccr & 0x0A) == 0x0A);
     case 0x0D: // lt (less; n!=v)
-      return ((this->regs.ccr & 0x0A) == 0x08) || ((this->regs.ccr & 0x0A) == 0x02);
+      return ((ccr & 0x0A) == 0x08) || ((ccr & 0x0A) == 0x02);
     case 0x0E: // gt (greater; n=v && z=0)
-      return ((this->regs.ccr & 0x0E) == 0x0A) || ((this->regs.ccr & 0x0E) == 0x00);
+      return ((ccr & 0x0E) == 0x0A) || ((ccr & 0x0E) == 0x00);
     case 0x0F: // le (less or equal; n!=v || z=1)
-      return ((this->regs.ccr & 0x04) == 0x04) || ((this->regs.ccr & 0x0A) == 0x08) || ((this->regs.ccr & 0x0A) == 0x02);
+      return ((ccr & 0x04) == 0x04) || ((ccr & 0x0A) == 0x08) || ((ccr & 0x0A) == 0x02);
     default:
       throw runtime_error("invalid condition code");
   }
@@ -992,6 +1055,38 @@ void M68KEmulator::exec_0123(uint16_t opcode) {
     return;
   }
 
+  // note: the immediate value comes before any extension words for the
+  // target address, so it must be fetched first. for bit operations (a == 4),
+  // s is the operation, not the size, and the immediate value is a word
+  uint8_t fetch_size = ((s == SIZE_BYTE) || (a == 4)) ? SIZE_WORD : s;
+  uint32_t value = this->fetch_instruction_data(fetch_size);
+
+  if (a == 4) {
+    // TODO: these are all byte operations and they ignore the size field
+    auto addr = this->resolve_address(M, Xn, SIZE_BYTE);
+
+    switch (s) {
+      case 0:
+        if (addr.is_register()) {
+          uint32_t mem_value = this->read(addr, SIZE_LONG);
+          this->regs.set_ccr_flags(-1, -1, (mem_value & (1 << (value & 0x1F))) ? 0 : 1, -1, -1);
+        } else {
+          uint32_t mem_value = this->read(addr, SIZE_BYTE);
+          this->regs.set_ccr_flags(-1, -1, (mem_value & (1 << (value & 0x07))) ? 0 : 1, -1, -1);
+        }
+        break;
+      case 1:
+        throw runtime_error("unimplemented: bchg ADDR, IMM");
+      case 2:
+        throw runtime_error("unimplemented: bclr ADDR, IMM");
+      case 3:
+        throw runtime_error("unimplemented: bset ADDR, IMM");
+      default:
+        throw runtime_error("unimplemented: opcode 0:4");
+    }
+    return;
+  }
+
   // ccr/sr are allowed for ori, andi, and xori opcodes
   ResolvedAddress target;
   if (((a == 0) || (a == 1) || (a == 5)) && (M == 7) && (Xn == 4)) {
@@ -1003,8 +1098,6 @@ void M68KEmulator::exec_0123(uint16_t opcode) {
     target = this->resolve_address(M, Xn, s);
   }
 
-  uint8_t fetch_size = (s == SIZE_BYTE) ? SIZE_WORD : s;
-  uint32_t value = this->fetch_instruction_data(fetch_size);
   uint32_t mem_value = this->read(target, s);
   switch (a) {
     case 0: // ori ADDR, IMM
@@ -1020,15 +1113,13 @@ void M68KEmulator::exec_0123(uint16_t opcode) {
       break;
 
     case 2: // subi ADDR, IMM
-      this->regs.set_ccr_flags_integer_subtract(mem_value, value, s);
-      this->regs.set_ccr_flags(this->regs.ccr & 0x01, -1, -1, -1, -1);
+      this->regs.set_ccr_flags_integer_subtract(mem_value, value, s, true);
       mem_value -= value;
       this->write(target, mem_value, s);
       break;
 
     case 3: // addi ADDR, IMM
-      this->regs.set_ccr_flags_integer_add(mem_value, value, s);
-      this->regs.set_ccr_flags(this->regs.ccr & 0x01, -1, -1, -1, -1);
+      this->regs.set_ccr_flags_integer_add(mem_value, value, s, true);
       mem_value += value;
       this->write(target, mem_value, s);
       break;
@@ -1043,32 +1134,6 @@ void M68KEmulator::exec_0123(uint16_t opcode) {
       this->regs.set_ccr_flags_integer_subtract(mem_value, value, s);
       break;
 
-    case 4: {
-      // TODO: these are all byte operations and they ignore the size field
-      auto addr = this->resolve_address(M, Xn, SIZE_BYTE);
-
-      switch (s) {
-        case 0:
-          if (addr.is_register()) {
-            uint32_t mem_value = this->read(addr, SIZE_LONG);
-            this->regs.set_ccr_flags(-1, -1, (mem_value & (1 << (value & 0x1F))) ? 0 : 1, -1, -1);
-          } else {
-            uint32_t mem_value = this->read(addr, SIZE_BYTE);
-            this->regs.set_ccr_flags(-1, -1, (mem_value & (1 << (value & 0x07))) ? 0 : 1, -1, -1);
-          }
-          break;
-        case 1:
-          throw runtime_error("unimplemented: bchg ADDR, IMM");
-        case 2:
-          throw runtime_error("unimplemented: bclr ADDR, IMM");
-        case 3:
-          throw runtime_error("unimplemented: bset ADDR, IMM");
-        default:
-          throw runtime_error("unimplemented: opcode 0:4");
-      }
-      break;
-    }
-
     default:
       throw runtime_error("invalid immediate operation");
   }
@@ -1248,12 +1313,12 @@ void M68KEmulator::exec_4(uint16_t opcode) {
           this->regs.a[7] += 4;
           return;
         case 6: // trapv
-          if (this->regs.ccr & Condition::V) {
+          if (this->regs.get_ccr() & Condition::V) {
             throw runtime_error("unimplemented: overflow trap");
           }
           return;
         case 7: // rtr
-          this->regs.ccr = this->read(this->regs.a[7], SIZE_WORD);
+          this->regs.set_ccr(this->read(this->regs.a[7], SIZE_WORD));
           this->regs.pc = this->read(this->regs.a[7] + 2, SIZE_LONG);
           this->regs.a[7] += 6;
           return;
@@ -1272,10 +1337,10 @@ void M68KEmulator::exec_4(uint16_t opcode) {
         if (a == 0) { // move.w ADDR, sr
           throw runtime_error("cannot read from sr in user mode");
         } else if (a == 1) { // move.w ccr, ADDR
-          this->regs.ccr = this->read(addr, SIZE_WORD) & 0x1F;
+          this->regs.set_ccr(this->read(addr, SIZE_WORD) & 0x1F);
           return;
         } else if (a == 2) { // move.w ADDR, ccr
-          this->write(addr, this->regs.ccr, SIZE_WORD);
+          this->write(addr, this->regs.get_ccr(), SIZE_WORD);
           return;
         } else if (a == 3) { // move.w sr, ADDR
           throw runtime_error("cannot write to sr in user mode");
@@ -1707,20 +1772,23 @@ void M68KEmulator::exec_5(uint16_t opcode) {
       value = 8;
     }
 
-    // note: ccr flags are skipped when operating on an A register (M == 1)
+    // note: ccr flags are skipped when operating on an A register (M == 1),
+    // except that X is still set from the existing C
     uint32_t mem_value = this->read(addr, size);
     if (op_get_g(opcode)) {
       this->write(addr, mem_value - value, size);
       if (M != 1) {
-        this->regs.set_ccr_flags_integer_subtract(mem_value, value, size);
+        this->regs.set_ccr_flags_integer_subtract(mem_value, value, size, true);
       }
     } else {
       this->write(addr, mem_value + value, size);
       if (M != 1) {
-        this->regs.set_ccr_flags_integer_add(mem_value, value, size);
+        this->regs.set_ccr_flags_integer_add(mem_value, value, size, true);
       }
     }
-    this->regs.set_ccr_flags(this->regs.ccr & 0x01, -1, -1, -1, -1);
+    if (M == 1) {
+      this->regs.set_ccr_flags(this->regs.get_ccr() & 0x01, -1, -1, -1, -1);
+    }
   }
 }
 
@@ -1956,26 +2024,37 @@ string M68KEmulator::dasm_8(StringReader& r, uint32_t start_address, unordered_s
 
 
 
+static inline uint8_t size_for_9D_opmode(uint8_t opmode) {
+  if ((opmode & 3) == 3) {
+    return (opmode & 4) ? SIZE_LONG : SIZE_WORD;
+  }
+  return opmode & 3;
+}
+
+static inline bool is_valid_9D_opcode(uint16_t opcode) {
+  return !(((op_get_c(opcode) & 6) == 0) && (op_get_b(opcode) & 4) && (op_get_b(opcode) != 7));
+}
+
 void M68KEmulator::exec_9D(uint16_t opcode) {
+  if (!is_valid_9D_opcode(opcode)) {
+    throw runtime_error("unimplemented: opcode 9/D");
+  }
+  this->exec_9D_resolved(opcode, this->resolve_address(op_get_c(opcode),
+      op_get_d(opcode), size_for_9D_opmode(op_get_b(opcode))));
+}
+
+void M68KEmulator::exec_9D_resolved(uint16_t opcode, const ResolvedAddress& addr) {
   bool is_add = (opcode & 0xF000) == 0xD000;
 
   uint8_t dest = op_get_a(opcode);
   uint8_t opmode = op_get_b(opcode);
-  uint8_t M = op_get_c(opcode);
-  uint8_t Xn = op_get_d(opcode);
-
-  if (((M & 6) == 0) && (opmode & 4) && (opmode != 7)) {
-    throw runtime_error("unimplemented: opcode 9/D");
-  }
 
   if ((opmode & 3) == 3) {
     uint32_t mem_value;
     if (opmode & 4) { // add.l/sub.l AREG, ADDR
-      auto addr = this->resolve_address(M, Xn, SIZE_LONG);
       mem_value = this->read(addr, SIZE_LONG);
 
     } else { // add.w/sub.w AREG, ADDR (mem value is sign-extended)
-      auto addr = this->resolve_address(M, Xn, SIZE_WORD);
       mem_value = this->read(addr, SIZE_WORD);
       if (mem_value & 0x00008000) {
         mem_value |= 0xFFFF0000;
@@ -1984,42 +2063,39 @@ void M68KEmulator::exec_9D(uint16_t opcode) {
 
     // TODO: should we sign-extend here? is this always a long operation?
     if (is_add) {
-      this->regs.set_ccr_flags_integer_add(this->regs.a[dest], mem_value, SIZE_LONG);
+      this->regs.set_ccr_flags_integer_add(this->regs.a[dest], mem_value, SIZE_LONG, true);
       this->regs.a[dest] += mem_value;
     } else {
-      this->regs.set_ccr_flags_integer_subtract(this->regs.a[dest], mem_value, SIZE_LONG);
+      this->regs.set_ccr_flags_integer_subtract(this->regs.a[dest], mem_value, SIZE_LONG, true);
       this->regs.a[dest] -= mem_value;
     }
-    this->regs.set_ccr_flags(this->regs.ccr & 0x01, -1, -1, -1, -1);
     return;
   }
 
   // add.S/sub.S DREG, ADDR
   // add.S/sub.S ADDR, DREG
   uint8_t size = opmode & 3;
-  auto addr = this->resolve_address(M, Xn, size);
   uint32_t mem_value = this->read(addr, size);
   uint32_t reg_value = this->read({dest, ResolvedAddress::Location::D_REGISTER}, size);
   if (opmode & 4) {
     if (is_add) {
-      this->regs.set_ccr_flags_integer_add(mem_value, reg_value, size);
+      this->regs.set_ccr_flags_integer_add(mem_value, reg_value, size, true);
       mem_value += reg_value;
     } else {
-      this->regs.set_ccr_flags_integer_subtract(mem_value, reg_value, size);
+      this->regs.set_ccr_flags_integer_subtract(mem_value, reg_value, size, true);
       mem_value -= reg_value;
     }
     this->write(addr, mem_value, size);
   } else {
     if (is_add) {
-      this->regs.set_ccr_flags_integer_add(reg_value, mem_value, size);
+      this->regs.set_ccr_flags_integer_add(reg_value, mem_value, size, true);
       reg_value += mem_value;
     } else {
-      this->regs.set_ccr_flags_integer_subtract(reg_value, mem_value, size);
+      this->regs.set_ccr_flags_integer_subtract(reg_value, mem_value, size, true);
       reg_value -= mem_value;
     }
     this->write({dest, ResolvedAddress::Location::D_REGISTER}, reg_value, size);
   }
-  this->regs.set_ccr_flags(this->regs.ccr & 0x01, -1, -1, -1, -1);
 }
 
 string M68KEmulator::dasm_9D(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
@@ -2064,9 +2140,12 @@ string M68KEmulator::dasm_9D(StringReader& r, uint32_t start_address, unordered_
 
 void M68KEmulator::exec_A(uint16_t opcode) {
   if (this->syscall_handler) {
+    this->regs.materialize_ccr();
     if (!this->syscall_handler(*this, this->regs, opcode)) {
       this->should_exit = true;
     }
+    // the handler may have modified memory without going through this->write
+    this->invalidate_instruction_cache();
   } else {
     this->exec_unimplemented(opcode);
   }
@@ -2107,38 +2186,43 @@ string M68KEmulator::dasm_A(StringReader& r, uint32_t start_address, unordered_s
 
 
 
+static inline bool is_valid_B_opcode(uint16_t opcode) {
+  uint8_t opmode = op_get_b(opcode);
+  return (opmode < 3) || ((opmode & 3) == 3);
+}
+
+static inline uint8_t size_for_B_opmode(uint8_t opmode) {
+  if (opmode < 3) {
+    return opmode;
+  }
+  return (opmode & 4) ? SIZE_LONG : SIZE_WORD;
+}
+
 void M68KEmulator::exec_B(uint16_t opcode) {
+  if (!is_valid_B_opcode(opcode)) { // probably xor
+    throw runtime_error("unimplemented: opcode B");
+  }
+  this->exec_B_resolved(opcode, this->resolve_address(op_get_c(opcode),
+      op_get_d(opcode), size_for_B_opmode(op_get_b(opcode))));
+}
+
+void M68KEmulator::exec_B_resolved(uint16_t opcode, const ResolvedAddress& addr) {
   uint8_t dest = op_get_a(opcode);
   uint8_t opmode = op_get_b(opcode);
-  uint8_t M = op_get_c(opcode);
-  uint8_t Xn = op_get_d(opcode);
+  uint8_t size = size_for_B_opmode(opmode);
 
-  int32_t left_value, right_value;
-  uint8_t size;
+  int32_t left_value;
   if (opmode < 3) { // cmp.S DREG, ADDR
-    size = opmode;
-
     left_value = this->regs.d[dest].u;
     if (size == SIZE_BYTE) {
       left_value &= 0x000000FF;
     } else if (size == SIZE_WORD) {
       left_value &= 0x0000FFFF;
     }
-
-    auto addr = this->resolve_address(M, Xn, size);
-    right_value = this->read(addr, size);
-
-  } else if ((opmode & 3) == 3) { // cmpa.S AREG, ADDR
-    size = (opmode & 4) ? SIZE_LONG : SIZE_WORD;
-
+  } else { // cmpa.S AREG, ADDR
     left_value = this->regs.a[dest];
-
-    auto addr = this->resolve_address(M, Xn, size);
-    right_value = this->read(addr, size);
-
-  } else { // probably xor
-    throw runtime_error("unimplemented: opcode B");
   }
+  int32_t right_value = this->read(addr, size);
 
   this->regs.set_ccr_flags_integer_subtract(left_value, right_value, size);
 }
@@ -2359,7 +2443,9 @@ void M68KEmulator::exec_E(uint16_t opcode) {
       bool logical_shift = (k & 2);
       bool rotate = (k & 4);
 
-      this->regs.ccr &= 0xE0;
+      // all of the flags are replaced, so any pending ones don't need to be
+      // computed first
+      this->regs.set_ccr(this->regs.ccr & 0xE0);
       if (shift_amount == 0) {
         this->regs.set_ccr_flags(-1, is_negative(this->regs.d[Xn].u, SIZE_LONG),
             (this->regs.d[Xn].u == 0), 0, 0);
@@ -2606,9 +2692,12 @@ string M68KEmulator::dasm_E(StringReader& r, uint32_t start_address, unordered_s
 
 void M68KEmulator::exec_F(uint16_t opcode) {
   if (this->syscall_handler) {
+    this->regs.materialize_ccr();
     if (!this->syscall_handler(*this, this->regs, opcode)) {
       this->should_exit = true;
     }
+    // the handler may have modified memory without going through this->write
+    this->invalidate_instruction_cache();
   } else {
     this->exec_unimplemented(opcode);
   }
@@ -2730,30 +2819,895 @@ string M68KEmulator::disassemble(const void* vdata, size_t size,
 
 
 
-void M68KEmulator::execute(const M68KRegisters& regs) {
-  this->regs = regs;
-  if (!this->interrupt_manager.get()) {
-    this->interrupt_manager.reset(new InterruptManager());
+void M68KEmulator::invalidate_instruction_cache() {
+  // if the generation number wraps around, stale entries could appear valid
+  // again, so clear them all in that case
+  if (++this->instruction_cache_generation == 0) {
+    for (auto& inst : this->instruction_cache) {
+      inst.generation = 0;
+    }
+    this->instruction_cache_generation = 1;
   }
+  this->instruction_cache_start_addr = 0xFFFFFFFF;
+  this->instruction_cache_end_addr = 0;
+  this->loop_idioms.clear();
+  this->fetch_page_host = nullptr;
+}
+
+inline const M68KEmulator::PredecodedInstruction& M68KEmulator::fetch_predecoded_instruction() {
+  uint32_t pc = this->regs.pc;
+  auto& inst = this->instruction_cache[(pc >> 1) & (INSTRUCTION_CACHE_SIZE - 1)];
+  if ((inst.pc != pc) || (inst.generation != this->instruction_cache_generation)) {
+    this->predecode_instruction(inst, pc);
+  }
+  return inst;
+}
+
+bool M68KEmulator::predecode_operand(PredecodedOperand& op, uint8_t M,
+    uint8_t Xn, uint8_t size, uint32_t& ext_addr) {
+  // this mirrors resolve_address, but reads the extension words ahead of time.
+  // it returns false for modes that resolve_address would reject (so the
+  // generic path can throw the appropriate exception)
+  op.M = M;
+  op.Xn = Xn;
+  op.ext = 0;
+  op.ext_addr = ext_addr;
+  switch (M) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+      return true;
+    case 5:
+      op.ext = static_cast<int16_t>(bswap16(this->read_instruction_data<uint16_t>(ext_addr)));
+      ext_addr += 2;
+      return true;
+    case 6:
+      op.ext = bswap16(this->read_instruction_data<uint16_t>(ext_addr));
+      ext_addr += 2;
+      return !(op.ext & 0x0100); // full extension words aren't implemented
+    case 7:
+      switch (Xn) {
+        case 0:
+          op.ext = static_cast<int16_t>(bswap16(this->read_instruction_data<uint16_t>(ext_addr)));
+          ext_addr += 2;
+          return true;
+        case 1:
+          op.ext = bswap32(this->read_instruction_data<uint32_t>(ext_addr));
+          ext_addr += 4;
+          return true;
+        case 2:
+          op.ext = ext_addr + static_cast<int16_t>(bswap16(this->read_instruction_data<uint16_t>(ext_addr)));
+          ext_addr += 2;
+          return true;
+        case 3:
+          op.ext = bswap16(this->read_instruction_data<uint16_t>(ext_addr));
+          ext_addr += 2;
+          return !(op.ext & 0x0100);
+        case 4:
+          if (size == SIZE_LONG) {
+            op.ext = ext_addr;
+            ext_addr += 4;
+            return true;
+          } else if (size == SIZE_WORD) {
+            op.ext = ext_addr;
+            ext_addr += 2;
+            return true;
+          }
+          return false;
+        default:
+          return false;
+      }
+    default:
+      return false;
+  }
+}
+
+M68KEmulator::ResolvedAddress M68KEmulator::resolve_predecoded_address(
+    const PredecodedOperand& op, uint8_t size) {
+  switch (op.M) {
+    case 0:
+      return {op.Xn, ResolvedAddress::Location::D_REGISTER};
+    case 1:
+      return {op.Xn, ResolvedAddress::Location::A_REGISTER};
+    case 2:
+      return {this->regs.a[op.Xn], ResolvedAddress::Location::MEMORY};
+    case 5:
+      return {this->regs.a[op.Xn] + op.ext, ResolvedAddress::Location::MEMORY};
+    case 6:
+      return {this->regs.a[op.Xn] + this->resolve_address_extension(op.ext),
+              ResolvedAddress::Location::MEMORY};
+    case 7:
+      if (op.Xn == 3) {
+        return {op.ext_addr + this->resolve_address_extension(op.ext),
+                ResolvedAddress::Location::MEMORY};
+      }
+      return {op.ext, ResolvedAddress::Location::MEMORY};
+    default:
+      // modes 3 and 4 modify registers, so resolve them the normal way
+      return this->resolve_address(op.M, op.Xn, size);
+  }
+}
+
+void M68KEmulator::predecode_instruction(PredecodedInstruction& inst, uint32_t pc) {
+  uint16_t opcode = bswap16(this->read_instruction_data<uint16_t>(pc));
+  inst.pc = pc;
+  inst.generation = this->instruction_cache_generation;
+  inst.opcode = opcode;
+  inst.fn = &M68KEmulator::exec_predecoded_generic;
+  inst.next_pc = pc + 2;
+
+  // only the most common opcodes have predecoded implementations; everything
+  // else goes through exec_fns as usual. the generic path reads its extension
+  // words at execution time, so only the opcode word is covered by the cache
+  // in that case
+  uint8_t i = op_get_i(opcode);
+  if ((i >= 1) && (i <= 3)) {
+    // move.S ADDR1, ADDR2 / movea.S An, ADDR
+    inst.size = size_for_dsize[i];
+    uint32_t ext_addr = pc + 2;
+    uint8_t dest_M = op_get_b(opcode);
+    bool is_movea = (dest_M == 1);
+    if (!(is_movea && (inst.size == SIZE_BYTE)) &&
+        this->predecode_operand(inst.source, op_get_c(opcode), op_get_d(opcode), inst.size, ext_addr) &&
+        (is_movea || ((dest_M != 7) || (op_get_a(opcode) < 2))) &&
+        this->predecode_operand(inst.dest, dest_M, op_get_a(opcode), inst.size, ext_addr)) {
+      inst.fn = is_movea ? &M68KEmulator::exec_predecoded_movea : &M68KEmulator::exec_predecoded_move;
+      inst.next_pc = ext_addr;
+    }
+
+  } else if (i == 6) {
+    // bra/bsr/bCC DISPLACEMENT
+    // the displacement is relative to (pc + 2) regardless of its size
+    int32_t displacement = static_cast<int8_t>(op_get_y(opcode));
+    if (displacement == 0) {
+      displacement = static_cast<int16_t>(bswap16(this->read_instruction_data<uint16_t>(pc + 2)));
+      inst.next_pc = pc + 4;
+    } else if (displacement == -1) {
+      displacement = bswap32(this->read_instruction_data<uint32_t>(pc + 2));
+      inst.next_pc = pc + 6;
+    }
+    inst.target = pc + 2 + displacement;
+    inst.fn = &M68KEmulator::exec_predecoded_branch;
+
+  } else if (i == 7) {
+    inst.fn = &M68KEmulator::exec_predecoded_moveq;
+
+  } else if ((i == 0x9) || (i == 0xD)) {
+    // add/sub/adda/suba
+    inst.size = size_for_9D_opmode(op_get_b(opcode));
+    uint32_t ext_addr = pc + 2;
+    if (is_valid_9D_opcode(opcode) &&
+        this->predecode_operand(inst.source, op_get_c(opcode), op_get_d(opcode), inst.size, ext_addr)) {
+      inst.fn = &M68KEmulator::exec_predecoded_9D;
+      inst.next_pc = ext_addr;
+    }
+
+  } else if (i == 0xB) {
+    // cmp/cmpa
+    inst.size = size_for_B_opmode(op_get_b(opcode));
+    uint32_t ext_addr = pc + 2;
+    if (is_valid_B_opcode(opcode) &&
+        this->predecode_operand(inst.source, op_get_c(opcode), op_get_d(opcode), inst.size, ext_addr)) {
+      inst.fn = &M68KEmulator::exec_predecoded_B;
+      inst.next_pc = ext_addr;
+    }
+  }
+
+  // counting profiles use next_pc to find where basic blocks end, so for
+  // instructions on the generic path (whose extension words aren't decoded
+  // here), get the real length from the disassembler
+  if ((inst.fn == &M68KEmulator::exec_predecoded_generic) &&
+      this->is_counting_profile()) {
+    inst.next_pc = pc + this->instruction_size(pc);
+  }
+
+  // the whole loop has to be in the cached range, so writes to any part of it
+  // invalidate the idiom
+  uint32_t end_pc = inst.next_pc;
+  if (!this->debug_hook && !this->differential_mode && !this->trace &&
+      !this->is_counting_profile()) {
+    LoopIdiom idiom;
+    if (this->recognize_loop_idiom(idiom, pc)) {
+      idiom.fn = inst.fn;
+      inst.fn = &M68KEmulator::exec_predecoded_loop_idiom;
+      end_pc = idiom.end_pc;
+      this->loop_idioms[pc] = idiom;
+    }
+  }
+
+  if (pc < this->instruction_cache_start_addr) {
+    this->instruction_cache_start_addr = pc;
+  }
+  if (end_pc > this->instruction_cache_end_addr) {
+    this->instruction_cache_end_addr = end_pc;
+  }
+}
+
+uint32_t M68KEmulator::instruction_size(uint32_t pc) {
+  // the longest instructions (with two full extension words, each with 32-bit
+  // displacements) are 22 bytes
+  size_t size = 22;
+  while ((size > 2) && !this->mem->exists(pc, size)) {
+    size -= 2;
+  }
+  StringReader r(this->mem->at(pc, size), size);
+  unordered_set<uint32_t> branch_target_addresses;
+  M68KEmulator::disassemble_one(r, pc, branch_target_addresses);
+  return r.where();
+}
+
+bool M68KEmulator::recognize_loop_idiom(LoopIdiom& idiom, uint32_t pc) {
+  uint16_t w[7];
+  auto read_words = [&](size_t count) -> bool {
+    if (!this->mem->exists(pc, count * 2)) {
+      return false;
+    }
+    for (size_t x = 0; x < count; x++) {
+      w[x] = this->mem->read_u16(pc + x * 2);
+    }
+    return true;
+  };
+
+  uint16_t opcode = this->mem->read_u16(pc);
+  uint8_t i = op_get_i(opcode);
+  if (((i >= 1) && (i <= 3) && (op_get_b(opcode) == 3)) ||
+      (((opcode & 0xFF38) == 0x4218) && ((opcode & 0x00C0) != 0x00C0))) {
+    // move.S [Ax]+, [Ay]+ / move.S [Ax]+, Dy / clr.S [Ax]+, followed by
+    // dbf Dn, start
+    if (!read_words(3) || ((w[1] & 0xFFF8) != 0x51C8) || (w[2] != 0xFFFC)) {
+      return false;
+    }
+    idiom.num_instructions = 2;
+    idiom.count_reg = op_get_d(w[1]);
+    idiom.end_pc = pc + 6;
+    if (i == 4) {
+      idiom.type = LoopIdiom::Type::CLEAR;
+      idiom.size = op_get_s(opcode);
+      idiom.dest_reg = op_get_d(opcode);
+      return (idiom.dest_reg != 7);
+    }
+    idiom.size = size_for_dsize[i];
+    idiom.dest_reg = op_get_a(opcode);
+    idiom.source_reg = op_get_d(opcode);
+    uint8_t source_M = op_get_c(opcode);
+    if (source_M == 3) {
+      idiom.type = LoopIdiom::Type::COPY;
+      return (idiom.dest_reg != 7) && (idiom.source_reg != 7) &&
+          (idiom.dest_reg != idiom.source_reg);
+    } else if (source_M == 0) {
+      idiom.type = LoopIdiom::Type::FILL;
+      return (idiom.dest_reg != 7) && (idiom.source_reg != idiom.count_reg);
+    }
+    return false;
+
+  } else if ((opcode & 0xF1FF) == 0x7000) {
+    // moveq Di, 0 at the start of a table lookup loop
+    if (!read_words(7)) {
+      return false;
+    }
+    uint8_t index_reg = op_get_a(opcode);
+    uint8_t source_reg = op_get_d(w[1]);
+    uint8_t dest_reg = op_get_a(w[3]);
+    uint8_t table_reg = op_get_d(w[3]);
+    if ((w[1] != (0x1018 | (index_reg << 9) | source_reg)) || // move.b Di, [Ay]+
+        (w[2] != (0xD040 | (index_reg << 9) | index_reg)) || // add.w Di, Di
+        (w[3] != (0x30F0 | (dest_reg << 9) | table_reg)) || // move.w [Ax]+, [Az + ...]
+        ((w[4] & 0xFF00) != (index_reg << 12)) || // brief extension word with Di.w
+        ((w[5] & 0xF1F8) != 0xB1C8) || // cmpa.l Al, Ar
+        ((w[6] & 0xF0FF) != 0x60F2)) { // bCC start
+      return false;
+    }
+    // the condition must depend only on the comparison result
+    uint8_t condition = op_get_k(w[6]);
+    if ((condition < 0x02) || ((condition >= 0x08) && (condition < 0x0C))) {
+      return false;
+    }
+    if ((source_reg == 7) || (dest_reg == 7) || (source_reg == dest_reg) ||
+        (table_reg == source_reg) || (table_reg == dest_reg)) {
+      return false;
+    }
+    idiom.type = LoopIdiom::Type::TABLE_LOOKUP;
+    idiom.size = SIZE_WORD;
+    idiom.num_instructions = 6;
+    idiom.dest_reg = dest_reg;
+    idiom.source_reg = source_reg;
+    idiom.index_reg = index_reg;
+    idiom.table_reg = table_reg;
+    idiom.table_offset = static_cast<int8_t>(w[4] & 0xFF);
+    idiom.compare_left_reg = op_get_a(w[5]);
+    idiom.compare_right_reg = op_get_d(w[5]);
+    idiom.condition = condition;
+    idiom.end_pc = pc + 14;
+    return true;
+  }
+
+  return false;
+}
+
+void M68KEmulator::exec_predecoded_generic(const PredecodedInstruction& inst) {
+  this->regs.pc = inst.pc + 2;
+  (this->*this->exec_fns[(inst.opcode >> 12) & 0x000F])(inst.opcode);
+}
+
+void M68KEmulator::exec_predecoded_move(const PredecodedInstruction& inst) {
+  this->regs.pc = inst.next_pc;
+  auto source_addr = this->resolve_predecoded_address(inst.source, inst.size);
+  auto dest_addr = this->resolve_predecoded_address(inst.dest, inst.size);
+  uint32_t value = this->read(source_addr, inst.size);
+  this->write(dest_addr, value, inst.size);
+  this->regs.set_ccr_flags(-1, is_negative(value, inst.size), (value == 0), 0, 0);
+}
+
+void M68KEmulator::exec_predecoded_movea(const PredecodedInstruction& inst) {
+  this->regs.pc = inst.next_pc;
+  auto source_addr = this->resolve_predecoded_address(inst.source, inst.size);
+  this->regs.a[inst.dest.Xn] = sign_extend(this->read(source_addr, inst.size), inst.size);
+}
+
+void M68KEmulator::exec_predecoded_moveq(const PredecodedInstruction& inst) {
+  this->regs.pc = inst.next_pc;
+  this->exec_7(inst.opcode);
+}
+
+void M68KEmulator::exec_predecoded_9D(const PredecodedInstruction& inst) {
+  this->regs.pc = inst.next_pc;
+  this->exec_9D_resolved(inst.opcode, this->resolve_predecoded_address(inst.source, inst.size));
+}
+
+void M68KEmulator::exec_predecoded_B(const PredecodedInstruction& inst) {
+  this->regs.pc = inst.next_pc;
+  this->exec_B_resolved(inst.opcode, this->resolve_predecoded_address(inst.source, inst.size));
+}
+
+void M68KEmulator::exec_predecoded_branch(const PredecodedInstruction& inst) {
+  uint8_t k = op_get_k(inst.opcode);
+  bool should_branch;
+  if (k == 1) { // bsr
+    this->regs.a[7] -= 4;
+    this->write(this->regs.a[7], inst.next_pc, SIZE_LONG);
+    should_branch = true;
+  } else {
+    should_branch = this->check_condition(k);
+  }
+  this->regs.pc = should_branch ? inst.target : inst.next_pc;
+}
+
+// Returns the result of check_condition() after cmp.l computes left - right,
+// for the conditions that depend only on the comparison
+static bool check_comparison_condition(uint8_t condition, uint32_t left, uint32_t right) {
+  switch (condition) {
+    case 0x02: // hi
+      return left > right;
+    case 0x03: // ls
+      return left <= right;
+    case 0x04: // cc
+      return left >= right;
+    case 0x05: // cs
+      return left < right;
+    case 0x06: // ne
+      return left != right;
+    case 0x07: // eq
+      return left == right;
+    case 0x0C: // ge
+      return static_cast<int32_t>(left) >= static_cast<int32_t>(right);
+    case 0x0D: // lt
+      return static_cast<int32_t>(left) < static_cast<int32_t>(right);
+    case 0x0E: // gt
+      return static_cast<int32_t>(left) > static_cast<int32_t>(right);
+    case 0x0F: // le
+      return static_cast<int32_t>(left) <= static_cast<int32_t>(right);
+    default:
+      throw logic_error("condition does not depend only on comparison");
+  }
+}
+
+void M68KEmulator::exec_predecoded_loop_idiom(const PredecodedInstruction& inst) {
+  const auto& idiom = this->loop_idioms.at(inst.pc);
+
+  // this instruction's cycle has already started, so the skipped iterations
+  // can use one more cycle than cycles_until_next_call() allows
+  uint64_t cycles = this->interrupt_manager->cycles_until_next_call();
+  uint32_t max_iterations = (cycles >= MAX_LOOP_IDIOM_ITERATIONS * idiom.num_instructions)
+      ? MAX_LOOP_IDIOM_ITERATIONS : ((cycles + 1) / idiom.num_instructions);
+
+  // the iteration after which the loop ends has to run normally, so it isn't
+  // counted here
+  uint32_t iterations;
+  if (idiom.type == LoopIdiom::Type::TABLE_LOOKUP) {
+    uint32_t a[8];
+    memcpy(a, this->regs.a, sizeof(a));
+    for (iterations = 0; iterations < max_iterations; iterations++) {
+      a[idiom.source_reg]++;
+      a[idiom.dest_reg] += 2;
+      if (!check_comparison_condition(idiom.condition,
+          a[idiom.compare_left_reg], a[idiom.compare_right_reg])) {
+        break;
+      }
+    }
+  } else {
+    iterations = min<uint32_t>(this->regs.d[idiom.count_reg].u & 0xFFFF, max_iterations);
+  }
+
+  // all of the memory involved must be valid, and the writes must not touch
+  // any cached code (which would include the loop itself)
+  uint32_t dest_addr = this->regs.a[idiom.dest_reg];
+  auto can_skip = [&](uint32_t iterations) -> bool {
+    uint32_t dest_size = iterations * bytes_for_size[idiom.size];
+    if (!this->mem->exists(dest_addr, dest_size) ||
+        ((static_cast<uint64_t>(dest_addr) + dest_size + 4 > this->instruction_cache_start_addr) &&
+         (dest_addr < this->instruction_cache_end_addr))) {
+      return false;
+    }
+    if (idiom.type == LoopIdiom::Type::COPY) {
+      return this->mem->exists(this->regs.a[idiom.source_reg], dest_size);
+    } else if (idiom.type == LoopIdiom::Type::TABLE_LOOKUP) {
+      // the index is at most 0x1FE, since it's a doubled byte
+      return this->mem->exists(this->regs.a[idiom.source_reg], iterations) &&
+          this->mem->exists(this->regs.a[idiom.table_reg] + idiom.table_offset, 0x200);
+    }
+    return true;
+  };
+  // if the loop runs off the end of the valid memory, skip as far as possible
+  // before that point instead of none of it; otherwise, every iteration near
+  // the end would repeat all of these checks only to run normally anyway
+  while ((iterations > 0) && !can_skip(iterations)) {
+    iterations >>= 1;
+  }
+  if (iterations == 0) {
+    (this->*idiom.fn)(inst);
+    return;
+  }
+
+  auto read_element = [&](uint32_t addr) -> uint32_t {
+    if (idiom.size == SIZE_BYTE) {
+      return this->mem->read_u8(addr);
+    } else if (idiom.size == SIZE_WORD) {
+      return this->mem->read_u16(addr);
+    } else {
+      return this->mem->read_u32(addr);
+    }
+  };
+  auto write_element = [&](uint32_t addr, uint32_t value) {
+    if (idiom.size == SIZE_BYTE) {
+      this->mem->write_u8(addr, value);
+    } else if (idiom.size == SIZE_WORD) {
+      this->mem->write_u16(addr, value);
+    } else {
+      this->mem->write_u32(addr, value);
+    }
+  };
+
+  // elements are copied one at a time in order, so overlapping copies have the
+  // same result as when the loop runs normally
+  uint32_t& dest = this->regs.a[idiom.dest_reg];
+  uint32_t element_bytes = bytes_for_size[idiom.size];
+  switch (idiom.type) {
+    case LoopIdiom::Type::COPY: {
+      uint32_t& source = this->regs.a[idiom.source_reg];
+      for (uint32_t x = 0; x < iterations; x++) {
+        write_element(dest, read_element(source));
+        source += element_bytes;
+        dest += element_bytes;
+      }
+      break;
+    }
+    case LoopIdiom::Type::FILL:
+    case LoopIdiom::Type::CLEAR: {
+      uint32_t value = (idiom.type == LoopIdiom::Type::FILL)
+          ? this->regs.d[idiom.source_reg].u : 0;
+      for (uint32_t x = 0; x < iterations; x++) {
+        write_element(dest, value);
+        dest += element_bytes;
+      }
+      break;
+    }
+    case LoopIdiom::Type::TABLE_LOOKUP: {
+      uint32_t& source = this->regs.a[idiom.source_reg];
+      uint32_t& index = this->regs.d[idiom.index_reg].u;
+      uint32_t table_addr = this->regs.a[idiom.table_reg] + idiom.table_offset;
+      for (uint32_t x = 0; x < iterations; x++) {
+        index = this->mem->read_u8(source++) << 1;
+        this->mem->write_u16(dest, this->mem->read_u16(table_addr + index));
+        dest += 2;
+      }
+      break;
+    }
+  }
+  if (idiom.type != LoopIdiom::Type::TABLE_LOOKUP) {
+    // this can't borrow from the high word, since iterations is at most the
+    // low word's value
+    this->regs.d[idiom.count_reg].u -= iterations;
+  }
+
+  this->regs.pc = inst.pc;
+  this->interrupt_manager->skip_cycles(iterations * idiom.num_instructions - 1);
+}
+
+// The run loop is specialized on whether there's a debug hook, so normal
+// execution doesn't have to check for one before every instruction. Traces and
+// counting profiles also use the debug hook version. (If a debug hook is set
+// while the emulator is running without one, it takes effect at the next call
+// to execute().)
+template <bool HasDebugHook>
+void M68KEmulator::execute_loop() {
+  // Hold a reference here in case a syscall handler replaces the interrupt
+  // manager during execution
+  shared_ptr<InterruptManager> interrupt_manager = this->interrupt_manager;
 
-  this->should_exit = false;
   while (!this->should_exit) {
 
     // Call debug hook if present
-    if (this->debug_hook && !this->debug_hook(*this, this->regs)) {
-      break;
+    if (HasDebugHook && this->debug_hook) {
+      this->regs.materialize_ccr();
+      if (!this->debug_hook(*this, this->regs)) {
+        break;
+      }
     }
 
     // Call any timer interrupt functions scheduled for this cycle
-    if (!this->interrupt_manager->on_cycle_start()) {
+    if (!interrupt_manager->on_cycle_start()) {
       break;
     }
 
     // Execute a cycle
-    uint16_t opcode = this->fetch_instruction_word();
-    auto fn = this->exec_fns[(opcode >> 12) & 0x000F];
-    (this->*fn)(opcode);
+    const auto& inst = this->fetch_predecoded_instruction();
+    if (HasDebugHook && this->trace) {
+      this->record_trace_instruction(inst);
+    }
+    if (HasDebugHook && this->is_counting_profile()) {
+      this->profile->on_instruction(inst.pc, inst.next_pc);
+    }
+    (this->*inst.fn)(inst);
+
+    // Report any watched memory accesses the instruction made
+    MemoryContext::dispatch_watchpoint_hits();
+  }
+}
+
+void M68KEmulator::get_trace_registers(uint32_t* values) {
+  for (size_t x = 0; x < 8; x++) {
+    values[x] = this->regs.d[x].u;
+    values[x + 8] = this->regs.a[x];
+  }
+  values[16] = this->regs.get_sr();
+}
+
+void M68KEmulator::record_trace_instruction(const PredecodedInstruction& inst) {
+  // the previous instruction's writes are in write_log; its record is
+  // completed by on_instruction
+  for (const auto& w : this->write_log) {
+    this->trace->on_memory_write(w.addr, bytes_for_size[w.size]);
+  }
+  this->write_log.clear();
+
+  // the predecoded instruction doesn't always cover the extension words, so
+  // just record as many bytes as the longest instruction
+  uint32_t pc = this->regs.pc;
+  size_t opcode_size = ExecutionTrace::MAX_OPCODE_SIZE;
+  while ((opcode_size > 2) && !this->mem->exists(pc, opcode_size)) {
+    opcode_size -= 2;
+  }
+
+  uint32_t values[17];
+  this->get_trace_registers(values);
+  this->trace->on_instruction(values, pc, this->mem->at(pc, opcode_size), opcode_size);
+}
+
+void M68KEmulator::finish_trace() {
+  for (const auto& w : this->write_log) {
+    this->trace->on_memory_write(w.addr, bytes_for_size[w.size]);
+  }
+  this->write_log.clear();
+  this->log_writes = false;
+
+  uint32_t values[17];
+  this->get_trace_registers(values);
+  this->trace->finish(values);
+}
+
+// Reference implementations for differential mode. The predecoded handlers
+// for these opcodes share code with exec_7, exec_9D, and exec_B, so the
+// reference interpreter uses these copies of the original implementations
+// instead; that way it doesn't depend on any of the code it's checking. Like
+// the original implementations, these read ccr directly, so they're only
+// correct when the condition codes are computed eagerly.
+
+void M68KEmulator::exec_7_reference(uint16_t opcode) {
+  // moveq DREG, IMM
+  uint32_t y = op_get_y(opcode);
+  if (y & 0x00000080) {
+    y |= 0xFFFFFF00;
+  }
+  this->regs.d[op_get_a(opcode)].u = y;
+  this->regs.set_ccr_flags(-1, (y & 0x80000000), (y == 0), 0, 0);
+}
+
+void M68KEmulator::exec_9D_reference(uint16_t opcode) {
+  bool is_add = (opcode & 0xF000) == 0xD000;
+
+  uint8_t dest = op_get_a(opcode);
+  uint8_t opmode = op_get_b(opcode);
+  uint8_t M = op_get_c(opcode);
+  uint8_t Xn = op_get_d(opcode);
+
+  if (((M & 6) == 0) && (opmode & 4) && (opmode != 7)) {
+    throw runtime_error("unimplemented: opcode 9/D");
+  }
+
+  if ((opmode & 3) == 3) {
+    uint32_t mem_value;
+    if (opmode & 4) { // add.l/sub.l AREG, ADDR
+      auto addr = this->resolve_address(M, Xn, SIZE_LONG);
+      mem_value = this->read(addr, SIZE_LONG);
+
+    } else { // add.w/sub.w AREG, ADDR (mem value is sign-extended)
+      auto addr = this->resolve_address(M, Xn, SIZE_WORD);
+      mem_value = this->read(addr, SIZE_WORD);
+      if (mem_value & 0x00008000) {
+        mem_value |= 0xFFFF0000;
+      }
+    }
+
+    // TODO: should we sign-extend here? is this always a long operation?
+    if (is_add) {
+      this->regs.set_ccr_flags_integer_add(this->regs.a[dest], mem_value, SIZE_LONG);
+      this->regs.a[dest] += mem_value;
+    } else {
+      this->regs.set_ccr_flags_integer_subtract(this->regs.a[dest], mem_value, SIZE_LONG);
+      this->regs.a[dest] -= mem_value;
+    }
+    this->regs.set_ccr_flags(this->regs.ccr & 0x01, -1, -1, -1, -1);
+    return;
+  }
+
+  // add.S/sub.S DREG, ADDR
+  // add.S/sub.S ADDR, DREG
+  uint8_t size = opmode & 3;
+  auto addr = this->resolve_address(M, Xn, size);
+  uint32_t mem_value = this->read(addr, size);
+  uint32_t reg_value = this->read({dest, ResolvedAddress::Location::D_REGISTER}, size);
+  if (opmode & 4) {
+    if (is_add) {
+      this->regs.set_ccr_flags_integer_add(mem_value, reg_value, size);
+      mem_value += reg_value;
+    } else {
+      this->regs.set_ccr_flags_integer_subtract(mem_value, reg_value, size);
+      mem_value -= reg_value;
+    }
+    this->write(addr, mem_value, size);
+  } else {
+    if (is_add) {
+      this->regs.set_ccr_flags_integer_add(reg_value, mem_value, size);
+      reg_value += mem_value;
+    } else {
+      this->regs.set_ccr_flags_integer_subtract(reg_value, mem_value, size);
+      reg_value -= mem_value;
+    }
+    this->write({dest, ResolvedAddress::Location::D_REGISTER}, reg_value, size);
   }
+  this->regs.set_ccr_flags(this->regs.ccr & 0x01, -1, -1, -1, -1);
+}
+
+void M68KEmulator::exec_B_reference(uint16_t opcode) {
+  uint8_t dest = op_get_a(opcode);
+  uint8_t opmode = op_get_b(opcode);
+  uint8_t M = op_get_c(opcode);
+  uint8_t Xn = op_get_d(opcode);
+
+  int32_t left_value, right_value;
+  uint8_t size;
+  if (opmode < 3) { // cmp.S DREG, ADDR
+    size = opmode;
+
+    left_value = this->regs.d[dest].u;
+    if (size == SIZE_BYTE) {
+      left_value &= 0x000000FF;
+    } else if (size == SIZE_WORD) {
+      left_value &= 0x0000FFFF;
+    }
+
+    auto addr = this->resolve_address(M, Xn, size);
+    right_value = this->read(addr, size);
+
+  } else if ((opmode & 3) == 3) { // cmpa.S AREG, ADDR
+    size = (opmode & 4) ? SIZE_LONG : SIZE_WORD;
+
+    left_value = this->regs.a[dest];
+
+    auto addr = this->resolve_address(M, Xn, size);
+    right_value = this->read(addr, size);
+
+  } else { // probably xor
+    throw runtime_error("unimplemented: opcode B");
+  }
+
+  this->regs.set_ccr_flags_integer_subtract(left_value, right_value, size);
+}
+
+void M68KEmulator::execute_differential() {
+  shared_ptr<InterruptManager> interrupt_manager = this->interrupt_manager;
+
+  void (M68KEmulator::*reference_exec_fns[0x10])(uint16_t);
+  copy(begin(this->exec_fns), end(this->exec_fns), begin(reference_exec_fns));
+  reference_exec_fns[0x07] = &M68KEmulator::exec_7_reference;
+  reference_exec_fns[0x09] = &M68KEmulator::exec_9D_reference;
+  reference_exec_fns[0x0B] = &M68KEmulator::exec_B_reference;
+  reference_exec_fns[0x0D] = &M68KEmulator::exec_9D_reference;
+
+  // returns the final value of each byte written, in address order
+  auto bytes_written = [](const vector<LoggedWrite>& log) -> map<uint32_t, uint8_t> {
+    map<uint32_t, uint8_t> ret;
+    for (const auto& w : log) {
+      uint8_t num_bytes = bytes_for_size[w.size];
+      for (uint8_t x = 0; x < num_bytes; x++) {
+        ret[w.addr + x] = w.new_value >> (8 * (num_bytes - x - 1));
+      }
+    }
+    return ret;
+  };
+
+  while (!this->should_exit) {
+    if (this->debug_hook) {
+      this->regs.materialize_ccr();
+      if (!this->debug_hook(*this, this->regs)) {
+        break;
+      }
+    }
+
+    if (!interrupt_manager->on_cycle_start()) {
+      break;
+    }
+
+    uint32_t pc = this->regs.pc;
+    uint16_t opcode = this->mem->read_u16(pc);
+    uint8_t op_class = (opcode >> 12) & 0x000F;
+    if ((op_class == 0x0A) || (op_class == 0x0F)) {
+      const auto& inst = this->fetch_predecoded_instruction();
+      (this->*inst.fn)(inst);
+      MemoryContext::dispatch_watchpoint_hits();
+      continue;
+    }
+
+    // run the reference implementation, then undo its effects. a syscall may
+    // have left flags pending, so compute them first; the reference
+    // implementation expects them to be up to date
+    this->regs.materialize_ccr();
+    M68KRegisters start_regs = this->regs;
+    this->write_log.clear();
+    this->log_writes = true;
+    string reference_error;
+    try {
+      this->regs.eager_ccr = true;
+      this->regs.pc += 2;
+      (this->*reference_exec_fns[op_class])(opcode);
+    } catch (const exception& e) {
+      reference_error = e.what();
+      if (reference_error.empty()) {
+        reference_error = "(unknown error)";
+      }
+    }
+    this->log_writes = false;
+    this->regs.eager_ccr = false;
+    M68KRegisters reference_regs = this->regs;
+    vector<LoggedWrite> reference_writes;
+    reference_writes.swap(this->write_log);
+    for (auto it = reference_writes.rbegin(); it != reference_writes.rend(); it++) {
+      this->write(it->addr, it->old_value, it->size);
+    }
+    this->regs = start_regs;
+    // the predecoded implementation will make the same watched accesses, so
+    // report them only once
+    MemoryContext::discard_watchpoint_hits();
+
+    // run the predecoded implementation. if both fail, the predecoded
+    // implementation's exception is propagated as it would be normally
+    this->log_writes = true;
+    try {
+      const auto& inst = this->fetch_predecoded_instruction();
+      (this->*inst.fn)(inst);
+    } catch (const exception& e) {
+      this->log_writes = false;
+      if (reference_error.empty()) {
+        throw runtime_error(string_printf(
+            "differential mismatch at %08" PRIX32 " (opcode %04hX): predecoded implementation failed (%s) but reference implementation did not",
+            pc, opcode, e.what()));
+      }
+      throw;
+    }
+    this->log_writes = false;
+    if (!reference_error.empty()) {
+      throw runtime_error(string_printf(
+          "differential mismatch at %08" PRIX32 " (opcode %04hX): reference implementation failed (%s) but predecoded implementation did not",
+          pc, opcode, reference_error.c_str()));
+    }
+
+    string diffs;
+    for (size_t x = 0; x < 8; x++) {
+      if (this->regs.d[x].u != reference_regs.d[x].u) {
+        diffs += string_printf(" D%zu: reference=%08" PRIX32 " predecoded=%08" PRIX32 ";",
+            x, reference_regs.d[x].u, this->regs.d[x].u);
+      }
+    }
+    for (size_t x = 0; x < 8; x++) {
+      if (this->regs.a[x] != reference_regs.a[x]) {
+        diffs += string_printf(" A%zu: reference=%08" PRIX32 " predecoded=%08" PRIX32 ";",
+            x, reference_regs.a[x], this->regs.a[x]);
+      }
+    }
+    if (this->regs.pc != reference_regs.pc) {
+      diffs += string_printf(" PC: reference=%08" PRIX32 " predecoded=%08" PRIX32 ";",
+          reference_regs.pc, this->regs.pc);
+    }
+    if (this->regs.get_sr() != reference_regs.get_sr()) {
+      diffs += string_printf(" SR: reference=%04hX predecoded=%04hX;",
+          reference_regs.get_sr(), this->regs.get_sr());
+    }
+    if (bytes_written(reference_writes) != bytes_written(this->write_log)) {
+      diffs += " memory writes differ;";
+    }
+    if (!diffs.empty()) {
+      diffs.pop_back();
+      throw runtime_error(string_printf(
+          "differential mismatch at %08" PRIX32 " (opcode %04hX):%s",
+          pc, opcode, diffs.c_str()));
+    }
+    MemoryContext::dispatch_watchpoint_hits();
+  }
+}
+
+void M68KEmulator::execute(const M68KRegisters& regs) {
+  this->regs = regs;
+  if (!this->interrupt_manager.get()) {
+    this->interrupt_manager.reset(new InterruptManager());
+  }
+
+  // memory may have been modified since the last call
+  this->invalidate_instruction_cache();
+
+  this->should_exit = false;
+  if (this->profile && this->profile->is_sampling()) {
+    this->schedule_profile_sample(this->profile->next_sample_delay());
+  }
+  try {
+    if (this->differential_mode) {
+      this->execute_differential();
+    } else if (this->trace) {
+      // the last instruction's record is completed here, even if it failed
+      this->write_log.clear();
+      this->log_writes = true;
+      try {
+        this->execute_loop<true>();
+      } catch (const exception&) {
+        this->finish_trace();
+        throw;
+      }
+      this->finish_trace();
+    } else if (this->debug_hook || this->is_counting_profile()) {
+      this->execute_loop<true>();
+    } else {
+      this->execute_loop<false>();
+    }
+  } catch (const exception&) {
+    if (this->profile_sample_call) {
+      this->profile_sample_call->cancel();
+      this->profile_sample_call.reset();
+    }
+    throw;
+  }
+  if (this->profile_sample_call) {
+    this->profile_sample_call->cancel();
+    this->profile_sample_call.reset();
+  }
+}
+
+void M68KEmulator::schedule_profile_sample(uint64_t delay) {
+  this->profile_sample_call = this->interrupt_manager->add(delay, [this]() -> bool {
+    this->profile->on_sample(this->regs.pc);
+    this->schedule_profile_sample(this->profile->next_sample_delay());
+    return false;
+  });
 }
 
 void M68KEmulator::set_syscall_handler(
@@ -2761,6 +3715,18 @@ void M68KEmulator::set_syscall_handler(
   this->syscall_handler = handler;
 }
 
+void M68KEmulator::set_differential_mode(bool enabled) {
+  this->differential_mode = enabled;
+}
+
+void M68KEmulator::set_trace(shared_ptr<ExecutionTrace> trace) {
+  this->trace = trace;
+}
+
+void M68KEmulator::set_profile(shared_ptr<ExecutionProfile> profile) {
+  this->profile = profile;
+}
+
 void M68KEmulator::set_debug_hook(
     std::function<bool(M68KEmulator&, M68KRegisters&)> hook) {
   this->debug_hook = hook;
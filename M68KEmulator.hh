@@ -12,6 +12,8 @@
 
 #include "MemoryContext.hh"
 #include "InterruptManager.hh"
+#include "ExecutionTrace.hh"
+#include "ExecutionProfile.hh"
 
 
 struct M68KRegisters {
@@ -21,23 +23,140 @@ struct M68KRegisters {
     int32_t s;
   } d[8];
   uint32_t pc;
+  // The condition codes are computed lazily. Add and subtract operations only
+  // record their operands in pending_ccr, and N, Z, V, and C (and X, for the
+  // operations that copy C into it) are computed from them when something
+  // reads the flags; most of the time, another operation replaces them before
+  // that happens. So within the emulator, the flags
+  // must be accessed with get_ccr/set_ccr/get_sr/set_sr instead of through
+  // these fields directly. (The emulator computes any pending flags before
+  // calling debug hooks and syscall handlers, so ccr and sr are up to date
+  // when those functions see them.)
   union {
     uint8_t ccr;
     uint16_t sr;
   };
 
+  enum class PendingCCROp : uint8_t {
+    NONE = 0,
+    ADD = 1,
+    SUBTRACT = 2,
+  };
   struct {
-    uint32_t read_addr;
-    uint32_t write_addr;
-  } debug;
+    PendingCCROp op;
+    uint8_t size;
+    // If true, X is set to the same value as C when the flags are computed
+    bool x_from_c;
+    int32_t left_value;
+    int32_t right_value;
+  } pending_ccr;
+  // If this is true, add and subtract operations compute the flags
+  // immediately, as the emulator originally did, instead of leaving them
+  // pending. The reference interpreter uses this in differential mode, so the
+  // lazy flags are checked against the eager implementation.
+  bool eager_ccr;
 
   M68KRegisters();
 
   uint32_t get_reg_value(bool is_a_reg, uint8_t reg_num);
 
-  void set_ccr_flags(int64_t x, int64_t n, int64_t z, int64_t v, int64_t c);
-  void set_ccr_flags_integer_add(int32_t left_value, int32_t right_value, uint8_t size);
-  void set_ccr_flags_integer_subtract(int32_t left_value, int32_t right_value, uint8_t size);
+  inline void materialize_ccr() {
+    if (this->pending_ccr.op != PendingCCROp::NONE) {
+      this->compute_pending_ccr();
+    }
+  }
+  void compute_pending_ccr();
+
+  inline uint8_t get_ccr() {
+    this->materialize_ccr();
+    return this->ccr;
+  }
+  inline uint16_t get_sr() {
+    this->materialize_ccr();
+    return this->sr;
+  }
+  inline void set_ccr(uint8_t ccr) {
+    this->pending_ccr.op = PendingCCROp::NONE;
+    this->ccr = ccr;
+  }
+  inline void set_sr(uint16_t sr) {
+    this->pending_ccr.op = PendingCCROp::NONE;
+    this->sr = sr;
+  }
+
+  // Each argument is 1 to set the flag, 0 to clear it, or -1 to leave it
+  // unchanged. This is inline so that callers that pass constants for most of
+  // the flags don't have to check all of them at runtime.
+  inline void set_ccr_flags(int64_t x, int64_t n, int64_t z, int64_t v, int64_t c) {
+    // if all of the flags that the pending operation affects are replaced,
+    // there's no need to compute them first
+    if ((n < 0) || (z < 0) || (v < 0) || (c < 0) ||
+        ((x < 0) && this->pending_ccr.x_from_c)) {
+      this->materialize_ccr();
+    } else {
+      this->pending_ccr.op = PendingCCROp::NONE;
+    }
+
+    uint8_t mask = 0xFF;
+    uint8_t replace = 0x00;
+    if (x >= 0) {
+      mask &= ~0x10;
+      replace |= (x ? 0x10 : 0x00);
+    }
+    if (n >= 0) {
+      mask &= ~0x08;
+      replace |= (n ? 0x08 : 0x00);
+    }
+    if (z >= 0) {
+      mask &= ~0x04;
+      replace |= (z ? 0x04 : 0x00);
+    }
+    if (v >= 0) {
+      mask &= ~0x02;
+      replace |= (v ? 0x02 : 0x00);
+    }
+    if (c >= 0) {
+      mask &= ~0x01;
+      replace |= (c ? 0x01 : 0x00);
+    }
+    this->ccr = (this->ccr & mask) | replace;
+  }
+
+  // These set N, Z, V, and C. If x_from_c is true, they also set X to the
+  // same value as C (as add and subtract do, but cmp doesn't); otherwise, they
+  // leave X unchanged.
+  inline void set_ccr_flags_integer_add(int32_t left_value, int32_t right_value,
+      uint8_t size, bool x_from_c = false) {
+    if (this->eager_ccr) {
+      this->set_ccr_flags_integer_add_eager(left_value, right_value, size);
+      if (x_from_c) {
+        this->set_ccr_flags(this->ccr & 0x01, -1, -1, -1, -1);
+      }
+      return;
+    }
+    this->pending_ccr.op = PendingCCROp::ADD;
+    this->pending_ccr.size = size;
+    this->pending_ccr.x_from_c = x_from_c;
+    this->pending_ccr.left_value = left_value;
+    this->pending_ccr.right_value = right_value;
+  }
+  inline void set_ccr_flags_integer_subtract(int32_t left_value, int32_t right_value,
+      uint8_t size, bool x_from_c = false) {
+    if (this->eager_ccr) {
+      this->set_ccr_flags_integer_subtract_eager(left_value, right_value, size);
+      if (x_from_c) {
+        this->set_ccr_flags(this->ccr & 0x01, -1, -1, -1, -1);
+      }
+      return;
+    }
+    this->pending_ccr.op = PendingCCROp::SUBTRACT;
+    this->pending_ccr.size = size;
+    this->pending_ccr.x_from_c = x_from_c;
+    this->pending_ccr.left_value = left_value;
+    this->pending_ccr.right_value = right_value;
+  }
+  void set_ccr_flags_integer_add_eager(int32_t left_value, int32_t right_value, uint8_t size);
+  void set_ccr_flags_integer_subtract_eager(int32_t left_value, int32_t right_value, uint8_t size);
 };
 
 
@@ -75,6 +194,35 @@ public:
 
   void execute(const M68KRegisters& regs);
 
+  // The emulator caches decoded instructions by address. Writes done by the
+  // emulated code invalidate the cache automatically, as do syscalls and calls
+  // to execute(). If an interrupt callback modifies emulated code or frees
+  // memory that contains it, it must call this.
+  void invalidate_instruction_cache();
+
+  // In differential mode, each instruction is run twice from the same state:
+  // once by the reference interpreter (which decodes the opcode every time,
+  // uses the original implementations of the opcodes that have specialized
+  // handlers, and computes the condition codes eagerly) and once by the
+  // predecoded handlers used in normal execution, with lazy condition codes.
+  // If the resulting registers or memory writes differ, execute() throws
+  // runtime_error describing the difference. Syscalls (A-line and F-line
+  // opcodes) may have side effects that can't be undone, so they only run
+  // once. This is much slower than normal execution; it's intended for
+  // testing changes to the predecoded handlers and the condition codes.
+  void set_differential_mode(bool enabled);
+
+  // If a trace is set, each instruction is recorded in it. Like a debug hook,
+  // this disables the optimizations that run several instructions at once.
+  // Instructions aren't recorded in differential mode.
+  void set_trace(std::shared_ptr<ExecutionTrace> trace);
+
+  // If a profile is set, instructions are counted or sampled in it (see
+  // ExecutionProfile). In counting mode, this disables the optimizations that
+  // run several instructions at once, and instructions aren't counted in
+  // differential mode. Sampling mode uses the interrupt manager.
+  void set_profile(std::shared_ptr<ExecutionProfile> profile);
+
 private:
   bool should_exit;
   M68KRegisters regs;
@@ -84,6 +232,9 @@ private:
   std::function<bool(M68KEmulator&, M68KRegisters&)> debug_hook;
   std::shared_ptr<InterruptManager> interrupt_manager;
 
+  template <bool HasDebugHook>
+  void execute_loop();
+
   void (M68KEmulator::*exec_fns[0x10])(uint16_t);
   static const std::vector<std::string (*)(StringReader& r, uint32_t start_address, std::unordered_set<uint32_t>& branch_target_addresses)> dasm_fns;
 
@@ -116,6 +267,143 @@ private:
   uint32_t resolve_address_jump(uint8_t M, uint8_t Xn);
   ResolvedAddress resolve_address(uint8_t M, uint8_t Xn, uint8_t size);
 
+  struct PredecodedOperand {
+    uint8_t M;
+    uint8_t Xn;
+    // The extension word or value for modes that have one: a sign-extended
+    // displacement, an absolute address, a brief extension word, or for
+    // immediate values, the address of the value
+    uint32_t ext;
+    // The address of the extension word (used for pc-relative modes)
+    uint32_t ext_addr;
+  };
+
+  struct PredecodedInstruction {
+    // pc and generation together are the cache tag
+    uint32_t pc;
+    uint32_t generation;
+    uint32_t next_pc;
+    uint16_t opcode;
+    uint8_t size;
+    void (M68KEmulator::*fn)(const PredecodedInstruction& inst);
+    PredecodedOperand source;
+    PredecodedOperand dest;
+    // The branch target, for branch opcodes
+    uint32_t target;
+  };
+
+  // Direct-mapped by pc. Entries are invalidated in bulk by incrementing
+  // instruction_cache_generation. The start and end addresses are the range of
+  // memory that valid entries were decoded from; writes outside this range
+  // don't need to invalidate anything.
+  static constexpr size_t INSTRUCTION_CACHE_SIZE = 0x400;
+  std::vector<PredecodedInstruction> instruction_cache;
+  uint32_t instruction_cache_generation;
+  uint32_t instruction_cache_start_addr;
+  uint32_t instruction_cache_end_addr;
+
+  // While log_writes is true, write() records each memory write along with
+  // the previous contents of the location, so the reference interpreter's
+  // writes can be undone in differential mode
+  struct LoggedWrite {
+    uint32_t addr;
+    uint32_t old_value;
+    uint32_t new_value;
+    uint8_t size;
+  };
+  bool differential_mode;
+  bool log_writes;
+  std::vector<LoggedWrite> write_log;
+
+  void execute_differential();
+  void log_write(uint32_t addr, uint32_t value, uint8_t size);
+  void exec_7_reference(uint16_t opcode);
+  void exec_9D_reference(uint16_t opcode);
+  void exec_B_reference(uint16_t opcode);
+
+  // When tracing, log_writes is also true, and write_log holds the current
+  // instruction's writes until its record is completed
+  std::shared_ptr<ExecutionTrace> trace;
+  void get_trace_registers(uint32_t* values);
+  void record_trace_instruction(const PredecodedInstruction& inst);
+  void finish_trace();
+
+  std::shared_ptr<ExecutionProfile> profile;
+  std::shared_ptr<InterruptManager::PendingCall> profile_sample_call;
+  inline bool is_counting_profile() const {
+    return this->profile && !this->profile->is_sampling();
+  }
+  void schedule_profile_sample(uint64_t delay);
+
+  // Some loops that copy, fill, or translate memory one element at a time are
+  // recognized when their first instruction is predecoded. That instruction's
+  // handler runs all but the last iteration natively and leaves pc at the
+  // start of the loop, so the last iteration runs normally and leaves the
+  // registers and flags exactly as if every instruction had been executed.
+  // Loops aren't recognized when there's a debug hook, trace, or counting
+  // profile, or in differential mode, since all of these need each instruction
+  // to run individually.
+  struct LoopIdiom {
+    enum class Type {
+      COPY = 0, // move.S [Ax]+, [Ay]+; dbf Dn, start
+      FILL, // move.S [Ax]+, Dy; dbf Dn, start
+      CLEAR, // clr.S [Ax]+; dbf Dn, start
+      // moveq Di, 0; move.b Di, [Ay]+; add.w Di, Di;
+      // move.w [Ax]+, [Az + Di.w + table_offset]; cmpa.l Al, Ar; bCC start
+      TABLE_LOOKUP,
+    };
+    Type type;
+    uint8_t size;
+    uint8_t num_instructions;
+    uint8_t dest_reg; // Ax
+    uint8_t source_reg; // Ay for COPY and TABLE_LOOKUP; Dy for FILL
+    uint8_t count_reg; // Dn, for dbf loops
+    uint8_t index_reg; // Di
+    uint8_t table_reg; // Az
+    int8_t table_offset;
+    uint8_t compare_left_reg; // Al
+    uint8_t compare_right_reg; // Ar
+    uint8_t condition;
+    uint32_t end_pc;
+    // The normal handler for the loop's first instruction
+    void (M68KEmulator::*fn)(const PredecodedInstruction& inst);
+  };
+  static constexpr uint32_t MAX_LOOP_IDIOM_ITERATIONS = 0x10000;
+  std::unordered_map<uint32_t, LoopIdiom> loop_idioms;
+
+  bool recognize_loop_idiom(LoopIdiom& idiom, uint32_t pc);
+
+  // Instructions are usually fetched from the same page many times in a row,
+  // so the host address of the most recently used code page is kept here, and
+  // fetches from that page don't have to go through the memory context. The
+  // page is forgotten when the instruction cache is invalidated, since that
+  // happens after anything that could free or replace it.
+  uint32_t fetch_page_addr;
+  uint32_t fetch_page_size;
+  const uint8_t* fetch_page_host;
+
+  // Returns the value at addr without byteswapping it, like mem->read<T>()
+  template <typename T>
+  T read_instruction_data(uint32_t addr);
+  bool update_fetch_page(uint32_t addr, size_t size);
+
+  const PredecodedInstruction& fetch_predecoded_instruction();
+  void predecode_instruction(PredecodedInstruction& inst, uint32_t pc);
+  uint32_t instruction_size(uint32_t pc);
+  bool predecode_operand(PredecodedOperand& op, uint8_t M, uint8_t Xn,
+      uint8_t size, uint32_t& ext_addr);
+  ResolvedAddress resolve_predecoded_address(const PredecodedOperand& op,
+      uint8_t size);
+
+  void exec_predecoded_generic(const PredecodedInstruction& inst);
+  void exec_predecoded_move(const PredecodedInstruction& inst);
+  void exec_predecoded_movea(const PredecodedInstruction& inst);
+  void exec_predecoded_moveq(const PredecodedInstruction& inst);
+  void exec_predecoded_9D(const PredecodedInstruction& inst);
+  void exec_predecoded_B(const PredecodedInstruction& inst);
+  void exec_predecoded_branch(const PredecodedInstruction& inst);
+  void exec_predecoded_loop_idiom(const PredecodedInstruction& inst);
+
   static std::string dasm_reg_mask(uint16_t mask, bool reverse);
   static std::string dasm_address_extension(StringReader& r, uint16_t ext, int8_t An);
   static std::string dasm_address(StringReader& r, uint32_t opcode_start_address,
@@ -151,6 +439,7 @@ private:
       std::unordered_set<uint32_t>& branch_target_addresses);
 
   void exec_9D(uint16_t opcode);
+  void exec_9D_resolved(uint16_t opcode, const ResolvedAddress& addr);
   static std::string dasm_9D(StringReader& r, uint32_t start_address,
       std::unordered_set<uint32_t>& branch_target_addresses);
 
@@ -159,6 +448,7 @@ private:
       std::unordered_set<uint32_t>& branch_target_addresses);
 
   void exec_B(uint16_t opcode);
+  void exec_B_resolved(uint16_t opcode, const ResolvedAddress& addr);
   static std::string dasm_B(StringReader& r, uint32_t start_address,
       std::unordered_set<uint32_t>& branch_target_addresses);
 
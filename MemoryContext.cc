@@ -1,13 +1,192 @@
 #include "MemoryContext.hh"
 
+#include <signal.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
 
+#include <atomic>
+#include <mutex>
+
 using namespace std;
 
 
-MemoryContext::MemoryContext() : page_size(sysconf(_SC_PAGESIZE)) {
+#if defined(__linux__) && (UINTPTR_MAX > 0xFFFFFFFF)
+#define FLAT_MODE_SUPPORTED
+#endif
+
+#if defined(FLAT_MODE_SUPPORTED) && defined(__x86_64__)
+#include <ucontext.h>
+#define WATCHPOINTS_SUPPORTED
+#endif
+
+static const uint64_t FLAT_REGION_SIZE = 0x100000000;
+
+// The SIGSEGV handler needs to know which host addresses belong to flat-mode
+// contexts, but it can't take locks, so the reserved regions are tracked in a
+// fixed-size array of atomics. If all slots are in use, new contexts fall back
+// to the default mode.
+static const size_t MAX_FLAT_REGIONS = 4096;
+static atomic<uintptr_t> flat_region_bases[MAX_FLAT_REGIONS];
+static atomic<MemoryContext*> flat_region_contexts[MAX_FLAT_REGIONS];
+static struct sigaction prev_sigsegv_action;
+static struct sigaction prev_sigtrap_action;
+
+// When an access faults on a watched page, the SIGSEGV handler makes the page
+// accessible and sets the trap flag, so the faulting instruction runs once and
+// then raises SIGTRAP. This is the state that the SIGTRAP handler needs to
+// protect the page again and report the access. A single instruction can touch
+// more than one watched page (for example, if it's unaligned), hence the list.
+struct WatchedAccess {
+  MemoryContext* ctx;
+  uint32_t addr;
+  bool is_write;
+  uint8_t num_pages;
+  uint32_t page_indexes[4];
+};
+static thread_local WatchedAccess current_watched_access;
+
+// Completed watched accesses, recorded by the SIGTRAP handler and reported by
+// dispatch_watchpoint_hits. The count is num_pending_watchpoint_hits.
+struct WatchpointHit {
+  MemoryContext* ctx;
+  uint32_t addr;
+  bool is_write;
+};
+static thread_local WatchpointHit pending_watchpoint_hits[MemoryContext::MAX_PENDING_WATCHPOINT_HITS];
+
+void MemoryContext::sigsegv_handler(int, siginfo_t* info, void* uctx) {
+  uintptr_t fault_addr = reinterpret_cast<uintptr_t>(info->si_addr);
+  for (size_t x = 0; x < MAX_FLAT_REGIONS; x++) {
+    uintptr_t base = flat_region_bases[x].load(memory_order_relaxed);
+    if (base && (fault_addr >= base) && (fault_addr - base < FLAT_REGION_SIZE)) {
+#ifdef WATCHPOINTS_SUPPORTED
+      MemoryContext* ctx = flat_region_contexts[x].load(memory_order_relaxed);
+      uint32_t addr = fault_addr - base;
+      uint32_t page_index = ctx ? (addr >> ctx->page_bits) : 0;
+      auto& access = current_watched_access;
+      if (ctx && (page_index < ctx->watched_page_states.size()) &&
+          ctx->watched_page_states[page_index] &&
+          (!access.ctx || ((access.ctx == ctx) && (access.num_pages < 4)))) {
+        auto& mcontext = reinterpret_cast<ucontext_t*>(uctx)->uc_mcontext;
+        if (!access.ctx) {
+          access.ctx = ctx;
+          access.addr = addr;
+          access.is_write = (mcontext.gregs[REG_ERR] & 2);
+          access.num_pages = 0;
+        }
+        access.page_indexes[access.num_pages++] = page_index;
+        mprotect(ctx->flat_base + (static_cast<size_t>(page_index) << ctx->page_bits),
+            ctx->page_size, PROT_READ | PROT_WRITE);
+        mcontext.gregs[REG_EFL] |= 0x100; // trap flag
+        return;
+      }
+      // The instruction being stepped over a watched page faulted for some
+      // other reason, so it won't finish; protect the page again
+      end_watched_access();
+#endif
+      throw out_of_range("address not within allocated pages");
+    }
+  }
+
+  // The fault isn't in any flat-mode context, so it's a real crash. Put back
+  // the previous handler and return; the faulting instruction will run again
+  // and the previous handler will deal with it.
+  sigaction(SIGSEGV, &prev_sigsegv_action, nullptr);
+}
+
+void MemoryContext::sigtrap_handler(int, siginfo_t*, void* uctx) {
+#ifdef WATCHPOINTS_SUPPORTED
+  uint32_t addr = current_watched_access.addr;
+  bool is_write = current_watched_access.is_write;
+  MemoryContext* ctx = end_watched_access();
+  if (!ctx) {
+    // This trap has nothing to do with watchpoints (for example, there's a
+    // debugger breakpoint), so let the previous handler deal with it
+    sigaction(SIGTRAP, &prev_sigtrap_action, nullptr);
+    raise(SIGTRAP);
+    return;
+  }
+  reinterpret_cast<ucontext_t*>(uctx)->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+
+  // The watchpoint functions can't safely run here, so just record the access
+  size_t num_hits = num_pending_watchpoint_hits;
+  if (num_hits < MAX_PENDING_WATCHPOINT_HITS) {
+    pending_watchpoint_hits[num_hits] = WatchpointHit{ctx, addr, is_write};
+    num_pending_watchpoint_hits = num_hits + 1;
+  }
+#else
+  (void)uctx;
+#endif
+}
+
+MemoryContext* MemoryContext::end_watched_access() {
+  auto& access = current_watched_access;
+  MemoryContext* ctx = access.ctx;
+  if (ctx) {
+    for (size_t x = 0; x < access.num_pages; x++) {
+      uint32_t page_index = access.page_indexes[x];
+      uint8_t state = ctx->watched_page_states[page_index];
+      if (state) {
+        mprotect(ctx->flat_base + (static_cast<size_t>(page_index) << ctx->page_bits),
+            ctx->page_size, state - 1);
+      }
+    }
+    access.ctx = nullptr;
+  }
+  return ctx;
+}
+
+void MemoryContext::dispatch_pending_watchpoint_hits() {
+  // The functions may access watched memory too, which records more hits, so
+  // take the current ones out of the buffer before calling any of them
+  WatchpointHit hits[MAX_PENDING_WATCHPOINT_HITS];
+  size_t num_hits = num_pending_watchpoint_hits;
+  memcpy(hits, pending_watchpoint_hits, num_hits * sizeof(WatchpointHit));
+  num_pending_watchpoint_hits = 0;
+  for (size_t x = 0; x < num_hits; x++) {
+    hits[x].ctx->call_watchpoints(hits[x].addr, hits[x].is_write);
+  }
+}
+
+void MemoryContext::call_watchpoints(uint32_t addr, bool is_write) {
+  // The functions may add or remove watchpoints, so find the next one again
+  // after each call instead of keeping an iterator
+  auto it = this->watchpoints.begin();
+  while ((it != this->watchpoints.end()) && (it->first <= addr)) {
+    uint32_t wp_addr = it->first;
+    const auto& wp = it->second;
+    if ((addr - wp_addr < wp.size) && (is_write ? wp.on_write : wp.on_read)) {
+      wp.fn(addr, is_write);
+      it = this->watchpoints.upper_bound(wp_addr);
+    } else {
+      it++;
+    }
+  }
+}
+
+static void install_signal_handler(int signum,
+    void (*handler)(int, siginfo_t*, void*), int flags,
+    struct sigaction* prev_action) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = handler;
+  sa.sa_flags = SA_SIGINFO | flags;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(signum, &sa, prev_action)) {
+    throw runtime_error("cannot install signal handler");
+  }
+}
+
+
+MemoryContext::MemoryContext(bool flat)
+  : page_size(sysconf(_SC_PAGESIZE)),
+    flat_base(nullptr),
+    flat_slot(-1),
+    free_small_blocks(SMALL_BLOCK_MAX_SIZE >> 4),
+    arena_next_addr(0),
+    arena_end_addr(0) {
   if (this->page_size == 0) {
     throw invalid_argument("system page size is zero");
   }
@@ -27,130 +206,393 @@ MemoryContext::MemoryContext() : page_size(sysconf(_SC_PAGESIZE)) {
     throw invalid_argument("system page bits is zero");
   }
 
-  size_t total_pages = (0x100000000 >> this->page_bits) - 1;
+  // Page 0 is never allocated, so that allocate() can return 0 on failure, and
+  // neither is the last page, so the end address of every block fits in 32
+  // bits. The page table still covers the entire address space, so any guest
+  // address can be looked up in it.
+  size_t total_pages = 0x100000000 >> this->page_bits;
   this->page_host_addrs.resize(total_pages, nullptr);
-  this->free_page_regions_by_count.emplace(total_pages, 0);
-  this->free_page_regions_by_index.emplace(0, total_pages);
-}
+  this->free_page_regions_by_count.emplace(total_pages - 2, 1);
+  this->free_page_regions_by_index.emplace(1, total_pages - 2);
 
-MemoryContext::~MemoryContext() {
-  for (const auto& it : this->allocated_page_regions_by_index) {
-    munmap(this->page_host_addrs[it.first], it.second << this->page_bits);
+  if (flat) {
+    this->init_flat();
   }
 }
 
-uint32_t MemoryContext::allocate(size_t requested_size) {
-  // Round requested_size up to a multiple of 0x10
-  requested_size = (requested_size + 0x0F) & (~0x0F);
+MemoryContext::MemoryContext(shared_ptr<const Snapshot> snapshot)
+  : page_size(snapshot->page_size),
+    page_bits(snapshot->page_bits),
+    flat_base(nullptr),
+    flat_slot(-1),
+    allocated_blocks_by_addr(snapshot->allocated_blocks_by_addr),
+    free_page_regions_by_count(snapshot->free_page_regions_by_count),
+    free_page_regions_by_index(snapshot->free_page_regions_by_index),
+    free_small_blocks(snapshot->free_small_blocks),
+    arena_next_addr(snapshot->arena_next_addr),
+    arena_end_addr(snapshot->arena_end_addr),
+    symbol_addrs(snapshot->symbol_addrs) {
+  this->page_host_addrs.resize(0x100000000 >> this->page_bits, nullptr);
+  if (snapshot->flat) {
+    this->init_flat();
+  }
 
-  // Find the smallest free block with enough space, and put the allocated block
-  // in the first part of it
-  auto free_block_it = this->free_regions_by_size.lower_bound(requested_size);
-  if (free_block_it == this->free_regions_by_size.end()) {
+  // Map each page region privately from the snapshot's file, so writes to
+  // this context's memory don't affect the snapshot or other contexts
+  for (const auto& it : snapshot->page_regions) {
+    uint32_t page_index = it.first;
+    uint32_t page_count = it.second.first;
+    void* region_base = mmap(
+        this->flat_base ? (this->flat_base + (static_cast<size_t>(page_index) << this->page_bits)) : nullptr,
+        page_count << this->page_bits, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | (this->flat_base ? MAP_FIXED : 0), snapshot->fd,
+        it.second.second);
+    if (region_base == MAP_FAILED) {
+      if (this->flat_base) {
+        munmap(this->flat_base, FLAT_REGION_SIZE);
+        flat_region_contexts[this->flat_slot].store(nullptr);
+        flat_region_bases[this->flat_slot].store(0);
+      } else {
+        for (const auto& it : this->allocated_page_regions_by_index) {
+          munmap(this->page_host_addrs[it.first], it.second << this->page_bits);
+        }
+      }
+      throw runtime_error("cannot map snapshot pages");
+    }
+    this->allocated_page_regions_by_index.emplace(page_index, page_count);
+    for (size_t x = 0; x < page_count; x++) {
+      this->page_host_addrs[page_index + x] = reinterpret_cast<uint8_t*>(region_base) + (x << this->page_bits);
+    }
+  }
+}
 
-    // There's no free page region of sufficient size - we'll have to allocate
-    // some more pages
+MemoryContext::~MemoryContext() {
+  // Don't leave any unreported hits that refer to this context
+  size_t num_hits = 0;
+  for (size_t x = 0; x < static_cast<size_t>(num_pending_watchpoint_hits); x++) {
+    if (pending_watchpoint_hits[x].ctx != this) {
+      pending_watchpoint_hits[num_hits++] = pending_watchpoint_hits[x];
+    }
+  }
+  num_pending_watchpoint_hits = num_hits;
 
-    // Allocate at least 1MB at a time
-    size_t needed_page_count = (requested_size + (this->page_size - 1)) >> this->page_bits;
-    if (needed_page_count << this->page_bits < 0x100000) {
-      needed_page_count = 0x100000 >> this->page_bits;
+  if (this->flat_base) {
+    munmap(this->flat_base, FLAT_REGION_SIZE);
+    flat_region_contexts[this->flat_slot].store(nullptr);
+    flat_region_bases[this->flat_slot].store(0);
+  } else {
+    for (const auto& it : this->allocated_page_regions_by_index) {
+      munmap(this->page_host_addrs[it.first], it.second << this->page_bits);
     }
+  }
+}
 
-    // Find an address space region with enough space for this page region
-    auto free_page_it = this->free_page_regions_by_count.lower_bound(needed_page_count);
-    if (free_page_it == this->free_page_regions_by_count.end()) {
-      return 0;
+void MemoryContext::init_flat() {
+#ifdef FLAT_MODE_SUPPORTED
+  // SA_NODEFER is necessary because the handler usually doesn't return
+  // normally (it throws), so SIGSEGV would otherwise remain blocked afterward
+  static once_flag installed;
+  call_once(installed, []() {
+    install_signal_handler(SIGSEGV, &MemoryContext::sigsegv_handler,
+        SA_NODEFER, &prev_sigsegv_action);
+  });
+
+  void* base = mmap(nullptr, FLAT_REGION_SIZE, PROT_NONE,
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return; // fall back to the default mode
+  }
+  uintptr_t base_value = reinterpret_cast<uintptr_t>(base);
+  for (size_t x = 0; x < MAX_FLAT_REGIONS; x++) {
+    uintptr_t expected = 0;
+    if (flat_region_bases[x].compare_exchange_strong(expected, base_value)) {
+      flat_region_contexts[x].store(this);
+      this->flat_base = reinterpret_cast<uint8_t*>(base);
+      this->flat_slot = x;
+      return;
     }
+  }
+  munmap(base, FLAT_REGION_SIZE); // no free slots; fall back to the default mode
+#endif
+}
 
-    // Allocate the page region
-    void* region_base = mmap(nullptr, needed_page_count << this->page_bits,
-        PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (region_base == MAP_FAILED) {
-      return 0;
+void* MemoryContext::map_pages(uint32_t page_index, uint32_t page_count) {
+  size_t size = static_cast<size_t>(page_count) << this->page_bits;
+  if (this->flat_base) {
+    void* addr = this->flat_base + (static_cast<size_t>(page_index) << this->page_bits);
+    return mprotect(addr, size, PROT_READ | PROT_WRITE) ? nullptr : addr;
+  }
+  void* ret = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  return (ret == MAP_FAILED) ? nullptr : ret;
+}
+
+void MemoryContext::unmap_pages(uint32_t page_index, uint32_t page_count) {
+  size_t size = static_cast<size_t>(page_count) << this->page_bits;
+  if (this->flat_base) {
+    // Replace the pages with an inaccessible mapping rather than just
+    // protecting them, so their contents are discarded
+    void* addr = this->flat_base + (static_cast<size_t>(page_index) << this->page_bits);
+    if (mmap(addr, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+      throw runtime_error("cannot unmap pages");
     }
+  } else {
+    munmap(this->page_host_addrs[page_index], size);
+  }
+}
+
+MemoryContext::Snapshot::~Snapshot() {
+  if (this->fd >= 0) {
+    close(this->fd);
+  }
+}
 
-    // Figure out how to split up the block
-    uint32_t free_page_index = free_page_it->second;
-    uint32_t free_page_count = free_page_it->first;
-    size_t remaining_page_count = free_page_count - needed_page_count;
-    uint32_t allocated_page_index = free_page_index;
-    uint32_t new_free_page_index = free_page_index + needed_page_count;
-
-    // Delete the old free page region and create a new allocated page region,
-    // and create a new free page region if any space remains
-    this->free_page_regions_by_index.erase(free_page_it->second);
-    this->free_page_regions_by_count.erase(free_page_it);
-    this->allocated_page_regions_by_index.emplace(allocated_page_index, needed_page_count);
-    if (remaining_page_count > 0) {
-      this->free_page_regions_by_index.emplace(new_free_page_index, remaining_page_count);
-      this->free_page_regions_by_count.emplace(remaining_page_count, new_free_page_index);
+static int create_snapshot_file() {
+#ifdef __linux__
+  int fd = memfd_create("MemoryContext-snapshot", MFD_CLOEXEC);
+#else
+  char filename[] = "/tmp/MemoryContext-snapshot-XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd >= 0) {
+    unlink(filename);
+  }
+#endif
+  if (fd < 0) {
+    throw runtime_error("cannot create snapshot file");
+  }
+  return fd;
+}
+
+static bool page_is_zero(const void* page, size_t page_size) {
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(page);
+  for (size_t x = 0; x < page_size / sizeof(uint64_t); x++) {
+    if (words[x]) {
+      return false;
     }
+  }
+  return true;
+}
 
-    // Update the host address index appropriately
-    for (size_t x = 0; x < needed_page_count; x++) {
-      size_t page_index = allocated_page_index + x;
-      if (this->page_host_addrs[page_index]) {
-        throw logic_error("page already has host address");
+shared_ptr<const MemoryContext::Snapshot> MemoryContext::snapshot() const {
+  shared_ptr<Snapshot> ret(new Snapshot());
+  ret->fd = create_snapshot_file();
+  ret->page_size = this->page_size;
+  ret->page_bits = this->page_bits;
+  ret->flat = (this->flat_base != nullptr);
+
+  uint64_t total_size = 0;
+  for (const auto& it : this->allocated_page_regions_by_index) {
+    total_size += static_cast<uint64_t>(it.second) << this->page_bits;
+  }
+  if (ftruncate(ret->fd, total_size)) {
+    throw runtime_error("cannot resize snapshot file");
+  }
+
+  // The file is initially all zeroes, so only pages with data in them have to
+  // be written. Pages with read watchpoints on them are made readable while
+  // this is done, so copying them doesn't trigger the watchpoints.
+  this->set_watched_pages_readable(true);
+  try {
+    uint64_t offset = 0;
+    for (const auto& it : this->allocated_page_regions_by_index) {
+      ret->page_regions.emplace(it.first, make_pair(it.second, offset));
+      for (size_t x = 0; x < it.second; x++) {
+        const void* page = this->page_host_addrs[it.first + x];
+        if (page_is_zero(page, this->page_size)) {
+          continue;
+        }
+        if (pwrite(ret->fd, page, this->page_size, offset + (x << this->page_bits)) !=
+            static_cast<ssize_t>(this->page_size)) {
+          throw runtime_error("cannot write snapshot file");
+        }
       }
-      this->page_host_addrs[page_index] = reinterpret_cast<uint8_t*>(region_base) + (x << this->page_bits);
+      offset += static_cast<uint64_t>(it.second) << this->page_bits;
     }
+  } catch (const exception&) {
+    this->set_watched_pages_readable(false);
+    throw;
+  }
+  this->set_watched_pages_readable(false);
+
+  ret->allocated_blocks_by_addr = this->allocated_blocks_by_addr;
+  ret->free_page_regions_by_count = this->free_page_regions_by_count;
+  ret->free_page_regions_by_index = this->free_page_regions_by_index;
+  ret->free_small_blocks = this->free_small_blocks;
+  ret->arena_next_addr = this->arena_next_addr;
+  ret->arena_end_addr = this->arena_end_addr;
+  ret->symbol_addrs = this->symbol_addrs;
+  return ret;
+}
+
+shared_ptr<MemoryContext> MemoryContext::fork() const {
+  return shared_ptr<MemoryContext>(new MemoryContext(this->snapshot()));
+}
 
-    // Add the newly-created free space to the index
-    // TODO: rewrite this to just allocate the block directly here instead of
-    // falling through to the case below where there's a large-enough free block
-    uint32_t allocated_region_addr = allocated_page_index << this->page_bits;
-    uint32_t allocated_region_size = needed_page_count << this->page_bits;
-    this->free_regions_by_addr.emplace(allocated_region_addr, allocated_region_size);
-    free_block_it = this->free_regions_by_size.emplace(allocated_region_size, allocated_region_addr).first;
+bool MemoryContext::commit_page_region(uint32_t page_index, uint32_t page_count) {
+  void* region_base = this->map_pages(page_index, page_count);
+  if (!region_base) {
+    return false;
+  }
+  this->allocated_page_regions_by_index.emplace(page_index, page_count);
+  for (size_t x = 0; x < page_count; x++) {
+    if (this->page_host_addrs[page_index + x]) {
+      throw logic_error("page already has host address");
+    }
+    this->page_host_addrs[page_index + x] = reinterpret_cast<uint8_t*>(region_base) + (x << this->page_bits);
   }
+  return true;
+}
 
-  // Figure out how to split up the free block
-  uint32_t free_block_addr = free_block_it->second;
-  uint32_t free_block_size = free_block_it->first;
-  size_t remaining_size = free_block_size - requested_size;
-  uint32_t allocated_block_addr = free_block_addr;
-  uint32_t new_free_block_addr = free_block_addr + requested_size;
+uint32_t MemoryContext::allocate_page_region(uint32_t page_count) {
+  // Find the smallest free page region with enough space, and put the
+  // allocated page region in the first part of it
+  auto free_page_it = this->free_page_regions_by_count.lower_bound(make_pair(page_count, 0));
+  if (free_page_it == this->free_page_regions_by_count.end()) {
+    return 0;
+  }
+  uint32_t free_page_count = free_page_it->first;
+  uint32_t free_page_index = free_page_it->second;
+  if (!this->commit_page_region(free_page_index, page_count)) {
+    return 0;
+  }
 
-  // Delete the old free block, create a new allocated block, and create a new
-  // free block if any space remains
-  this->free_regions_by_addr.erase(free_block_it->second);
-  this->free_regions_by_size.erase(free_block_it);
+  this->free_page_regions_by_count.erase(free_page_it);
+  this->free_page_regions_by_index.erase(free_page_index);
+  if (free_page_count > page_count) {
+    this->free_page_regions_by_count.emplace(free_page_count - page_count, free_page_index + page_count);
+    this->free_page_regions_by_index.emplace(free_page_index + page_count, free_page_count - page_count);
+  }
+  return free_page_index;
+}
 
-  this->allocated_regions_by_addr.emplace(allocated_block_addr, requested_size);
-  if (remaining_size > 0) {
-    this->free_regions_by_addr.emplace(new_free_block_addr, remaining_size);
-    this->free_regions_by_size.emplace(remaining_size, new_free_block_addr);
+void MemoryContext::release_page_region(uint32_t page_index) {
+  auto allocated_page_it = this->allocated_page_regions_by_index.find(page_index);
+  if (allocated_page_it == this->allocated_page_regions_by_index.end()) {
+    throw logic_error("page region is not allocated");
+  }
+  uint32_t page_count = allocated_page_it->second;
+  this->allocated_page_regions_by_index.erase(allocated_page_it);
+  this->unmap_pages(page_index, page_count);
+  for (size_t x = 0; x < page_count; x++) {
+    this->page_host_addrs[page_index + x] = nullptr;
   }
 
-  return allocated_block_addr;
+  // Coalesce the released pages with the free page regions before and after
+  // them, if they're adjacent
+  auto next_it = this->free_page_regions_by_index.lower_bound(page_index);
+  if ((next_it != this->free_page_regions_by_index.end()) &&
+      (next_it->first == page_index + page_count)) {
+    page_count += next_it->second;
+    this->free_page_regions_by_count.erase(make_pair(next_it->second, next_it->first));
+    next_it = this->free_page_regions_by_index.erase(next_it);
+  }
+  if (next_it != this->free_page_regions_by_index.begin()) {
+    auto prev_it = prev(next_it);
+    if (prev_it->first + prev_it->second == page_index) {
+      page_index = prev_it->first;
+      page_count += prev_it->second;
+      this->free_page_regions_by_count.erase(make_pair(prev_it->second, prev_it->first));
+      this->free_page_regions_by_index.erase(prev_it);
+    }
+  }
+  this->free_page_regions_by_count.emplace(page_count, page_index);
+  this->free_page_regions_by_index.emplace(page_index, page_count);
 }
 
-uint32_t MemoryContext::allocate_at(uint32_t addr, size_t requested_size) {
+void MemoryContext::add_free_small_blocks(uint32_t addr, uint32_t size) {
+  while (size > 0) {
+    uint32_t block_size = min<uint32_t>(size, SMALL_BLOCK_MAX_SIZE);
+    this->free_small_blocks[(block_size >> 4) - 1].emplace_back(addr);
+    addr += block_size;
+    size -= block_size;
+  }
+}
+
+uint32_t MemoryContext::allocate(size_t requested_size) {
   // Round requested_size up to a multiple of 0x10
   requested_size = (requested_size + 0x0F) & (~0x0F);
+  if (requested_size == 0) {
+    requested_size = 0x10;
+  }
+  if (requested_size > 0xFFFFFFFF - this->page_size) {
+    return 0;
+  }
 
-  // Make sure no allocated block overlaps with the requested block
-  {
-    auto existing_block_it = this->allocated_regions_by_addr.lower_bound(addr);
-    if (existing_block_it != this->allocated_regions_by_addr.end()) {
-      if (existing_block_it->first < addr + requested_size) {
-        return 0; // next block begins before requested block ends
+  // Large blocks get their own page regions
+  if (requested_size > SMALL_BLOCK_MAX_SIZE) {
+    uint32_t page_count = (requested_size + (this->page_size - 1)) >> this->page_bits;
+    uint32_t page_index = this->allocate_page_region(page_count);
+    if (!page_index) {
+      return 0;
+    }
+    uint32_t addr = page_index << this->page_bits;
+    this->allocated_blocks_by_addr.emplace(addr, AllocatedBlock{
+        static_cast<uint32_t>(requested_size), true});
+    return addr;
+  }
+
+  // For small blocks, use a free block of exactly the right size if there is
+  // one; otherwise, carve a new block out of the current arena
+  uint32_t addr = 0;
+  auto& free_list = this->free_small_blocks[(requested_size >> 4) - 1];
+  if (!free_list.empty()) {
+    addr = free_list.back();
+    free_list.pop_back();
+
+  } else if (this->arena_end_addr - this->arena_next_addr >= requested_size) {
+    addr = this->arena_next_addr;
+    this->arena_next_addr += requested_size;
+
+  } else {
+    // The arena is exhausted; split a larger free block if there is one
+    for (size_t z = requested_size >> 4; z < this->free_small_blocks.size(); z++) {
+      auto& larger_free_list = this->free_small_blocks[z];
+      if (!larger_free_list.empty()) {
+        addr = larger_free_list.back();
+        larger_free_list.pop_back();
+        this->add_free_small_blocks(addr + requested_size, ((z + 1) << 4) - requested_size);
+        break;
       }
     }
-    if (existing_block_it != this->allocated_regions_by_addr.begin()) {
-      existing_block_it--;
-      if (existing_block_it->first + existing_block_it->second > addr) {
-        return 0; // prev block ends after requested block begins
+
+    // If there are no larger free blocks either, start a new arena. The
+    // remaining space in the old arena (if any) becomes a free block
+    if (!addr) {
+      uint32_t page_count = max<uint32_t>(ARENA_SIZE >> this->page_bits, 1);
+      uint32_t page_index = this->allocate_page_region(page_count);
+      if (!page_index) {
+        return 0;
       }
+      if (this->arena_next_addr < this->arena_end_addr) {
+        this->add_free_small_blocks(this->arena_next_addr, this->arena_end_addr - this->arena_next_addr);
+      }
+      addr = page_index << this->page_bits;
+      this->arena_next_addr = addr + requested_size;
+      this->arena_end_addr = addr + (page_count << this->page_bits);
     }
   }
 
-  // TODO: For now, this function always allocates a new page region, so the
-  // requested range must not have any currently-valid pages in it. In the
-  // future we may want to support allocating from existing pages.
+  this->allocated_blocks_by_addr.emplace(addr, AllocatedBlock{
+      static_cast<uint32_t>(requested_size), false});
+  return addr;
+}
+
+uint32_t MemoryContext::allocate_at(uint32_t addr, size_t requested_size) {
+  // Round requested_size up to a multiple of 0x10
+  requested_size = (requested_size + 0x0F) & (~0x0F);
+  if (requested_size == 0) {
+    requested_size = 0x10;
+  }
+  if (static_cast<uint64_t>(addr) + requested_size > 0x100000000 - this->page_size) {
+    return 0;
+  }
+
+  // The requested block always gets its own page region, so all the pages it
+  // covers must be in a single free page region. (This also guarantees that it
+  // doesn't overlap any existing block, since all blocks are within allocated
+  // pages.)
   uint32_t start_page_index = addr >> this->page_bits;
-  uint32_t needed_page_count = ((addr + requested_size + 0xFFF) >> this->page_bits) - start_page_index;
+  uint32_t needed_page_count = ((addr + requested_size + (this->page_size - 1)) >> this->page_bits) - start_page_index;
   auto free_page_it = this->free_page_regions_by_index.upper_bound(start_page_index);
   if (free_page_it == this->free_page_regions_by_index.begin()) {
     return 0;
@@ -161,26 +603,16 @@ uint32_t MemoryContext::allocate_at(uint32_t addr, size_t requested_size) {
     return 0;
   }
 
-  // Allocate the page region and update the host address index
-  void* region_base = mmap(nullptr, needed_page_count << this->page_bits,
-      PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-  if (region_base == MAP_FAILED) {
+  if (!this->commit_page_region(start_page_index, needed_page_count)) {
     return 0;
   }
-  for (size_t x = 0; x < needed_page_count; x++) {
-    size_t page_index = start_page_index + x;
-    if (this->page_host_addrs[page_index]) {
-      throw logic_error("page already has host address");
-    }
-    this->page_host_addrs[page_index] = reinterpret_cast<uint8_t*>(region_base) + (x << this->page_bits);
-  }
 
   // Split the free page region into multiple (if needed)
   uint32_t existing_free_page_index = free_page_it->first;
   uint32_t existing_free_page_count = free_page_it->second;
   uint32_t before_free_pages = start_page_index - existing_free_page_index;
   uint32_t after_free_pages = (existing_free_page_index + existing_free_page_count) - (start_page_index + needed_page_count);
-  this->free_page_regions_by_count.erase(free_page_it->second);
+  this->free_page_regions_by_count.erase(make_pair(existing_free_page_count, existing_free_page_index));
   this->free_page_regions_by_index.erase(free_page_it);
   if (before_free_pages) {
     this->free_page_regions_by_count.emplace(before_free_pages, existing_free_page_index);
@@ -191,21 +623,8 @@ uint32_t MemoryContext::allocate_at(uint32_t addr, size_t requested_size) {
     this->free_page_regions_by_index.emplace(start_page_index + needed_page_count, after_free_pages);
   }
 
-  // Create the allocated block and free blocks if needed
-  uint32_t allocated_page_region_start_addr = start_page_index << this->page_bits;
-  uint32_t allocated_page_region_end_addr = (start_page_index + needed_page_count) << this->page_bits;
-  if (allocated_page_region_start_addr < addr) {
-    size_t remaining_size = addr - allocated_page_region_start_addr;
-    this->free_regions_by_size.emplace(remaining_size, allocated_page_region_start_addr);
-    this->free_regions_by_addr.emplace(allocated_page_region_start_addr, remaining_size);
-  }
-  if (addr + requested_size < allocated_page_region_end_addr) {
-    size_t remaining_size = allocated_page_region_end_addr - (addr + requested_size);
-    this->free_regions_by_size.emplace(remaining_size, addr + requested_size);
-    this->free_regions_by_addr.emplace(addr + requested_size, remaining_size);
-  }
-  this->allocated_regions_by_addr.emplace(addr, requested_size);
-
+  this->allocated_blocks_by_addr.emplace(addr, AllocatedBlock{
+      static_cast<uint32_t>(requested_size), true});
   return addr;
 }
 
@@ -216,61 +635,177 @@ void MemoryContext::free(uint32_t addr) {
     throw invalid_argument("pointer being freed is not part of any page");
   }
 
-  auto allocated_region_it = this->allocated_regions_by_addr.find(addr);
-  if (allocated_region_it == this->allocated_regions_by_addr.end()) {
+  auto block_it = this->allocated_blocks_by_addr.find(addr);
+  if (block_it == this->allocated_blocks_by_addr.end()) {
     throw invalid_argument("pointer being freed was not allocated");
   }
+  AllocatedBlock block = block_it->second;
+  this->allocated_blocks_by_addr.erase(block_it);
 
-  // Deallocate the region
-  uint32_t size = allocated_region_it->second;
-  this->allocated_regions_by_addr.erase(allocated_region_it);
-
-  // If there are no free regions at all, make one
-  if (this->free_regions_by_addr.empty()) {
-    this->free_regions_by_addr.emplace(addr, size);
-    this->free_regions_by_size.emplace(size, addr);
+  if (!this->watchpoints.empty()) {
+    if (block.owns_pages) {
+      this->remove_watchpoints(addr,
+          this->allocated_page_regions_by_index.at(page_index) << this->page_bits);
+    } else {
+      this->remove_watchpoints(addr, block.size);
+    }
+  }
 
-  // If there are free regions, check the regions before and after the freed
-  // region; if either or both directly border it, then coalesce them into a
-  // single free region. But, take care not to coalesce across page boundaries.
+  if (block.owns_pages) {
+    this->release_page_region(page_index);
   } else {
-    auto begin_it = this->free_regions_by_addr.begin();
-    auto end_it = this->free_regions_by_addr.end();
-    auto next_it = this->free_regions_by_addr.lower_bound(addr);
-
-    bool freed_region_begins_on_page_boundary = this->allocated_page_regions_by_index.count(addr >> this->page_bits);
-    bool next_region_begins_on_page_boundary = (next_it == end_it)
-        ? false
-        : this->allocated_page_regions_by_index.count(next_it->first >> this->page_bits);
-
-    // This is like `(next_it != begin_it) ? (next_it - 1) : end_it` but
-    // iterators can't be used in expressions like `x - 1`... :(
-    auto prev_it = next_it;
-    if (prev_it == begin_it) {
-      prev_it = end_it;
-    } else {
-      prev_it--;
+    this->free_small_blocks[(block.size >> 4) - 1].emplace_back(addr);
+  }
+}
+
+void MemoryContext::zero(uint32_t addr, size_t size) {
+  uint64_t end_addr = static_cast<uint64_t>(addr) + size;
+  uint64_t whole_pages_start_addr = (static_cast<uint64_t>(addr) + (this->page_size - 1)) & ~(this->page_size - 1);
+  uint64_t whole_pages_end_addr = end_addr & ~(this->page_size - 1);
+  if (whole_pages_start_addr >= whole_pages_end_addr) {
+    memset(this->at(addr, size), 0, size);
+    return;
+  }
+
+  // Clear the partial pages at the beginning and end (if any) directly
+  if (addr < whole_pages_start_addr) {
+    memset(this->at(addr), 0, whole_pages_start_addr - addr);
+  }
+  if (whole_pages_end_addr < end_addr) {
+    memset(this->at(whole_pages_end_addr), 0, end_addr - whole_pages_end_addr);
+  }
+
+  // Replace the whole pages with new anonymous mappings at the same host
+  // addresses, in runs of pages that are contiguous in host memory
+  uint64_t page_addr = whole_pages_start_addr;
+  while (page_addr < whole_pages_end_addr) {
+    uint8_t* run_base = reinterpret_cast<uint8_t*>(
+        this->page_host_addrs[page_addr >> this->page_bits]);
+    if (!run_base) {
+      throw out_of_range("address not within allocated pages");
     }
+    size_t run_size = this->page_size;
+    for (page_addr += this->page_size;
+         (page_addr < whole_pages_end_addr) &&
+           (this->page_host_addrs[page_addr >> this->page_bits] == run_base + run_size);
+         page_addr += this->page_size) {
+      run_size += this->page_size;
+    }
+    if (mmap(run_base, run_size, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      throw runtime_error("cannot replace pages");
+    }
+  }
 
-    uint32_t freed_addr = addr;
-    uint32_t freed_size = size;
-    if (!next_region_begins_on_page_boundary && (next_it != end_it) && (next_it->first == freed_addr + freed_size)) {
-      freed_size += next_it->second;
-      this->free_regions_by_size.erase(next_it->second);
-      this->free_regions_by_addr.erase(next_it);
+  // The new pages are accessible, so protect any watched ones again
+  if (!this->watched_page_protections.empty()) {
+    this->update_watched_pages(whole_pages_start_addr,
+        whole_pages_end_addr - whole_pages_start_addr);
+  }
+}
+
+void MemoryContext::add_watchpoint(uint32_t addr, size_t size, bool on_read,
+    bool on_write, WatchpointFn fn) {
+#ifdef WATCHPOINTS_SUPPORTED
+  if (!this->flat_base) {
+    throw runtime_error("watchpoints require flat mode");
+  }
+  if (!on_read && !on_write) {
+    throw invalid_argument("watchpoint must be triggered by reads or writes");
+  }
+  if (!size || !this->exists(addr, size)) {
+    throw out_of_range("watched range not within allocated pages");
+  }
+  if (!this->watchpoints.emplace(addr, Watchpoint{size, on_read, on_write, std::move(fn)}).second) {
+    throw invalid_argument("a watchpoint already exists at this address");
+  }
+
+  static once_flag installed;
+  call_once(installed, []() {
+    install_signal_handler(SIGTRAP, &MemoryContext::sigtrap_handler, 0,
+        &prev_sigtrap_action);
+  });
+  this->update_watched_pages(addr, size);
+#else
+  (void)addr;
+  (void)size;
+  (void)on_read;
+  (void)on_write;
+  (void)fn;
+  throw runtime_error("watchpoints are not supported on this platform");
+#endif
+}
+
+void MemoryContext::remove_watchpoint(uint32_t addr) {
+  auto it = this->watchpoints.find(addr);
+  if (it == this->watchpoints.end()) {
+    throw out_of_range("no watchpoint exists at this address");
+  }
+  size_t size = it->second.size;
+  this->watchpoints.erase(it);
+  this->update_watched_pages(addr, size);
+}
+
+void MemoryContext::remove_watchpoints(uint32_t addr, size_t size) {
+  uint64_t end_addr = static_cast<uint64_t>(addr) + size;
+  for (auto it = this->watchpoints.begin(); it != this->watchpoints.end();) {
+    if ((it->first < end_addr) && (it->first + it->second.size > addr)) {
+      uint32_t wp_addr = it->first;
+      size_t wp_size = it->second.size;
+      it = this->watchpoints.erase(it);
+      this->update_watched_pages(wp_addr, wp_size);
+    } else {
+      it++;
     }
-    if (!freed_region_begins_on_page_boundary && (prev_it != end_it) && (prev_it->first + prev_it->second == freed_addr)) {
-      freed_addr = prev_it->first;
-      freed_size += prev_it->second;
-      this->free_regions_by_size.erase(prev_it->second);
-      this->free_regions_by_addr.erase(prev_it);
+  }
+}
+
+void MemoryContext::update_watched_pages(uint32_t addr, size_t size) {
+  if (this->watched_page_states.empty()) {
+    this->watched_page_states.resize(static_cast<size_t>(1) << (32 - this->page_bits), 0);
+  }
+  uint64_t end_page_index = (static_cast<uint64_t>(addr) + size + (this->page_size - 1)) >> this->page_bits;
+  for (uint64_t page_index = addr >> this->page_bits; page_index < end_page_index; page_index++) {
+    // Pages with read watchpoints have to be completely inaccessible; pages
+    // with only write watchpoints can still be read
+    uint64_t page_addr = page_index << this->page_bits;
+    int prot = PROT_READ | PROT_WRITE;
+    for (const auto& it : this->watchpoints) {
+      if (it.first >= page_addr + this->page_size) {
+        break;
+      }
+      if (it.first + it.second.size > page_addr) {
+        if (it.second.on_read) {
+          prot = PROT_NONE;
+        } else if (prot != PROT_NONE) {
+          prot = PROT_READ;
+        }
+      }
     }
 
-    this->free_regions_by_size.emplace(freed_size, freed_addr);
-    this->free_regions_by_addr.emplace(freed_addr, freed_size);
+    if (prot == (PROT_READ | PROT_WRITE)) {
+      if (!this->watched_page_protections.erase(page_index)) {
+        continue;
+      }
+      this->watched_page_states[page_index] = 0;
+    } else {
+      this->watched_page_protections[page_index] = prot;
+      this->watched_page_states[page_index] = prot + 1;
+    }
+    if (this->page_host_addrs[page_index] &&
+        mprotect(this->page_host_addrs[page_index], this->page_size, prot)) {
+      throw runtime_error("cannot protect watched page");
+    }
   }
+}
 
-  // TODO: check if the entire page region is now free and unmap it if so
+void MemoryContext::set_watched_pages_readable(bool readable) const {
+  for (const auto& it : this->watched_page_protections) {
+    if (it.second == PROT_NONE) {
+      mprotect(this->page_host_addrs[it.first], this->page_size,
+          readable ? PROT_READ : PROT_NONE);
+    }
+  }
 }
 
 void MemoryContext::set_symbol_addr(const char* name, uint32_t addr) {
@@ -283,24 +818,46 @@ uint32_t MemoryContext::get_symbol_addr(const char* name) {
   return this->symbol_addrs.at(name);
 }
 
+bool MemoryContext::exists(uint32_t addr, size_t size) const {
+  if (size == 0) {
+    return true;
+  }
+  uint64_t end_addr = static_cast<uint64_t>(addr) + size;
+  if (end_addr > 0x100000000) {
+    return false;
+  }
+  size_t end_page_index = (end_addr - 1) >> this->page_bits;
+  for (size_t index = addr >> this->page_bits; index <= end_page_index; index++) {
+    if (!this->page_host_addrs[index]) {
+      return false;
+    }
+  }
+  return true;
+}
+
 size_t MemoryContext::get_page_size() const {
   return this->page_size;
 }
 
 void MemoryContext::print_state(FILE* stream) const {
   fprintf(stream, "[mem bits=%hhu alloc=[", this->page_bits);
-  for (const auto& it : this->allocated_regions_by_addr) {
-    fprintf(stream, "(%X,%X),", it.first, it.second);
+  map<uint32_t, AllocatedBlock> sorted_blocks(
+      this->allocated_blocks_by_addr.begin(), this->allocated_blocks_by_addr.end());
+  for (const auto& it : sorted_blocks) {
+    fprintf(stream, "(%X,%X%s),", it.first, it.second.size, it.second.owns_pages ? ",p" : "");
   }
   fprintf(stream, "] free=[");
-  for (const auto& it : this->free_regions_by_addr) {
-    fprintf(stream, "(%X,%X),", it.first, it.second);
-  }
-  fprintf(stream, "] frees=[");
-  for (const auto& it : this->free_regions_by_size) {
-    fprintf(stream, "(%X,%X),", it.first, it.second);
+  for (size_t x = 0; x < this->free_small_blocks.size(); x++) {
+    if (this->free_small_blocks[x].empty()) {
+      continue;
+    }
+    fprintf(stream, "%zX:(", (x + 1) << 4);
+    for (uint32_t addr : this->free_small_blocks[x]) {
+      fprintf(stream, "%X,", addr);
+    }
+    fprintf(stream, "),");
   }
-  fprintf(stream, "] allocp=[");
+  fprintf(stream, "] arena=(%X,%X) allocp=[", this->arena_next_addr, this->arena_end_addr);
   for (const auto& it : this->allocated_page_regions_by_index) {
     fprintf(stream, "(%X,%X),", it.first, it.second);
   }
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <signal.h>
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <functional>
 #include <map>
+#include <memory>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -12,27 +16,104 @@
 
 
 class MemoryContext {
+private:
+  struct AllocatedBlock {
+    uint32_t size;
+    // True if this block has its own page region (which is released when the
+    // block is freed); false if it's a small block within an arena
+    bool owns_pages;
+  };
+
 public:
-  MemoryContext();
+  // A frozen copy of a MemoryContext's contents and allocation state. Contexts
+  // created from a snapshot map its pages copy-on-write, so creating them is
+  // cheap and they don't affect each other or the snapshot. This is useful for
+  // preparing an image once (for example, loading and relocating a PEFF file)
+  // and then running many independent jobs on it.
+  class Snapshot {
+  public:
+    ~Snapshot();
+
+  private:
+    friend class MemoryContext;
+    Snapshot() = default;
+
+    int fd = -1;
+    size_t page_size;
+    uint8_t page_bits;
+    bool flat;
+    // Page index -> (page count, offset in fd)
+    std::map<uint32_t, std::pair<uint32_t, uint64_t>> page_regions;
+    std::unordered_map<uint32_t, AllocatedBlock> allocated_blocks_by_addr;
+    std::set<std::pair<uint32_t, uint32_t>> free_page_regions_by_count;
+    std::map<uint32_t, uint32_t> free_page_regions_by_index;
+    std::vector<std::vector<uint32_t>> free_small_blocks;
+    uint32_t arena_next_addr;
+    uint32_t arena_end_addr;
+    std::unordered_map<std::string, uint32_t> symbol_addrs;
+  };
+
+  // If flat is true, the entire 4GB guest address space is reserved in the host
+  // address space up front, and allocating memory just makes the relevant
+  // pages accessible. This makes address translation in at() a single
+  // addition; accesses to unallocated guest memory are caught by a SIGSEGV
+  // handler and rethrown as out_of_range, as in the default mode. (This
+  // requires code that accesses guest memory to be compiled with
+  // -fnon-call-exceptions.) Flat mode is only available on 64-bit Linux hosts;
+  // elsewhere, this flag is ignored.
+  explicit MemoryContext(bool flat = false);
+  // Contexts created from a snapshot use the same mode as the snapshotted
+  // context.
+  explicit MemoryContext(std::shared_ptr<const Snapshot> snapshot);
+  MemoryContext(const MemoryContext&) = delete;
+  MemoryContext& operator=(const MemoryContext&) = delete;
   ~MemoryContext();
 
+  // Captures the current state of this context. This copies all allocated
+  // pages that aren't entirely zero, so it's best done on small prepared
+  // images rather than on contexts with large amounts of data.
+  std::shared_ptr<const Snapshot> snapshot() const;
+  // Equivalent to creating a new context from snapshot(); if the same state
+  // will be forked multiple times, it's faster to snapshot it only once.
+  std::shared_ptr<MemoryContext> fork() const;
+
   uint32_t guest_addr_for_host_addr(const void* ptr);
 
   inline void* at(uint32_t addr, size_t size = 1) {
+    if (this->flat_base) {
+      // Unallocated pages are inaccessible, so the caller will fault (and the
+      // SIGSEGV handler will throw out_of_range) if this range isn't valid;
+      // the only thing to check here is that the range doesn't extend past the
+      // end of the reserved region
+      if (static_cast<uint64_t>(addr) + size > 0x100000000) {
+        throw std::out_of_range("data not contained within allocated pages");
+      }
+      return this->flat_base + addr;
+    }
+
+    uint64_t end_addr = static_cast<uint64_t>(addr) + size;
+    if (end_addr > 0x100000000) {
+      throw std::out_of_range("data not contained within allocated pages");
+    }
     size_t start_page_index = addr >> this->page_bits;
-    size_t end_page_index = (addr + size) >> this->page_bits;
+    size_t end_page_index = (end_addr + (this->page_size - 1)) >> this->page_bits;
     void* page_addr = this->page_host_addrs[start_page_index];
     if (!page_addr) {
       throw std::out_of_range("address not within allocated pages");
     }
     for (size_t index = start_page_index + 1; index < end_page_index; index++) {
-      if (!this->page_host_addrs[start_page_index]) {
+      if (!this->page_host_addrs[index]) {
         throw std::out_of_range("data not contained within allocated pages");
       }
     }
     return reinterpret_cast<uint8_t*>(page_addr) + (addr & 0xFFF);
   }
 
+  // Returns true if every byte in the range is within allocated pages. Unlike
+  // at(), this never throws or faults, so it can be used to check a range
+  // before accessing it piece by piece.
+  bool exists(uint32_t addr, size_t size) const;
+
   template <typename T>
   T* obj(uint32_t addr, uint32_t size = sizeof(T)) {
     return reinterpret_cast<T*>(this->at(addr, size));
@@ -84,30 +165,140 @@ public:
     this->write<uint32_t>(addr, bswap32(value));
   }
 
+  // Allocation sizes are rounded up to a multiple of 0x10. Blocks up to
+  // SMALL_BLOCK_MAX_SIZE bytes are carved out of shared arenas and recycled
+  // through per-size free lists, so allocating and freeing them takes constant
+  // time in the common case. Larger blocks get their own page regions, which
+  // are unmapped when the blocks are freed. Blocks allocated with allocate_at
+  // always get their own page regions.
+  static constexpr uint32_t SMALL_BLOCK_MAX_SIZE = 0x1000;
+  static constexpr uint32_t ARENA_SIZE = 0x100000;
+
+  // Both of these return 0 on failure. Page 0 is never allocated, so 0 is
+  // never a valid block address.
   uint32_t allocate(size_t size);
   uint32_t allocate_at(uint32_t addr, size_t size);
   void free(uint32_t addr);
 
+  // Sets a range of memory to zero. Whole pages in the range are replaced with
+  // new zero-filled pages rather than being overwritten, so this is cheap even
+  // for large regions of which only a small part was used.
+  void zero(uint32_t addr, size_t size);
+
+  // Watchpoints call a function whenever memory in a range is read or written.
+  // They're implemented by protecting the pages that contain the range and
+  // catching the resulting faults, so accesses to memory that isn't on a
+  // watched page cost nothing extra. (Accesses to unwatched parts of a watched
+  // page are caught and resumed without being reported, so they're much
+  // slower than usual.) Watchpoints are only available in flat mode on x86-64
+  // Linux hosts; elsewhere, add_watchpoint throws runtime_error.
+  //
+  // The function is called with the address of the first byte the access
+  // touched on the watched page. The signal handlers only record each access
+  // (in a small per-thread buffer); the emulators call the functions for the
+  // recorded accesses after the instruction that made them has finished, from
+  // dispatch_watchpoint_hits. So the function runs outside of any signal
+  // handler, and it can throw (which stops the emulator, as if the instruction
+  // had thrown), access memory, or add or remove watchpoints. Accesses by host
+  // code (for example, in syscall handlers) are reported too: if that code
+  // runs within an emulator, they're reported after the current instruction;
+  // otherwise, the caller should call dispatch_watchpoint_hits itself. At most
+  // MAX_PENDING_WATCHPOINT_HITS accesses are recorded between calls to
+  // dispatch_watchpoint_hits; any more than that aren't reported. Watchpoints
+  // on a block are removed when the block is freed, and aren't included in
+  // snapshots.
+  using WatchpointFn = std::function<void(uint32_t addr, bool is_write)>;
+  void add_watchpoint(uint32_t addr, size_t size, bool on_read, bool on_write,
+      WatchpointFn fn);
+  void remove_watchpoint(uint32_t addr);
+
+  // Calls the watchpoint functions for all accesses recorded on this thread
+  // since the last call. This is cheap when there are none, so the emulators
+  // call it after every instruction.
+  static const size_t MAX_PENDING_WATCHPOINT_HITS = 64;
+  static inline void dispatch_watchpoint_hits() {
+    if (num_pending_watchpoint_hits) {
+      dispatch_pending_watchpoint_hits();
+    }
+  }
+  // Drops all accesses recorded on this thread without reporting them
+  static inline void discard_watchpoint_hits() {
+    num_pending_watchpoint_hits = 0;
+  }
+
   void set_symbol_addr(const char* name, uint32_t addr);
   uint32_t get_symbol_addr(const char* name);
 
   size_t get_page_size() const;
+  inline bool is_flat() const {
+    return this->flat_base != nullptr;
+  }
 
   void print_state(FILE* stream) const;
 
 private:
+  struct Watchpoint {
+    size_t size;
+    bool on_read;
+    bool on_write;
+    WatchpointFn fn;
+  };
+
+  static void sigsegv_handler(int signum, siginfo_t* info, void* uctx);
+  static void sigtrap_handler(int signum, siginfo_t* info, void* uctx);
+  static MemoryContext* end_watched_access();
+  static void dispatch_pending_watchpoint_hits();
+  void call_watchpoints(uint32_t addr, bool is_write);
+
+  // Written by the SIGTRAP handler, so it's volatile
+  static inline thread_local volatile sig_atomic_t num_pending_watchpoint_hits = 0;
+
+  void init_flat();
+  void* map_pages(uint32_t page_index, uint32_t page_count);
+  void unmap_pages(uint32_t page_index, uint32_t page_count);
+  bool commit_page_region(uint32_t page_index, uint32_t page_count);
+  uint32_t allocate_page_region(uint32_t page_count);
+  void release_page_region(uint32_t page_index);
+  void add_free_small_blocks(uint32_t addr, uint32_t size);
+  void remove_watchpoints(uint32_t addr, size_t size);
+  void update_watched_pages(uint32_t addr, size_t size);
+  void set_watched_pages_readable(bool readable) const;
+
   size_t page_size;
   uint8_t page_bits;
 
-  std::map<uint32_t, uint32_t> allocated_regions_by_addr;
+  // Base of the reserved 4GB region in flat mode, or nullptr in the default
+  // mode. flat_slot is this context's entry in the SIGSEGV handler's list of
+  // reserved regions.
+  uint8_t* flat_base;
+  ssize_t flat_slot;
+
+  std::unordered_map<uint32_t, AllocatedBlock> allocated_blocks_by_addr;
 
   std::map<uint32_t, uint32_t> allocated_page_regions_by_index;
-  std::map<uint32_t, uint32_t> free_page_regions_by_count;
+  // (page count, page index)
+  std::set<std::pair<uint32_t, uint32_t>> free_page_regions_by_count;
   std::map<uint32_t, uint32_t> free_page_regions_by_index;
 
-  std::map<uint32_t, uint32_t> free_regions_by_addr;
-  std::map<uint32_t, uint32_t> free_regions_by_size;
+  // Free small blocks, indexed by (size / 0x10) - 1. Freed small blocks are not
+  // coalesced; when an exact-size block isn't available, the current arena is
+  // used, and if that's exhausted, a larger free block is split.
+  std::vector<std::vector<uint32_t>> free_small_blocks;
+  // The unused part of the arena that small blocks are currently being carved
+  // from
+  uint32_t arena_next_addr;
+  uint32_t arena_end_addr;
+
   std::unordered_map<std::string, uint32_t> symbol_addrs;
 
   std::vector<void*> page_host_addrs;
+
+  // Watchpoints by start address, and the protection of each page that
+  // contains any watched memory (by page index). The signal handlers can't
+  // look up the map, so watched_page_states has the same information for
+  // every page in the address space (0 if the page isn't watched, or the
+  // protection + 1). It's allocated when the first watchpoint is added.
+  std::map<uint32_t, Watchpoint> watchpoints;
+  std::unordered_map<uint32_t, int> watched_page_protections;
+  std::vector<uint8_t> watched_page_states;
 };
@@ -311,6 +311,14 @@ public:
   inline bool is_ppc() const {
     return this->arch_is_ppc;
   }
+  // Sections that load_into allocates memory for are registered as the symbols
+  // <lib_name>:section:<index>; this returns how much memory each one occupies
+  inline size_t section_count() const {
+    return this->sections.size();
+  }
+  inline uint32_t section_total_size(size_t index) const {
+    return this->sections.at(index).total_size;
+  }
 
 private:
   void parse(const std::string& data);
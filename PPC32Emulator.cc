@@ -110,7 +110,7 @@ struct BranchBOField {
   uint8_t u;
 
   inline bool skip_condition() const {
-    return (u >> 4) & 0x10;
+    return (u >> 4) & 0x01;
   }
   inline bool branch_condition_value() const {
     return (u >> 3) & 0x01;
@@ -261,11 +261,6 @@ bool PPC32Emulator::should_branch(uint32_t op) {
   return ctr_ok && cond_ok;
 }
 
-void PPC32Emulator::set_cr_bits_int(uint8_t crf, int32_t value) {
-  uint8_t cr_bits = ((value < 0) << 3) | ((value > 0) << 2) | ((value == 0) << 1) | this->regs.xer.get_so();
-  this->regs.cr.replace_field(crf, cr_bits);
-}
-
 
 
 void PPC32Emulator::exec_unimplemented(uint32_t op) {
@@ -318,9 +313,11 @@ string PPC32Emulator::dasm_1C_mulli(uint32_t pc, uint32_t op, set<uint32_t>& lab
 
 void PPC32Emulator::exec_20_subfic(uint32_t op) {
   // 001000 DDDDD AAAAA IIIIIIIIIIIIIIII
-  this->regs.r[op_get_reg1(op)].s =
-      op_get_imm_ext(op) - this->regs.r[op_get_reg2(op)].s;
-  this->exec_unimplemented(op); // TODO: set XER[CA]
+  uint32_t a = this->regs.r[op_get_reg2(op)].u;
+  uint32_t imm = op_get_imm_ext(op);
+  this->regs.r[op_get_reg1(op)].u = imm - a;
+  // xer[ca] is set unless the (unsigned) subtraction borrows
+  this->regs.xer.set_ca(imm >= a);
 }
 
 string PPC32Emulator::dasm_20_subfic(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -559,6 +556,9 @@ void PPC32Emulator::exec_44_sc(uint32_t op) {
     if (!this->syscall_handler(*this, this->regs)) {
       this->should_exit = true;
     }
+    // the handler may have modified memory without going through
+    // on_memory_write
+    this->invalidate_translated_blocks();
   } else {
     this->exec_unimplemented(op);
   }
@@ -610,88 +610,28 @@ string PPC32Emulator::dasm_48_b(uint32_t pc, uint32_t op, set<uint32_t>& labels)
 
 
 void PPC32Emulator::exec_4C(uint32_t op) {
-  switch (op_get_subopcode(op)) {
-    case 0x000:
-      this->exec_4C_000_mcrf(op);
-      break;
-    case 0x010:
-      this->exec_4C_010_bclr(op);
-      break;
-    case 0x021:
-      this->exec_4C_021_crnor(op);
-      break;
-    case 0x031:
-      this->exec_4C_031_rfi(op);
-      break;
-    case 0x081:
-      this->exec_4C_081_crandc(op);
-      break;
-    case 0x096:
-      this->exec_4C_096_isync(op);
-      break;
-    case 0x0C1:
-      this->exec_4C_0C1_crxor(op);
-      break;
-    case 0x0E1:
-      this->exec_4C_0E1_crnand(op);
-      break;
-    case 0x101:
-      this->exec_4C_101_crand(op);
-      break;
-    case 0x121:
-      this->exec_4C_121_creqv(op);
-      break;
-    case 0x1A1:
-      this->exec_4C_1A1_crorc(op);
-      break;
-    case 0x1C1:
-      this->exec_4C_1C1_cror(op);
-      break;
-    case 0x210:
-      this->exec_4C_210_bcctr(op);
-      break;
-    default:
-      throw runtime_error("invalid 4C subopcode");
+  ExecFn fn = PPC32Emulator::subopcodes_4C[op_get_subopcode(op)].exec;
+  if (!fn) {
+    throw runtime_error("invalid 4C subopcode");
   }
+  (this->*fn)(op);
 }
 
 string PPC32Emulator::dasm_4C(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
-  switch (op_get_subopcode(op)) {
-    case 0x000:
-      return PPC32Emulator::dasm_4C_000_mcrf(pc, op, labels);
-    case 0x010:
-      return PPC32Emulator::dasm_4C_010_bclr(pc, op, labels);
-    case 0x021:
-      return PPC32Emulator::dasm_4C_021_crnor(pc, op, labels);
-    case 0x031:
-      return PPC32Emulator::dasm_4C_031_rfi(pc, op, labels);
-    case 0x081:
-      return PPC32Emulator::dasm_4C_081_crandc(pc, op, labels);
-    case 0x096:
-      return PPC32Emulator::dasm_4C_096_isync(pc, op, labels);
-    case 0x0C1:
-      return PPC32Emulator::dasm_4C_0C1_crxor(pc, op, labels);
-    case 0x0E1:
-      return PPC32Emulator::dasm_4C_0E1_crnand(pc, op, labels);
-    case 0x101:
-      return PPC32Emulator::dasm_4C_101_crand(pc, op, labels);
-    case 0x121:
-      return PPC32Emulator::dasm_4C_121_creqv(pc, op, labels);
-    case 0x1A1:
-      return PPC32Emulator::dasm_4C_1A1_crorc(pc, op, labels);
-    case 0x1C1:
-      return PPC32Emulator::dasm_4C_1C1_cror(pc, op, labels);
-    case 0x210:
-      return PPC32Emulator::dasm_4C_210_bcctr(pc, op, labels);
-    default:
-      return ".invalid  4C";
+  DasmFn fn = PPC32Emulator::subopcodes_4C[op_get_subopcode(op)].dasm;
+  if (!fn) {
+    return ".invalid  4C";
   }
+  return fn(pc, op, labels);
 }
 
 
 
 void PPC32Emulator::exec_4C_000_mcrf(uint32_t op) {
-  this->exec_unimplemented(op); // 010011 DDD 00 SSS 0000000 0000000000 0
+  // 010011 DDD 00 SSS 0000000 0000000000 0
+  uint8_t crf_src = op_get_crf2(op);
+  this->regs.cr.replace_field(op_get_crf1(op),
+      (this->regs.cr.u >> (28 - (4 * crf_src))) & 0xF);
 }
 
 string PPC32Emulator::dasm_4C_000_mcrf(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -703,11 +643,13 @@ string PPC32Emulator::dasm_4C_000_mcrf(uint32_t pc, uint32_t op, set<uint32_t>&
 
 void PPC32Emulator::exec_4C_010_bclr(uint32_t op) {
   // 010011 OOOOO IIIII 00000 0000010000 L
+  // note: the target must be read before lr is overwritten (for blrl)
+  uint32_t target = this->regs.lr & 0xFFFFFFFC;
   if (op_get_b_link(op)) {
     this->regs.lr = this->regs.pc + 4;
   }
   if (this->should_branch(op)) {
-    this->regs.pc = (this->regs.lr & 0xFFFFFFFC) - 4;
+    this->regs.pc = target - 4;
   }
 }
 
@@ -1060,509 +1002,19 @@ string PPC32Emulator::dasm_74_andis_rec(uint32_t pc, uint32_t op, set<uint32_t>&
 
 
 void PPC32Emulator::exec_7C(uint32_t op) {
-  switch (op_get_subopcode(op)) {
-    case 0x000:
-      this->exec_7C_000_cmp(op);
-      break;
-    case 0x004:
-      this->exec_7C_004_tw(op);
-      break;
-    case 0x008:
-      this->exec_7C_008_208_subfc(op);
-      break;
-    case 0x00A:
-      this->exec_7C_00A_20A_addc(op);
-      break;
-    case 0x00B:
-      this->exec_7C_00B_mulhwu(op);
-      break;
-    case 0x013:
-      this->exec_7C_013_mfcr(op);
-      break;
-    case 0x014:
-      this->exec_7C_014_lwarx(op);
-      break;
-    case 0x017:
-      this->exec_7C_017_lwzx(op);
-      break;
-    case 0x018:
-      this->exec_7C_018_slw(op);
-      break;
-    case 0x01A:
-      this->exec_7C_01A_cntlzw(op);
-      break;
-    case 0x01C:
-      this->exec_7C_01C_and(op);
-      break;
-    case 0x020:
-      this->exec_7C_020_cmpl(op);
-      break;
-    case 0x028:
-      this->exec_7C_028_228_subf(op);
-      break;
-    case 0x036:
-      this->exec_7C_036_dcbst(op);
-      break;
-    case 0x037:
-      this->exec_7C_037_lwzux(op);
-      break;
-    case 0x03C:
-      this->exec_7C_03C_andc(op);
-      break;
-    case 0x04B:
-      this->exec_7C_04B_mulhw(op);
-      break;
-    case 0x053:
-      this->exec_7C_053_mfmsr(op);
-      break;
-    case 0x056:
-      this->exec_7C_056_dcbf(op);
-      break;
-    case 0x057:
-      this->exec_7C_057_lbzx(op);
-      break;
-    case 0x058:
-    case 0x258:
-      this->exec_7C_058_258_neg(op);
-      break;
-    case 0x077:
-      this->exec_7C_077_lbzux(op);
-      break;
-    case 0x07C:
-      this->exec_7C_07C_nor(op);
-      break;
-    case 0x088:
-    case 0x288:
-      this->exec_7C_088_288_subfe(op);
-      break;
-    case 0x08A:
-    case 0x28A:
-      this->exec_7C_08A_28A_adde(op);
-      break;
-    case 0x090:
-      this->exec_7C_090_mtcrf(op);
-      break;
-    case 0x092:
-      this->exec_7C_092_mtmsr(op);
-      break;
-    case 0x096:
-      this->exec_7C_096_stwcx_rec(op);
-      break;
-    case 0x097:
-      this->exec_7C_097_stwx(op);
-      break;
-    case 0x0B7:
-      this->exec_7C_0B7_stwux(op);
-      break;
-    case 0x0C8:
-    case 0x2C8:
-      this->exec_7C_0C8_2C8_subfze(op);
-      break;
-    case 0x0CA:
-    case 0x2CA:
-      this->exec_7C_0CA_2CA_addze(op);
-      break;
-    case 0x0D2:
-      this->exec_7C_0D2_mtsr(op);
-      break;
-    case 0x0D7:
-      this->exec_7C_0D7_stbx(op);
-      break;
-    case 0x0E8:
-    case 0x2E8:
-      this->exec_7C_0E8_2E8_subfme(op);
-      break;
-    case 0x0EA:
-    case 0x2EA:
-      this->exec_7C_0EA_2EA_addme(op);
-      break;
-    case 0x0EB:
-    case 0x2EB:
-      this->exec_7C_0EB_2EB_mullw(op);
-      break;
-    case 0x0F2:
-      this->exec_7C_0F2_mtsrin(op);
-      break;
-    case 0x0F6:
-      this->exec_7C_0F6_dcbtst(op);
-      break;
-    case 0x0F7:
-      this->exec_7C_0F7_stbux(op);
-      break;
-    case 0x10A:
-    case 0x30A:
-      this->exec_7C_10A_30A_add(op);
-      break;
-    case 0x116:
-      this->exec_7C_116_dcbt(op);
-      break;
-    case 0x117:
-      this->exec_7C_117_lhzx(op);
-      break;
-    case 0x11C:
-      this->exec_7C_11C_eqv(op);
-      break;
-    case 0x132:
-      this->exec_7C_132_tlbie(op);
-      break;
-    case 0x136:
-      this->exec_7C_136_eciwx(op);
-      break;
-    case 0x137:
-      this->exec_7C_137_lhzux(op);
-      break;
-    case 0x13C:
-      this->exec_7C_13C_xor(op);
-      break;
-    case 0x153:
-      this->exec_7C_153_mfspr(op);
-      break;
-    case 0x157:
-      this->exec_7C_157_lhax(op);
-      break;
-    case 0x172:
-      this->exec_7C_172_tlbia(op);
-      break;
-    case 0x173:
-      this->exec_7C_173_mftb(op);
-      break;
-    case 0x177:
-      this->exec_7C_177_lhaux(op);
-      break;
-    case 0x197:
-      this->exec_7C_197_sthx(op);
-      break;
-    case 0x19C:
-      this->exec_7C_19C_orc(op);
-      break;
-    case 0x1B6:
-      this->exec_7C_1B6_ecowx(op);
-      break;
-    case 0x1B7:
-      this->exec_7C_1B7_sthux(op);
-      break;
-    case 0x1BC:
-      this->exec_7C_1BC_or(op);
-      break;
-    case 0x1CB:
-    case 0x3CB:
-      this->exec_7C_1CB_3CB_divwu(op);
-      break;
-    case 0x1D3:
-      this->exec_7C_1D3_mtspr(op);
-      break;
-    case 0x1D6:
-      this->exec_7C_1D6_dcbi(op);
-      break;
-    case 0x1DC:
-      this->exec_7C_1DC_nand(op);
-      break;
-    case 0x1EB:
-    case 0x3EB:
-      this->exec_7C_1EB_3EB_divw(op);
-      break;
-    case 0x200:
-      this->exec_7C_200_mcrxr(op);
-      break;
-    case 0x215:
-      this->exec_7C_215_lswx(op);
-      break;
-    case 0x216:
-      this->exec_7C_216_lwbrx(op);
-      break;
-    case 0x217:
-      this->exec_7C_217_lfsx(op);
-      break;
-    case 0x218:
-      this->exec_7C_218_srw(op);
-      break;
-    case 0x236:
-      this->exec_7C_236_tlbsync(op);
-      break;
-    case 0x237:
-      this->exec_7C_237_lfsux(op);
-      break;
-    case 0x253:
-      this->exec_7C_253_mfsr(op);
-      break;
-    case 0x255:
-      this->exec_7C_255_lswi(op);
-      break;
-    case 0x256:
-      this->exec_7C_256_sync(op);
-      break;
-    case 0x257:
-      this->exec_7C_257_lfdx(op);
-      break;
-    case 0x277:
-      this->exec_7C_277_lfdux(op);
-      break;
-    case 0x293:
-      this->exec_7C_293_mfsrin(op);
-      break;
-    case 0x295:
-      this->exec_7C_295_stswx(op);
-      break;
-    case 0x296:
-      this->exec_7C_296_stwbrx(op);
-      break;
-    case 0x297:
-      this->exec_7C_297_stfsx(op);
-      break;
-    case 0x2B7:
-      this->exec_7C_2B7_stfsux(op);
-      break;
-    case 0x2E5:
-      this->exec_7C_2E5_stswi(op);
-      break;
-    case 0x2E7:
-      this->exec_7C_2E7_stfdx(op);
-      break;
-    case 0x2F6:
-      this->exec_7C_2F6_dcba(op);
-      break;
-    case 0x2F7:
-      this->exec_7C_2F7_stfdux(op);
-      break;
-    case 0x316:
-      this->exec_7C_316_lhbrx(op);
-      break;
-    case 0x318:
-      this->exec_7C_318_sraw(op);
-      break;
-    case 0x338:
-      this->exec_7C_338_srawi(op);
-      break;
-    case 0x356:
-      this->exec_7C_356_eieio(op);
-      break;
-    case 0x396:
-      this->exec_7C_396_sthbrx(op);
-      break;
-    case 0x39A:
-      this->exec_7C_39A_extsh(op);
-      break;
-    case 0x3BA:
-      this->exec_7C_3BA_extsb(op);
-      break;
-    case 0x3D6:
-      this->exec_7C_3D6_icbi(op);
-      break;
-    case 0x3D7:
-      this->exec_7C_3D7_stfiwx(op);
-      break;
-    case 0x3F6:
-      this->exec_7C_3F6_dcbz(op);
-      break;
-    default:
-      throw runtime_error("invalid 7C subopcode");
+  ExecFn fn = PPC32Emulator::subopcodes_7C[op_get_subopcode(op)].exec;
+  if (!fn) {
+    throw runtime_error("invalid 7C subopcode");
   }
+  (this->*fn)(op);
 }
 
 string PPC32Emulator::dasm_7C(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
-  switch (op_get_subopcode(op)) {
-    case 0x000:
-      return PPC32Emulator::dasm_7C_000_cmp(pc, op, labels);
-    case 0x004:
-      return PPC32Emulator::dasm_7C_004_tw(pc, op, labels);
-    case 0x008:
-      return PPC32Emulator::dasm_7C_008_208_subfc(pc, op, labels);
-    case 0x00A:
-      return PPC32Emulator::dasm_7C_00A_20A_addc(pc, op, labels);
-    case 0x00B:
-      return PPC32Emulator::dasm_7C_00B_mulhwu(pc, op, labels);
-    case 0x013:
-      return PPC32Emulator::dasm_7C_013_mfcr(pc, op, labels);
-    case 0x014:
-      return PPC32Emulator::dasm_7C_014_lwarx(pc, op, labels);
-    case 0x017:
-      return PPC32Emulator::dasm_7C_017_lwzx(pc, op, labels);
-    case 0x018:
-      return PPC32Emulator::dasm_7C_018_slw(pc, op, labels);
-    case 0x01A:
-      return PPC32Emulator::dasm_7C_01A_cntlzw(pc, op, labels);
-    case 0x01C:
-      return PPC32Emulator::dasm_7C_01C_and(pc, op, labels);
-    case 0x020:
-      return PPC32Emulator::dasm_7C_020_cmpl(pc, op, labels);
-    case 0x028:
-      return PPC32Emulator::dasm_7C_028_228_subf(pc, op, labels);
-    case 0x036:
-      return PPC32Emulator::dasm_7C_036_dcbst(pc, op, labels);
-    case 0x037:
-      return PPC32Emulator::dasm_7C_037_lwzux(pc, op, labels);
-    case 0x03C:
-      return PPC32Emulator::dasm_7C_03C_andc(pc, op, labels);
-    case 0x04B:
-      return PPC32Emulator::dasm_7C_04B_mulhw(pc, op, labels);
-    case 0x053:
-      return PPC32Emulator::dasm_7C_053_mfmsr(pc, op, labels);
-    case 0x056:
-      return PPC32Emulator::dasm_7C_056_dcbf(pc, op, labels);
-    case 0x057:
-      return PPC32Emulator::dasm_7C_057_lbzx(pc, op, labels);
-    case 0x058:
-    case 0x258:
-      return PPC32Emulator::dasm_7C_058_258_neg(pc, op, labels);
-    case 0x077:
-      return PPC32Emulator::dasm_7C_077_lbzux(pc, op, labels);
-    case 0x07C:
-      return PPC32Emulator::dasm_7C_07C_nor(pc, op, labels);
-    case 0x088:
-    case 0x288:
-      return PPC32Emulator::dasm_7C_088_288_subfe(pc, op, labels);
-    case 0x08A:
-    case 0x28A:
-      return PPC32Emulator::dasm_7C_08A_28A_adde(pc, op, labels);
-    case 0x090:
-      return PPC32Emulator::dasm_7C_090_mtcrf(pc, op, labels);
-    case 0x092:
-      return PPC32Emulator::dasm_7C_092_mtmsr(pc, op, labels);
-    case 0x096:
-      return PPC32Emulator::dasm_7C_096_stwcx_rec(pc, op, labels);
-    case 0x097:
-      return PPC32Emulator::dasm_7C_097_stwx(pc, op, labels);
-    case 0x0B7:
-      return PPC32Emulator::dasm_7C_0B7_stwux(pc, op, labels);
-    case 0x0C8:
-    case 0x2C8:
-      return PPC32Emulator::dasm_7C_0C8_2C8_subfze(pc, op, labels);
-    case 0x0CA:
-    case 0x2CA:
-      return PPC32Emulator::dasm_7C_0CA_2CA_addze(pc, op, labels);
-    case 0x0D2:
-      return PPC32Emulator::dasm_7C_0D2_mtsr(pc, op, labels);
-    case 0x0D7:
-      return PPC32Emulator::dasm_7C_0D7_stbx(pc, op, labels);
-    case 0x0E8:
-    case 0x2E8:
-      return PPC32Emulator::dasm_7C_0E8_2E8_subfme(pc, op, labels);
-    case 0x0EA:
-    case 0x2EA:
-      return PPC32Emulator::dasm_7C_0EA_2EA_addme(pc, op, labels);
-    case 0x0EB:
-    case 0x2EB:
-      return PPC32Emulator::dasm_7C_0EB_2EB_mullw(pc, op, labels);
-    case 0x0F2:
-      return PPC32Emulator::dasm_7C_0F2_mtsrin(pc, op, labels);
-    case 0x0F6:
-      return PPC32Emulator::dasm_7C_0F6_dcbtst(pc, op, labels);
-    case 0x0F7:
-      return PPC32Emulator::dasm_7C_0F7_stbux(pc, op, labels);
-    case 0x10A:
-    case 0x30A:
-      return PPC32Emulator::dasm_7C_10A_30A_add(pc, op, labels);
-    case 0x116:
-      return PPC32Emulator::dasm_7C_116_dcbt(pc, op, labels);
-    case 0x117:
-      return PPC32Emulator::dasm_7C_117_lhzx(pc, op, labels);
-    case 0x11C:
-      return PPC32Emulator::dasm_7C_11C_eqv(pc, op, labels);
-    case 0x132:
-      return PPC32Emulator::dasm_7C_132_tlbie(pc, op, labels);
-    case 0x136:
-      return PPC32Emulator::dasm_7C_136_eciwx(pc, op, labels);
-    case 0x137:
-      return PPC32Emulator::dasm_7C_137_lhzux(pc, op, labels);
-    case 0x13C:
-      return PPC32Emulator::dasm_7C_13C_xor(pc, op, labels);
-    case 0x153:
-      return PPC32Emulator::dasm_7C_153_mfspr(pc, op, labels);
-    case 0x157:
-      return PPC32Emulator::dasm_7C_157_lhax(pc, op, labels);
-    case 0x172:
-      return PPC32Emulator::dasm_7C_172_tlbia(pc, op, labels);
-    case 0x173:
-      return PPC32Emulator::dasm_7C_173_mftb(pc, op, labels);
-    case 0x177:
-      return PPC32Emulator::dasm_7C_177_lhaux(pc, op, labels);
-    case 0x197:
-      return PPC32Emulator::dasm_7C_197_sthx(pc, op, labels);
-    case 0x19C:
-      return PPC32Emulator::dasm_7C_19C_orc(pc, op, labels);
-    case 0x1B6:
-      return PPC32Emulator::dasm_7C_1B6_ecowx(pc, op, labels);
-    case 0x1B7:
-      return PPC32Emulator::dasm_7C_1B7_sthux(pc, op, labels);
-    case 0x1BC:
-      return PPC32Emulator::dasm_7C_1BC_or(pc, op, labels);
-    case 0x1CB:
-    case 0x3CB:
-      return PPC32Emulator::dasm_7C_1CB_3CB_divwu(pc, op, labels);
-    case 0x1D3:
-      return PPC32Emulator::dasm_7C_1D3_mtspr(pc, op, labels);
-    case 0x1D6:
-      return PPC32Emulator::dasm_7C_1D6_dcbi(pc, op, labels);
-    case 0x1DC:
-      return PPC32Emulator::dasm_7C_1DC_nand(pc, op, labels);
-    case 0x1EB:
-    case 0x3EB:
-      return PPC32Emulator::dasm_7C_1EB_3EB_divw(pc, op, labels);
-    case 0x200:
-      return PPC32Emulator::dasm_7C_200_mcrxr(pc, op, labels);
-    case 0x215:
-      return PPC32Emulator::dasm_7C_215_lswx(pc, op, labels);
-    case 0x216:
-      return PPC32Emulator::dasm_7C_216_lwbrx(pc, op, labels);
-    case 0x217:
-      return PPC32Emulator::dasm_7C_217_lfsx(pc, op, labels);
-    case 0x218:
-      return PPC32Emulator::dasm_7C_218_srw(pc, op, labels);
-    case 0x236:
-      return PPC32Emulator::dasm_7C_236_tlbsync(pc, op, labels);
-    case 0x237:
-      return PPC32Emulator::dasm_7C_237_lfsux(pc, op, labels);
-    case 0x253:
-      return PPC32Emulator::dasm_7C_253_mfsr(pc, op, labels);
-    case 0x255:
-      return PPC32Emulator::dasm_7C_255_lswi(pc, op, labels);
-    case 0x256:
-      return PPC32Emulator::dasm_7C_256_sync(pc, op, labels);
-    case 0x257:
-      return PPC32Emulator::dasm_7C_257_lfdx(pc, op, labels);
-    case 0x277:
-      return PPC32Emulator::dasm_7C_277_lfdux(pc, op, labels);
-    case 0x293:
-      return PPC32Emulator::dasm_7C_293_mfsrin(pc, op, labels);
-    case 0x295:
-      return PPC32Emulator::dasm_7C_295_stswx(pc, op, labels);
-    case 0x296:
-      return PPC32Emulator::dasm_7C_296_stwbrx(pc, op, labels);
-    case 0x297:
-      return PPC32Emulator::dasm_7C_297_stfsx(pc, op, labels);
-    case 0x2B7:
-      return PPC32Emulator::dasm_7C_2B7_stfsux(pc, op, labels);
-    case 0x2E5:
-      return PPC32Emulator::dasm_7C_2E5_stswi(pc, op, labels);
-    case 0x2E7:
-      return PPC32Emulator::dasm_7C_2E7_stfdx(pc, op, labels);
-    case 0x2F6:
-      return PPC32Emulator::dasm_7C_2F6_dcba(pc, op, labels);
-    case 0x2F7:
-      return PPC32Emulator::dasm_7C_2F7_stfdux(pc, op, labels);
-    case 0x316:
-      return PPC32Emulator::dasm_7C_316_lhbrx(pc, op, labels);
-    case 0x318:
-      return PPC32Emulator::dasm_7C_318_sraw(pc, op, labels);
-    case 0x338:
-      return PPC32Emulator::dasm_7C_338_srawi(pc, op, labels);
-    case 0x356:
-      return PPC32Emulator::dasm_7C_356_eieio(pc, op, labels);
-    case 0x396:
-      return PPC32Emulator::dasm_7C_396_sthbrx(pc, op, labels);
-    case 0x39A:
-      return PPC32Emulator::dasm_7C_39A_extsh(pc, op, labels);
-    case 0x3BA:
-      return PPC32Emulator::dasm_7C_3BA_extsb(pc, op, labels);
-    case 0x3D6:
-      return PPC32Emulator::dasm_7C_3D6_icbi(pc, op, labels);
-    case 0x3D7:
-      return PPC32Emulator::dasm_7C_3D7_stfiwx(pc, op, labels);
-    case 0x3F6:
-      return PPC32Emulator::dasm_7C_3F6_dcbz(pc, op, labels);
-    default:
-      return ".invalid  7C";
+  DasmFn fn = PPC32Emulator::subopcodes_7C[op_get_subopcode(op)].dasm;
+  if (!fn) {
+    return ".invalid  7C";
   }
+  return fn(pc, op, labels);
 }
 
 string PPC32Emulator::dasm_7C_a_b(uint32_t op, const char* base_name) {
@@ -1706,12 +1158,11 @@ void PPC32Emulator::exec_7C_008_208_subfc(uint32_t op) {
   uint8_t rd = op_get_reg1(op);
   uint8_t ra = op_get_reg2(op);
   uint8_t rb = op_get_reg3(op);
+  // xer[ca] is the carry out of ~ra + rb + 1, which is set unless the
+  // (unsigned) subtraction borrows
+  bool ca = (this->regs.r[rb].u >= this->regs.r[ra].u);
   this->regs.r[rd].s = this->regs.r[rb].s - this->regs.r[ra].s;
-  if (this->regs.r[rd].s < 0) {
-    this->regs.xer.u |= 0x20000000; // xer[ca] = 1
-  } else {
-    this->regs.xer.u &= ~0x20000000; // xer[ca] = 0
-  }
+  this->regs.xer.set_ca(ca);
   if (op_get_rec(op)) {
     this->set_cr_bits_int(0, this->regs.r[rd].s);
   }
@@ -1780,7 +1231,15 @@ string PPC32Emulator::dasm_7C_017_lwzx(uint32_t pc, uint32_t op, set<uint32_t>&
 
 
 void PPC32Emulator::exec_7C_018_slw(uint32_t op) {
-  this->exec_unimplemented(op); // 011111 SSSSS AAAAA BBBBB 0000011000 R
+  // 011111 SSSSS AAAAA BBBBB 0000011000 R
+  uint8_t rs = op_get_reg1(op);
+  uint8_t ra = op_get_reg2(op);
+  uint8_t rb = op_get_reg3(op);
+  uint8_t sh = this->regs.r[rb].u & 0x3F;
+  this->regs.r[ra].u = (sh & 0x20) ? 0 : (this->regs.r[rs].u << sh);
+  if (op_get_rec(op)) {
+    this->set_cr_bits_int(0, this->regs.r[ra].s);
+  }
 }
 
 string PPC32Emulator::dasm_7C_018_slw(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -1803,7 +1262,14 @@ string PPC32Emulator::dasm_7C_01A_cntlzw(uint32_t pc, uint32_t op, set<uint32_t>
 
 
 void PPC32Emulator::exec_7C_01C_and(uint32_t op) {
-  this->exec_unimplemented(op); // 011111 SSSSS AAAAA BBBBB 0000011100 R
+  // 011111 SSSSS AAAAA BBBBB 0000011100 R
+  uint8_t rs = op_get_reg1(op);
+  uint8_t ra = op_get_reg2(op);
+  uint8_t rb = op_get_reg3(op);
+  this->regs.r[ra].u = this->regs.r[rs].u & this->regs.r[rb].u;
+  if (op_get_rec(op)) {
+    this->set_cr_bits_int(0, this->regs.r[ra].s);
+  }
 }
 
 string PPC32Emulator::dasm_7C_01C_and(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -2036,7 +1502,19 @@ string PPC32Emulator::dasm_7C_0C8_2C8_subfze(uint32_t pc, uint32_t op, set<uint3
 
 
 void PPC32Emulator::exec_7C_0CA_2CA_addze(uint32_t op) {
-  this->exec_unimplemented(op); // 011111 DDDDD AAAAA 00000 O 011001010 R
+  // 011111 DDDDD AAAAA 00000 O 011001010 R
+  if (op_get_o(op)) {
+    throw runtime_error("overflow bits not implemented");
+  }
+
+  uint8_t rd = op_get_reg1(op);
+  uint8_t ra = op_get_reg2(op);
+  uint32_t a = this->regs.r[ra].u;
+  this->regs.r[rd].u = a + this->regs.xer.get_ca();
+  this->regs.xer.set_ca(this->regs.r[rd].u < a);
+  if (op_get_rec(op)) {
+    this->set_cr_bits_int(0, this->regs.r[rd].s);
+  }
 }
 
 string PPC32Emulator::dasm_7C_0CA_2CA_addze(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -2259,7 +1737,12 @@ string PPC32Emulator::dasm_7C_153_mfspr(uint32_t pc, uint32_t op, set<uint32_t>&
 
 
 void PPC32Emulator::exec_7C_157_lhax(uint32_t op) {
-  this->exec_unimplemented(op); // 011111 DDDDD AAAAA BBBBB 0101010111 0
+  // 011111 DDDDD AAAAA BBBBB 0101010111 0
+  uint8_t rd = op_get_reg1(op);
+  uint8_t ra = op_get_reg2(op);
+  uint8_t rb = op_get_reg3(op);
+  this->regs.debug.addr = (ra == 0 ? 0 : this->regs.r[ra].u) + this->regs.r[rb].u;
+  this->regs.r[rd].s = static_cast<int16_t>(bswap16(this->mem->read<uint16_t>(this->regs.debug.addr)));
 }
 
 string PPC32Emulator::dasm_7C_157_lhax(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -2488,7 +1971,15 @@ string PPC32Emulator::dasm_7C_217_lfsx(uint32_t pc, uint32_t op, set<uint32_t>&
 
 
 void PPC32Emulator::exec_7C_218_srw(uint32_t op) {
-  this->exec_unimplemented(op); // 011111 SSSSS AAAAA BBBBB 1000011000 R
+  // 011111 SSSSS AAAAA BBBBB 1000011000 R
+  uint8_t rs = op_get_reg1(op);
+  uint8_t ra = op_get_reg2(op);
+  uint8_t rb = op_get_reg3(op);
+  uint8_t sh = this->regs.r[rb].u & 0x3F;
+  this->regs.r[ra].u = (sh & 0x20) ? 0 : (this->regs.r[rs].u >> sh);
+  if (op_get_rec(op)) {
+    this->set_cr_bits_int(0, this->regs.r[ra].s);
+  }
 }
 
 string PPC32Emulator::dasm_7C_218_srw(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -2690,7 +2181,9 @@ string PPC32Emulator::dasm_7C_316_lhbrx(uint32_t pc, uint32_t op, set<uint32_t>&
 
 
 void PPC32Emulator::exec_7C_318_sraw(uint32_t op) {
-  this->exec_unimplemented(op); // 011111 SSSSS AAAAA BBBBB 1100011000 R
+  // 011111 SSSSS AAAAA BBBBB 1100011000 R
+  uint8_t rb = op_get_reg3(op);
+  this->exec_sraw_common(op, this->regs.r[rb].u & 0x3F);
 }
 
 string PPC32Emulator::dasm_7C_318_sraw(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -2700,7 +2193,27 @@ string PPC32Emulator::dasm_7C_318_sraw(uint32_t pc, uint32_t op, set<uint32_t>&
 
 
 void PPC32Emulator::exec_7C_338_srawi(uint32_t op) {
-  this->exec_unimplemented(op); // 011111 SSSSS AAAAA <<<<< 1100111000 R
+  // 011111 SSSSS AAAAA <<<<< 1100111000 R
+  this->exec_sraw_common(op, op_get_reg3(op));
+}
+
+void PPC32Emulator::exec_sraw_common(uint32_t op, uint8_t sh) {
+  uint8_t rs = op_get_reg1(op);
+  uint8_t ra = op_get_reg2(op);
+  int32_t v = this->regs.r[rs].s;
+  // xer[ca] is set if the value is negative and any 1 bits are shifted out
+  bool ca;
+  if (sh & 0x20) {
+    this->regs.r[ra].s = (v < 0) ? -1 : 0;
+    ca = (v < 0);
+  } else {
+    this->regs.r[ra].s = v >> sh;
+    ca = (v < 0) && (static_cast<uint32_t>(v) & ((1 << sh) - 1));
+  }
+  this->regs.xer.set_ca(ca);
+  if (op_get_rec(op)) {
+    this->set_cr_bits_int(0, this->regs.r[ra].s);
+  }
 }
 
 string PPC32Emulator::dasm_7C_338_srawi(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
@@ -2920,6 +2433,7 @@ void PPC32Emulator::exec_90_94_stw_stwu(uint32_t op) {
     throw runtime_error("invalid opcode: stwu [r0 + X], rY");
   }
   this->regs.debug.addr = (ra == 0 ? 0 : this->regs.r[ra].u) + imm;
+  this->on_memory_write(this->regs.debug.addr, 4);
   this->mem->write<uint32_t>(this->regs.debug.addr, bswap32(this->regs.r[rs].u));
   if (u) {
     this->regs.r[ra].u = this->regs.debug.addr;
@@ -2942,6 +2456,7 @@ void PPC32Emulator::exec_98_9C_stb_stbu(uint32_t op) {
     throw runtime_error("invalid opcode: stbu [r0 + X], rY");
   }
   this->regs.debug.addr = (ra == 0 ? 0 : this->regs.r[ra].u) + imm;
+  this->on_memory_write(this->regs.debug.addr, 1);
   this->mem->write<uint8_t>(this->regs.debug.addr, this->regs.r[rs].u & 0xFF);
   if (u) {
     this->regs.r[ra].u = this->regs.debug.addr;
@@ -3008,6 +2523,7 @@ void PPC32Emulator::exec_B0_B4_sth_sthu(uint32_t op) {
     throw runtime_error("invalid opcode: sthu [r0 + X], rY");
   }
   this->regs.debug.addr = (ra == 0 ? 0 : this->regs.r[ra].u) + imm;
+  this->on_memory_write(this->regs.debug.addr, 2);
   this->mem->write<uint16_t>(this->regs.debug.addr, bswap16(this->regs.r[rs].u & 0xFFFF));
   if (u) {
     this->regs.r[ra].u = this->regs.debug.addr;
@@ -3046,6 +2562,7 @@ void PPC32Emulator::exec_BC_stmw(uint32_t op) {
   uint8_t ra = op_get_reg2(op);
   int32_t imm = op_get_imm_ext(op);
   this->regs.debug.addr = (ra == 0 ? 0 : this->regs.r[ra].u) + imm;
+  this->on_memory_write(this->regs.debug.addr, (32 - rs) * 4);
   for (uint32_t addr = this->regs.debug.addr; rs < 32; rs++, addr += 4) {
     this->mem->write<uint32_t>(addr, bswap32(this->regs.r[rs].u));
   }
@@ -3098,67 +2615,19 @@ string PPC32Emulator::dasm_D8_DC_stfd_stfdu(uint32_t pc, uint32_t op, set<uint32
 
 
 void PPC32Emulator::exec_EC(uint32_t op) {
-  switch (op_get_short_subopcode(op)) {
-    case 0x12:
-      this->exec_EC_12_fdivs(op);
-      break;
-    case 0x14:
-      this->exec_EC_14_fsubs(op);
-      break;
-    case 0x15:
-      this->exec_EC_15_fadds(op);
-      break;
-    case 0x16:
-      this->exec_EC_16_fsqrts(op);
-      break;
-    case 0x18:
-      this->exec_EC_18_fres(op);
-      break;
-    case 0x19:
-      this->exec_EC_19_fmuls(op);
-      break;
-    case 0x1C:
-      this->exec_EC_1C_fmsubs(op);
-      break;
-    case 0x1D:
-      this->exec_EC_1D_fmadds(op);
-      break;
-    case 0x1E:
-      this->exec_EC_1E_fnmsubs(op);
-      break;
-    case 0x1F:
-      this->exec_EC_1F_fnmadds(op);
-      break;
-    default:
-      throw runtime_error("invalid EC subopcode");
+  ExecFn fn = PPC32Emulator::subopcodes_EC[op_get_subopcode(op)].exec;
+  if (!fn) {
+    throw runtime_error("invalid EC subopcode");
   }
+  (this->*fn)(op);
 }
 
 string PPC32Emulator::dasm_EC(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
-  switch (op_get_short_subopcode(op)) {
-    case 0x12:
-      return PPC32Emulator::dasm_EC_12_fdivs(pc, op, labels);
-    case 0x14:
-      return PPC32Emulator::dasm_EC_14_fsubs(pc, op, labels);
-    case 0x15:
-      return PPC32Emulator::dasm_EC_15_fadds(pc, op, labels);
-    case 0x16:
-      return PPC32Emulator::dasm_EC_16_fsqrts(pc, op, labels);
-    case 0x18:
-      return PPC32Emulator::dasm_EC_18_fres(pc, op, labels);
-    case 0x19:
-      return PPC32Emulator::dasm_EC_19_fmuls(pc, op, labels);
-    case 0x1C:
-      return PPC32Emulator::dasm_EC_1C_fmsubs(pc, op, labels);
-    case 0x1D:
-      return PPC32Emulator::dasm_EC_1D_fmadds(pc, op, labels);
-    case 0x1E:
-      return PPC32Emulator::dasm_EC_1E_fnmsubs(pc, op, labels);
-    case 0x1F:
-      return PPC32Emulator::dasm_EC_1F_fnmadds(pc, op, labels);
-    default:
-      return ".invalid  EC";
+  DasmFn fn = PPC32Emulator::subopcodes_EC[op_get_subopcode(op)].dasm;
+  if (!fn) {
+    return ".invalid  EC";
   }
+  return fn(pc, op, labels);
 }
 
 
@@ -3316,163 +2785,19 @@ string PPC32Emulator::dasm_EC_1F_fnmadds(uint32_t pc, uint32_t op, set<uint32_t>
 
 
 void PPC32Emulator::exec_FC(uint32_t op) {
-  uint8_t short_sub = op_get_short_subopcode(op);
-  if (short_sub & 0x10) {
-    switch (short_sub) {
-      case 0x12:
-        this->exec_FC_12_fdiv(op);
-        break;
-      case 0x14:
-        this->exec_FC_14_fsub(op);
-        break;
-      case 0x15:
-        this->exec_FC_15_fadd(op);
-        break;
-      case 0x16:
-        this->exec_FC_16_fsqrt(op);
-        break;
-      case 0x17:
-        this->exec_FC_17_fsel(op);
-        break;
-      case 0x19:
-        this->exec_FC_19_fmul(op);
-        break;
-      case 0x1A:
-        this->exec_FC_1A_frsqrte(op);
-        break;
-      case 0x1C:
-        this->exec_FC_1C_fmsub(op);
-        break;
-      case 0x1D:
-        this->exec_FC_1D_fmadd(op);
-        break;
-      case 0x1E:
-        this->exec_FC_1E_fnmsub(op);
-        break;
-      case 0x1F:
-        this->exec_FC_1F_fnmadd(op);
-        break;
-      default:
-        throw runtime_error("invalid FC subopcode");
-    }
-  } else {
-    switch (op_get_subopcode(op)) {
-      case 0x000:
-        this->exec_FC_000_fcmpu(op);
-        break;
-      case 0x00C:
-        this->exec_FC_00C_frsp(op);
-        break;
-      case 0x00E:
-        this->exec_FC_00E_fctiw(op);
-        break;
-      case 0x00F:
-        this->exec_FC_00F_fctiwz(op);
-        break;
-      case 0x020:
-        this->exec_FC_020_fcmpo(op);
-        break;
-      case 0x026:
-        this->exec_FC_026_mtfsb1(op);
-        break;
-      case 0x028:
-        this->exec_FC_028_fneg(op);
-        break;
-      case 0x040:
-        this->exec_FC_040_mcrfs(op);
-        break;
-      case 0x046:
-        this->exec_FC_046_mtfsb0(op);
-        break;
-      case 0x048:
-        this->exec_FC_048_fmr(op);
-        break;
-      case 0x086:
-        this->exec_FC_086_mtfsfi(op);
-        break;
-      case 0x088:
-        this->exec_FC_088_fnabs(op);
-        break;
-      case 0x108:
-        this->exec_FC_108_fabs(op);
-        break;
-      case 0x247:
-        this->exec_FC_247_mffs(op);
-        break;
-      case 0x2C7:
-        this->exec_FC_2C7_mtfsf(op);
-        break;
-      default:
-        throw runtime_error("invalid FC subopcode");
-    }
+  ExecFn fn = PPC32Emulator::subopcodes_FC[op_get_subopcode(op)].exec;
+  if (!fn) {
+    throw runtime_error("invalid FC subopcode");
   }
+  (this->*fn)(op);
 }
 
 string PPC32Emulator::dasm_FC(uint32_t pc, uint32_t op, set<uint32_t>& labels) {
-  uint8_t short_sub = op_get_short_subopcode(op);
-  if (short_sub & 0x10) {
-    switch (short_sub) {
-      case 0x12:
-        return PPC32Emulator::dasm_FC_12_fdiv(pc, op, labels);
-      case 0x14:
-        return PPC32Emulator::dasm_FC_14_fsub(pc, op, labels);
-      case 0x15:
-        return PPC32Emulator::dasm_FC_15_fadd(pc, op, labels);
-      case 0x16:
-        return PPC32Emulator::dasm_FC_16_fsqrt(pc, op, labels);
-      case 0x17:
-        return PPC32Emulator::dasm_FC_17_fsel(pc, op, labels);
-      case 0x19:
-        return PPC32Emulator::dasm_FC_19_fmul(pc, op, labels);
-      case 0x1A:
-        return PPC32Emulator::dasm_FC_1A_frsqrte(pc, op, labels);
-      case 0x1C:
-        return PPC32Emulator::dasm_FC_1C_fmsub(pc, op, labels);
-      case 0x1D:
-        return PPC32Emulator::dasm_FC_1D_fmadd(pc, op, labels);
-      case 0x1E:
-        return PPC32Emulator::dasm_FC_1E_fnmsub(pc, op, labels);
-      case 0x1F:
-        return PPC32Emulator::dasm_FC_1F_fnmadd(pc, op, labels);
-      default:
-        return ".invalid  FC, 1";
-    }
-  } else {
-    switch (op_get_subopcode(op)) {
-      case 0x000:
-        return PPC32Emulator::dasm_FC_000_fcmpu(pc, op, labels);
-      case 0x00C:
-        return PPC32Emulator::dasm_FC_00C_frsp(pc, op, labels);
-      case 0x00E:
-        return PPC32Emulator::dasm_FC_00E_fctiw(pc, op, labels);
-      case 0x00F:
-        return PPC32Emulator::dasm_FC_00F_fctiwz(pc, op, labels);
-      case 0x020:
-        return PPC32Emulator::dasm_FC_020_fcmpo(pc, op, labels);
-      case 0x026:
-        return PPC32Emulator::dasm_FC_026_mtfsb1(pc, op, labels);
-      case 0x028:
-        return PPC32Emulator::dasm_FC_028_fneg(pc, op, labels);
-      case 0x040:
-        return PPC32Emulator::dasm_FC_040_mcrfs(pc, op, labels);
-      case 0x046:
-        return PPC32Emulator::dasm_FC_046_mtfsb0(pc, op, labels);
-      case 0x048:
-        return PPC32Emulator::dasm_FC_048_fmr(pc, op, labels);
-      case 0x086:
-        return PPC32Emulator::dasm_FC_086_mtfsfi(pc, op, labels);
-      case 0x088:
-        return PPC32Emulator::dasm_FC_088_fnabs(pc, op, labels);
-      case 0x108:
-        return PPC32Emulator::dasm_FC_108_fabs(pc, op, labels);
-      case 0x247:
-        return PPC32Emulator::dasm_FC_247_mffs(pc, op, labels);
-      case 0x2C7:
-        return PPC32Emulator::dasm_FC_2C7_mtfsf(pc, op, labels);
-      default:
-        return ".invalid  FC, 0";
-    }
+  DasmFn fn = PPC32Emulator::subopcodes_FC[op_get_subopcode(op)].dasm;
+  if (!fn) {
+    return (op_get_short_subopcode(op) & 0x10) ? ".invalid  FC, 1" : ".invalid  FC, 0";
   }
+  return fn(pc, op, labels);
 }
 
 
@@ -3765,6 +3090,219 @@ string PPC32Emulator::dasm_FC_2C7_mtfsf(uint32_t pc, uint32_t op, set<uint32_t>&
 
 
 
+// The extended opcode groups are dispatched through tables indexed by the
+// 10-bit subopcode. For EC opcodes and FC opcodes with bit 4 of the subopcode
+// set, only the low 5 bits of the subopcode select the operation (the rest is
+// the C register field), so those entries are given separately and repeated
+// for every value of the high 5 bits.
+constexpr PPC32Emulator::SubopcodeTable PPC32Emulator::make_subopcode_table(
+    std::initializer_list<SubopcodeTableEntry> entries,
+    std::initializer_list<SubopcodeTableEntry> short_entries) {
+  SubopcodeTable ret{};
+  for (const auto& entry : entries) {
+    ret[entry.subopcode] = {entry.exec, entry.dasm};
+  }
+  for (const auto& entry : short_entries) {
+    for (uint16_t subopcode = entry.subopcode; subopcode < 0x400; subopcode += 0x20) {
+      ret[subopcode] = {entry.exec, entry.dasm};
+    }
+  }
+  return ret;
+}
+
+const PPC32Emulator::SubopcodeTable PPC32Emulator::subopcodes_4C = PPC32Emulator::make_subopcode_table({
+  {0x000, &PPC32Emulator::exec_4C_000_mcrf, &PPC32Emulator::dasm_4C_000_mcrf},
+  {0x010, &PPC32Emulator::exec_4C_010_bclr, &PPC32Emulator::dasm_4C_010_bclr},
+  {0x021, &PPC32Emulator::exec_4C_021_crnor, &PPC32Emulator::dasm_4C_021_crnor},
+  {0x031, &PPC32Emulator::exec_4C_031_rfi, &PPC32Emulator::dasm_4C_031_rfi},
+  {0x081, &PPC32Emulator::exec_4C_081_crandc, &PPC32Emulator::dasm_4C_081_crandc},
+  {0x096, &PPC32Emulator::exec_4C_096_isync, &PPC32Emulator::dasm_4C_096_isync},
+  {0x0C1, &PPC32Emulator::exec_4C_0C1_crxor, &PPC32Emulator::dasm_4C_0C1_crxor},
+  {0x0E1, &PPC32Emulator::exec_4C_0E1_crnand, &PPC32Emulator::dasm_4C_0E1_crnand},
+  {0x101, &PPC32Emulator::exec_4C_101_crand, &PPC32Emulator::dasm_4C_101_crand},
+  {0x121, &PPC32Emulator::exec_4C_121_creqv, &PPC32Emulator::dasm_4C_121_creqv},
+  {0x1A1, &PPC32Emulator::exec_4C_1A1_crorc, &PPC32Emulator::dasm_4C_1A1_crorc},
+  {0x1C1, &PPC32Emulator::exec_4C_1C1_cror, &PPC32Emulator::dasm_4C_1C1_cror},
+  {0x210, &PPC32Emulator::exec_4C_210_bcctr, &PPC32Emulator::dasm_4C_210_bcctr},
+});
+
+const PPC32Emulator::SubopcodeTable PPC32Emulator::subopcodes_7C = PPC32Emulator::make_subopcode_table({
+  {0x000, &PPC32Emulator::exec_7C_000_cmp, &PPC32Emulator::dasm_7C_000_cmp},
+  {0x004, &PPC32Emulator::exec_7C_004_tw, &PPC32Emulator::dasm_7C_004_tw},
+  {0x008, &PPC32Emulator::exec_7C_008_208_subfc, &PPC32Emulator::dasm_7C_008_208_subfc},
+  {0x00A, &PPC32Emulator::exec_7C_00A_20A_addc, &PPC32Emulator::dasm_7C_00A_20A_addc},
+  {0x00B, &PPC32Emulator::exec_7C_00B_mulhwu, &PPC32Emulator::dasm_7C_00B_mulhwu},
+  {0x013, &PPC32Emulator::exec_7C_013_mfcr, &PPC32Emulator::dasm_7C_013_mfcr},
+  {0x014, &PPC32Emulator::exec_7C_014_lwarx, &PPC32Emulator::dasm_7C_014_lwarx},
+  {0x017, &PPC32Emulator::exec_7C_017_lwzx, &PPC32Emulator::dasm_7C_017_lwzx},
+  {0x018, &PPC32Emulator::exec_7C_018_slw, &PPC32Emulator::dasm_7C_018_slw},
+  {0x01A, &PPC32Emulator::exec_7C_01A_cntlzw, &PPC32Emulator::dasm_7C_01A_cntlzw},
+  {0x01C, &PPC32Emulator::exec_7C_01C_and, &PPC32Emulator::dasm_7C_01C_and},
+  {0x020, &PPC32Emulator::exec_7C_020_cmpl, &PPC32Emulator::dasm_7C_020_cmpl},
+  {0x028, &PPC32Emulator::exec_7C_028_228_subf, &PPC32Emulator::dasm_7C_028_228_subf},
+  {0x036, &PPC32Emulator::exec_7C_036_dcbst, &PPC32Emulator::dasm_7C_036_dcbst},
+  {0x037, &PPC32Emulator::exec_7C_037_lwzux, &PPC32Emulator::dasm_7C_037_lwzux},
+  {0x03C, &PPC32Emulator::exec_7C_03C_andc, &PPC32Emulator::dasm_7C_03C_andc},
+  {0x04B, &PPC32Emulator::exec_7C_04B_mulhw, &PPC32Emulator::dasm_7C_04B_mulhw},
+  {0x053, &PPC32Emulator::exec_7C_053_mfmsr, &PPC32Emulator::dasm_7C_053_mfmsr},
+  {0x056, &PPC32Emulator::exec_7C_056_dcbf, &PPC32Emulator::dasm_7C_056_dcbf},
+  {0x057, &PPC32Emulator::exec_7C_057_lbzx, &PPC32Emulator::dasm_7C_057_lbzx},
+  {0x058, &PPC32Emulator::exec_7C_058_258_neg, &PPC32Emulator::dasm_7C_058_258_neg},
+  {0x077, &PPC32Emulator::exec_7C_077_lbzux, &PPC32Emulator::dasm_7C_077_lbzux},
+  {0x07C, &PPC32Emulator::exec_7C_07C_nor, &PPC32Emulator::dasm_7C_07C_nor},
+  {0x088, &PPC32Emulator::exec_7C_088_288_subfe, &PPC32Emulator::dasm_7C_088_288_subfe},
+  {0x08A, &PPC32Emulator::exec_7C_08A_28A_adde, &PPC32Emulator::dasm_7C_08A_28A_adde},
+  {0x090, &PPC32Emulator::exec_7C_090_mtcrf, &PPC32Emulator::dasm_7C_090_mtcrf},
+  {0x092, &PPC32Emulator::exec_7C_092_mtmsr, &PPC32Emulator::dasm_7C_092_mtmsr},
+  {0x096, &PPC32Emulator::exec_7C_096_stwcx_rec, &PPC32Emulator::dasm_7C_096_stwcx_rec},
+  {0x097, &PPC32Emulator::exec_7C_097_stwx, &PPC32Emulator::dasm_7C_097_stwx},
+  {0x0B7, &PPC32Emulator::exec_7C_0B7_stwux, &PPC32Emulator::dasm_7C_0B7_stwux},
+  {0x0C8, &PPC32Emulator::exec_7C_0C8_2C8_subfze, &PPC32Emulator::dasm_7C_0C8_2C8_subfze},
+  {0x0CA, &PPC32Emulator::exec_7C_0CA_2CA_addze, &PPC32Emulator::dasm_7C_0CA_2CA_addze},
+  {0x0D2, &PPC32Emulator::exec_7C_0D2_mtsr, &PPC32Emulator::dasm_7C_0D2_mtsr},
+  {0x0D7, &PPC32Emulator::exec_7C_0D7_stbx, &PPC32Emulator::dasm_7C_0D7_stbx},
+  {0x0E8, &PPC32Emulator::exec_7C_0E8_2E8_subfme, &PPC32Emulator::dasm_7C_0E8_2E8_subfme},
+  {0x0EA, &PPC32Emulator::exec_7C_0EA_2EA_addme, &PPC32Emulator::dasm_7C_0EA_2EA_addme},
+  {0x0EB, &PPC32Emulator::exec_7C_0EB_2EB_mullw, &PPC32Emulator::dasm_7C_0EB_2EB_mullw},
+  {0x0F2, &PPC32Emulator::exec_7C_0F2_mtsrin, &PPC32Emulator::dasm_7C_0F2_mtsrin},
+  {0x0F6, &PPC32Emulator::exec_7C_0F6_dcbtst, &PPC32Emulator::dasm_7C_0F6_dcbtst},
+  {0x0F7, &PPC32Emulator::exec_7C_0F7_stbux, &PPC32Emulator::dasm_7C_0F7_stbux},
+  {0x10A, &PPC32Emulator::exec_7C_10A_30A_add, &PPC32Emulator::dasm_7C_10A_30A_add},
+  {0x116, &PPC32Emulator::exec_7C_116_dcbt, &PPC32Emulator::dasm_7C_116_dcbt},
+  {0x117, &PPC32Emulator::exec_7C_117_lhzx, &PPC32Emulator::dasm_7C_117_lhzx},
+  {0x11C, &PPC32Emulator::exec_7C_11C_eqv, &PPC32Emulator::dasm_7C_11C_eqv},
+  {0x132, &PPC32Emulator::exec_7C_132_tlbie, &PPC32Emulator::dasm_7C_132_tlbie},
+  {0x136, &PPC32Emulator::exec_7C_136_eciwx, &PPC32Emulator::dasm_7C_136_eciwx},
+  {0x137, &PPC32Emulator::exec_7C_137_lhzux, &PPC32Emulator::dasm_7C_137_lhzux},
+  {0x13C, &PPC32Emulator::exec_7C_13C_xor, &PPC32Emulator::dasm_7C_13C_xor},
+  {0x153, &PPC32Emulator::exec_7C_153_mfspr, &PPC32Emulator::dasm_7C_153_mfspr},
+  {0x157, &PPC32Emulator::exec_7C_157_lhax, &PPC32Emulator::dasm_7C_157_lhax},
+  {0x172, &PPC32Emulator::exec_7C_172_tlbia, &PPC32Emulator::dasm_7C_172_tlbia},
+  {0x173, &PPC32Emulator::exec_7C_173_mftb, &PPC32Emulator::dasm_7C_173_mftb},
+  {0x177, &PPC32Emulator::exec_7C_177_lhaux, &PPC32Emulator::dasm_7C_177_lhaux},
+  {0x197, &PPC32Emulator::exec_7C_197_sthx, &PPC32Emulator::dasm_7C_197_sthx},
+  {0x19C, &PPC32Emulator::exec_7C_19C_orc, &PPC32Emulator::dasm_7C_19C_orc},
+  {0x1B6, &PPC32Emulator::exec_7C_1B6_ecowx, &PPC32Emulator::dasm_7C_1B6_ecowx},
+  {0x1B7, &PPC32Emulator::exec_7C_1B7_sthux, &PPC32Emulator::dasm_7C_1B7_sthux},
+  {0x1BC, &PPC32Emulator::exec_7C_1BC_or, &PPC32Emulator::dasm_7C_1BC_or},
+  {0x1CB, &PPC32Emulator::exec_7C_1CB_3CB_divwu, &PPC32Emulator::dasm_7C_1CB_3CB_divwu},
+  {0x1D3, &PPC32Emulator::exec_7C_1D3_mtspr, &PPC32Emulator::dasm_7C_1D3_mtspr},
+  {0x1D6, &PPC32Emulator::exec_7C_1D6_dcbi, &PPC32Emulator::dasm_7C_1D6_dcbi},
+  {0x1DC, &PPC32Emulator::exec_7C_1DC_nand, &PPC32Emulator::dasm_7C_1DC_nand},
+  {0x1EB, &PPC32Emulator::exec_7C_1EB_3EB_divw, &PPC32Emulator::dasm_7C_1EB_3EB_divw},
+  {0x200, &PPC32Emulator::exec_7C_200_mcrxr, &PPC32Emulator::dasm_7C_200_mcrxr},
+  {0x215, &PPC32Emulator::exec_7C_215_lswx, &PPC32Emulator::dasm_7C_215_lswx},
+  {0x216, &PPC32Emulator::exec_7C_216_lwbrx, &PPC32Emulator::dasm_7C_216_lwbrx},
+  {0x217, &PPC32Emulator::exec_7C_217_lfsx, &PPC32Emulator::dasm_7C_217_lfsx},
+  {0x218, &PPC32Emulator::exec_7C_218_srw, &PPC32Emulator::dasm_7C_218_srw},
+  {0x236, &PPC32Emulator::exec_7C_236_tlbsync, &PPC32Emulator::dasm_7C_236_tlbsync},
+  {0x237, &PPC32Emulator::exec_7C_237_lfsux, &PPC32Emulator::dasm_7C_237_lfsux},
+  {0x253, &PPC32Emulator::exec_7C_253_mfsr, &PPC32Emulator::dasm_7C_253_mfsr},
+  {0x255, &PPC32Emulator::exec_7C_255_lswi, &PPC32Emulator::dasm_7C_255_lswi},
+  {0x256, &PPC32Emulator::exec_7C_256_sync, &PPC32Emulator::dasm_7C_256_sync},
+  {0x257, &PPC32Emulator::exec_7C_257_lfdx, &PPC32Emulator::dasm_7C_257_lfdx},
+  {0x258, &PPC32Emulator::exec_7C_058_258_neg, &PPC32Emulator::dasm_7C_058_258_neg},
+  {0x277, &PPC32Emulator::exec_7C_277_lfdux, &PPC32Emulator::dasm_7C_277_lfdux},
+  {0x288, &PPC32Emulator::exec_7C_088_288_subfe, &PPC32Emulator::dasm_7C_088_288_subfe},
+  {0x28A, &PPC32Emulator::exec_7C_08A_28A_adde, &PPC32Emulator::dasm_7C_08A_28A_adde},
+  {0x293, &PPC32Emulator::exec_7C_293_mfsrin, &PPC32Emulator::dasm_7C_293_mfsrin},
+  {0x295, &PPC32Emulator::exec_7C_295_stswx, &PPC32Emulator::dasm_7C_295_stswx},
+  {0x296, &PPC32Emulator::exec_7C_296_stwbrx, &PPC32Emulator::dasm_7C_296_stwbrx},
+  {0x297, &PPC32Emulator::exec_7C_297_stfsx, &PPC32Emulator::dasm_7C_297_stfsx},
+  {0x2B7, &PPC32Emulator::exec_7C_2B7_stfsux, &PPC32Emulator::dasm_7C_2B7_stfsux},
+  {0x2C8, &PPC32Emulator::exec_7C_0C8_2C8_subfze, &PPC32Emulator::dasm_7C_0C8_2C8_subfze},
+  {0x2CA, &PPC32Emulator::exec_7C_0CA_2CA_addze, &PPC32Emulator::dasm_7C_0CA_2CA_addze},
+  {0x2E5, &PPC32Emulator::exec_7C_2E5_stswi, &PPC32Emulator::dasm_7C_2E5_stswi},
+  {0x2E7, &PPC32Emulator::exec_7C_2E7_stfdx, &PPC32Emulator::dasm_7C_2E7_stfdx},
+  {0x2E8, &PPC32Emulator::exec_7C_0E8_2E8_subfme, &PPC32Emulator::dasm_7C_0E8_2E8_subfme},
+  {0x2EA, &PPC32Emulator::exec_7C_0EA_2EA_addme, &PPC32Emulator::dasm_7C_0EA_2EA_addme},
+  {0x2EB, &PPC32Emulator::exec_7C_0EB_2EB_mullw, &PPC32Emulator::dasm_7C_0EB_2EB_mullw},
+  {0x2F6, &PPC32Emulator::exec_7C_2F6_dcba, &PPC32Emulator::dasm_7C_2F6_dcba},
+  {0x2F7, &PPC32Emulator::exec_7C_2F7_stfdux, &PPC32Emulator::dasm_7C_2F7_stfdux},
+  {0x30A, &PPC32Emulator::exec_7C_10A_30A_add, &PPC32Emulator::dasm_7C_10A_30A_add},
+  {0x316, &PPC32Emulator::exec_7C_316_lhbrx, &PPC32Emulator::dasm_7C_316_lhbrx},
+  {0x318, &PPC32Emulator::exec_7C_318_sraw, &PPC32Emulator::dasm_7C_318_sraw},
+  {0x338, &PPC32Emulator::exec_7C_338_srawi, &PPC32Emulator::dasm_7C_338_srawi},
+  {0x356, &PPC32Emulator::exec_7C_356_eieio, &PPC32Emulator::dasm_7C_356_eieio},
+  {0x396, &PPC32Emulator::exec_7C_396_sthbrx, &PPC32Emulator::dasm_7C_396_sthbrx},
+  {0x39A, &PPC32Emulator::exec_7C_39A_extsh, &PPC32Emulator::dasm_7C_39A_extsh},
+  {0x3BA, &PPC32Emulator::exec_7C_3BA_extsb, &PPC32Emulator::dasm_7C_3BA_extsb},
+  {0x3CB, &PPC32Emulator::exec_7C_1CB_3CB_divwu, &PPC32Emulator::dasm_7C_1CB_3CB_divwu},
+  {0x3D6, &PPC32Emulator::exec_7C_3D6_icbi, &PPC32Emulator::dasm_7C_3D6_icbi},
+  {0x3D7, &PPC32Emulator::exec_7C_3D7_stfiwx, &PPC32Emulator::dasm_7C_3D7_stfiwx},
+  {0x3EB, &PPC32Emulator::exec_7C_1EB_3EB_divw, &PPC32Emulator::dasm_7C_1EB_3EB_divw},
+  {0x3F6, &PPC32Emulator::exec_7C_3F6_dcbz, &PPC32Emulator::dasm_7C_3F6_dcbz},
+});
+
+const PPC32Emulator::SubopcodeTable PPC32Emulator::subopcodes_EC = PPC32Emulator::make_subopcode_table({}, {
+  {0x12, &PPC32Emulator::exec_EC_12_fdivs, &PPC32Emulator::dasm_EC_12_fdivs},
+  {0x14, &PPC32Emulator::exec_EC_14_fsubs, &PPC32Emulator::dasm_EC_14_fsubs},
+  {0x15, &PPC32Emulator::exec_EC_15_fadds, &PPC32Emulator::dasm_EC_15_fadds},
+  {0x16, &PPC32Emulator::exec_EC_16_fsqrts, &PPC32Emulator::dasm_EC_16_fsqrts},
+  {0x18, &PPC32Emulator::exec_EC_18_fres, &PPC32Emulator::dasm_EC_18_fres},
+  {0x19, &PPC32Emulator::exec_EC_19_fmuls, &PPC32Emulator::dasm_EC_19_fmuls},
+  {0x1C, &PPC32Emulator::exec_EC_1C_fmsubs, &PPC32Emulator::dasm_EC_1C_fmsubs},
+  {0x1D, &PPC32Emulator::exec_EC_1D_fmadds, &PPC32Emulator::dasm_EC_1D_fmadds},
+  {0x1E, &PPC32Emulator::exec_EC_1E_fnmsubs, &PPC32Emulator::dasm_EC_1E_fnmsubs},
+  {0x1F, &PPC32Emulator::exec_EC_1F_fnmadds, &PPC32Emulator::dasm_EC_1F_fnmadds},
+});
+
+const PPC32Emulator::SubopcodeTable PPC32Emulator::subopcodes_FC = PPC32Emulator::make_subopcode_table({
+  {0x000, &PPC32Emulator::exec_FC_000_fcmpu, &PPC32Emulator::dasm_FC_000_fcmpu},
+  {0x00C, &PPC32Emulator::exec_FC_00C_frsp, &PPC32Emulator::dasm_FC_00C_frsp},
+  {0x00E, &PPC32Emulator::exec_FC_00E_fctiw, &PPC32Emulator::dasm_FC_00E_fctiw},
+  {0x00F, &PPC32Emulator::exec_FC_00F_fctiwz, &PPC32Emulator::dasm_FC_00F_fctiwz},
+  {0x020, &PPC32Emulator::exec_FC_020_fcmpo, &PPC32Emulator::dasm_FC_020_fcmpo},
+  {0x026, &PPC32Emulator::exec_FC_026_mtfsb1, &PPC32Emulator::dasm_FC_026_mtfsb1},
+  {0x028, &PPC32Emulator::exec_FC_028_fneg, &PPC32Emulator::dasm_FC_028_fneg},
+  {0x040, &PPC32Emulator::exec_FC_040_mcrfs, &PPC32Emulator::dasm_FC_040_mcrfs},
+  {0x046, &PPC32Emulator::exec_FC_046_mtfsb0, &PPC32Emulator::dasm_FC_046_mtfsb0},
+  {0x048, &PPC32Emulator::exec_FC_048_fmr, &PPC32Emulator::dasm_FC_048_fmr},
+  {0x086, &PPC32Emulator::exec_FC_086_mtfsfi, &PPC32Emulator::dasm_FC_086_mtfsfi},
+  {0x088, &PPC32Emulator::exec_FC_088_fnabs, &PPC32Emulator::dasm_FC_088_fnabs},
+  {0x108, &PPC32Emulator::exec_FC_108_fabs, &PPC32Emulator::dasm_FC_108_fabs},
+  {0x247, &PPC32Emulator::exec_FC_247_mffs, &PPC32Emulator::dasm_FC_247_mffs},
+  {0x2C7, &PPC32Emulator::exec_FC_2C7_mtfsf, &PPC32Emulator::dasm_FC_2C7_mtfsf},
+}, {
+  {0x12, &PPC32Emulator::exec_FC_12_fdiv, &PPC32Emulator::dasm_FC_12_fdiv},
+  {0x14, &PPC32Emulator::exec_FC_14_fsub, &PPC32Emulator::dasm_FC_14_fsub},
+  {0x15, &PPC32Emulator::exec_FC_15_fadd, &PPC32Emulator::dasm_FC_15_fadd},
+  {0x16, &PPC32Emulator::exec_FC_16_fsqrt, &PPC32Emulator::dasm_FC_16_fsqrt},
+  {0x17, &PPC32Emulator::exec_FC_17_fsel, &PPC32Emulator::dasm_FC_17_fsel},
+  {0x19, &PPC32Emulator::exec_FC_19_fmul, &PPC32Emulator::dasm_FC_19_fmul},
+  {0x1A, &PPC32Emulator::exec_FC_1A_frsqrte, &PPC32Emulator::dasm_FC_1A_frsqrte},
+  {0x1C, &PPC32Emulator::exec_FC_1C_fmsub, &PPC32Emulator::dasm_FC_1C_fmsub},
+  {0x1D, &PPC32Emulator::exec_FC_1D_fmadd, &PPC32Emulator::dasm_FC_1D_fmadd},
+  {0x1E, &PPC32Emulator::exec_FC_1E_fnmsub, &PPC32Emulator::dasm_FC_1E_fnmsub},
+  {0x1F, &PPC32Emulator::exec_FC_1F_fnmadd, &PPC32Emulator::dasm_FC_1F_fnmadd},
+});
+
+PPC32Emulator::ExecFn PPC32Emulator::exec_fn_for_opcode(uint32_t op) const {
+  const SubopcodeTable* table;
+  switch (op_get_op(op)) {
+    case (0x4C >> 2):
+      table = &PPC32Emulator::subopcodes_4C;
+      break;
+    case (0x7C >> 2):
+      table = &PPC32Emulator::subopcodes_7C;
+      break;
+    case (0xEC >> 2):
+      table = &PPC32Emulator::subopcodes_EC;
+      break;
+    case (0xFC >> 2):
+      table = &PPC32Emulator::subopcodes_FC;
+      break;
+    default:
+      return this->exec_fns[op_get_op(op)];
+  }
+  // for invalid subopcodes, return the group's handler, which throws the
+  // appropriate exception when (and if) the opcode is executed
+  ExecFn fn = (*table)[op_get_subopcode(op)].exec;
+  return fn ? fn : this->exec_fns[op_get_op(op)];
+}
+
+
+
 std::string (*PPC32Emulator::dasm_fns[0x40])(uint32_t, uint32_t, std::set<uint32_t>&) = {
   &PPC32Emulator::dasm_invalid,
   &PPC32Emulator::dasm_invalid,
@@ -3885,7 +3423,11 @@ void PPC32Registers::print(FILE* stream) const {
   // fprintf(stream, " addr/%08" PRIX32, this->debug.addr);
 }
 
-PPC32Emulator::PPC32Emulator(shared_ptr<MemoryContext> mem) : mem(mem) {
+PPC32Emulator::PPC32Emulator(shared_ptr<MemoryContext> mem)
+  : mem(mem),
+    translated_start_addr(0xFFFFFFFF),
+    translated_end_addr(0),
+    translated_blocks_invalid(false) {
   // TODO: this sucks; figure out a way to make it static-initializable
 
   this->exec_fns[(0x00 >> 2)] = &PPC32Emulator::exec_invalid;
@@ -3983,35 +3525,449 @@ void PPC32Emulator::set_debug_hook(
   this->debug_hook = hook;
 }
 
+void PPC32Emulator::set_trace(shared_ptr<ExecutionTrace> trace) {
+  this->trace = trace;
+}
+
+void PPC32Emulator::set_profile(shared_ptr<ExecutionProfile> profile) {
+  this->profile = profile;
+}
+
 void PPC32Emulator::set_interrupt_manager(shared_ptr<InterruptManager> im) {
   this->interrupt_manager = im;
 }
 
-void PPC32Emulator::execute(const PPC32Registers& regs) {
-  this->regs = regs;
-  if (!this->interrupt_manager.get()) {
-    this->interrupt_manager.reset(new InterruptManager());
+void PPC32Emulator::invalidate_translated_blocks() {
+  this->translated_blocks_invalid = true;
+  this->translated_start_addr = 0xFFFFFFFF;
+  this->translated_end_addr = 0;
+}
+
+PPC32Emulator::TranslatedBlock* PPC32Emulator::get_translated_block(uint32_t addr) {
+  auto it = this->translated_blocks.find(addr);
+  if (it != this->translated_blocks.end()) {
+    return it->second.get();
   }
 
-  this->should_exit = false;
+  unique_ptr<TranslatedBlock> block(new TranslatedBlock());
+  block->start_addr = addr;
+  block->next_blocks[0] = nullptr;
+  block->next_blocks[1] = nullptr;
+
+  uint32_t pc = addr;
+  while (block->instructions.size() < MAX_TRANSLATED_BLOCK_SIZE) {
+    uint32_t full_op;
+    try {
+      full_op = bswap32(this->mem->read<uint32_t>(pc));
+    } catch (const out_of_range&) {
+      // if the block runs off the end of the allocated memory, end it there;
+      // the fault will happen when (and if) execution actually gets there
+      if (block->instructions.empty()) {
+        throw;
+      }
+      break;
+    }
+    uint8_t op = op_get_op(full_op);
+    block->instructions.emplace_back(TranslatedInstruction{this->exec_fn_for_opcode(full_op), full_op});
+    pc += 4;
+
+    // bc, sc, b, and the opcodes in the 4C group (bclr, bcctr, rfi, etc.) can
+    // all change pc, so they end the block
+    if ((op == 0x10) || (op == 0x11) || (op == 0x12) || (op == 0x13)) {
+      break;
+    }
+  }
+
+  block->loop_idiom = this->recognize_loop_idiom(*block);
+
+  if (addr < this->translated_start_addr) {
+    this->translated_start_addr = addr;
+  }
+  if (pc > this->translated_end_addr) {
+    this->translated_end_addr = pc;
+  }
+  return this->translated_blocks.emplace(addr, move(block)).first->second.get();
+}
+
+PPC32Emulator::LoopIdiom PPC32Emulator::recognize_loop_idiom(const TranslatedBlock& block) {
+  LoopIdiom idiom;
+  idiom.type = LoopIdiom::Type::NONE;
+
+  // the block must end with bdnz back to its start; the bdnz can't be the only
+  // instruction, since that wouldn't do anything besides counting
+  const auto& insts = block.instructions;
+  size_t count = insts.size();
+  if (count < 2) {
+    return idiom;
+  }
+  uint32_t branch_op = insts[count - 1].op;
+  if ((op_get_op(branch_op) != 0x10) ||
+      ((op_get_bo(branch_op).u & 0x16) != 0x10) ||
+      op_get_b_abs(branch_op) || op_get_b_link(branch_op) ||
+      ((op_get_imm_ext(branch_op) & (~3)) != -static_cast<int32_t>((count - 1) * 4))) {
+    return idiom;
+  }
+
+  // returns the access size for the update forms of the integer loads and
+  // stores, or 0 for any other opcode
+  auto update_access_size = [](uint32_t op, bool is_store) -> uint8_t {
+    switch (op_get_op(op)) {
+      case 0x21: // lwzu
+        return is_store ? 0 : 4;
+      case 0x23: // lbzu
+        return is_store ? 0 : 1;
+      case 0x29: // lhzu
+        return is_store ? 0 : 2;
+      case 0x25: // stwu
+        return is_store ? 4 : 0;
+      case 0x27: // stbu
+        return is_store ? 1 : 0;
+      case 0x2D: // sthu
+        return is_store ? 2 : 0;
+      default:
+        return 0;
+    }
+  };
+
+  if (count == 2) {
+    uint32_t store_op = insts[0].op;
+    uint8_t size = update_access_size(store_op, true);
+    uint8_t rt = op_get_reg1(store_op);
+    uint8_t rd = op_get_reg2(store_op);
+    if (size && (op_get_imm_ext(store_op) == size) && (rd != 0) && (rd != rt)) {
+      idiom.type = LoopIdiom::Type::FILL;
+      idiom.size = size;
+      idiom.dest_reg = rd;
+      idiom.value_reg = rt;
+    }
+
+  } else if (count == 3) {
+    uint32_t load_op = insts[0].op;
+    uint32_t store_op = insts[1].op;
+    uint8_t size = update_access_size(load_op, false);
+    uint8_t rt = op_get_reg1(load_op);
+    uint8_t rs = op_get_reg2(load_op);
+    uint8_t rd = op_get_reg2(store_op);
+    if (size && (update_access_size(store_op, true) == size) &&
+        (op_get_imm_ext(load_op) == size) && (op_get_imm_ext(store_op) == size) &&
+        (op_get_reg1(store_op) == rt) && (rs != 0) && (rd != 0) &&
+        (rs != rt) && (rd != rt) && (rs != rd)) {
+      idiom.type = LoopIdiom::Type::COPY;
+      idiom.size = size;
+      idiom.dest_reg = rd;
+      idiom.source_reg = rs;
+      idiom.value_reg = rt;
+    }
+
+  } else if (count == 7) {
+    uint32_t rt = op_get_reg1(insts[0].op);
+    uint32_t rs = op_get_reg2(insts[0].op);
+    uint32_t rv = op_get_reg1(insts[3].op);
+    uint32_t rb = op_get_reg2(insts[3].op);
+    uint32_t rd = op_get_reg2(insts[5].op);
+    uint32_t regs_used = (1 << rt) | (1 << rs) | (1 << rv) | (1 << rb) | (1 << rd);
+    if ((insts[0].op == (0x88000000 | (rt << 21) | (rs << 16))) && // lbz rT, [rS]
+        (insts[1].op == (0x38000001 | (rs << 21) | (rs << 16))) && // addi rS, rS, 1
+        (insts[2].op == (0x5400083C | (rt << 21) | (rt << 16))) && // rlwinm rT, rT, 1, 0, 30
+        (insts[3].op == (0x7C0002AE | (rv << 21) | (rb << 16) | (rt << 11))) && // lhax rV, rB, rT
+        (insts[4].op == (0x5400043E | (rv << 21) | (rv << 16))) && // rlwinm rV, rV, 0, 16, 31
+        (insts[5].op == (0xB4000002 | (rv << 21) | (rd << 16))) && // sthu [rD + 2], rV
+        !(regs_used & 1) && (__builtin_popcount(regs_used) == 5)) {
+      idiom.type = LoopIdiom::Type::TABLE_LOOKUP;
+      idiom.size = 2;
+      idiom.dest_reg = rd;
+      idiom.source_reg = rs;
+      idiom.value_reg = rt;
+      idiom.table_reg = rb;
+      idiom.result_reg = rv;
+    }
+  }
+
+  return idiom;
+}
+
+void PPC32Emulator::run_loop_idiom(const TranslatedBlock& block) {
+  const auto& idiom = block.loop_idiom;
+  uint32_t num_instructions = block.instructions.size();
+
+  // the last iteration (when ctr becomes zero) runs normally, so it isn't
+  // counted here. if ctr is zero, the loop runs 2^32 times
+  uint64_t cycles = this->interrupt_manager->cycles_until_next_call();
+  uint32_t iterations = min<uint64_t>(this->regs.ctr - 1, min<uint64_t>(
+      MAX_LOOP_IDIOM_ITERATIONS, cycles / num_instructions));
+
+  // all of the memory involved must be valid, and the stores must not touch
+  // any translated code (which would include the loop itself). stores are
+  // done after updating rD, so they start one element after it
+  uint32_t dest_addr = this->regs.r[idiom.dest_reg].u + idiom.size;
+  auto can_skip = [&](uint32_t iterations) -> bool {
+    uint32_t dest_size = iterations * idiom.size;
+    if (!this->mem->exists(dest_addr, dest_size) ||
+        ((static_cast<uint64_t>(dest_addr) + dest_size > this->translated_start_addr) &&
+         (dest_addr < this->translated_end_addr))) {
+      return false;
+    }
+    if (idiom.type == LoopIdiom::Type::COPY) {
+      return this->mem->exists(this->regs.r[idiom.source_reg].u + idiom.size, dest_size);
+    } else if (idiom.type == LoopIdiom::Type::TABLE_LOOKUP) {
+      // the index is at most 0x1FE, since it's a doubled byte
+      return this->mem->exists(this->regs.r[idiom.source_reg].u, iterations) &&
+          this->mem->exists(this->regs.r[idiom.table_reg].u, 0x200);
+    }
+    return true;
+  };
+  // if the loop runs off the end of the valid memory, skip as far as possible
+  // before that point instead of none of it
+  while ((iterations > 0) && !can_skip(iterations)) {
+    iterations >>= 1;
+  }
+  if (iterations == 0) {
+    return;
+  }
+
+  // elements are copied one at a time in order, so overlapping copies have the
+  // same result as when the loop runs normally
+  uint32_t& dest = this->regs.r[idiom.dest_reg].u;
+  uint32_t& value = this->regs.r[idiom.value_reg].u;
+  switch (idiom.type) {
+    case LoopIdiom::Type::COPY: {
+      uint32_t& source = this->regs.r[idiom.source_reg].u;
+      for (uint32_t x = 0; x < iterations; x++) {
+        source += idiom.size;
+        dest += idiom.size;
+        if (idiom.size == 1) {
+          value = this->mem->read_u8(source);
+          this->mem->write_u8(dest, value);
+        } else if (idiom.size == 2) {
+          value = this->mem->read_u16(source);
+          this->mem->write_u16(dest, value);
+        } else {
+          value = this->mem->read_u32(source);
+          this->mem->write_u32(dest, value);
+        }
+      }
+      break;
+    }
+    case LoopIdiom::Type::FILL:
+      for (uint32_t x = 0; x < iterations; x++) {
+        dest += idiom.size;
+        if (idiom.size == 1) {
+          this->mem->write_u8(dest, value);
+        } else if (idiom.size == 2) {
+          this->mem->write_u16(dest, value);
+        } else {
+          this->mem->write_u32(dest, value);
+        }
+      }
+      break;
+    case LoopIdiom::Type::TABLE_LOOKUP: {
+      uint32_t& source = this->regs.r[idiom.source_reg].u;
+      uint32_t& result = this->regs.r[idiom.result_reg].u;
+      uint32_t table_addr = this->regs.r[idiom.table_reg].u;
+      for (uint32_t x = 0; x < iterations; x++) {
+        value = this->mem->read_u8(source++) << 1;
+        result = this->mem->read_u16(table_addr + value);
+        dest += 2;
+        this->mem->write_u16(dest, result);
+      }
+      break;
+    }
+    case LoopIdiom::Type::NONE:
+      throw logic_error("run_loop_idiom called on a block that isn't a loop");
+  }
+
+  this->regs.ctr -= iterations;
+  this->interrupt_manager->skip_cycles(iterations * num_instructions);
+  this->regs.tbr += iterations * num_instructions * this->regs.tbr_ticks_per_cycle;
+}
+
+void PPC32Emulator::execute_with_debug_hook() {
+  // Hold a reference here in case a syscall handler replaces the interrupt
+  // manager during execution
+  shared_ptr<InterruptManager> interrupt_manager = this->interrupt_manager;
+
   while (!this->should_exit) {
     if (this->debug_hook && !this->debug_hook(*this, this->regs)) {
       break;
     }
 
-    if (!this->interrupt_manager->on_cycle_start()) {
+    if (!interrupt_manager->on_cycle_start()) {
       break;
     }
 
     uint32_t full_op = bswap32(this->mem->read<uint32_t>(this->regs.pc));
+    if (this->trace) {
+      uint32_t values[101];
+      this->get_trace_registers(values);
+      uint32_t opcode_be = bswap32(full_op);
+      this->trace->on_instruction(values, this->regs.pc, &opcode_be, 4);
+    }
+    if (this->is_counting_profile()) {
+      this->profile->on_instruction(this->regs.pc, this->regs.pc + 4);
+    }
     uint8_t op = op_get_op(full_op);
     auto fn = this->exec_fns[op];
     (this->*fn)(full_op);
     this->regs.pc += 4;
     this->regs.tbr += this->regs.tbr_ticks_per_cycle;
+
+    // Report any watched memory accesses the instruction made
+    MemoryContext::dispatch_watchpoint_hits();
   }
 }
 
+void PPC32Emulator::get_trace_registers(uint32_t* values) {
+  for (size_t x = 0; x < 32; x++) {
+    values[x] = this->regs.r[x].u;
+    values[32 + 2 * x] = this->regs.f[x].i >> 32;
+    values[33 + 2 * x] = this->regs.f[x].i;
+  }
+  values[96] = this->regs.cr.u;
+  values[97] = this->regs.fpscr;
+  values[98] = this->regs.xer.u;
+  values[99] = this->regs.lr;
+  values[100] = this->regs.ctr;
+}
+
+void PPC32Emulator::finish_trace() {
+  uint32_t values[101];
+  this->get_trace_registers(values);
+  this->trace->finish(values);
+}
+
+void PPC32Emulator::execute_translated() {
+  shared_ptr<InterruptManager> interrupt_manager = this->interrupt_manager;
+
+  TranslatedBlock* prev_block = nullptr;
+  while (!this->should_exit) {
+    if (this->translated_blocks_invalid) {
+      this->translated_blocks.clear();
+      this->translated_blocks_invalid = false;
+      prev_block = nullptr;
+    }
+
+    // interrupt callbacks may change registers or memory, so when one is due
+    // before the next block would end, run one instruction at a time (as if
+    // there were a debug hook) until it has been called
+    if (!interrupt_manager->cycles_until_next_call()) {
+      if (!interrupt_manager->on_cycle_start()) {
+        break;
+      }
+      uint32_t full_op = bswap32(this->mem->read<uint32_t>(this->regs.pc));
+      auto fn = this->exec_fns[op_get_op(full_op)];
+      (this->*fn)(full_op);
+      this->regs.pc += 4;
+      this->regs.tbr += this->regs.tbr_ticks_per_cycle;
+      MemoryContext::dispatch_watchpoint_hits();
+      prev_block = nullptr;
+      continue;
+    }
+
+    TranslatedBlock* block;
+    if (prev_block && prev_block->next_blocks[0] &&
+        (prev_block->next_blocks[0]->start_addr == this->regs.pc)) {
+      block = prev_block->next_blocks[0];
+    } else if (prev_block && prev_block->next_blocks[1] &&
+        (prev_block->next_blocks[1]->start_addr == this->regs.pc)) {
+      block = prev_block->next_blocks[1];
+      prev_block->next_blocks[1] = prev_block->next_blocks[0];
+      prev_block->next_blocks[0] = block;
+    } else {
+      block = this->get_translated_block(this->regs.pc);
+      if (prev_block) {
+        prev_block->next_blocks[1] = prev_block->next_blocks[0];
+        prev_block->next_blocks[0] = block;
+      }
+    }
+
+    if (block->loop_idiom.type != LoopIdiom::Type::NONE) {
+      this->run_loop_idiom(*block);
+    }
+
+    // if a call would be due partway through the block, run only the part of
+    // the block before it; the loop above will handle the call
+    size_t count = block->instructions.size();
+    uint64_t cycles_until_call = interrupt_manager->cycles_until_next_call();
+    if (cycles_until_call < count) {
+      count = cycles_until_call;
+    }
+
+    const TranslatedInstruction* inst = block->instructions.data();
+    const TranslatedInstruction* end = inst + count;
+    for (; inst != end; inst++) {
+      // calls are usually not due here (see above), but one may have been
+      // added during the block, for example by a memory watchpoint function
+      if (!interrupt_manager->on_cycle_start()) {
+        this->should_exit = true;
+        break;
+      }
+      (this->*inst->fn)(inst->op);
+      this->regs.pc += 4;
+      this->regs.tbr += this->regs.tbr_ticks_per_cycle;
+      MemoryContext::dispatch_watchpoint_hits();
+      if (this->translated_blocks_invalid) {
+        break;
+      }
+    }
+
+    // if the block didn't run to completion, the next block isn't its
+    // successor
+    prev_block = (inst == block->instructions.data() + block->instructions.size())
+        ? block : nullptr;
+  }
+}
+
+void PPC32Emulator::execute(const PPC32Registers& regs) {
+  this->regs = regs;
+  if (!this->interrupt_manager.get()) {
+    this->interrupt_manager.reset(new InterruptManager());
+  }
+
+  // memory may have been modified since the last call to execute()
+  this->invalidate_translated_blocks();
+
+  // if a debug hook is set while the emulator is running without one, it takes
+  // effect at the next call to execute()
+  this->should_exit = false;
+  if (this->profile && this->profile->is_sampling()) {
+    this->schedule_profile_sample(this->profile->next_sample_delay());
+  }
+  try {
+    if (this->trace) {
+      // the last instruction's record is completed here, even if it failed
+      try {
+        this->execute_with_debug_hook();
+      } catch (const exception&) {
+        this->finish_trace();
+        throw;
+      }
+      this->finish_trace();
+    } else if (this->debug_hook || this->is_counting_profile()) {
+      this->execute_with_debug_hook();
+    } else {
+      this->execute_translated();
+    }
+  } catch (const exception&) {
+    if (this->profile_sample_call) {
+      this->profile_sample_call->cancel();
+      this->profile_sample_call.reset();
+    }
+    throw;
+  }
+  if (this->profile_sample_call) {
+    this->profile_sample_call->cancel();
+    this->profile_sample_call.reset();
+  }
+}
+
+void PPC32Emulator::schedule_profile_sample(uint64_t delay) {
+  this->profile_sample_call = this->interrupt_manager->add(delay, [this]() -> bool {
+    this->profile->on_sample(this->regs.pc);
+    this->schedule_profile_sample(this->profile->next_sample_delay());
+    return false;
+  });
+}
+
 string PPC32Emulator::disassemble(const void* data, size_t size, uint32_t pc) {
   const uint32_t* opcodes = reinterpret_cast<const uint32_t*>(data);
 
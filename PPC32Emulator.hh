@@ -2,13 +2,17 @@
 
 #include <stdint.h>
 
+#include <array>
 #include <functional>
 #include <memory>
 #include <vector>
 #include <set>
+#include <unordered_map>
 
 #include "MemoryContext.hh"
 #include "InterruptManager.hh"
+#include "ExecutionTrace.hh"
+#include "ExecutionProfile.hh"
 
 
 struct PPC32CR {
@@ -52,6 +56,10 @@ struct PPC32XER {
   inline uint8_t get_byte_count() {
     return this->u & 0xFF;
   }
+
+  inline void set_ca(bool ca) {
+    this->u = (this->u & ~0x20000000) | (static_cast<uint32_t>(ca) << 29);
+  }
 };
 
 struct PPC32Registers {
@@ -100,6 +108,23 @@ public:
   static std::string disassemble(uint32_t pc, uint32_t opcode, std::set<uint32_t>& labels);
   static std::string disassemble(uint32_t pc, uint32_t opcode);
 
+  // The emulator translates straight-line runs of code into blocks that can be
+  // executed without fetching and decoding each instruction again. Writes done
+  // by the emulated code invalidate the blocks automatically, as do syscalls
+  // and calls to execute(). If an interrupt callback modifies emulated code, it
+  // must call this.
+  void invalidate_translated_blocks();
+
+  // If a trace is set, each instruction is recorded in it. Like a debug hook,
+  // this makes the emulator run one instruction at a time instead of running
+  // translated blocks.
+  void set_trace(std::shared_ptr<ExecutionTrace> trace);
+
+  // If a profile is set, instructions are counted or sampled in it (see
+  // ExecutionProfile). In counting mode, this makes the emulator run one
+  // instruction at a time. Sampling mode uses the interrupt manager.
+  void set_profile(std::shared_ptr<ExecutionProfile> profile);
+
 private:
   bool should_exit;
   PPC32Registers regs;
@@ -107,12 +132,129 @@ private:
   std::function<bool(PPC32Emulator&, PPC32Registers&)> syscall_handler;
   std::function<bool(PPC32Emulator&, PPC32Registers&)> debug_hook;
   std::shared_ptr<InterruptManager> interrupt_manager;
+  std::shared_ptr<ExecutionTrace> trace;
+
+  void get_trace_registers(uint32_t* values);
+  void finish_trace();
+
+  std::shared_ptr<ExecutionProfile> profile;
+  std::shared_ptr<InterruptManager::PendingCall> profile_sample_call;
+  inline bool is_counting_profile() const {
+    return this->profile && !this->profile->is_sampling();
+  }
+  void schedule_profile_sample(uint64_t delay);
+
+  // With a debug hook, trace, or counting profile, each instruction is fetched
+  // from memory just before it runs, so the hook may modify code or registers
+  // freely. Otherwise, the emulator runs translated blocks.
+  void execute_with_debug_hook();
+  void execute_translated();
+
+  struct TranslatedInstruction {
+    void (PPC32Emulator::*fn)(uint32_t);
+    uint32_t op;
+  };
+
+  // Blocks that are loops copying, filling, or translating memory one element
+  // at a time are recognized when they're translated. When such a block is
+  // about to run, run_loop_idiom() runs all but the last iteration natively;
+  // the block then runs normally, so the registers and memory end up exactly
+  // as if every instruction had been executed.
+  struct LoopIdiom {
+    enum class Type {
+      NONE = 0,
+      COPY, // lXzu rT, [rS + N]; stXu [rD + N], rT; bdnz start (N = size)
+      FILL, // stXu [rD + N], rT; bdnz start (N = size)
+      // lbz rT, [rS]; addi rS, rS, 1; rlwinm rT, rT, 1, 0, 30; lhax rV, rB, rT;
+      // rlwinm rV, rV, 0, 16, 31; sthu [rD + 2], rV; bdnz start
+      TABLE_LOOKUP,
+    };
+    Type type;
+    uint8_t size;
+    uint8_t dest_reg; // rD
+    uint8_t source_reg; // rS
+    uint8_t value_reg; // rT
+    uint8_t table_reg; // rB
+    uint8_t result_reg; // rV
+  };
+  static constexpr uint32_t MAX_LOOP_IDIOM_ITERATIONS = 0x10000;
+
+  // A straight-line run of instructions ending with a branch or syscall (or
+  // after MAX_TRANSLATED_BLOCK_SIZE instructions). Each block remembers the
+  // blocks that most recently ran after it, so loops don't have to look up
+  // their blocks by address on every iteration.
+  struct TranslatedBlock {
+    uint32_t start_addr;
+    std::vector<TranslatedInstruction> instructions;
+    TranslatedBlock* next_blocks[2];
+    LoopIdiom loop_idiom;
+  };
+
+  // The start and end addresses are the range of memory that translated blocks
+  // were read from; writes outside this range don't need to invalidate
+  // anything. Invalidation only sets translated_blocks_invalid; the blocks are
+  // deleted by execute_translated() after the current instruction, since the
+  // block that did the write may still be running.
+  static constexpr size_t MAX_TRANSLATED_BLOCK_SIZE = 0x100;
+  std::unordered_map<uint32_t, std::unique_ptr<TranslatedBlock>> translated_blocks;
+  uint32_t translated_start_addr;
+  uint32_t translated_end_addr;
+  bool translated_blocks_invalid;
+
+  TranslatedBlock* get_translated_block(uint32_t addr);
+  static LoopIdiom recognize_loop_idiom(const TranslatedBlock& block);
+  void run_loop_idiom(const TranslatedBlock& block);
+
+  inline void on_memory_write(uint32_t addr, uint32_t size) {
+    if (this->trace) {
+      this->trace->on_memory_write(addr, size);
+    }
+    if ((static_cast<uint64_t>(addr) + size > this->translated_start_addr) &&
+        (addr < this->translated_end_addr)) {
+      this->invalidate_translated_blocks();
+    }
+  }
+
+  typedef void (PPC32Emulator::*ExecFn)(uint32_t);
+  typedef std::string (*DasmFn)(uint32_t, uint32_t, std::set<uint32_t>&);
 
   void (PPC32Emulator::*exec_fns[0x40])(uint32_t);
   static std::string (*dasm_fns[0x40])(uint32_t, uint32_t, std::set<uint32_t>&);
 
+  // The 4C, 7C, EC, and FC opcode groups have a second level of dispatch on
+  // the subopcode, which goes through these tables instead of a switch. They
+  // are indexed by the 10-bit subopcode and built at compile time; entries for
+  // invalid subopcodes are null.
+  struct SubopcodeHandlers {
+    ExecFn exec;
+    DasmFn dasm;
+  };
+  struct SubopcodeTableEntry {
+    uint16_t subopcode;
+    ExecFn exec;
+    DasmFn dasm;
+  };
+  typedef std::array<SubopcodeHandlers, 0x400> SubopcodeTable;
+  static constexpr SubopcodeTable make_subopcode_table(
+      std::initializer_list<SubopcodeTableEntry> entries,
+      std::initializer_list<SubopcodeTableEntry> short_entries = {});
+  static const SubopcodeTable subopcodes_4C;
+  static const SubopcodeTable subopcodes_7C;
+  static const SubopcodeTable subopcodes_EC;
+  static const SubopcodeTable subopcodes_FC;
+
+  // Returns the function that executes op, without going through the
+  // subopcode dispatch for extended opcodes
+  ExecFn exec_fn_for_opcode(uint32_t op) const;
+
   bool should_branch(uint32_t op);
-  void set_cr_bits_int(uint8_t crf, int32_t value);
+
+  // This is called by every record-form (.) opcode, so it's inline
+  inline void set_cr_bits_int(uint8_t crf, int32_t value) {
+    uint8_t cr_bits = ((value < 0) << 3) | ((value > 0) << 2) |
+        ((value == 0) << 1) | this->regs.xer.get_so();
+    this->regs.cr.replace_field(crf, cr_bits);
+  }
 
   void exec_unimplemented(uint32_t op);
   static std::string dasm_unimplemented(uint32_t pc, uint32_t op, std::set<uint32_t>& labels);
@@ -370,6 +512,7 @@ private:
   static std::string dasm_7C_318_sraw(uint32_t pc, uint32_t op, std::set<uint32_t>& labels);
   void exec_7C_338_srawi(uint32_t op);
   static std::string dasm_7C_338_srawi(uint32_t pc, uint32_t op, std::set<uint32_t>& labels);
+  void exec_sraw_common(uint32_t op, uint8_t sh);
   void exec_7C_356_eieio(uint32_t op);
   static std::string dasm_7C_356_eieio(uint32_t pc, uint32_t op, std::set<uint32_t>& labels);
   void exec_7C_396_sthbrx(uint32_t op);
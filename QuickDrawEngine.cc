@@ -32,6 +32,10 @@ pict_contains_undecodable_quicktime::pict_contains_undecodable_quicktime(
 
 QuickDrawPortInterface::~QuickDrawPortInterface() { }
 
+void QuickDrawPortInterface::print_warning(const string& message) {
+  fprintf(stderr, "warning: %s\n", message.c_str());
+}
+
 
 
 struct PictColorTable {
@@ -1043,7 +1047,8 @@ void QuickDrawEngine::pict_write_quicktime_data(StringReader& r, uint16_t opcode
   if (matte_size) {
     // the next header is always word-aligned, so if the matte image is an odd
     // number of bytes, round up
-    fprintf(stderr, "warning: skipping matte image (%u bytes) from QuickTime data\n", matte_size);
+    this->port->print_warning(string_printf(
+        "skipping matte image (%u bytes) from QuickTime data", matte_size));
     r.go((r.where() + matte_size + 1) & ~1);
   }
 
@@ -27,6 +27,10 @@ public:
   // External resource data accessors
   virtual std::vector<Color> read_clut(int16_t id) = 0;
 
+  // Warnings about parts of the picture that can't be rendered. The default
+  // implementation writes them to stderr.
+  virtual void print_warning(const std::string& message);
+
   // QuickDraw state accessors
   virtual const Rect& get_bounds() const = 0;
   virtual void set_bounds(Rect z) = 0;
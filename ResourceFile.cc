@@ -1,15 +1,22 @@
 #include "ResourceFile.hh"
 
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <exception>
+#include <functional>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -22,8 +29,11 @@
 #include "AudioCodecs.hh"
 #include "QuickDrawFormats.hh"
 #include "QuickDrawEngine.hh"
+#include "SystemDecompressors.hh"
 #include "M68KEmulator.hh"
 #include "PPC32Emulator.hh"
+#include "TrapHandlers.hh"
+#include "TrapInfo.hh"
 
 using namespace std;
 
@@ -35,6 +45,46 @@ using namespace std;
 
 
 
+static ResourceFile::LogFunction log_function;
+
+void ResourceFile::set_log_function(LogFunction fn) {
+  log_function = move(fn);
+}
+
+__attribute__((format(printf, 1, 2)))
+static void print_log(const char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  if (log_function) {
+    log_function(string_vprintf(fmt, va));
+  } else {
+    vfprintf(stderr, fmt, va);
+  }
+  va_end(va);
+}
+
+// For functions that can only print to a FILE*, like print_data and the
+// emulators' state printers
+static void print_log_stream(const function<void(FILE*)>& fn) {
+  if (!log_function) {
+    fn(stderr);
+    return;
+  }
+  char* data = nullptr;
+  size_t size = 0;
+  FILE* stream = open_memstream(&data, &size);
+  if (!stream) {
+    throw runtime_error("cannot open log stream");
+  }
+  fn(stream);
+  fclose(stream);
+  string text(data, size);
+  free(data);
+  log_function(text);
+}
+
+
+
 string string_for_resource_type(uint32_t type) {
   string result;
   for (ssize_t s = 24; s >= 0; s -= 8) {
@@ -123,51 +173,132 @@ int16_t ResourceFile::id_from_resource_key(uint64_t key) {
   return key & 0xFFFF;
 }
 
-ResourceFile::Resource::Resource() : type(0), id(0), flags(0) { }
+ResourceFile::Resource::Resource() : type(0), id(0), flags(0),
+    mapped_data(nullptr), mapped_size(0), num_data_users(0) { }
+
+ResourceFile::Resource::Resource(const Resource& other)
+  : type(other.type), id(other.id), flags(other.flags), name(other.name),
+    data(other.mapped_data ? string(other.mapped_data, other.mapped_size) : other.data),
+    mapped_data(nullptr), mapped_size(0), num_data_users(0) { }
+
+ResourceFile::Resource& ResourceFile::Resource::operator=(const Resource& other) {
+  if (this != &other) {
+    this->type = other.type;
+    this->id = other.id;
+    this->flags = other.flags;
+    this->name = other.name;
+    if (other.mapped_data) {
+      this->data.assign(other.mapped_data, other.mapped_size);
+    } else {
+      this->data = other.data;
+    }
+    this->mapped_data = nullptr;
+    this->mapped_size = 0;
+    this->num_data_users = 0;
+  }
+  return *this;
+}
 
 ResourceFile::Resource::Resource(uint32_t type, int16_t id, const std::string& data)
-  : type(type), id(id), flags(0), data(data) { }
+  : type(type), id(id), flags(0), data(data), mapped_data(nullptr),
+    mapped_size(0), num_data_users(0) { }
 
 ResourceFile::Resource::Resource(uint32_t type, int16_t id, std::string&& data)
-  : type(type), id(id), flags(0), data(move(data)) { }
+  : type(type), id(id), flags(0), data(move(data)), mapped_data(nullptr),
+    mapped_size(0), num_data_users(0) { }
 
 ResourceFile::Resource::Resource(uint32_t type, int16_t id, uint16_t flags, const std::string& name, const std::string& data)
-  : type(type), id(id), flags(flags), name(name), data(data) { }
+  : type(type), id(id), flags(flags), name(name), data(data),
+    mapped_data(nullptr), mapped_size(0), num_data_users(0) { }
 
 ResourceFile::Resource::Resource(uint32_t type, int16_t id, uint16_t flags, std::string&& name, std::string&& data)
-  : type(type), id(id), flags(flags), name(move(name)), data(move(data)) { }
+  : type(type), id(id), flags(flags), name(move(name)), data(move(data)),
+    mapped_data(nullptr), mapped_size(0), num_data_users(0) { }
 
-ResourceFile::ResourceFile(const string& raw_data) {
+ResourceFile::ResourceFile(const string& raw_data)
+    : file_data(nullptr), file_size(0), all_names_loaded(true) {
   StringReader r(raw_data.data(), raw_data.size());
   this->parse_structure(r);
 }
 
-ResourceFile::ResourceFile(const void* data, size_t size) {
+ResourceFile::ResourceFile(const void* data, size_t size)
+    : file_data(nullptr), file_size(0), all_names_loaded(true) {
   StringReader r(data, size);
   this->parse_structure(r);
 }
 
-ResourceFile::ResourceFile(const Resource& res) {
+ResourceFile::ResourceFile(const char* filename, bool index_only)
+    : file_data(nullptr), file_size(0), all_names_loaded(true) {
+  {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      throw cannot_open_file(filename);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+      close(fd);
+      throw io_error(fd);
+    }
+
+    // mmap can't map zero bytes; an empty fork is handled by parse_structure
+    // below (it becomes an empty index)
+    if (st.st_size > 0) {
+      void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base != MAP_FAILED) {
+        size_t size = st.st_size;
+        this->file_data_owner.reset(base, [size](void* base) {
+          munmap(base, size);
+        });
+        this->file_data = reinterpret_cast<const char*>(base);
+        this->file_size = size;
+      }
+    }
+    close(fd);
+  }
+
+  if (!this->file_data_owner.get()) {
+    shared_ptr<string> data(new string(load_file(filename)));
+    this->file_data = data->data();
+    this->file_size = data->size();
+    this->file_data_owner = data;
+  }
+
+  StringReader r(this->file_data, this->file_size);
+  this->parse_structure(r, this->file_data, index_only);
+}
+
+ResourceFile::ResourceFile(const Resource& res)
+    : file_data(nullptr), file_size(0), all_names_loaded(true) {
   this->resources.emplace(this->make_resource_key(res.type, res.id), res);
 }
 
-ResourceFile::ResourceFile(Resource&& res) {
+ResourceFile::ResourceFile(Resource&& res)
+    : file_data(nullptr), file_size(0), all_names_loaded(true) {
   this->resources.emplace(this->make_resource_key(res.type, res.id), move(res));
 }
 
-ResourceFile::ResourceFile(const std::vector<Resource>& ress) {
+ResourceFile::ResourceFile(const std::vector<Resource>& ress)
+    : file_data(nullptr), file_size(0), all_names_loaded(true) {
   for (const auto& res : ress) {
     this->resources.emplace(this->make_resource_key(res.type, res.id), res);
   }
 }
 
-ResourceFile::ResourceFile(std::vector<Resource>&& ress) {
+ResourceFile::ResourceFile(std::vector<Resource>&& ress)
+    : file_data(nullptr), file_size(0), all_names_loaded(true) {
   for (const auto& res : ress) {
     this->resources.emplace(this->make_resource_key(res.type, res.id), move(res));
   }
 }
 
-void ResourceFile::parse_structure(StringReader& r) {
+static string read_resource_name(StringReader& r, size_t offset) {
+  uint8_t name_len = r.pget<uint8_t>(offset);
+  return r.pread(offset + 1, name_len);
+}
+
+void ResourceFile::parse_structure(StringReader& r, const char* file_data,
+    bool index_only) {
   // if the resource fork is empty, treat it as a valid index with no contents
   if (r.eof()) {
     return;
@@ -201,19 +332,48 @@ void ResourceFile::parse_structure(StringReader& r) {
       ref_entry.byteswap();
       uint64_t key = this->make_resource_key(type_list_entry.resource_type, ref_entry.resource_id);
 
+      size_t abs_name_offset = (ref_entry.name_offset == 0xFFFF)
+          ? SIZE_MAX
+          : (header.resource_map_offset + map_header.resource_name_list_offset + ref_entry.name_offset);
+      size_t data_offset = header.resource_data_offset + (ref_entry.attributes_and_offset & 0x00FFFFFF);
+      uint8_t attributes = (ref_entry.attributes_and_offset >> 24) & 0xFF;
+
+      // in index-only mode, don't read the name or data at all; just remember
+      // where they are so get_resource can load them later
+      if (index_only) {
+        this->resources.emplace(piecewise_construct, forward_as_tuple(key),
+            forward_as_tuple(type_list_entry.resource_type, ref_entry.resource_id,
+              attributes, string(), string()));
+        this->unloaded_resources.emplace(key,
+            UnloadedResource({abs_name_offset, data_offset}));
+        if (abs_name_offset != SIZE_MAX) {
+          this->all_names_loaded = false;
+        }
+        continue;
+      }
+
       string name;
-      if (ref_entry.name_offset != 0xFFFF) {
-        size_t abs_name_offset = header.resource_map_offset + map_header.resource_name_list_offset + ref_entry.name_offset;
-        uint8_t name_len = r.pget<uint8_t>(abs_name_offset);
-        name = r.pread(abs_name_offset + 1, name_len);
+      if (abs_name_offset != SIZE_MAX) {
+        name = read_resource_name(r, abs_name_offset);
       }
 
-      size_t data_offset = header.resource_data_offset + (ref_entry.attributes_and_offset & 0x00FFFFFF);
       size_t data_size = bswap32(r.pget<uint32_t>(data_offset));
-      uint8_t attributes = (ref_entry.attributes_and_offset >> 24) & 0xFF;
-      this->resources.emplace(piecewise_construct, forward_as_tuple(key),
-          forward_as_tuple(type_list_entry.resource_type, ref_entry.resource_id,
-            attributes, name, r.preadx(data_offset + 4, data_size)));
+      if (file_data) {
+        // don't copy the data; just remember where it is in the file
+        if (data_offset + 4 + data_size > r.size()) {
+          throw out_of_range("resource data extends beyond end of file");
+        }
+        auto& res = this->resources.emplace(piecewise_construct,
+            forward_as_tuple(key), forward_as_tuple(
+              type_list_entry.resource_type, ref_entry.resource_id, attributes,
+              name, string())).first->second;
+        res.mapped_data = file_data + data_offset + 4;
+        res.mapped_size = data_size;
+      } else {
+        this->resources.emplace(piecewise_construct, forward_as_tuple(key),
+            forward_as_tuple(type_list_entry.resource_type, ref_entry.resource_id,
+              attributes, name, r.preadx(data_offset + 4, data_size)));
+      }
       if (!name.empty()) {
         this->name_to_resource_key.emplace(move(name), key);
       }
@@ -221,9 +381,68 @@ void ResourceFile::parse_structure(StringReader& r) {
   }
 }
 
+void ResourceFile::load_resource_name(uint64_t key, Resource& res,
+    UnloadedResource& unloaded_res) {
+  if (unloaded_res.name_offset == SIZE_MAX) {
+    return;
+  }
+
+  StringReader r(this->file_data, this->file_size);
+  try {
+    res.name = read_resource_name(r, unloaded_res.name_offset);
+  } catch (const out_of_range&) {
+    throw runtime_error("resource name is beyond end of file");
+  }
+  unloaded_res.name_offset = SIZE_MAX;
+  if (!res.name.empty()) {
+    this->name_to_resource_key.emplace(res.name, key);
+  }
+}
+
+void ResourceFile::load_resource(uint64_t key, Resource& res) {
+  auto it = this->unloaded_resources.find(key);
+  if (it == this->unloaded_resources.end()) {
+    return;
+  }
+
+  this->load_resource_name(key, res, it->second);
+
+  StringReader r(this->file_data, this->file_size);
+  size_t data_offset = it->second.data_offset;
+  size_t data_size;
+  try {
+    data_size = bswap32(r.pget<uint32_t>(data_offset));
+  } catch (const out_of_range&) {
+    throw runtime_error("resource data is beyond end of file");
+  }
+  if (data_offset + 4 + data_size > this->file_size) {
+    throw runtime_error("resource data extends beyond end of file");
+  }
+  res.mapped_data = this->file_data + data_offset + 4;
+  res.mapped_size = data_size;
+
+  this->unloaded_resources.erase(it);
+}
+
+void ResourceFile::load_all_resource_names() {
+  if (this->all_names_loaded) {
+    return;
+  }
+  // go in key order so name_to_resource_key's order doesn't depend on hashing
+  for (auto& it : this->resources) {
+    auto unloaded_it = this->unloaded_resources.find(it.first);
+    if (unloaded_it != this->unloaded_resources.end()) {
+      this->load_resource_name(it.first, it.second, unloaded_it->second);
+    }
+  }
+  this->all_names_loaded = true;
+}
+
 const ResourceFile::Resource& ResourceFile::get_system_decompressor(
     bool use_ncmp, int16_t resource_id) {
   static unordered_map<uint64_t, const Resource> id_to_res;
+  static mutex id_to_res_lock;
+  lock_guard<mutex> g(id_to_res_lock);
 
   // if it's already in the cache, just return it verbatim
   uint32_t resource_type = use_ncmp ? RESOURCE_TYPE_ncmp : RESOURCE_TYPE_dcmp;
@@ -258,9 +477,11 @@ struct CompressedResourceHeader {
 
     struct {
       uint16_t dcmp_resource_id;
-      uint16_t unused1;
-      uint8_t unused2;
-      uint8_t unused3;
+      uint16_t unused;
+      // for dcmp 2, these are the custom table size (number of entries - 1)
+      // and flags (0x01 = custom table present, 0x02 = tagged data)
+      uint8_t param1;
+      uint8_t param2;
     } header9;
   };
 
@@ -322,15 +543,561 @@ struct PPC32DecompressorInputHeader {
   uint32_t syscall_opcode;
 };
 
-string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
+// Setting up an emulated decompressor (creating the MemoryContext, then
+// loading and relocating the code) is expensive relative to running it on a
+// small resource, so each decompressor is only loaded once. The loaded image is
+// kept as a MemoryContext snapshot, and execution contexts are forked from it
+// as needed. Contexts are kept in a pool and reused; a context is only used by
+// one thread at a time (it's removed from the pool while in use), and is only
+// put back if the decompressor succeeded, so a crashed decompressor's context
+// is never reused.
+//
+// Each context has fixed regions for the stack, output, working buffer, and
+// input. These are allocated larger than necessary so they can be reused for
+// later resources; if a resource needs larger regions than a pooled context
+// has, a new context is forked instead. Before each reuse, the code is restored
+// (some decompressors modify themselves) and the data regions are cleared.
+
+static const uint32_t DECOMPRESSOR_STACK_REGION_ADDR = 0x10000000;
+static const uint32_t DECOMPRESSOR_OUTPUT_REGION_ADDR = 0x20000000;
+static const uint32_t DECOMPRESSOR_WORKING_REGION_ADDR = 0x80000000;
+static const uint32_t DECOMPRESSOR_INPUT_REGION_ADDR = 0xC0000000;
+static const uint32_t DECOMPRESSOR_IMPORT_STUBS_ADDR = 0xE0000000;
+static const uint32_t DECOMPRESSOR_CODE_ADDR = 0xF0000000;
+static const size_t DECOMPRESSOR_STACK_REGION_SIZE = 1024 * 16; // 16KB; should be enough
+
+struct DecompressorImage {
+  shared_ptr<const MemoryContext::Snapshot> snapshot;
+  bool is_ppc;
+  uint32_t entry_pc;
+  uint32_t entry_r2;
+  uint32_t block_move_data_syscall_addr;
+
+  // the loaded code (and data, for ncmps) as it was before the first run
+  vector<pair<uint32_t, string>> image_regions;
+
+  DecompressorImage()
+    : is_ppc(false),
+      entry_pc(0),
+      entry_r2(0),
+      block_move_data_syscall_addr(0) { }
+};
+
+struct DecompressorContext {
+  shared_ptr<const DecompressorImage> image;
+  shared_ptr<MemoryContext> mem;
+
+  size_t output_region_capacity;
+  size_t working_region_capacity;
+  size_t input_region_capacity;
+
+  // call stubs created by GetTrapAddress; these persist between runs
+  unordered_map<uint16_t, uint32_t> trap_to_call_stub_addr;
+};
+
+struct DecompressorContextPoolEntry {
+  shared_ptr<const DecompressorImage> image;
+  vector<unique_ptr<DecompressorContext>> contexts;
+  // value of decompressor_context_pool_use_count when this entry was last used
+  uint64_t last_used;
+
+  // when profiling, the profiles of all runs of this decompressor are combined
+  // here. the type and ID are those of the first resource that used it
+  unique_ptr<ExecutionProfile> profile;
+  uint32_t type;
+  int16_t id;
+};
+
+// The pool is bounded, since each context holds its own copy of the data
+// regions. Each decompressor keeps at most a few idle contexts (normally there
+// is at most one per thread), and only the most recently used decompressors
+// keep their images and contexts at all. Contexts whose regions grew very large
+// for an unusually large resource are freed instead of being pooled.
+static const size_t MAX_POOLED_CONTEXTS_PER_DECOMPRESSOR = 4;
+static const size_t MAX_POOLED_DECOMPRESSORS = 16;
+static const size_t MAX_POOLED_CONTEXT_REGION_SIZE = 0x4000000;
+
+static mutex decompressor_context_pool_lock;
+static unordered_map<string, DecompressorContextPoolEntry> decompressor_context_pool;
+static uint64_t decompressor_context_pool_use_count = 0;
+
+static string decompressor_context_pool_key(const ResourceFile::Resource& dcmp_res) {
+  // contexts are keyed by the decompressor's contents rather than by the
+  // Resource object, so contexts for the system decompressors are shared
+  // across all files, and a context is never used for a different
+  // decompressor that happens to have the same type and ID
+  string key(reinterpret_cast<const char*>(&dcmp_res.type), sizeof(dcmp_res.type));
+  key += dcmp_res.data;
+  return key;
+}
+
+static size_t decompressor_region_capacity(size_t size) {
+  size_t capacity = 0x10000;
+  while (capacity < size) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
+
+static shared_ptr<const DecompressorImage> load_decompressor_image(
+    const ResourceFile::Resource& dcmp_res, bool verbose) {
+  shared_ptr<DecompressorImage> image(new DecompressorImage());
+  // the image (and all contexts forked from it) use a flat address space,
+  // since the emulators access guest memory very frequently
+  shared_ptr<MemoryContext> mem(new MemoryContext(true));
+
+  if (dcmp_res.type == RESOURCE_TYPE_dcmp) {
+    image->is_ppc = false;
+
+    // figure out where in the dcmp to start execution. there appear to be two
+    // formats: one that has 'dcmp' in bytes 4-8 where execution appears to just
+    // start at byte 0 (usually it's a branch opcode), and one where the first
+    // three words appear to be offsets to various functions, followed by code.
+    // the second word appears to be the main entry point in this format, so we'll
+    // use that to determine where to start execution.
+    uint32_t entry_offset;
+    if (dcmp_res.data.size() < 10) {
+      throw runtime_error("decompressor resource is too short");
+    }
+    if (dcmp_res.data.substr(4, 4) == "dcmp") {
+      entry_offset = 0;
+    } else {
+      entry_offset = bswap16(*reinterpret_cast<const uint16_t*>(
+          dcmp_res.data.data() + 2));
+    }
+
+    // load the dcmp into emulated memory
+    size_t code_region_size = dcmp_res.data.size();
+    uint32_t code_addr = mem->allocate_at(DECOMPRESSOR_CODE_ADDR, code_region_size);
+    if (!code_addr) {
+      throw runtime_error("cannot allocate code region");
+    }
+    uint8_t* code_base = mem->obj<uint8_t>(code_addr, code_region_size);
+    memcpy(code_base, dcmp_res.data.data(), dcmp_res.data.size());
+    image->image_regions.emplace_back(code_addr, dcmp_res.data);
+    if (verbose) {
+      print_log("loaded code at %08" PRIX32 ":%zX\n", code_addr, code_region_size);
+    }
+
+    image->entry_pc = code_addr + entry_offset;
+    if (verbose) {
+      print_log("dcmp entry offset is %08" PRIX32 " (loaded at %" PRIX32 ")\n",
+          entry_offset, image->entry_pc);
+    }
+
+  } else if (dcmp_res.type == RESOURCE_TYPE_ncmp) {
+    // ncmp 2 imports BlockMoveData from InterfaceLib, so provide an
+    // implementation for it: a transition vector pointing to a syscall
+    // that the syscall handler recognizes, followed by a return
+    uint32_t import_stubs_addr = mem->allocate_at(DECOMPRESSOR_IMPORT_STUBS_ADDR, 0x10);
+    if (!import_stubs_addr) {
+      throw runtime_error("cannot allocate import stubs region");
+    }
+    image->block_move_data_syscall_addr = import_stubs_addr + 8;
+    mem->write_u32(import_stubs_addr, image->block_move_data_syscall_addr);
+    mem->write_u32(import_stubs_addr + 4, 0);
+    mem->write_u32(import_stubs_addr + 8, 0x44000002); // sc
+    mem->write_u32(import_stubs_addr + 12, 0x4E800020); // blr
+    mem->set_symbol_addr("InterfaceLib:BlockMoveData", import_stubs_addr);
+
+    PEFFFile f("<ncmp>", dcmp_res.data);
+    f.load_into("<ncmp>", mem, DECOMPRESSOR_CODE_ADDR);
+    image->is_ppc = f.is_ppc();
+
+    // ncmp decompressors don't appear to define any of the standard export
+    // symbols (init/main/term); instead, they define a single export symbol in
+    // the export table and apparently expect the system to just use that one.
+    if (!f.init().name.empty()) {
+      throw runtime_error("ncmp decompressor has init symbol");
+    }
+    if (!f.main().name.empty()) {
+      throw runtime_error("ncmp decompressor has main symbol");
+    }
+    if (!f.term().name.empty()) {
+      throw runtime_error("ncmp decompressor has term symbol");
+    }
+    const auto& exports = f.exports();
+    if (exports.size() != 1) {
+      throw runtime_error("ncmp decompressor does not export exactly one symbol");
+    }
+
+    // the start symbol is actually a transition vector, which is the code addr
+    // followed by the desired value in r2
+    string start_symbol_name = "<ncmp>:" + exports.begin()->second.name;
+    uint32_t start_symbol_addr = mem->get_symbol_addr(start_symbol_name.c_str());
+    image->entry_pc = mem->read_u32(start_symbol_addr);
+    image->entry_r2 = mem->read_u32(start_symbol_addr + 4);
+
+    if (verbose) {
+      print_log("ncmp entry pc is %08" PRIX32 " with r2 = %08" PRIX32 "\n",
+          image->entry_pc, image->entry_r2);
+    }
+
+    // save the loaded (and relocated) sections so they can be restored before
+    // each later run
+    for (size_t x = 0; x < f.section_count(); x++) {
+      uint32_t section_size = f.section_total_size(x);
+      if (section_size == 0) {
+        continue;
+      }
+      string symbol_name = string_printf("<ncmp>:section:%zu", x);
+      uint32_t section_addr = mem->get_symbol_addr(symbol_name.c_str());
+      image->image_regions.emplace_back(section_addr,
+          string(mem->obj<char>(section_addr, section_size), section_size));
+    }
+
+  } else {
+    throw runtime_error("decompressor resource is not dcmp or ncmp");
+  }
+
+  image->snapshot = mem->snapshot();
+  return image;
+}
+
+static unique_ptr<DecompressorContext> create_decompressor_context(
+    shared_ptr<const DecompressorImage> image, size_t output_region_size,
+    size_t working_buffer_region_size, size_t input_region_size) {
+  unique_ptr<DecompressorContext> ctx(new DecompressorContext());
+  ctx->image = image;
+  ctx->mem.reset(new MemoryContext(image->snapshot));
+
+  // set up data memory regions
+  ctx->output_region_capacity = decompressor_region_capacity(output_region_size);
+  ctx->working_region_capacity = decompressor_region_capacity(working_buffer_region_size);
+  ctx->input_region_capacity = decompressor_region_capacity(input_region_size);
+  if (!ctx->mem->allocate_at(DECOMPRESSOR_STACK_REGION_ADDR, DECOMPRESSOR_STACK_REGION_SIZE)) {
+    throw runtime_error("cannot allocate stack region");
+  }
+  if (!ctx->mem->allocate_at(DECOMPRESSOR_OUTPUT_REGION_ADDR, ctx->output_region_capacity)) {
+    throw runtime_error("cannot allocate output region");
+  }
+  if (!ctx->mem->allocate_at(DECOMPRESSOR_WORKING_REGION_ADDR, ctx->working_region_capacity)) {
+    throw runtime_error("cannot allocate working buffer region");
+  }
+  if (!ctx->mem->allocate_at(DECOMPRESSOR_INPUT_REGION_ADDR, ctx->input_region_capacity)) {
+    throw runtime_error("cannot allocate input region");
+  }
+
+  return ctx;
+}
+
+static unique_ptr<DecompressorContext> checkout_decompressor_context(
+    const ResourceFile::Resource& dcmp_res, size_t output_region_size,
+    size_t working_buffer_region_size, size_t input_region_size, bool verbose) {
+  string key = decompressor_context_pool_key(dcmp_res);
+
+  shared_ptr<const DecompressorImage> image;
+  unique_ptr<DecompressorContext> ctx;
+  {
+    lock_guard<mutex> g(decompressor_context_pool_lock);
+    auto it = decompressor_context_pool.find(key);
+    if (it != decompressor_context_pool.end()) {
+      image = it->second.image;
+      it->second.last_used = ++decompressor_context_pool_use_count;
+      if (!it->second.contexts.empty()) {
+        ctx = move(it->second.contexts.back());
+        it->second.contexts.pop_back();
+      }
+    }
+  }
+
+  // if the decompressor hasn't been loaded yet, load it. (if another thread
+  // loads it at the same time, one of the images is just discarded)
+  if (!image) {
+    image = load_decompressor_image(dcmp_res, verbose);
+    lock_guard<mutex> g(decompressor_context_pool_lock);
+    auto& entry = decompressor_context_pool[key];
+    if (!entry.image) {
+      entry.image = image;
+    }
+    entry.last_used = ++decompressor_context_pool_use_count;
+  } else if (verbose) {
+    print_log("using previously-loaded decompressor image\n");
+  }
+
+  // if there's no pooled context or its regions are too small, make a new one.
+  // (the regions can't be resized in place since MemoryContext doesn't unmap
+  // pages when they're freed.) the new context's regions are at least twice
+  // as large as the old one's, so this doesn't happen often
+  if (ctx && ((ctx->output_region_capacity < output_region_size) ||
+      (ctx->working_region_capacity < working_buffer_region_size) ||
+      (ctx->input_region_capacity < input_region_size))) {
+    output_region_size = max<size_t>(output_region_size, ctx->output_region_capacity * 2);
+    working_buffer_region_size = max<size_t>(working_buffer_region_size, ctx->working_region_capacity * 2);
+    input_region_size = max<size_t>(input_region_size, ctx->input_region_capacity * 2);
+    ctx.reset();
+  }
+  if (!ctx) {
+    return create_decompressor_context(image, output_region_size,
+        working_buffer_region_size, input_region_size);
+  }
+
+  // restore the code and clear the data regions
+  for (const auto& it : ctx->image->image_regions) {
+    memcpy(ctx->mem->at(it.first, it.second.size()), it.second.data(), it.second.size());
+  }
+  ctx->mem->zero(DECOMPRESSOR_STACK_REGION_ADDR, DECOMPRESSOR_STACK_REGION_SIZE);
+  ctx->mem->zero(DECOMPRESSOR_OUTPUT_REGION_ADDR, ctx->output_region_capacity);
+  ctx->mem->zero(DECOMPRESSOR_WORKING_REGION_ADDR, ctx->working_region_capacity);
+  ctx->mem->zero(DECOMPRESSOR_INPUT_REGION_ADDR, ctx->input_region_capacity);
+  if (verbose) {
+    print_log("reusing decompressor context\n");
+  }
+  return ctx;
+}
+
+static void return_decompressor_context(const ResourceFile::Resource& dcmp_res,
+    unique_ptr<DecompressorContext>&& ctx) {
+  if (ctx->output_region_capacity + ctx->working_region_capacity +
+      ctx->input_region_capacity > MAX_POOLED_CONTEXT_REGION_SIZE) {
+    return;
+  }
+
+  string key = decompressor_context_pool_key(dcmp_res);
+
+  // contexts and images evicted from the pool are destroyed after the lock is
+  // released, since freeing their memory can take a while
+  vector<unique_ptr<DecompressorContext>> evicted_contexts;
+  shared_ptr<const DecompressorImage> evicted_image;
+  lock_guard<mutex> g(decompressor_context_pool_lock);
+
+  auto& entry = decompressor_context_pool[key];
+  entry.last_used = ++decompressor_context_pool_use_count;
+  if (!entry.image) {
+    entry.image = ctx->image;
+  }
+  if (entry.contexts.size() >= MAX_POOLED_CONTEXTS_PER_DECOMPRESSOR) {
+    evicted_contexts.emplace_back(move(ctx));
+  } else {
+    entry.contexts.emplace_back(move(ctx));
+  }
+
+  // if too many decompressors are pooled, evict the least recently used one.
+  // entries with profiles are kept (without their image and contexts) so the
+  // profiles can still be reported
+  size_t num_images = 0;
+  auto lru_it = decompressor_context_pool.end();
+  for (auto it = decompressor_context_pool.begin(); it != decompressor_context_pool.end(); it++) {
+    if (!it->second.image) {
+      continue;
+    }
+    num_images++;
+    if ((lru_it == decompressor_context_pool.end()) ||
+        (it->second.last_used < lru_it->second.last_used)) {
+      lru_it = it;
+    }
+  }
+  if (num_images > MAX_POOLED_DECOMPRESSORS) {
+    evicted_image = move(lru_it->second.image);
+    for (auto& evicted_ctx : lru_it->second.contexts) {
+      evicted_contexts.emplace_back(move(evicted_ctx));
+    }
+    if (lru_it->second.profile) {
+      lru_it->second.contexts.clear();
+    } else {
+      decompressor_context_pool.erase(lru_it);
+    }
+  }
+}
+
+static void save_decompressor_trace(const ResourceFile::Resource& dcmp_res,
+    const ExecutionTrace& trace) {
+  static atomic<size_t> next_trace_number(0);
+  string filename = string_printf("%s%hd-trace-%zu.bin",
+      (dcmp_res.type == RESOURCE_TYPE_dcmp) ? "dcmp" : "ncmp", dcmp_res.id,
+      next_trace_number++);
+  save_file(filename, trace.serialize());
+  print_log("note: saved decompressor execution trace to %s\n",
+      filename.c_str());
+}
+
+static shared_ptr<ExecutionProfile> create_decompressor_profile(uint64_t flags,
+    ExecutionTrace::Architecture arch, shared_ptr<MemoryContext> mem) {
+  if (flags & DecompressionFlag::PROFILE_BY_SAMPLING) {
+    return shared_ptr<ExecutionProfile>(new ExecutionProfile(arch, mem,
+        ExecutionProfile::DEFAULT_SAMPLE_INTERVAL));
+  } else if (flags & DecompressionFlag::PROFILE) {
+    return shared_ptr<ExecutionProfile>(new ExecutionProfile(arch, mem));
+  }
+  return nullptr;
+}
+
+static void add_decompressor_profile(const ResourceFile::Resource& dcmp_res,
+    const ExecutionProfile& profile) {
+  string key = decompressor_context_pool_key(dcmp_res);
+  lock_guard<mutex> g(decompressor_context_pool_lock);
+  auto& entry = decompressor_context_pool[key];
+  if (!entry.profile) {
+    entry.profile.reset(new ExecutionProfile(profile.architecture(), nullptr,
+        profile.is_sampling() ? ExecutionProfile::DEFAULT_SAMPLE_INTERVAL : 0));
+    entry.type = dcmp_res.type;
+    entry.id = dcmp_res.id;
+  }
+  entry.profile->add(profile);
+}
+
+void ResourceFile::print_decompressor_profiles(FILE* stream) {
+  lock_guard<mutex> g(decompressor_context_pool_lock);
+  vector<const DecompressorContextPoolEntry*> entries;
+  for (const auto& it : decompressor_context_pool) {
+    if (it.second.profile) {
+      entries.emplace_back(&it.second);
+    }
+  }
+  sort(entries.begin(), entries.end(), [](const auto* a, const auto* b) {
+    return (a->type != b->type) ? (a->type < b->type) : (a->id < b->id);
+  });
+  for (const auto* entry : entries) {
+    fprintf(stream, "\n===== %s %hd\n",
+        (entry->type == RESOURCE_TYPE_dcmp) ? "dcmp" : "ncmp", entry->id);
+    entry->profile->print_report(stream);
+  }
+}
+
+decompression_limit_exceeded::decompression_limit_exceeded(const string& what)
+  : runtime_error(what) { }
+
+static atomic<uint64_t> decompression_max_cycles(0);
+static atomic<uint64_t> decompression_max_usecs(0);
+static atomic<size_t> decompression_cycle_limit_count(0);
+static atomic<size_t> decompression_time_limit_count(0);
+
+// The time limit is checked this often, in emulated instructions. The emulators
+// run at least tens of millions of instructions per second, so this catches a
+// runaway decompressor within a few milliseconds, and the checks cost nothing
+// measurable.
+static const uint64_t DECOMPRESSION_TIME_CHECK_INTERVAL = 0x100000;
+
+void ResourceFile::set_decompression_limits(uint64_t max_cycles,
+    uint64_t max_usecs) {
+  decompression_max_cycles = max_cycles;
+  decompression_max_usecs = max_usecs;
+}
+
+ResourceFile::DecompressionLimitStats ResourceFile::decompression_limit_stats() {
+  return DecompressionLimitStats{decompression_cycle_limit_count,
+      decompression_time_limit_count};
+}
+
+// Enforces the decompression limits for one resource, across all the emulated
+// decompressors that are tried for it. While an emulator runs, interrupt
+// manager calls stop it when the cycle limit is reached, and check the time
+// periodically.
+class DecompressionBudget {
+public:
+  DecompressionBudget()
+    : max_cycles(decompression_max_cycles),
+      max_usecs(decompression_max_usecs),
+      cycles_used(0),
+      deadline(0),
+      start_cycles(0),
+      exceeded_limit(Limit::NONE) { }
+  ~DecompressionBudget() = default;
+
+  // Throws decompression_limit_exceeded without starting if a limit was
+  // already reached by the decompressors that ran before
+  void start(shared_ptr<InterruptManager> im) {
+    if (this->max_cycles && (this->cycles_used >= this->max_cycles)) {
+      this->exceeded_limit = Limit::CYCLES;
+      this->check();
+    }
+    if (this->deadline && (now() >= this->deadline)) {
+      this->exceeded_limit = Limit::TIME;
+      this->check();
+    }
+
+    this->im = im;
+    this->start_cycles = im->cycles();
+    if (this->max_cycles) {
+      this->cycle_limit_call = im->add(this->max_cycles - this->cycles_used,
+          [this]() -> bool {
+        this->exceeded_limit = Limit::CYCLES;
+        return true;
+      });
+    }
+    if (this->max_usecs) {
+      if (!this->deadline) {
+        this->deadline = now() + this->max_usecs;
+      }
+      this->schedule_time_check();
+    }
+  }
+
+  // Called when the emulator stops for any reason. This can be called more
+  // than once.
+  void stop() {
+    if (!this->im) {
+      return;
+    }
+    if (this->cycle_limit_call) {
+      this->cycle_limit_call->cancel();
+      this->cycle_limit_call.reset();
+    }
+    if (this->time_check_call) {
+      this->time_check_call->cancel();
+      this->time_check_call.reset();
+    }
+    this->cycles_used += this->im->cycles() - this->start_cycles;
+    this->im.reset();
+  }
+
+  // Throws decompression_limit_exceeded if the emulator was stopped because a
+  // limit was reached
+  void check() const {
+    if (this->exceeded_limit == Limit::CYCLES) {
+      decompression_cycle_limit_count++;
+      throw decompression_limit_exceeded(string_printf(
+          "decompressor exceeded the cycle limit (%" PRIu64 " instructions)",
+          this->max_cycles));
+    } else if (this->exceeded_limit == Limit::TIME) {
+      decompression_time_limit_count++;
+      throw decompression_limit_exceeded(string_printf(
+          "decompressor exceeded the time limit (%" PRIu64 " usecs)",
+          this->max_usecs));
+    }
+  }
+
+private:
+  enum class Limit {
+    NONE = 0,
+    CYCLES,
+    TIME,
+  };
+
+  void schedule_time_check() {
+    this->time_check_call = this->im->add(DECOMPRESSION_TIME_CHECK_INTERVAL,
+        [this]() -> bool {
+      if (now() >= this->deadline) {
+        this->exceeded_limit = Limit::TIME;
+        return true;
+      }
+      this->schedule_time_check();
+      return false;
+    });
+  }
+
+  uint64_t max_cycles;
+  uint64_t max_usecs;
+  uint64_t cycles_used;
+  uint64_t deadline;
+
+  shared_ptr<InterruptManager> im;
+  uint64_t start_cycles;
+  shared_ptr<InterruptManager::PendingCall> cycle_limit_call;
+  shared_ptr<InterruptManager::PendingCall> time_check_call;
+  Limit exceeded_limit;
+};
+
+string ResourceFile::decompress_resource(const void* data, size_t size,
+    uint64_t flags) {
   bool verbose = !!(flags & DecompressionFlag::VERBOSE);
 
-  if (data.size() < sizeof(CompressedResourceHeader)) {
+  if (size < sizeof(CompressedResourceHeader)) {
     throw runtime_error("resource marked as compressed but is too small");
   }
 
   CompressedResourceHeader header;
-  memcpy(&header, data.data(), sizeof(header));
+  memcpy(&header, data, sizeof(header));
   header.byteswap();
   if (header.magic != 0xA89F6572) {
     throw runtime_error("resource marked as compressed but does not appear to be compressed");
@@ -345,6 +1112,49 @@ string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
     throw runtime_error("compressed resource header version is not 8 or 9");
   }
 
+  // if there's a native implementation of this decompressor, try it first,
+  // unless the file has its own decompressor with the same ID (it may not
+  // implement the same algorithm as the system decompressor)
+  string native_output;
+  bool native_succeeded = false;
+  bool file_has_decompressor =
+      (!(flags & DecompressionFlag::SKIP_FILE_DCMP) &&
+        this->resource_exists(RESOURCE_TYPE_dcmp, dcmp_resource_id)) ||
+      (!(flags & DecompressionFlag::SKIP_FILE_NCMP) &&
+        this->resource_exists(RESOURCE_TYPE_ncmp, dcmp_resource_id));
+  if (!(flags & DecompressionFlag::SKIP_NATIVE) && !file_has_decompressor &&
+      (dcmp_resource_id >= 0) && (dcmp_resource_id <= 2)) {
+    const void* compressed_data = reinterpret_cast<const uint8_t*>(data) + sizeof(CompressedResourceHeader);
+    size_t compressed_size = size - sizeof(CompressedResourceHeader);
+    uint64_t execution_start_time = now();
+    try {
+      if (dcmp_resource_id == 0) {
+        native_output = decompress_dcmp0(compressed_data, compressed_size,
+            header.decompressed_size);
+      } else if (dcmp_resource_id == 1) {
+        native_output = decompress_dcmp1(compressed_data, compressed_size,
+            header.decompressed_size);
+      } else {
+        native_output = decompress_dcmp2(compressed_data, compressed_size,
+            header.decompressed_size, header.header9.param1,
+            header.header9.param2);
+      }
+      native_succeeded = true;
+      if (verbose) {
+        float duration = static_cast<float>(now() - execution_start_time) / 1000000.0f;
+        print_log("note: decompressed resource using native dcmp %hd in %g seconds\n",
+            dcmp_resource_id, duration);
+      }
+    } catch (const runtime_error& e) {
+      if (verbose) {
+        print_log("native dcmp %hd failed: %s\n", dcmp_resource_id, e.what());
+      }
+    }
+    if (native_succeeded && !(flags & DecompressionFlag::VERIFY_NATIVE)) {
+      return native_output;
+    }
+  }
+
   // in order of priority, we try:
   // 1. dcmp resource from the file
   // 2. ncmp resource from the file
@@ -373,142 +1183,69 @@ string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
   }
 
   if (dcmp_resources.empty()) {
+    if (native_succeeded) {
+      return native_output;
+    }
     throw runtime_error("no decompressors are available for this resource");
   }
 
   if (verbose) {
-    fprintf(stderr, "using dcmp/ncmp %hd (%zu implementations available)\n",
+    print_log("using dcmp/ncmp %hd (%zu implementations available)\n",
         dcmp_resource_id, dcmp_resources.size());
-    fprintf(stderr, "resource header looks like:\n");
-    print_data(stderr, data.data(), data.size() > 0x40 ? 0x40 : data.size());
-    fprintf(stderr, "note: data size is %zu (0x%zX); decompressed data size is %" PRIu32 " (0x%" PRIX32 ") bytes\n",
-        data.size(), data.size(), header.decompressed_size, header.decompressed_size);
+    print_log("resource header looks like:\n");
+    print_log_stream([&](FILE* stream) {
+      print_data(stream, data, size > 0x40 ? 0x40 : size);
+    });
+    print_log("note: data size is %zu (0x%zX); decompressed data size is %" PRIu32 " (0x%" PRIX32 ") bytes\n",
+        size, size, header.decompressed_size, header.decompressed_size);
   }
 
+  DecompressionBudget budget;
   for (size_t z = 0; z < dcmp_resources.size(); z++) {
     const Resource* dcmp_res = dcmp_resources[z];
     if (verbose) {
-      fprintf(stderr, "attempting decompression with implementation %zu of %zu\n",
+      print_log("attempting decompression with implementation %zu of %zu\n",
           z + 1, dcmp_resources.size());
     }
 
     try {
-      shared_ptr<MemoryContext> mem(new MemoryContext());
-
-      uint32_t entry_pc;
-      uint32_t entry_r2;
-      bool is_ppc;
-      if (dcmp_res->type == RESOURCE_TYPE_dcmp) {
-        is_ppc = false;
-
-        // figure out where in the dcmp to start execution. there appear to be two
-        // formats: one that has 'dcmp' in bytes 4-8 where execution appears to just
-        // start at byte 0 (usually it's a branch opcode), and one where the first
-        // three words appear to be offsets to various functions, followed by code.
-        // the second word appears to be the main entry point in this format, so we'll
-        // use that to determine where to start execution.
-        uint32_t entry_offset;
-        if (dcmp_res->data.size() < 10) {
-          throw runtime_error("decompressor resource is too short");
-        }
-        if (dcmp_res->data.substr(4, 4) == "dcmp") {
-          entry_offset = 0;
-        } else {
-          entry_offset = bswap16(*reinterpret_cast<const uint16_t*>(
-              dcmp_res->data.data() + 2));
-        }
-
-        // load the dcmp into emulated memory
-        size_t code_region_size = dcmp_res->data.size();
-        uint32_t code_addr = mem->allocate_at(0xF0000000, code_region_size);
-        uint8_t* code_base = mem->obj<uint8_t>(code_addr, code_region_size);
-        memcpy(code_base, dcmp_res->data.data(), dcmp_res->data.size());
-        fprintf(stderr, "loaded code at %08" PRIX32 ":%zX\n", code_addr, code_region_size);
-
-        entry_pc = code_addr + entry_offset;
-        if (verbose) {
-          fprintf(stderr, "dcmp entry offset is %08" PRIX32 " (loaded at %" PRIX32 ")\n",
-              entry_offset, entry_pc);
-        }
-
-      } else if (dcmp_res->type == RESOURCE_TYPE_ncmp) {
-        PEFFFile f("<ncmp>", dcmp_res->data);
-        f.load_into("<ncmp>", mem, 0xF0000000);
-        is_ppc = f.is_ppc();
-
-        // ncmp decompressors don't appear to define any of the standard export
-        // symbols (init/main/term); instead, they define a single export symbol in
-        // the export table and apparently expect the system to just use that one.
-        if (!f.init().name.empty()) {
-          throw runtime_error("ncmp decompressor has init symbol");
-        }
-        if (!f.main().name.empty()) {
-          throw runtime_error("ncmp decompressor has main symbol");
-        }
-        if (!f.term().name.empty()) {
-          throw runtime_error("ncmp decompressor has term symbol");
-        }
-        const auto& exports = f.exports();
-        if (exports.size() != 1) {
-          throw runtime_error("ncmp decompressor does not export exactly one symbol");
-        }
-
-        // the start symbol is actually a transition vector, which is the code addr
-        // followed by the desired value in r2
-        string start_symbol_name = "<ncmp>:" + exports.begin()->second.name;
-        uint32_t start_symbol_addr = mem->get_symbol_addr(start_symbol_name.c_str());
-        entry_pc = mem->read_u32(start_symbol_addr);
-        entry_r2 = mem->read_u32(start_symbol_addr + 4);
-
-        if (verbose) {
-          fprintf(stderr, "ncmp entry pc is %08" PRIX32 " with r2 = %08" PRIX32 "\n",
-              entry_pc, entry_r2);
-        }
-
-      } else {
-        throw runtime_error("decompressor resource is not dcmp or ncmp");
-      }
-
-      size_t stack_region_size = 1024 * 16; // 16KB; should be enough
+      size_t stack_region_size = DECOMPRESSOR_STACK_REGION_SIZE;
       size_t output_region_size = header.decompressed_size + 0x100;
       // TODO: looks like some decompressors expect zero bytes after the compressed
       // data? find out if this is actually true and fix it if not
-      size_t input_region_size = data.size() + 0x100;
-      // TODO: this is probably way too big
-      size_t working_buffer_region_size = data.size() * 256;
-
-      // set up data memory regions
+      size_t input_region_size = size + 0x100;
       // slightly awkward assumption: decompressed data is never more than 256 times
       // the size of the input data. TODO: it looks like we probably should be using
-      // ((data.size() * 256) / working_buffer_fractional_size) instead here?
-      uint32_t stack_addr = mem->allocate_at(0x10000000, stack_region_size);
-      if (!stack_addr) {
-        throw runtime_error("cannot allocate stack region");
-      }
-      uint32_t output_addr = mem->allocate_at(0x20000000, output_region_size);
-      if (!stack_addr) {
-        throw runtime_error("cannot allocate output region");
-      }
-      uint32_t working_buffer_addr = mem->allocate_at(0x80000000, working_buffer_region_size);
-      if (!stack_addr) {
-        throw runtime_error("cannot allocate working buffer region");
-      }
-      uint32_t input_addr = mem->allocate_at(0xC0000000, input_region_size);
-      if (!stack_addr) {
-        throw runtime_error("cannot allocate input region");
-      }
+      // ((size * 256) / working_buffer_fractional_size) instead here?
+      // TODO: this is probably way too big
+      size_t working_buffer_region_size = size * 256;
+
+      // get a context with the decompressor already loaded, and with data
+      // regions that are large enough for this resource
+      unique_ptr<DecompressorContext> ctx = checkout_decompressor_context(
+          *dcmp_res, output_region_size, working_buffer_region_size,
+          input_region_size, verbose);
+      shared_ptr<MemoryContext> mem = ctx->mem;
+      uint32_t entry_pc = ctx->image->entry_pc;
+      uint32_t entry_r2 = ctx->image->entry_r2;
+      uint32_t block_move_data_syscall_addr = ctx->image->block_move_data_syscall_addr;
+      bool is_ppc = ctx->image->is_ppc;
+      uint32_t stack_addr = DECOMPRESSOR_STACK_REGION_ADDR;
+      uint32_t output_addr = DECOMPRESSOR_OUTPUT_REGION_ADDR;
+      uint32_t working_buffer_addr = DECOMPRESSOR_WORKING_REGION_ADDR;
+      uint32_t input_addr = DECOMPRESSOR_INPUT_REGION_ADDR;
       if (verbose) {
-        fprintf(stderr, "memory:\n");
-        fprintf(stderr, "  stack region at %08" PRIX32 ":%zX\n", stack_addr, stack_region_size);
-        fprintf(stderr, "  output region at %08" PRIX32 ":%zX\n", output_addr, output_region_size);
-        fprintf(stderr, "  working region at %08" PRIX32 ":%zX\n", working_buffer_addr, working_buffer_region_size);
-        fprintf(stderr, "  input region at %08" PRIX32 ":%zX\n", input_addr, input_region_size);
+        print_log("memory:\n");
+        print_log("  stack region at %08" PRIX32 ":%zX\n", stack_addr, stack_region_size);
+        print_log("  output region at %08" PRIX32 ":%zX\n", output_addr, output_region_size);
+        print_log("  working region at %08" PRIX32 ":%zX\n", working_buffer_addr, working_buffer_region_size);
+        print_log("  input region at %08" PRIX32 ":%zX\n", input_addr, input_region_size);
       }
       uint8_t* stack_base = mem->obj<uint8_t>(stack_addr, stack_region_size);
       uint8_t* output_base = mem->obj<uint8_t>(output_addr, output_region_size);
       // uint8_t* working_buffer_base = mem->obj<uint8_t>(working_buffer_addr, working_buffer_region_size);
       uint8_t* input_base = mem->obj<uint8_t>(input_addr, input_region_size);
-      memcpy(input_base, data.data(), data.size());
+      memcpy(input_base, data, size);
 
       uint64_t execution_start_time;
       if (is_ppc) {
@@ -538,30 +1275,57 @@ string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
         regs.lr = return_addr;
         regs.pc = entry_pc;
         if (verbose) {
-          fprintf(stderr, "initial stack contents (input header data):\n");
-          print_data(stderr, input_header, sizeof(*input_header), regs.r[1].u);
+          print_log("initial stack contents (input header data):\n");
+          print_log_stream([&](FILE* stream) {
+            print_data(stream, input_header, sizeof(*input_header), regs.r[1].u);
+          });
         }
 
         // set up environment
         shared_ptr<InterruptManager> interrupt_manager(new InterruptManager());
         PPC32Emulator emu(mem);
         emu.set_interrupt_manager(interrupt_manager);
+        shared_ptr<ExecutionTrace> trace;
+        if (flags & DecompressionFlag::TRACE) {
+          trace.reset(new ExecutionTrace(ExecutionTrace::Architecture::PPC32, mem));
+          emu.set_trace(trace);
+        }
+        auto profile = create_decompressor_profile(flags,
+            ExecutionTrace::Architecture::PPC32, mem);
+        if (profile) {
+          emu.set_profile(profile);
+        }
         if (verbose) {
           emu.set_debug_hook([&](PPC32Emulator& emu, PPC32Registers& regs) -> bool {
             if (interrupt_manager->cycles() % 25 == 0) {
-              regs.print_header(stderr);
-              fprintf(stderr, " => -OPCODE- DISASSEMBLY\n");
+              print_log_stream([&](FILE* stream) {
+                regs.print_header(stream);
+              });
+              print_log(" => -OPCODE- DISASSEMBLY\n");
             }
-            regs.print(stderr);
+            print_log_stream([&](FILE* stream) {
+              regs.print(stream);
+            });
             uint32_t opcode = bswap32(mem->read<uint32_t>(regs.pc));
             string dasm = PPC32Emulator::disassemble(regs.pc, opcode);
-            fprintf(stderr, " => %08X %s\n", opcode, dasm.c_str());
+            print_log(" => %08X %s\n", opcode, dasm.c_str());
             return true;
           });
         }
         emu.set_syscall_handler([&](PPC32Emulator& emu, PPC32Registers& regs) -> bool {
-          // we don't support any syscalls in ppc mode - the only syscall that
-          // should occur is the one at the end of emulation, when r2 == -1
+          // the only syscalls we support in ppc mode are BlockMoveData (see
+          // above) and the one at the end of emulation, when r2 == -1
+          if (block_move_data_syscall_addr && (regs.pc == block_move_data_syscall_addr)) {
+            // BlockMoveData(r3=src, r4=dest, r5=size)
+            uint32_t size = regs.r[5].u;
+            if (size) {
+              memmove(mem->at(regs.r[4].u, size), mem->at(regs.r[3].u, size), size);
+            }
+            if (verbose) {
+              print_log("BlockMoveData: copied %08" PRIX32 " bytes\n", size);
+            }
+            return true;
+          }
           if (regs.r[2].u != 0xFFFFFFFF) {
             throw runtime_error("unimplemented syscall");
           }
@@ -570,16 +1334,29 @@ string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
 
         // let's roll, son
         execution_start_time = now();
+        budget.start(interrupt_manager);
         try {
           emu.execute(regs);
+          budget.stop();
+          budget.check();
         } catch (const exception& e) {
+          budget.stop();
           if (verbose) {
             uint64_t diff = now() - execution_start_time;
             float duration = static_cast<float>(diff) / 1000000.0f;
-            fprintf(stderr, "powerpc decompressor execution failed (%gsec): %s\n", duration, e.what());
+            print_log("powerpc decompressor execution failed (%gsec): %s\n", duration, e.what());
+          }
+          if (trace) {
+            save_decompressor_trace(*dcmp_res, *trace);
+          }
+          if (profile) {
+            add_decompressor_profile(*dcmp_res, *profile);
           }
           throw;
         }
+        if (profile) {
+          add_decompressor_profile(*dcmp_res, *profile);
+        }
 
       } else {
         // set up header in stack region
@@ -606,72 +1383,96 @@ string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
         regs.a[7] = stack_addr + stack_region_size - sizeof(M68KDecompressorInputHeader);
         regs.pc = entry_pc;
         if (verbose) {
-          fprintf(stderr, "initial stack contents (input header data):\n");
-          print_data(stderr, input_header, sizeof(*input_header), regs.a[7]);
+          print_log("initial stack contents (input header data):\n");
+          print_log_stream([&](FILE* stream) {
+            print_data(stream, input_header, sizeof(*input_header), regs.a[7]);
+          });
         }
 
         // set up environment
-        unordered_map<uint16_t, uint32_t> trap_to_call_stub_addr;
+        auto& trap_to_call_stub_addr = ctx->trap_to_call_stub_addr;
+        shared_ptr<InterruptManager> interrupt_manager(new InterruptManager());
         M68KEmulator emu(mem);
+        emu.set_interrupt_manager(interrupt_manager);
+        if (flags & DecompressionFlag::VERIFY_EMULATION) {
+          emu.set_differential_mode(true);
+        }
+        shared_ptr<ExecutionTrace> trace;
+        if (flags & DecompressionFlag::TRACE) {
+          trace.reset(new ExecutionTrace(ExecutionTrace::Architecture::M68K, mem));
+          emu.set_trace(trace);
+        }
+        auto profile = create_decompressor_profile(flags,
+            ExecutionTrace::Architecture::M68K, mem);
+        if (profile) {
+          emu.set_profile(profile);
+        }
         if (verbose) {
-          emu.print_state_header(stderr);
+          print_log_stream([&](FILE* stream) {
+            emu.print_state_header(stream);
+          });
           emu.set_debug_hook([&](M68KEmulator& emu, M68KRegisters& regs) -> bool {
-            emu.print_state(stderr);
+            print_log_stream([&](FILE* stream) {
+              emu.print_state(stream);
+            });
             return true;
           });
         }
-        emu.set_syscall_handler([&](M68KEmulator& emu, M68KRegisters& regs, uint16_t opcode) -> bool {
-          uint16_t trap_number;
-          bool auto_pop = false;
-          uint8_t flags = 0;
 
-          if (opcode & 0x0800) {
-            trap_number = opcode & 0x0BFF;
-            auto_pop = opcode & 0x0400;
-          } else {
-            trap_number = opcode & 0x00FF;
-            flags = (opcode >> 9) & 3;
+        // the memory manager traps (including BlockMove, which dcmp 2 uses to
+        // copy custom tables into its working area) are implemented natively.
+        // blocks the decompressor allocates are freed when traps goes out of
+        // scope, so they don't accumulate in pooled contexts. traps doesn't log
+        // the calls itself, since it would write them directly to stderr
+        TrapHandlers traps(mem, false);
+        traps.add_memory_manager_handlers();
+        traps.set_handler(0x0046, [&](M68KEmulator&, M68KRegisters& regs, uint16_t) { // GetTrapAddress
+          uint16_t trap_number = regs.d[0].u & 0xFFFF;
+          if ((trap_number > 0x4F) && (trap_number != 0x54) && (trap_number != 0x57)) {
+            trap_number |= 0x0800;
           }
 
-          // we only support GetTrapAddress, and no other traps
-          if (trap_number == 0x0046) {
-            uint16_t trap_number = regs.d[0].u & 0xFFFF;
-            if ((trap_number > 0x4F) && (trap_number != 0x54) && (trap_number != 0x57)) {
-              trap_number |= 0x0800;
+          // if it already has a call routine, just return that
+          try {
+            regs.a[0] = trap_to_call_stub_addr.at(trap_number);
+            if (verbose) {
+              print_log("GetTrapAddress: using cached call stub for trap %04hX -> %08" PRIX32 "\n",
+                  trap_number, regs.a[0]);
             }
 
-            // if it already has a call routine, just return that
-            try {
-              regs.a[0] = trap_to_call_stub_addr.at(trap_number);
-              if (verbose) {
-                fprintf(stderr, "GetTrapAddress: using cached call stub for trap %04hX -> %08" PRIX32 "\n",
-                    trap_number, regs.a[0]);
-              }
-
-            } catch (const out_of_range&) {
-              // create a call stub
-              uint32_t call_stub_addr = mem->allocate(4);
-              uint16_t* call_stub = mem->obj<uint16_t>(call_stub_addr, 4);
-              trap_to_call_stub_addr.emplace(trap_number, call_stub_addr);
-              call_stub[0] = bswap16(0xA000 | trap_number); // A-trap opcode
-              call_stub[1] = bswap16(0x4E75); // rts
-
-              // return the address
-              regs.a[0] = call_stub_addr;
-
-              if (verbose) {
-                fprintf(stderr, "GetTrapAddress: created call stub for trap %04hX -> %08" PRIX32 "\n",
-                    trap_number, regs.a[0]);
-              }
-            }
+          } catch (const out_of_range&) {
+            // create a call stub
+            uint32_t call_stub_addr = mem->allocate(4);
+            uint16_t* call_stub = mem->obj<uint16_t>(call_stub_addr, 4);
+            trap_to_call_stub_addr.emplace(trap_number, call_stub_addr);
+            call_stub[0] = bswap16(0xA000 | trap_number); // A-trap opcode
+            call_stub[1] = bswap16(0x4E75); // rts
+
+            // return the address
+            regs.a[0] = call_stub_addr;
 
-          } else if (verbose) {
-            if (trap_number & 0x0800) {
-              fprintf(stderr, "warning: skipping unimplemented toolbox trap (num=%hX, auto_pop=%s)",
-                  static_cast<uint16_t>(trap_number & 0x0BFF), auto_pop ? "true" : "false");
+            if (verbose) {
+              print_log("GetTrapAddress: created call stub for trap %04hX -> %08" PRIX32 "\n",
+                  trap_number, regs.a[0]);
+            }
+          }
+        });
+        emu.set_syscall_handler([&](M68KEmulator& emu, M68KRegisters& regs, uint16_t opcode) -> bool {
+          // traps that have no handler are skipped
+          bool handled = traps.handle(emu, regs, opcode);
+          if (verbose) {
+            uint16_t trap_number = TrapHandlers::trap_number_for_opcode(opcode);
+            if (handled) {
+              const TrapInfo* info = info_for_68k_trap(trap_number, (opcode >> 9) & 3);
+              print_log("trap %04hX (%s): D0=%08" PRIX32 " A0=%08" PRIX32 "\n",
+                  opcode, info ? info->name : "unknown", regs.d[0].u, regs.a[0]);
+            } else if (trap_number & 0x0800) {
+              bool auto_pop = opcode & 0x0400;
+              print_log("warning: skipping unimplemented toolbox trap (num=%hX, auto_pop=%s)\n",
+                  trap_number, auto_pop ? "true" : "false");
             } else {
-              fprintf(stderr, "warning: skipping unimplemented os trap (num=%hX, flags=%hhu)",
-                  static_cast<uint16_t>(trap_number & 0x00FF), flags);
+              print_log("warning: skipping unimplemented os trap (num=%hX, flags=%hhu)\n",
+                  trap_number, static_cast<uint8_t>((opcode >> 9) & 3));
             }
           }
 
@@ -680,23 +1481,38 @@ string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
 
         // let's roll, son
         execution_start_time = now();
+        budget.start(interrupt_manager);
         try {
           emu.execute(regs);
+          budget.stop();
+          budget.check();
         } catch (const exception& e) {
+          budget.stop();
           if (verbose) {
             uint64_t diff = now() - execution_start_time;
             float duration = static_cast<float>(diff) / 1000000.0f;
-            fprintf(stderr, "m68k decompressor execution failed (%gsec): %s\n", duration, e.what());
-            emu.print_state(stderr);
+            print_log("m68k decompressor execution failed (%gsec): %s\n", duration, e.what());
+            print_log_stream([&](FILE* stream) {
+              emu.print_state(stream);
+            });
+          }
+          if (trace) {
+            save_decompressor_trace(*dcmp_res, *trace);
+          }
+          if (profile) {
+            add_decompressor_profile(*dcmp_res, *profile);
           }
           throw;
         }
+        if (profile) {
+          add_decompressor_profile(*dcmp_res, *profile);
+        }
       }
 
       if (verbose) {
         uint64_t diff = now() - execution_start_time;
         float duration = static_cast<float>(diff) / 1000000.0f;
-        fprintf(stderr, "note: decompressed resource using %s %hd in %g seconds\n",
+        print_log("note: decompressed resource using %s %hd in %g seconds\n",
             (dcmp_res->type == RESOURCE_TYPE_dcmp) ? "dcmp" : "ncmp", dcmp_res->id,
             duration);
       }
@@ -704,24 +1520,56 @@ string ResourceFile::decompress_resource(const string& data, uint64_t flags) {
       string output;
       output.resize(header.decompressed_size);
       memcpy(const_cast<char*>(output.data()), output_base, header.decompressed_size);
+
+      if (native_succeeded && (output != native_output)) {
+        size_t offset = 0;
+        while ((offset < output.size()) && (output[offset] == native_output[offset])) {
+          offset++;
+        }
+        print_log("warning: native dcmp %hd result differs from %s %hd result at offset 0x%zX\n",
+            dcmp_resource_id,
+            (dcmp_res->type == RESOURCE_TYPE_dcmp) ? "dcmp" : "ncmp", dcmp_res->id,
+            offset);
+      }
+
+      return_decompressor_context(*dcmp_res, move(ctx));
       return output;
 
+    } catch (const decompression_limit_exceeded& e) {
+      // don't try the other decompressors; they would just use up more time
+      if (verbose) {
+        print_log("decompressor implementation %zu of %zu failed: %s\n",
+            z + 1, dcmp_resources.size(), e.what());
+      }
+      if (native_succeeded) {
+        break;
+      }
+      throw;
+
     } catch (const exception& e) {
       if (verbose) {
-        fprintf(stderr, "decompressor implementation %zu of %zu failed: %s\n",
+        print_log("decompressor implementation %zu of %zu failed: %s\n",
             z + 1, dcmp_resources.size(), e.what());
       }
     }
   }
 
+  if (native_succeeded) {
+    print_log("warning: native dcmp %hd succeeded but no emulated decompressor did\n",
+        dcmp_resource_id);
+    return native_output;
+  }
   throw runtime_error("no deecompressor succeeded");
 }
 
 bool ResourceFile::resource_exists(uint32_t type, int16_t id) {
+  lock_guard<mutex> g(this->resources_lock);
   return this->resources.count(this->make_resource_key(type, id));
 }
 
 bool ResourceFile::resource_exists(uint32_t type, const char* name) {
+  lock_guard<mutex> g(this->resources_lock);
+  this->load_all_resource_names();
   auto its = this->name_to_resource_key.equal_range(name);
   for (; its.first != its.second; its.first++) {
     if (this->type_from_resource_key(its.first->second) == type) {
@@ -733,39 +1581,126 @@ bool ResourceFile::resource_exists(uint32_t type, const char* name) {
 
 const ResourceFile::Resource& ResourceFile::get_resource(uint32_t type,
     int16_t id, uint64_t decompress_flags) {
-  Resource& res = this->resources.at(this->make_resource_key(type, id));
+  uint64_t key = this->make_resource_key(type, id);
+  unique_lock<mutex> g(this->resources_lock);
+  Resource& res = this->resources.at(key);
+  this->load_resource(key, res);
+
+  // once a resource has been decompressed (or decompression has failed), the
+  // result is returned instead of the original resource
+  auto decompressed_it = this->decompressed_resources.find(key);
+  if (decompressed_it != this->decompressed_resources.end()) {
+    return decompressed_it->second;
+  }
 
   if ((res.flags & ResourceFlag::FLAG_COMPRESSED) &&
-      !(res.flags & ResourceFlag::FLAG_DECOMPRESSION_FAILED) &&
       !(decompress_flags & DecompressionFlag::DISABLED)) {
+    // if the resource is in the mapping, decompress directly from there so the
+    // compressed data is never copied. otherwise, res.data can be used
+    // directly, since it's never modified after the data is loaded
+    const void* compressed_data;
+    size_t compressed_size;
+    if (res.mapped_data) {
+      compressed_data = res.mapped_data;
+      compressed_size = res.mapped_size;
+    } else {
+      compressed_data = res.data.data();
+      compressed_size = res.data.size();
+    }
+
+    // decompression can take a long time, and the decompressor may need to
+    // get other resources from this file, so don't hold the lock while it runs
+    g.unlock();
+    string decompressed_data;
+    bool failed = false;
+    bool limit_exceeded = false;
     try {
-      string decompressed_data = this->decompress_resource(res.data, decompress_flags);
-      res.data = move(decompressed_data);
-      res.flags = (res.flags & ~ResourceFlag::FLAG_COMPRESSED) | ResourceFlag::FLAG_DECOMPRESSED;
+      decompressed_data = this->decompress_resource(compressed_data,
+          compressed_size, decompress_flags);
     } catch (const runtime_error& e) {
-      res.flags |= ResourceFlag::FLAG_DECOMPRESSION_FAILED;
+      failed = true;
+      limit_exceeded = !!dynamic_cast<const decompression_limit_exceeded*>(&e);
       if (decompress_flags & DecompressionFlag::VERBOSE) {
-        fprintf(stderr, "warning: decompression failed: %s\n", e.what());
+        print_log("warning: decompression failed: %s\n", e.what());
       }
     }
+    g.lock();
+
+    // another thread may have decompressed the resource in the meantime; if
+    // so, keep its result. if decompression failed, the result is a copy of
+    // the compressed resource with the failure flags set
+    decompressed_it = this->decompressed_resources.find(key);
+    if (decompressed_it == this->decompressed_resources.end()) {
+      uint16_t flags = res.flags;
+      if (failed) {
+        flags |= ResourceFlag::FLAG_DECOMPRESSION_FAILED;
+        if (limit_exceeded) {
+          flags |= ResourceFlag::FLAG_DECOMPRESSION_LIMIT_EXCEEDED;
+        }
+        decompressed_data.assign(reinterpret_cast<const char*>(compressed_data),
+            compressed_size);
+      } else {
+        flags = (flags & ~ResourceFlag::FLAG_COMPRESSED) | ResourceFlag::FLAG_DECOMPRESSED;
+      }
+      decompressed_it = this->decompressed_resources.emplace(piecewise_construct,
+          forward_as_tuple(key), forward_as_tuple(res.type, res.id, flags,
+              string(res.name), move(decompressed_data))).first;
+    }
+    return decompressed_it->second;
+  }
+
+  // copy the data out of the mapping if no one else is using it already
+  if (res.mapped_data && (res.num_data_users++ == 0)) {
+    res.data.assign(res.mapped_data, res.mapped_size);
   }
 
   return res;
 }
 
+void ResourceFile::release_resource(uint32_t type, int16_t id) {
+  uint64_t key = this->make_resource_key(type, id);
+  lock_guard<mutex> g(this->resources_lock);
+  Resource& res = this->resources.at(key);
+  if (res.mapped_data && (res.num_data_users > 0) &&
+      (--res.num_data_users == 0)) {
+    // clear() wouldn't free the buffer
+    string().swap(res.data);
+  }
+}
+
 const ResourceFile::Resource& ResourceFile::get_resource(uint32_t type,
     const char* name, uint64_t decompress_flags) {
-  auto its = this->name_to_resource_key.equal_range(name);
-  for (; its.first != its.second; its.first++) {
-    if (this->type_from_resource_key(its.first->second) == type) {
-      return this->get_resource(type,
-          this->id_from_resource_key(its.first->second), decompress_flags);
+  int16_t id;
+  {
+    lock_guard<mutex> g(this->resources_lock);
+    this->load_all_resource_names();
+    auto its = this->name_to_resource_key.equal_range(name);
+    for (; its.first != its.second; its.first++) {
+      if (this->type_from_resource_key(its.first->second) == type) {
+        break;
+      }
     }
+    if (its.first == its.second) {
+      throw out_of_range("no such resource");
+    }
+    id = this->id_from_resource_key(its.first->second);
   }
-  throw out_of_range("no such resource");
+  return this->get_resource(type, id, decompress_flags);
+}
+
+const string& ResourceFile::get_resource_name(uint32_t type, int16_t id) {
+  uint64_t key = this->make_resource_key(type, id);
+  lock_guard<mutex> g(this->resources_lock);
+  Resource& res = this->resources.at(key);
+  auto it = this->unloaded_resources.find(key);
+  if (it != this->unloaded_resources.end()) {
+    this->load_resource_name(key, res, it->second);
+  }
+  return res.name;
 }
 
 vector<int16_t> ResourceFile::all_resources_of_type(uint32_t type) {
+  lock_guard<mutex> g(this->resources_lock);
   vector<int16_t> all_ids;
   for (auto it = this->resources.lower_bound(this->make_resource_key(type, 0));
        it != this->resources.end(); it++) {
@@ -778,6 +1713,7 @@ vector<int16_t> ResourceFile::all_resources_of_type(uint32_t type) {
 }
 
 vector<pair<uint32_t, int16_t>> ResourceFile::all_resources() {
+  lock_guard<mutex> g(this->resources_lock);
   vector<pair<uint32_t, int16_t>> all_resources;
   for (const auto& it : this->resources) {
     all_resources.emplace_back(make_pair(
@@ -2004,6 +2940,10 @@ public:
     return this->rf->decode_clut(id);
   }
 
+  virtual void print_warning(const std::string& message) {
+    print_log("warning: %s\n", message.c_str());
+  }
+
   // QuickDraw state accessors
   Rect bounds;
   virtual const Rect& get_bounds() const {
@@ -2218,7 +3158,7 @@ ResourceFile::DecodedPictResource ResourceFile::decode_PICT(const Resource& res)
   try {
     return this->decode_PICT_internal(res);
   } catch (const exception& e) {
-    fprintf(stderr, "warning: PICT rendering failed (%s); attempting rendering using picttoppm\n", e.what());
+    print_log("warning: PICT rendering failed (%s); attempting rendering using picttoppm\n", e.what());
     return {this->decode_PICT_external(res), "", ""};
   }
 }
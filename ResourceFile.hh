@@ -7,7 +7,12 @@
 
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -103,11 +108,33 @@ enum DecompressionFlag {
   SKIP_FILE_NCMP = 0x08,
   SKIP_SYSTEM_DCMP = 0x10,
   SKIP_SYSTEM_NCMP = 0x20,
+  // By default, native implementations of the standard system decompressors
+  // (dcmps 0, 1, and 2, and ncmps 0 and 2, which use the same formats as dcmps
+  // 0 and 2) are used when available, and the emulated decompressors are only
+  // run if the native implementation fails. SKIP_NATIVE disables the native
+  // implementations; VERIFY_NATIVE runs both and warns if the results differ
+  // (the emulated result is used in that case).
+  SKIP_NATIVE = 0x40,
+  VERIFY_NATIVE = 0x80,
+  // Runs 68K decompressors in the emulator's differential mode, which checks
+  // its fast path against the reference interpreter after every instruction
+  VERIFY_EMULATION = 0x100,
+  // Records a compact trace of each emulated decompressor's execution, and if
+  // the decompressor fails, saves the most recent part of it to a file in the
+  // current directory (which can be read with trace_dasm)
+  TRACE = 0x200,
+  // Profiles the emulated decompressors, either by counting every instruction
+  // or by sampling (see ExecutionProfile). The profiles are combined across
+  // all resources; use ResourceFile::print_decompressor_profiles to see them.
+  // If both flags are given, the decompressors are profiled by sampling.
+  PROFILE = 0x400,
+  PROFILE_BY_SAMPLING = 0x800,
 };
 
 enum ResourceFlag {
   // The low 8 bits come from the resource itself; the high 8 bits are reserved
   // for resource_dasm
+  FLAG_DECOMPRESSION_LIMIT_EXCEEDED = 0x0400, // set along with FLAG_DECOMPRESSION_FAILED
   FLAG_DECOMPRESSED = 0x0200, // decompressor ran successfully
   FLAG_DECOMPRESSION_FAILED = 0x0100, // so we don't try to decompress again
   FLAG_LOAD_IN_SYSTEM_HEAP = 0x0040,
@@ -121,6 +148,14 @@ enum ResourceFlag {
 
 
 
+// Thrown when the emulated decompressors for a resource run for longer than
+// the limits set by ResourceFile::set_decompression_limits
+class decompression_limit_exceeded : public std::runtime_error {
+public:
+  explicit decompression_limit_exceeded(const std::string& what);
+  ~decompression_limit_exceeded() = default;
+};
+
 class ResourceFile {
 public:
   struct Resource {
@@ -130,7 +165,19 @@ public:
     std::string name;
     std::string data;
 
+    // For resources in memory-mapped files, the contents are in the mapping at
+    // mapped_data, and data is a copy of them that only exists while the
+    // resource is in use: it's made when get_resource returns the resource,
+    // and dropped when each of those calls has been matched by a call to
+    // release_resource. Decompressed resources and copies of resources always
+    // own their data.
+    const char* mapped_data;
+    size_t mapped_size;
+    size_t num_data_users;
+
     Resource();
+    Resource(const Resource& other);
+    Resource& operator=(const Resource& other);
     Resource(uint32_t type, int16_t id, const std::string& data);
     Resource(uint32_t type, int16_t id, std::string&& data);
     Resource(uint32_t type, int16_t id, uint16_t flags, const std::string& name, const std::string& data);
@@ -141,6 +188,15 @@ public:
   ResourceFile(const std::string& data);
   ResourceFile(const void* data, size_t size);
 
+  // Memory-mapped file constructor. Resource data stays in the mapping and is
+  // only copied out when each resource is first accessed. If the file can't be
+  // mapped (e.g. some filesystems don't support mapping resource forks), it is
+  // read into memory instead. If index_only is true, only the type and
+  // reference lists are parsed here; each resource's name and data are read
+  // from the file when it's first accessed, so listing resources (or getting
+  // only a few of them) costs time proportional to the index size.
+  explicit ResourceFile(const char* filename, bool index_only = false);
+
   // Existing-resource constructors
   ResourceFile(const Resource& res);
   ResourceFile(Resource&& res);
@@ -155,11 +211,51 @@ public:
       uint64_t decompression_flags = 0);
   const Resource& get_resource(uint32_t type, const char* name,
       uint64_t decompression_flags = 0);
+  // Tells the ResourceFile that the caller is done with a resource returned by
+  // get_resource. If the resource's data was copied out of a memory-mapped file
+  // and no other caller is still using it, the copy is freed; it's made again if
+  // the resource is needed later. References to the resource's data must not be
+  // used after this. Callers don't have to release resources (the copies are
+  // then kept until the ResourceFile is destroyed), but exporting every
+  // resource from a large file without releasing them uses as much memory as
+  // the whole file.
+  void release_resource(uint32_t type, int16_t id);
+  // Returns only the resource's name, without loading or decompressing its
+  // data. This is cheaper than get_resource for index-only ResourceFiles.
+  const std::string& get_resource_name(uint32_t type, int16_t id);
   std::vector<int16_t> all_resources_of_type(uint32_t type);
   std::vector<std::pair<uint32_t, int16_t>> all_resources();
 
   uint32_t find_resource_by_id(int16_t id, const std::vector<uint32_t>& types);
 
+  // Prints the combined profile of each emulated decompressor that ran with
+  // DecompressionFlag::PROFILE or PROFILE_BY_SAMPLING, in all ResourceFiles
+  static void print_decompressor_profiles(FILE* stream);
+
+  // Warnings, notes, and verbose decompression output are written to stderr by
+  // default. If a log function is set, they're passed to it instead, on the
+  // thread that produced them, so a caller that works on several resources at
+  // once can keep each resource's messages together. This applies to all
+  // ResourceFiles, and should be set before any of them are used.
+  using LogFunction = std::function<void(const std::string& text)>;
+  static void set_log_function(LogFunction fn);
+
+  // Limits how long the emulated decompressors can run for each resource, in
+  // emulated instructions and in wall-clock time. The limits cover all the
+  // decompressors tried for a resource together; if they're exceeded,
+  // decompression fails with decompression_limit_exceeded, and no other
+  // decompressors are tried. 0 means no limit (the default). The limits apply
+  // to all ResourceFiles, and are counted only for decompressors started after
+  // they're set. The time limit is checked periodically, so it may be exceeded
+  // by a few milliseconds.
+  static void set_decompression_limits(uint64_t max_cycles, uint64_t max_usecs);
+  struct DecompressionLimitStats {
+    size_t cycle_limit_count;
+    size_t time_limit_count;
+  };
+  // Returns the number of resources that exceeded each limit so far
+  static DecompressionLimitStats decompression_limit_stats();
+
   struct DecodedCodeFragmentEntry {
     uint32_t architecture;
     uint8_t update_level;
@@ -477,16 +573,45 @@ public:
   std::string decode_styl(const Resource& res);
 
 private:
+  // Backing storage for file-backed ResourceFiles; this is either a read-only
+  // mapping of the file or (if it couldn't be mapped) a copy of its contents
+  std::shared_ptr<void> file_data_owner;
+  const char* file_data;
+  size_t file_size;
+
+  // Resources in index-only ResourceFiles whose names and/or data haven't been
+  // read from the file yet. Entries are removed when the data is loaded.
+  struct UnloadedResource {
+    size_t name_offset; // SIZE_MAX if the resource has no name or it's loaded
+    size_t data_offset; // points to the data's size field
+  };
+  std::unordered_map<uint64_t, UnloadedResource> unloaded_resources;
+  bool all_names_loaded;
+
+  // Guards the resource index and lazy loading/decompression, so resources
+  // may be fetched and decoded from multiple threads at once. Decompression
+  // itself runs without holding the lock.
+  std::mutex resources_lock;
   std::map<uint64_t, Resource> resources;
+  // Other threads may be using any Resource that get_resource has returned,
+  // so those are never modified. Instead, the result of decompressing a
+  // resource is stored here, and get_resource returns it from then on.
+  std::map<uint64_t, Resource> decompressed_resources;
   std::multimap<std::string, uint64_t> name_to_resource_key;
   std::unordered_map<int16_t, Resource> system_dcmp_cache;
 
   static uint64_t make_resource_key(uint32_t type, int16_t id);
   static uint32_t type_from_resource_key(uint64_t key);
   static int16_t id_from_resource_key(uint64_t key);
-  void parse_structure(StringReader& r);
-
-  std::string decompress_resource(const std::string& data, uint64_t flags);
+  void parse_structure(StringReader& r, const char* file_data = nullptr,
+      bool index_only = false);
+  void load_resource_name(uint64_t key, Resource& res,
+      UnloadedResource& unloaded_res);
+  void load_resource(uint64_t key, Resource& res);
+  void load_all_resource_names();
+
+  std::string decompress_resource(const void* data, size_t size,
+      uint64_t flags);
   static const Resource& get_system_decompressor(bool use_ncmp, int16_t resource_id);
 };
 
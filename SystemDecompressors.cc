@@ -0,0 +1,423 @@
+#include "SystemDecompressors.hh"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+
+// These tables are copied from the 68K implementations in system_dcmps/
+
+static const uint16_t dcmp0_const_table[0xB3] = {
+  0x0000, 0x4EBA, 0x0008, 0x4E75, 0x000C, 0x4EAD, 0x2053, 0x2F0B,
+  0x6100, 0x0010, 0x7000, 0x2F00, 0x486E, 0x2050, 0x206E, 0x2F2E,
+  0xFFFC, 0x48E7, 0x3F3C, 0x0004, 0xFFF8, 0x2F0C, 0x2006, 0x4EED,
+  0x4E56, 0x2068, 0x4E5E, 0x0001, 0x588F, 0x4FEF, 0x0002, 0x0018,
+  0x6000, 0xFFFF, 0x508F, 0x4E90, 0x0006, 0x266E, 0x0014, 0xFFF4,
+  0x4CEE, 0x000A, 0x000E, 0x41EE, 0x4CDF, 0x48C0, 0xFFF0, 0x2D40,
+  0x0012, 0x302E, 0x7001, 0x2F28, 0x2054, 0x6700, 0x0020, 0x001C,
+  0x205F, 0x1800, 0x266F, 0x4878, 0x0016, 0x41FA, 0x303C, 0x2840,
+  0x7200, 0x286E, 0x200C, 0x6600, 0x206B, 0x2F07, 0x558F, 0x0028,
+  0xFFFE, 0xFFEC, 0x22D8, 0x200B, 0x000F, 0x598F, 0x2F3C, 0xFF00,
+  0x0118, 0x81E1, 0x4A00, 0x4EB0, 0xFFE8, 0x48C7, 0x0003, 0x0022,
+  0x0007, 0x001A, 0x6706, 0x6708, 0x4EF9, 0x0024, 0x2078, 0x0800,
+  0x6604, 0x002A, 0x4ED0, 0x3028, 0x265F, 0x6704, 0x0030, 0x43EE,
+  0x3F00, 0x201F, 0x001E, 0xFFF6, 0x202E, 0x42A7, 0x2007, 0xFFFA,
+  0x6002, 0x3D40, 0x0C40, 0x6606, 0x0026, 0x2D48, 0x2F01, 0x70FF,
+  0x6004, 0x1880, 0x4A40, 0x0040, 0x002C, 0x2F08, 0x0011, 0xFFE4,
+  0x2140, 0x2640, 0xFFF2, 0x426E, 0x4EB9, 0x3D7C, 0x0038, 0x000D,
+  0x6006, 0x422E, 0x203C, 0x670C, 0x2D68, 0x6608, 0x4A2E, 0x4AAE,
+  0x002E, 0x4840, 0x225F, 0x2200, 0x670A, 0x3007, 0x4267, 0x0032,
+  0x2028, 0x0009, 0x487A, 0x0200, 0x2F2B, 0x0005, 0x226E, 0x6602,
+  0xE580, 0x670E, 0x660A, 0x0050, 0x3E00, 0x660C, 0x2E00, 0xFFEE,
+  0x206D, 0x2040, 0xFFE0, 0x5340, 0x6008, 0x0480, 0x0068, 0x0B7C,
+  0x4400, 0x41E8, 0x4841,
+};
+
+static const uint16_t dcmp1_const_table[0x29] = {
+  0x0000, 0x0001, 0x0002, 0x0003, 0x2E01, 0x3E01, 0x0101, 0x1E01,
+  0xFFFF, 0x0E01, 0x3100, 0x1112, 0x0107, 0x3332, 0x1239, 0xED10,
+  0x0127, 0x2322, 0x0137, 0x0706, 0x0117, 0x0123, 0x00FF, 0x002F,
+  0x070E, 0xFD3C, 0x0135, 0x0115, 0x0102, 0x0007, 0x003E, 0x05D5,
+  0x0201, 0x0607, 0x0708, 0x3001, 0x0133, 0x0010, 0x1716, 0x373E,
+  0x3637,
+};
+
+static const uint16_t dcmp2_default_table[0x100] = {
+  0x0000, 0x0008, 0x4EBA, 0x206E, 0x4E75, 0x000C, 0x0004, 0x7000,
+  0x0010, 0x0002, 0x486E, 0xFFFC, 0x6000, 0x0001, 0x48E7, 0x2F2E,
+  0x4E56, 0x0006, 0x4E5E, 0x2F00, 0x6100, 0xFFF8, 0x2F0B, 0xFFFF,
+  0x0014, 0x000A, 0x0018, 0x205F, 0x000E, 0x2050, 0x3F3C, 0xFFF4,
+  0x4CEE, 0x302E, 0x6700, 0x4CDF, 0x266E, 0x0012, 0x001C, 0x4267,
+  0xFFF0, 0x303C, 0x2F0C, 0x0003, 0x4ED0, 0x0020, 0x7001, 0x0016,
+  0x2D40, 0x48C0, 0x2078, 0x7200, 0x588F, 0x6600, 0x4FEF, 0x42A7,
+  0x6706, 0xFFFA, 0x558F, 0x286E, 0x3F00, 0xFFFE, 0x2F3C, 0x6704,
+  0x598F, 0x206B, 0x0024, 0x201F, 0x41FA, 0x81E1, 0x6604, 0x6708,
+  0x001A, 0x4EB9, 0x508F, 0x202E, 0x0007, 0x4EB0, 0xFFF2, 0x3D40,
+  0x001E, 0x2068, 0x6606, 0xFFF6, 0x4EF9, 0x0800, 0x0C40, 0x3D7C,
+  0xFFEC, 0x0005, 0x203C, 0xFFE8, 0xDEFC, 0x4A2E, 0x0030, 0x0028,
+  0x2F08, 0x200B, 0x6002, 0x426E, 0x2D48, 0x2053, 0x2040, 0x1800,
+  0x6004, 0x41EE, 0x2F28, 0x2F01, 0x670A, 0x4840, 0x2007, 0x6608,
+  0x0118, 0x2F07, 0x3028, 0x3F2E, 0x302B, 0x226E, 0x2F2B, 0x002C,
+  0x670C, 0x225F, 0x6006, 0x00FF, 0x3007, 0xFFEE, 0x5340, 0x0040,
+  0xFFE4, 0x4A40, 0x660A, 0x000F, 0x4EAD, 0x70FF, 0x22D8, 0x486B,
+  0x0022, 0x204B, 0x670E, 0x4AAE, 0x4E90, 0xFFE0, 0xFFC0, 0x002A,
+  0x2740, 0x6702, 0x51C8, 0x02B6, 0x487A, 0x2278, 0xB06E, 0xFFE6,
+  0x0009, 0x322E, 0x3E00, 0x4841, 0xFFEA, 0x43EE, 0x4E71, 0x7400,
+  0x2F2C, 0x206C, 0x003C, 0x0026, 0x0050, 0x1880, 0x301F, 0x2200,
+  0x660C, 0xFFDA, 0x0038, 0x6602, 0x302C, 0x200C, 0x2D6E, 0x4240,
+  0xFFE2, 0xA9F0, 0xFF00, 0x377C, 0xE580, 0xFFDC, 0x4868, 0x594F,
+  0x0034, 0x3E1F, 0x6008, 0x2F06, 0xFFDE, 0x600A, 0x7002, 0x0032,
+  0xFFCC, 0x0080, 0x2251, 0x101F, 0x317C, 0xA029, 0xFFD8, 0x5240,
+  0x0100, 0x6710, 0xA023, 0xFFCE, 0xFFD4, 0x2006, 0x4878, 0x002E,
+  0x504F, 0x43FA, 0x6712, 0x7600, 0x41E8, 0x4A6E, 0x20D9, 0x005A,
+  0x7FFF, 0x51CA, 0x005C, 0x2E00, 0x0240, 0x48C7, 0x6714, 0x0C80,
+  0x2E9F, 0xFFD6, 0x8000, 0x1000, 0x4842, 0x4A6B, 0xFFD2, 0x0048,
+  0x4A47, 0x4ED1, 0x206F, 0x0041, 0x600C, 0x2A78, 0x422E, 0x3200,
+  0x6574, 0x6716, 0x0044, 0x486D, 0x2008, 0x486C, 0x0B7C, 0x2640,
+  0x0400, 0x0068, 0x206D, 0x000D, 0x2A40, 0x000B, 0x003E, 0x0220,
+};
+
+
+
+static void put_u16(string& out, uint16_t v) {
+  out.push_back(static_cast<char>(v >> 8));
+  out.push_back(static_cast<char>(v));
+}
+
+static void put_u32(string& out, uint32_t v) {
+  put_u16(out, v >> 16);
+  put_u16(out, v);
+}
+
+// The decompressed size comes from the resource header, so it can't be trusted
+// for allocating the output buffer up front. The output is reserved up to this
+// multiple of the compressed size; beyond that, it grows as needed.
+static const size_t MAX_RESERVE_RATIO = 8;
+
+static size_t initial_reserve_size(size_t compressed_size, size_t decompressed_size) {
+  if (compressed_size > decompressed_size / MAX_RESERVE_RATIO) {
+    return decompressed_size;
+  }
+  return compressed_size * MAX_RESERVE_RATIO;
+}
+
+static void check_decompressed_size(const string& out, size_t decompressed_size) {
+  if (out.size() != decompressed_size) {
+    throw runtime_error(string_printf(
+        "decompressed data size (0x%zX) does not match expected size (0x%zX)",
+        out.size(), decompressed_size));
+  }
+}
+
+
+
+// dcmp 0 and 1 (these only differ in the primary opcode mapping)
+
+// Numbers are stored in a variable-length format: 00-7F are literal values;
+// 80-FE are the high byte of a 15-bit signed value (biased by 0xC0); FF is
+// followed by a 32-bit value.
+static int32_t dcmp01_read_number(StringReader& r) {
+  uint8_t v = r.get_u8();
+  if (v < 0x80) {
+    return v;
+  }
+  if (v == 0xFF) {
+    return r.get_u32r();
+  }
+  return (static_cast<int32_t>(v) - 0xC0) * 0x100 + r.get_u8();
+}
+
+namespace {
+
+struct Dcmp01State {
+  StringReader r;
+  string out;
+  size_t decompressed_size;
+  // offset and size in out of each literal that can be referred to later
+  vector<pair<size_t, size_t>> saved_literals;
+
+  Dcmp01State(const void* data, size_t size, size_t decompressed_size)
+    : r(data, size), decompressed_size(decompressed_size) {
+    this->out.reserve(initial_reserve_size(size, decompressed_size));
+  }
+
+  // this is called before each write to out, so malformed data can't produce
+  // more output than the header says there should be
+  void check_output_size(size_t bytes_to_write) const {
+    if (bytes_to_write > this->decompressed_size - this->out.size()) {
+      throw runtime_error(string_printf(
+          "decompressed data is larger than expected size (0x%zX)",
+          this->decompressed_size));
+    }
+  }
+
+  void put_const_word(uint16_t v) {
+    this->check_output_size(2);
+    put_u16(this->out, v);
+  }
+
+  void copy_literal(size_t size, bool save) {
+    this->check_output_size(size);
+    if (save) {
+      this->saved_literals.emplace_back(this->out.size(), size);
+    }
+    this->out += this->r.readx(size);
+  }
+
+  void copy_saved_literal(size_t index) {
+    if (index >= this->saved_literals.size()) {
+      throw runtime_error(string_printf(
+          "reference to literal %zu, but only %zu literals exist",
+          index, this->saved_literals.size()));
+    }
+    // make sure out won't be reallocated while appending part of itself
+    const auto& lit = this->saved_literals[index];
+    this->check_output_size(lit.second);
+    if (this->out.capacity() < this->out.size() + lit.second) {
+      this->out.reserve(max<size_t>(
+          this->out.capacity() * 2, this->out.size() + lit.second));
+    }
+    this->out.append(this->out, lit.first, lit.second);
+  }
+
+  void execute_extended_opcode() {
+    uint8_t kind = this->r.get_u8();
+    switch (kind) {
+      case 0x00: { // 68K jump table (unloaded entries)
+        uint16_t segment_number = dcmp01_read_number(this->r);
+        uint16_t count = dcmp01_read_number(this->r);
+        this->check_output_size(count * 8 + 6);
+        uint16_t offset = 6;
+        for (size_t x = 0; x < count; x++) {
+          offset += dcmp01_read_number(this->r) - 6;
+          put_u16(this->out, 0x3F3C); // move.w -[A7], segment_number
+          put_u16(this->out, segment_number);
+          put_u16(this->out, 0xA9F0); // _LoadSeg
+          put_u16(this->out, offset);
+        }
+        put_u16(this->out, 0x3F3C);
+        put_u16(this->out, segment_number);
+        put_u16(this->out, 0xA9F0);
+        break;
+      }
+
+      case 0x01: { // 68K jump table (bsr/jmp entries)
+        uint16_t bsr_offset = dcmp01_read_number(this->r);
+        uint16_t jmp_offset_delta = dcmp01_read_number(this->r);
+        uint16_t count = dcmp01_read_number(this->r);
+        uint16_t jmp_offset = dcmp01_read_number(this->r);
+        this->check_output_size((count + 1) * 8);
+        for (size_t x = 0; ; x++) {
+          put_u16(this->out, 0x6100); // bsr
+          put_u16(this->out, bsr_offset);
+          put_u16(this->out, 0x4EED); // jmp [A5 + jmp_offset]
+          put_u16(this->out, jmp_offset);
+          if (x == count) {
+            break;
+          }
+          bsr_offset -= 8;
+          if (jmp_offset_delta) {
+            jmp_offset += jmp_offset_delta;
+          } else {
+            jmp_offset = dcmp01_read_number(this->r);
+          }
+        }
+        break;
+      }
+
+      case 0x02: // repeated byte
+      case 0x03: { // repeated word
+        int32_t value = dcmp01_read_number(this->r);
+        size_t count = static_cast<uint16_t>(dcmp01_read_number(this->r)) + 1;
+        this->check_output_size(count * ((kind == 0x02) ? 1 : 2));
+        for (size_t x = 0; x < count; x++) {
+          if (kind == 0x02) {
+            this->out.push_back(static_cast<char>(value));
+          } else {
+            put_u16(this->out, value);
+          }
+        }
+        break;
+      }
+
+      case 0x04: // words with byte deltas
+      case 0x05: // words with variable-length deltas
+      case 0x06: { // longs with variable-length deltas
+        uint32_t value = dcmp01_read_number(this->r);
+        uint16_t count = dcmp01_read_number(this->r);
+        this->check_output_size((count + 1) * ((kind == 0x06) ? 4 : 2));
+        for (size_t x = 0; ; x++) {
+          if (kind == 0x06) {
+            put_u32(this->out, value);
+          } else {
+            put_u16(this->out, value);
+          }
+          if (x == count) {
+            break;
+          }
+          if (kind == 0x04) {
+            value += this->r.get_s8();
+          } else {
+            value += dcmp01_read_number(this->r);
+          }
+        }
+        break;
+      }
+
+      default:
+        // the 68K implementation ignores unknown extended opcodes (after
+        // consuming their kind byte), so we do the same
+        break;
+    }
+  }
+};
+
+} // namespace
+
+string decompress_dcmp0(const void* data, size_t size, size_t decompressed_size) {
+  Dcmp01State s(data, size, decompressed_size);
+  try {
+    for (;;) {
+      uint8_t opcode = s.r.get_u8();
+      if (opcode < 0x20) { // literal
+        bool save = (opcode & 0x10);
+        size_t count = (opcode & 0x0F)
+            ? ((opcode & 0x0F) * 2)
+            : static_cast<uint16_t>(dcmp01_read_number(s.r) * 2);
+        s.copy_literal(count, save);
+
+      } else if (opcode == 0x20) { // reference to saved literal
+        s.copy_saved_literal(0x28 + s.r.get_u8());
+      } else if (opcode == 0x21) {
+        s.copy_saved_literal(0x128 + s.r.get_u8());
+      } else if (opcode == 0x22) {
+        s.copy_saved_literal(static_cast<uint16_t>(0x28 + s.r.get_u16r()));
+      } else if (opcode < 0x4B) {
+        s.copy_saved_literal(opcode - 0x23);
+
+      } else if (opcode < 0xFE) { // constant word
+        s.put_const_word(dcmp0_const_table[opcode - 0x4B]);
+
+      } else if (opcode == 0xFE) {
+        s.execute_extended_opcode();
+
+      } else { // 0xFF: end of stream
+        break;
+      }
+    }
+  } catch (const out_of_range&) {
+    throw runtime_error("compressed data is truncated");
+  }
+
+  check_decompressed_size(s.out, decompressed_size);
+  return move(s.out);
+}
+
+string decompress_dcmp1(const void* data, size_t size, size_t decompressed_size) {
+  Dcmp01State s(data, size, decompressed_size);
+  try {
+    for (;;) {
+      uint8_t opcode = s.r.get_u8();
+      if (opcode < 0x20) { // literal
+        s.copy_literal((opcode & 0x0F) + 1, opcode & 0x10);
+      } else if (opcode < 0xD0) { // reference to saved literal
+        s.copy_saved_literal(opcode - 0x20);
+
+      } else if (opcode == 0xD0 || opcode == 0xD1) { // long literal
+        s.copy_literal(static_cast<uint16_t>(dcmp01_read_number(s.r)),
+            opcode & 0x01);
+
+      } else if (opcode == 0xD2) { // reference to saved literal
+        s.copy_saved_literal(0xB0 + s.r.get_u8());
+      } else if (opcode == 0xD3) {
+        s.copy_saved_literal(0x1B0 + s.r.get_u8());
+      } else if (opcode == 0xD4) {
+        s.copy_saved_literal(static_cast<uint16_t>(0xB0 + s.r.get_u16r()));
+
+      } else if (opcode < 0xFE) { // constant word
+        s.put_const_word(dcmp1_const_table[opcode - 0xD5]);
+
+      } else if (opcode == 0xFE) {
+        s.execute_extended_opcode();
+
+      } else { // 0xFF: end of stream
+        break;
+      }
+    }
+  } catch (const out_of_range&) {
+    throw runtime_error("compressed data is truncated");
+  }
+
+  check_decompressed_size(s.out, decompressed_size);
+  return move(s.out);
+}
+
+
+
+// dcmp 2
+
+string decompress_dcmp2(const void* data, size_t size,
+    size_t decompressed_size, uint8_t custom_table_size, uint8_t flags) {
+  StringReader r(data, size);
+  string out;
+  // each byte of compressed data produces at most one word of output
+  out.reserve(min<size_t>(decompressed_size, size * 2) + 1);
+
+  try {
+    // if a custom table is given, it replaces the beginning of the table; the
+    // rest of the table is zero
+    uint16_t custom_table[0x100];
+    const uint16_t* table = dcmp2_default_table;
+    if (flags & 0x01) {
+      size_t count = custom_table_size + 1;
+      for (size_t x = 0; x < 0x100; x++) {
+        custom_table[x] = (x < count) ? r.get_u16r() : 0;
+      }
+      table = custom_table;
+    }
+
+    size_t word_count = decompressed_size >> 1;
+    if (flags & 0x02) {
+      // each tag byte describes the next 8 words; a 1 bit means the word is
+      // encoded as a table index, and a 0 bit means it's stored literally
+      for (size_t x = 0; x < word_count; x += 8) {
+        uint8_t tag = r.get_u8();
+        size_t end_x = min<size_t>(x + 8, word_count);
+        for (size_t z = x; z < end_x; z++, tag <<= 1) {
+          if (tag & 0x80) {
+            put_u16(out, table[r.get_u8()]);
+          } else {
+            put_u16(out, r.get_u16r());
+          }
+        }
+      }
+
+    } else {
+      // the 68K implementation always writes at least one word, even if the
+      // decompressed size is less than 2 bytes
+      do {
+        put_u16(out, table[r.get_u8()]);
+      } while (out.size() < (word_count << 1));
+    }
+
+    // an odd trailing byte is stored literally
+    if (decompressed_size & 1) {
+      out.push_back(r.get_u8());
+    }
+  } catch (const out_of_range&) {
+    throw runtime_error("compressed data is truncated");
+  }
+
+  if (out.size() > decompressed_size) {
+    out.resize(decompressed_size);
+  }
+  check_decompressed_size(out, decompressed_size);
+  return out;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+// Native implementations of the standard system decompressors. Each of these
+// takes the compressed data (everything after the compressed resource header)
+// and the decompressed size from the header. They throw runtime_error if the
+// compressed data is malformed or doesn't decompress to exactly the expected
+// size; in that case, the caller should fall back to running the emulated
+// decompressor, which may be more tolerant of malformed data.
+
+// The system ncmps 0 and 2 are PowerPC builds of the same algorithms as dcmps 0
+// and 2, so decompress_dcmp0 and decompress_dcmp2 also serve as native
+// implementations of those.
+
+// dcmp 0 and 1 use the same general scheme (literals, references to earlier
+// literals, a table of common values, and some special encodings for 68K jump
+// tables and sequences of numbers), but dcmp 0 works with 16-bit words while
+// dcmp 1 works with bytes.
+std::string decompress_dcmp0(const void* data, size_t size,
+    size_t decompressed_size);
+std::string decompress_dcmp1(const void* data, size_t size,
+    size_t decompressed_size);
+
+// dcmp 2 encodes each 16-bit word as a single byte indexing a table of common
+// words. The table may be replaced by a custom table in the compressed data,
+// and literal words may be mixed in via tag bytes; both of these are controlled
+// by parameters in the compressed resource header.
+std::string decompress_dcmp2(const void* data, size_t size,
+    size_t decompressed_size, uint8_t custom_table_size, uint8_t flags);
@@ -0,0 +1,475 @@
+#include "TrapHandlers.hh"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <phosg/Strings.hh>
+
+#include "TrapInfo.hh"
+
+using namespace std;
+
+
+
+// Memory Manager result codes
+static const int16_t noErr = 0;
+static const int16_t memFullErr = -108;
+static const int16_t nilHandleErr = -109;
+static const int16_t memWZErr = -111;
+static const int16_t memLockedErr = -117;
+
+// Handle state bits, as used by HGetState and HSetState
+static const uint8_t HANDLE_STATE_LOCKED = 0x80;
+static const uint8_t HANDLE_STATE_PURGEABLE = 0x40;
+static const uint8_t HANDLE_STATE_RESOURCE = 0x20;
+
+// MemErr is only updated if the low-memory globals are present
+static const uint32_t MEM_ERR_ADDR = 0x0220;
+
+// What FreeMem, MaxMem, etc. report. Guest memory isn't really limited this
+// way, but some code checks these before allocating.
+static const uint32_t REPORTED_FREE_MEMORY = 0x00800000;
+
+static const size_t NUM_TRAP_NUMBERS = 0xC00;
+
+
+
+TrapHandlers::TrapHandlers(shared_ptr<MemoryContext> mem, bool verbose)
+  : mem(mem),
+    verbose(verbose),
+    handlers(NUM_TRAP_NUMBERS) { }
+
+TrapHandlers::~TrapHandlers() {
+  for (const auto& it : this->ptrs) {
+    this->mem->free(it.first);
+  }
+  for (const auto& it : this->handles) {
+    if (it.second.data_addr) {
+      this->mem->free(it.second.data_addr);
+    }
+    this->mem->free(it.first);
+  }
+}
+
+uint16_t TrapHandlers::trap_number_for_opcode(uint16_t opcode) {
+  // toolbox traps have a 10-bit trap number (plus 0x800, as in TrapInfo.cc);
+  // os traps have an 8-bit trap number, and the bits above it are flags
+  return (opcode & 0x0800) ? (opcode & 0x0BFF) : (opcode & 0x00FF);
+}
+
+void TrapHandlers::set_handler(uint16_t trap_number, HandlerFn fn) {
+  this->handlers.at(trap_number) = fn;
+}
+
+bool TrapHandlers::handle(M68KEmulator& emu, M68KRegisters& regs,
+    uint16_t opcode) {
+  uint16_t trap_number = trap_number_for_opcode(opcode);
+  const auto& fn = this->handlers[trap_number];
+  if (!fn) {
+    return false;
+  }
+  fn(emu, regs, opcode);
+  if (this->verbose) {
+    const TrapInfo* info = info_for_68k_trap(trap_number, (opcode >> 9) & 3);
+    fprintf(stderr, "trap %04hX (%s): D0=%08" PRIX32 " A0=%08" PRIX32 "\n",
+        opcode, info ? info->name : "unknown", regs.d[0].u, regs.a[0]);
+  }
+  return true;
+}
+
+void TrapHandlers::set_result(M68KRegisters& regs, int16_t result) {
+  // the trap dispatcher returns OS trap results sign-extended in D0 and sets
+  // the condition codes from them, so callers can branch on the result
+  // directly after the trap
+  regs.d[0].s = result;
+  regs.set_ccr_flags(-1, result < 0, result == 0, 0, 0);
+  if (this->mem->exists(MEM_ERR_ADDR, 2)) {
+    this->mem->write_s16(MEM_ERR_ADDR, result);
+  }
+}
+
+void TrapHandlers::check_range(uint32_t addr, uint32_t size) const {
+  if (!this->mem->exists(addr, size)) {
+    throw out_of_range(string_printf(
+        "trap accesses unallocated memory at %08" PRIX32 ":%" PRIX32, addr, size));
+  }
+}
+
+uint32_t TrapHandlers::allocate_block(uint32_t size, uint32_t& capacity) {
+  // MemoryContext rounds sizes up the same way
+  capacity = size ? ((size + 0x0F) & (~0x0F)) : 0x10;
+  uint32_t addr = this->mem->allocate(size);
+  if (addr) {
+    // small blocks are recycled, so they may contain data from earlier
+    // allocations
+    this->mem->zero(addr, capacity);
+  }
+  return addr;
+}
+
+int16_t TrapHandlers::new_ptr(uint32_t& ptr, uint32_t size) {
+  uint32_t capacity;
+  ptr = this->allocate_block(size, capacity);
+  if (!ptr) {
+    return memFullErr;
+  }
+  this->ptrs.emplace(ptr, PtrBlock{size, capacity});
+  return noErr;
+}
+
+int16_t TrapHandlers::dispose_ptr(uint32_t ptr) {
+  if (!this->ptrs.erase(ptr)) {
+    return memWZErr;
+  }
+  this->mem->free(ptr);
+  return noErr;
+}
+
+int16_t TrapHandlers::set_ptr_size(uint32_t ptr, uint32_t size) {
+  // nonrelocatable blocks can't move, so they can only grow into the padding
+  // at the end of the allocated block. the padding is always zero, since
+  // shrinking a block clears the part that was removed
+  auto it = this->ptrs.find(ptr);
+  if (it == this->ptrs.end()) {
+    return memWZErr;
+  }
+  if (size > it->second.capacity) {
+    return memFullErr;
+  }
+  if (size < it->second.size) {
+    this->mem->zero(ptr + size, it->second.size - size);
+  }
+  it->second.size = size;
+  return noErr;
+}
+
+int16_t TrapHandlers::new_handle(uint32_t& handle, uint32_t size, bool empty) {
+  handle = this->mem->allocate(4);
+  if (!handle) {
+    return memFullErr;
+  }
+  uint32_t data_addr = 0;
+  uint32_t capacity = 0;
+  if (!empty) {
+    data_addr = this->allocate_block(size, capacity);
+    if (!data_addr) {
+      this->mem->free(handle);
+      handle = 0;
+      return memFullErr;
+    }
+    this->handle_for_data_addr.emplace(data_addr, handle);
+  }
+  this->mem->write_u32(handle, data_addr);
+  this->handles.emplace(handle, HandleBlock{data_addr, empty ? 0 : size, capacity, 0});
+  return noErr;
+}
+
+TrapHandlers::HandleBlock* TrapHandlers::handle_block(uint32_t handle) {
+  auto it = this->handles.find(handle);
+  return (it == this->handles.end()) ? nullptr : &it->second;
+}
+
+int16_t TrapHandlers::dispose_handle(uint32_t handle) {
+  HandleBlock* block = this->handle_block(handle);
+  if (!block) {
+    return handle ? memWZErr : nilHandleErr;
+  }
+  if (block->data_addr) {
+    this->handle_for_data_addr.erase(block->data_addr);
+    this->mem->free(block->data_addr);
+  }
+  this->handles.erase(handle);
+  this->mem->free(handle);
+  return noErr;
+}
+
+int16_t TrapHandlers::set_handle_size(uint32_t handle, uint32_t size,
+    bool keep_data) {
+  // relocatable blocks are resized in place if they fit in the allocated
+  // block, and moved otherwise (unless they're locked). if keep_data is false,
+  // the contents are discarded, as for ReallocHandle
+  HandleBlock* block = this->handle_block(handle);
+  if (!block) {
+    return handle ? memWZErr : nilHandleErr;
+  }
+  if (keep_data && !block->data_addr) {
+    return nilHandleErr;
+  }
+
+  if (block->data_addr && (size <= block->capacity)) {
+    if (!keep_data) {
+      this->mem->zero(block->data_addr, block->size);
+    } else if (size < block->size) {
+      this->mem->zero(block->data_addr + size, block->size - size);
+    }
+    block->size = size;
+    return noErr;
+  }
+  if (block->state & HANDLE_STATE_LOCKED) {
+    return memFullErr;
+  }
+
+  uint32_t capacity;
+  uint32_t new_data_addr = this->allocate_block(size, capacity);
+  if (!new_data_addr) {
+    return memFullErr;
+  }
+  if (block->data_addr) {
+    if (keep_data) {
+      uint32_t copy_size = min<uint32_t>(size, block->size);
+      if (copy_size) {
+        this->check_range(block->data_addr, copy_size);
+        memcpy(this->mem->at(new_data_addr, copy_size),
+            this->mem->at(block->data_addr, copy_size), copy_size);
+      }
+    }
+    this->handle_for_data_addr.erase(block->data_addr);
+    this->mem->free(block->data_addr);
+  }
+  block->data_addr = new_data_addr;
+  block->size = size;
+  block->capacity = capacity;
+  this->handle_for_data_addr.emplace(new_data_addr, handle);
+  this->mem->write_u32(handle, new_data_addr);
+  return noErr;
+}
+
+int16_t TrapHandlers::empty_handle(uint32_t handle) {
+  HandleBlock* block = this->handle_block(handle);
+  if (!block) {
+    return handle ? memWZErr : nilHandleErr;
+  }
+  if (block->state & HANDLE_STATE_LOCKED) {
+    return memLockedErr;
+  }
+  if (block->data_addr) {
+    this->handle_for_data_addr.erase(block->data_addr);
+    this->mem->free(block->data_addr);
+    block->data_addr = 0;
+    block->size = 0;
+    block->capacity = 0;
+  }
+  this->mem->write_u32(handle, 0);
+  return noErr;
+}
+
+void TrapHandlers::add_memory_manager_handlers() {
+  // all of these are register-based, including the Toolbox ones at the end.
+  // sizes are in D0, pointers and handles are in A0 (and A1 for a second
+  // argument), and results are returned in D0 and A0
+
+  auto set_state_handler = [this](uint8_t clear_bits, uint8_t set_bits) -> HandlerFn {
+    return [this, clear_bits, set_bits](M68KEmulator&, M68KRegisters& regs, uint16_t) {
+      HandleBlock* block = this->handle_block(regs.a[0]);
+      if (!block) {
+        this->set_result(regs, regs.a[0] ? memWZErr : nilHandleErr);
+      } else {
+        block->state = (block->state & ~clear_bits) | set_bits;
+        this->set_result(regs, noErr);
+      }
+    };
+  };
+  auto report_free_memory = [](M68KEmulator&, M68KRegisters& regs, uint16_t) {
+    regs.d[0].u = REPORTED_FREE_MEMORY;
+  };
+  auto succeed = [this](M68KEmulator&, M68KRegisters& regs, uint16_t) {
+    this->set_result(regs, noErr);
+  };
+
+  this->set_handler(0x001C, report_free_memory); // FreeMem
+  this->set_handler(0x001D, [](M68KEmulator&, M68KRegisters& regs, uint16_t) { // MaxMem
+    regs.d[0].u = REPORTED_FREE_MEMORY;
+    regs.a[0] = 0; // grow
+  });
+  this->set_handler(0x001E, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // NewPtr
+    this->set_result(regs, this->new_ptr(regs.a[0], regs.d[0].u));
+  });
+  this->set_handler(0x001F, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // DisposePtr
+    this->set_result(regs, this->dispose_ptr(regs.a[0]));
+  });
+  this->set_handler(0x0020, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // SetPtrSize
+    this->set_result(regs, this->set_ptr_size(regs.a[0], regs.d[0].u));
+  });
+  this->set_handler(0x0021, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // GetPtrSize
+    auto it = this->ptrs.find(regs.a[0]);
+    if (it == this->ptrs.end()) {
+      this->set_result(regs, memWZErr);
+    } else {
+      this->set_result(regs, noErr);
+      regs.d[0].u = it->second.size;
+    }
+  });
+  this->set_handler(0x0022, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // NewHandle
+    this->set_result(regs, this->new_handle(regs.a[0], regs.d[0].u, false));
+  });
+  this->set_handler(0x0023, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // DisposeHandle
+    this->set_result(regs, this->dispose_handle(regs.a[0]));
+  });
+  this->set_handler(0x0024, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // SetHandleSize
+    this->set_result(regs, this->set_handle_size(regs.a[0], regs.d[0].u, true));
+  });
+  this->set_handler(0x0025, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // GetHandleSize
+    HandleBlock* block = this->handle_block(regs.a[0]);
+    if (!block) {
+      this->set_result(regs, regs.a[0] ? memWZErr : nilHandleErr);
+    } else {
+      this->set_result(regs, block->data_addr ? noErr : nilHandleErr);
+      regs.d[0].u = block->size;
+    }
+  });
+  this->set_handler(0x0027, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // ReallocHandle
+    this->set_result(regs, this->set_handle_size(regs.a[0], regs.d[0].u, false));
+  });
+  this->set_handler(0x0028, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // RecoverHandle
+    // this doesn't change D0, but it does set MemErr
+    uint32_t d0 = regs.d[0].u;
+    auto it = this->handle_for_data_addr.find(regs.a[0]);
+    if (it == this->handle_for_data_addr.end()) {
+      this->set_result(regs, memWZErr);
+      regs.a[0] = 0;
+    } else {
+      this->set_result(regs, noErr);
+      regs.a[0] = it->second;
+    }
+    regs.d[0].u = d0;
+  });
+  this->set_handler(0x0029, set_state_handler(0, HANDLE_STATE_LOCKED)); // HLock
+  this->set_handler(0x002A, set_state_handler(HANDLE_STATE_LOCKED, 0)); // HUnlock
+  this->set_handler(0x002B, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // EmptyHandle
+    this->set_result(regs, this->empty_handle(regs.a[0]));
+  });
+  this->set_handler(0x002E, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // BlockMove
+    // BlockMove(a0=src, a1=dest, d0=size); BlockMoveData is the same trap
+    // with a flag bit set
+    uint32_t size = regs.d[0].u;
+    if (size) {
+      this->check_range(regs.a[0], size);
+      this->check_range(regs.a[1], size);
+      memmove(this->mem->at(regs.a[1], size), this->mem->at(regs.a[0], size), size);
+    }
+    this->set_result(regs, noErr);
+  });
+  this->set_handler(0x0040, succeed); // ResrvMem
+  this->set_handler(0x0049, set_state_handler(0, HANDLE_STATE_PURGEABLE)); // HPurge
+  this->set_handler(0x004A, set_state_handler(HANDLE_STATE_PURGEABLE, 0)); // HNoPurge
+  this->set_handler(0x004C, report_free_memory); // CompactMem
+  this->set_handler(0x004D, succeed); // PurgeMem
+  this->set_handler(0x0061, report_free_memory); // MaxBlock
+  this->set_handler(0x0062, [](M68KEmulator&, M68KRegisters& regs, uint16_t) { // PurgeSpace
+    regs.d[0].u = REPORTED_FREE_MEMORY; // total
+    regs.a[0] = REPORTED_FREE_MEMORY; // contiguous
+  });
+  this->set_handler(0x0063, succeed); // MaxApplZone
+  this->set_handler(0x0064, succeed); // MoveHHi
+  this->set_handler(0x0066, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // NewEmptyHandle
+    this->set_result(regs, this->new_handle(regs.a[0], 0, true));
+  });
+  this->set_handler(0x0067, set_state_handler(0, HANDLE_STATE_RESOURCE)); // HSetRBit
+  this->set_handler(0x0068, set_state_handler(HANDLE_STATE_RESOURCE, 0)); // HClrRBit
+  this->set_handler(0x0069, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // HGetState
+    HandleBlock* block = this->handle_block(regs.a[0]);
+    if (!block) {
+      this->set_result(regs, regs.a[0] ? memWZErr : nilHandleErr);
+    } else {
+      this->set_result(regs, noErr);
+      regs.d[0].u = block->state;
+    }
+  });
+  this->set_handler(0x006A, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // HSetState
+    HandleBlock* block = this->handle_block(regs.a[0]);
+    if (!block) {
+      this->set_result(regs, regs.a[0] ? memWZErr : nilHandleErr);
+    } else {
+      block->state = regs.d[0].u & (HANDLE_STATE_LOCKED | HANDLE_STATE_PURGEABLE | HANDLE_STATE_RESOURCE);
+      this->set_result(regs, noErr);
+    }
+  });
+
+  this->set_handler(0x09E1, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // HandToHand
+    HandleBlock* block = this->handle_block(regs.a[0]);
+    if (!block || !block->data_addr) {
+      this->set_result(regs, block ? nilHandleErr : memWZErr);
+      return;
+    }
+    uint32_t src_addr = block->data_addr;
+    uint32_t size = block->size;
+    this->check_range(src_addr, size);
+    uint32_t new_handle;
+    int16_t result = this->new_handle(new_handle, size, false);
+    if (result == noErr) {
+      if (size) {
+        memcpy(this->mem->at(this->handles.at(new_handle).data_addr, size),
+            this->mem->at(src_addr, size), size);
+      }
+      regs.a[0] = new_handle;
+    }
+    this->set_result(regs, result);
+  });
+  this->set_handler(0x09E2, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // PtrToXHand
+    uint32_t src_addr = regs.a[0];
+    uint32_t size = regs.d[0].u;
+    this->check_range(src_addr, size);
+    int16_t result = this->set_handle_size(regs.a[1], size, false);
+    if ((result == noErr) && size) {
+      memcpy(this->mem->at(this->handles.at(regs.a[1]).data_addr, size),
+          this->mem->at(src_addr, size), size);
+    }
+    regs.a[0] = regs.a[1];
+    this->set_result(regs, result);
+  });
+  this->set_handler(0x09E3, [this](M68KEmulator&, M68KRegisters& regs, uint16_t) { // PtrToHand
+    uint32_t src_addr = regs.a[0];
+    uint32_t size = regs.d[0].u;
+    this->check_range(src_addr, size);
+    uint32_t new_handle;
+    int16_t result = this->new_handle(new_handle, size, false);
+    if (result == noErr) {
+      if (size) {
+        memcpy(this->mem->at(this->handles.at(new_handle).data_addr, size),
+            this->mem->at(src_addr, size), size);
+      }
+      regs.a[0] = new_handle;
+    } else {
+      regs.a[0] = 0;
+    }
+    this->set_result(regs, result);
+  });
+
+  // HandAndHand(a0=src handle, a1=dest handle) and PtrAndHand(a0=src ptr,
+  // a1=dest handle, d0=size) both append data to the dest handle
+  auto append_to_handle = [this](M68KRegisters& regs, uint32_t src_addr,
+      uint32_t size) {
+    HandleBlock* block = this->handle_block(regs.a[1]);
+    int16_t result;
+    if (!block || !block->data_addr) {
+      result = block ? nilHandleErr : memWZErr;
+    } else {
+      uint32_t offset = block->size;
+      // the source may be part of the dest handle's data, which moves when it
+      // is resized
+      string data;
+      if (size) {
+        this->check_range(src_addr, size);
+        data.assign(reinterpret_cast<const char*>(this->mem->at(src_addr, size)), size);
+      }
+      result = this->set_handle_size(regs.a[1], offset + size, true);
+      if ((result == noErr) && size) {
+        memcpy(this->mem->at(block->data_addr + offset, size), data.data(), size);
+      }
+    }
+    regs.a[0] = regs.a[1];
+    this->set_result(regs, result);
+  };
+  this->set_handler(0x09E4, [this, append_to_handle](M68KEmulator&, M68KRegisters& regs, uint16_t) { // HandAndHand
+    HandleBlock* block = this->handle_block(regs.a[0]);
+    if (!block || !block->data_addr) {
+      this->set_result(regs, block ? nilHandleErr : memWZErr);
+      return;
+    }
+    append_to_handle(regs, block->data_addr, block->size);
+  });
+  this->set_handler(0x09EF, [append_to_handle](M68KEmulator&, M68KRegisters& regs, uint16_t) { // PtrAndHand
+    append_to_handle(regs, regs.a[0], regs.d[0].u);
+  });
+}
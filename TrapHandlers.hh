@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "M68KEmulator.hh"
+#include "MemoryContext.hh"
+
+
+// Native implementations of Mac OS and Toolbox traps, for 68K code running in
+// an emulator. Handlers are keyed on trap numbers as in TrapInfo.cc: OS traps
+// are 0x000-0x0FF and Toolbox traps are 0x800-0xBFF, so the flag bits in the
+// A-line opcode aren't part of the trap number. Traps that have no handler are
+// skipped, as if they returned immediately.
+//
+// add_memory_manager_handlers() registers the Memory Manager traps that
+// decompressors and code resources commonly use (NewPtr, NewHandle, HLock,
+// BlockMove, and similar). These run directly on the MemoryContext; handles
+// are master pointers in guest memory that point to blocks allocated from the
+// same context, so guest code can dereference them as usual. Blocks are
+// always zero-filled when allocated, whether or not the trap asks for it.
+// Blocks still allocated when this object is destroyed are freed then.
+class TrapHandlers {
+public:
+  // The handler is called with the full A-line opcode, so it can check the
+  // trap's flag bits if needed.
+  using HandlerFn = std::function<void(M68KEmulator& emu, M68KRegisters& regs,
+      uint16_t opcode)>;
+
+  explicit TrapHandlers(std::shared_ptr<MemoryContext> mem, bool verbose = false);
+  TrapHandlers(const TrapHandlers&) = delete;
+  TrapHandlers& operator=(const TrapHandlers&) = delete;
+  ~TrapHandlers();
+
+  static uint16_t trap_number_for_opcode(uint16_t opcode);
+
+  // Replaces any existing handler for the trap. Passing nullptr removes it.
+  void set_handler(uint16_t trap_number, HandlerFn fn);
+  void add_memory_manager_handlers();
+
+  // Calls the handler for an A-line opcode. Returns false if there's no
+  // handler for the trap.
+  bool handle(M68KEmulator& emu, M68KRegisters& regs, uint16_t opcode);
+
+private:
+  struct PtrBlock {
+    uint32_t size;
+    // Blocks can be resized in place up to this size (the allocated size,
+    // which is rounded up)
+    uint32_t capacity;
+  };
+  struct HandleBlock {
+    uint32_t data_addr; // 0 if the handle is empty
+    uint32_t size;
+    uint32_t capacity;
+    uint8_t state; // as returned by HGetState
+  };
+
+  // These return Memory Manager result codes (0 = noErr)
+  int16_t new_ptr(uint32_t& ptr, uint32_t size);
+  int16_t dispose_ptr(uint32_t ptr);
+  int16_t set_ptr_size(uint32_t ptr, uint32_t size);
+  int16_t new_handle(uint32_t& handle, uint32_t size, bool empty);
+  int16_t dispose_handle(uint32_t handle);
+  int16_t set_handle_size(uint32_t handle, uint32_t size, bool keep_data);
+  int16_t empty_handle(uint32_t handle);
+  HandleBlock* handle_block(uint32_t handle);
+  // Throws out_of_range if any of the range isn't allocated guest memory.
+  // Ranges from guest registers are checked with this before they're
+  // accessed directly (through mem->at) by any of the handlers.
+  void check_range(uint32_t addr, uint32_t size) const;
+  uint32_t allocate_block(uint32_t size, uint32_t& capacity);
+  void set_result(M68KRegisters& regs, int16_t result);
+
+  std::shared_ptr<MemoryContext> mem;
+  bool verbose;
+  std::vector<HandlerFn> handlers;
+
+  // Blocks allocated by NewPtr, and handles (master pointer address -> block)
+  std::unordered_map<uint32_t, PtrBlock> ptrs;
+  std::unordered_map<uint32_t, HandleBlock> handles;
+  std::unordered_map<uint32_t, uint32_t> handle_for_data_addr;
+};
@@ -0,0 +1,190 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Time.hh>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MemoryContext.hh"
+#include "ResourceFile.hh"
+
+using namespace std;
+
+
+
+// Allocates and frees blocks of random sizes, as emulated code that calls
+// NewPtr and DisposePtr (or NewHandle and DisposeHandle) heavily would. Most
+// blocks are small; a few are large enough to get their own pages.
+static void benchmark_memory(size_t num_operations, size_t max_live_blocks) {
+  MemoryContext mem;
+  mt19937 rng(1);
+  vector<uint32_t> live_blocks;
+  live_blocks.reserve(max_live_blocks);
+
+  uint64_t start = now();
+  for (size_t x = 0; x < num_operations; x++) {
+    if (live_blocks.empty() ||
+        ((live_blocks.size() < max_live_blocks) && (rng() % 3))) {
+      size_t size = (rng() % 16) ? (8 + rng() % 0x100) : (0x1000 + rng() % 0x10000);
+      live_blocks.emplace_back(mem.allocate(size));
+    } else {
+      size_t index = rng() % live_blocks.size();
+      mem.free(live_blocks[index]);
+      live_blocks[index] = live_blocks.back();
+      live_blocks.pop_back();
+    }
+  }
+  uint64_t elapsed = now() - start;
+
+  fprintf(stdout, "%zu allocate/free operations in %" PRIu64 " usecs (%g nsecs/operation)\n",
+      num_operations, elapsed, static_cast<double>(elapsed * 1000) / num_operations);
+}
+
+// Decompresses every compressed resource in the files with the emulated
+// decompressors (never the native implementations), num_iterations times.
+// get_resource keeps the result, so each iteration uses new ResourceFiles, but
+// only the decompression itself is timed.
+static void benchmark_decompression(const vector<string>& filenames,
+    bool use_data_fork, size_t num_iterations, uint64_t decompress_flags) {
+  vector<vector<ResourceFile::Resource>> compressed_resources;
+  size_t num_resources = 0;
+  for (const auto& filename : filenames) {
+    string resource_fork_filename = use_data_fork
+        ? filename : (filename + "/..namedfork/rsrc");
+    ResourceFile rf(resource_fork_filename.c_str());
+    auto& resources = compressed_resources.emplace_back();
+    for (const auto& it : rf.all_resources()) {
+      const auto& res = rf.get_resource(it.first, it.second,
+          DecompressionFlag::DISABLED);
+      if (res.flags & ResourceFlag::FLAG_COMPRESSED) {
+        resources.emplace_back(res);
+      }
+    }
+    num_resources += resources.size();
+  }
+  if (!num_resources) {
+    throw runtime_error("no compressed resources found");
+  }
+
+  decompress_flags |= DecompressionFlag::SKIP_NATIVE;
+  uint64_t elapsed = 0;
+  size_t num_bytes = 0;
+  size_t num_failures = 0;
+  for (size_t x = 0; x < num_iterations; x++) {
+    for (const auto& resources : compressed_resources) {
+      ResourceFile rf(resources);
+      uint64_t start = now();
+      for (const auto& res : resources) {
+        const auto& decompressed_res = rf.get_resource(res.type, res.id,
+            decompress_flags);
+        if (decompressed_res.flags & ResourceFlag::FLAG_DECOMPRESSION_FAILED) {
+          num_failures++;
+        } else {
+          num_bytes += decompressed_res.data.size();
+        }
+      }
+      elapsed += now() - start;
+    }
+  }
+
+  fprintf(stdout, "%zu resources decompressed %zu times (%zu bytes) in %" PRIu64 " usecs (%g usecs/resource)\n",
+      num_resources, num_iterations, num_bytes, elapsed,
+      static_cast<double>(elapsed) / (num_resources * num_iterations));
+  if (num_failures) {
+    fprintf(stdout, "warning: %zu decompressions failed\n", num_failures);
+  }
+}
+
+void print_usage(const char* argv0) {
+  fprintf(stderr, "\
+Usage: %s [options] filename [filename...]\n\
+       %s [options] --memory\n\
+\n\
+Measures how long common emulator operations take, for comparing builds.\n\
+\n\
+Given filenames, decompresses every compressed resource in the files'\n\
+resource forks with the emulated decompressors (never the native\n\
+implementations of the system decompressors), and prints the total time and\n\
+the average time per resource. Failed decompressions are counted, but aren't\n\
+included in the total size.\n\
+\n\
+With --memory, allocates and frees blocks of random sizes in a MemoryContext,\n\
+as emulated code that uses the Memory Manager heavily would, and prints the\n\
+average time per operation. The sequence of operations is the same every time.\n\
+\n\
+Options:\n\
+  --data-fork\n\
+      Read resources from the files' data forks instead of their resource\n\
+      forks.\n\
+  --iterations=N\n\
+      Decompress each resource N times. The default is 10.\n\
+  --skip-file-dcmp\n\
+  --skip-file-ncmp\n\
+  --skip-system-dcmp\n\
+  --skip-system-ncmp\n\
+      Don't use the 68K (dcmp) or PowerPC (ncmp) decompressors from the files\n\
+      or from the system, as for resource_dasm. For example, to time only the\n\
+      PowerPC decompressors, use --skip-file-dcmp and --skip-system-dcmp.\n\
+  --operations=N\n\
+      Run N allocate/free operations. The default is 10000000.\n\
+  --live-blocks=N\n\
+      Keep at most N blocks allocated at once. The default is 2000.\n\
+\n", argv0, argv0);
+}
+
+int main(int argc, char* argv[]) {
+  vector<string> filenames;
+  bool use_data_fork = false;
+  size_t num_iterations = 10;
+  uint64_t decompress_flags = 0;
+  bool memory = false;
+  size_t num_operations = 10000000;
+  size_t max_live_blocks = 2000;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--data-fork")) {
+      use_data_fork = true;
+    } else if (!strncmp(argv[x], "--iterations=", 13)) {
+      num_iterations = strtoull(&argv[x][13], NULL, 0);
+    } else if (!strcmp(argv[x], "--skip-file-dcmp")) {
+      decompress_flags |= DecompressionFlag::SKIP_FILE_DCMP;
+    } else if (!strcmp(argv[x], "--skip-file-ncmp")) {
+      decompress_flags |= DecompressionFlag::SKIP_FILE_NCMP;
+    } else if (!strcmp(argv[x], "--skip-system-dcmp")) {
+      decompress_flags |= DecompressionFlag::SKIP_SYSTEM_DCMP;
+    } else if (!strcmp(argv[x], "--skip-system-ncmp")) {
+      decompress_flags |= DecompressionFlag::SKIP_SYSTEM_NCMP;
+    } else if (!strcmp(argv[x], "--memory")) {
+      memory = true;
+    } else if (!strncmp(argv[x], "--operations=", 13)) {
+      num_operations = strtoull(&argv[x][13], NULL, 0);
+    } else if (!strncmp(argv[x], "--live-blocks=", 14)) {
+      max_live_blocks = strtoull(&argv[x][14], NULL, 0);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage(argv[0]);
+      return 2;
+    } else {
+      filenames.emplace_back(argv[x]);
+    }
+  }
+
+  if (memory) {
+    if (!filenames.empty() || !num_operations || !max_live_blocks) {
+      print_usage(argv[0]);
+      return 2;
+    }
+    benchmark_memory(num_operations, max_live_blocks);
+  } else {
+    if (filenames.empty() || !num_iterations) {
+      print_usage(argv[0]);
+      return 2;
+    }
+    benchmark_decompression(filenames, use_data_fork, num_iterations,
+        decompress_flags);
+  }
+  return 0;
+}
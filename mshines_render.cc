@@ -217,7 +217,8 @@ int main(int argc, char** argv) {
   const string filename = argv[1];
   const string out_prefix = (argc < 3) ? filename : argv[2];
 
-  ResourceFile rf(filename + "/..namedfork/rsrc");
+  const string rsrc_filename = filename + "/..namedfork/rsrc";
+  ResourceFile rf(rsrc_filename.c_str());
   const uint32_t room_type = 0x506C766C; // Plvl
   auto room_resource_ids = rf.all_resources_of_type(room_type);
   auto sprites_pict = rf.decode_PICT(130); // hardcoded ID for all worlds
@@ -6,12 +6,19 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/JSON.hh>
 #include <phosg/Strings.hh>
+#include <stdarg.h>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -23,6 +30,246 @@ using namespace std;
 
 
 
+// When exporting on multiple threads, each job's log messages are collected in
+// its log buffer instead of going directly to stderr, so they can be printed
+// in the same order as they would be in a serial run.
+static thread_local string* log_buffer = nullptr;
+
+__attribute__((format(printf, 1, 2)))
+static void print_log(const char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  if (log_buffer) {
+    *log_buffer += string_vprintf(fmt, va);
+  } else {
+    vfprintf(stderr, fmt, va);
+  }
+  va_end(va);
+}
+
+// Calls fn(0) through fn(count - 1) on up to num_threads threads. Each call's
+// log output is printed in index order as soon as it and all the calls before
+// it are done. If any call throws, no more calls are started, and the
+// exception is rethrown after the preceding calls' logs have been printed.
+static void run_ordered_parallel(size_t count, size_t num_threads,
+    const function<void(size_t)>& fn) {
+  struct JobResult {
+    bool done;
+    string log;
+    exception_ptr exc;
+  };
+  vector<JobResult> results(count);
+  mutex results_lock;
+  condition_variable results_cv;
+  atomic<size_t> next_index(0);
+  atomic<bool> should_stop(false);
+
+  auto thread_fn = [&]() {
+    for (;;) {
+      size_t index = next_index++;
+      if (index >= count || should_stop) {
+        break;
+      }
+      string log;
+      exception_ptr exc;
+      log_buffer = &log;
+      try {
+        fn(index);
+      } catch (...) {
+        exc = current_exception();
+        should_stop = true;
+      }
+      log_buffer = nullptr;
+
+      lock_guard<mutex> g(results_lock);
+      auto& result = results[index];
+      result.done = true;
+      result.log = move(log);
+      result.exc = exc;
+      results_cv.notify_all();
+    }
+  };
+
+  vector<thread> threads;
+  num_threads = min<size_t>(num_threads, count);
+  for (size_t x = 0; x < num_threads; x++) {
+    threads.emplace_back(thread_fn);
+  }
+
+  exception_ptr exc;
+  for (size_t x = 0; x < count; x++) {
+    unique_lock<mutex> g(results_lock);
+    results_cv.wait(g, [&]() { return results[x].done; });
+    print_log("%s", results[x].log.c_str());
+    results[x].log.clear();
+    if (results[x].exc) {
+      exc = results[x].exc;
+      break;
+    }
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (exc) {
+    rethrow_exception(exc);
+  }
+}
+
+// A thread pool where each worker has its own job queue. Jobs submitted from a
+// worker go on that worker's queue, which it runs newest-first; idle workers
+// steal the oldest jobs from other workers' queues. If too many jobs are
+// already queued, submit() runs the job immediately on the calling thread
+// instead, which keeps memory bounded even when jobs submit many more jobs.
+class WorkStealingPool {
+public:
+  WorkStealingPool(size_t num_threads, size_t max_queued_jobs)
+    : max_queued_jobs(max_queued_jobs),
+      num_queued_jobs(0),
+      num_pending_jobs(0),
+      next_submit_index(0),
+      should_exit(false) {
+    if (num_threads == 0) {
+      throw invalid_argument("thread pool must have at least one thread");
+    }
+    for (size_t x = 0; x < num_threads; x++) {
+      this->queues.emplace_back(new JobQueue());
+    }
+    for (size_t x = 0; x < num_threads; x++) {
+      this->threads.emplace_back(&WorkStealingPool::thread_fn, this, x);
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  ~WorkStealingPool() {
+    {
+      lock_guard<mutex> g(this->state_lock);
+      this->should_exit = true;
+    }
+    this->work_available_cv.notify_all();
+    for (auto& t : this->threads) {
+      t.join();
+    }
+  }
+
+  void submit(function<void()>&& fn) {
+    if (this->num_queued_jobs >= this->max_queued_jobs) {
+      fn();
+      return;
+    }
+
+    // jobs submitted by a worker go on its own queue; others are distributed
+    // round-robin
+    size_t queue_index = (current_pool == this)
+        ? current_worker_index
+        : (this->next_submit_index++ % this->queues.size());
+    this->num_pending_jobs++;
+    {
+      lock_guard<mutex> g(this->state_lock);
+      this->num_queued_jobs++;
+    }
+    {
+      auto& q = *this->queues[queue_index];
+      lock_guard<mutex> g(q.lock);
+      q.jobs.emplace_back(move(fn));
+    }
+    this->work_available_cv.notify_one();
+  }
+
+  // Waits until all submitted jobs (including jobs submitted by other jobs)
+  // are done. This must not be called from a worker thread.
+  void wait() {
+    unique_lock<mutex> g(this->state_lock);
+    this->all_done_cv.wait(g, [&]() { return this->num_pending_jobs == 0; });
+  }
+
+private:
+  struct JobQueue {
+    mutex lock;
+    deque<function<void()>> jobs;
+  };
+
+  size_t max_queued_jobs;
+  vector<unique_ptr<JobQueue>> queues;
+  vector<thread> threads;
+
+  // num_queued_jobs is only modified while holding state_lock, so idle
+  // workers can't miss a wakeup
+  mutex state_lock;
+  condition_variable work_available_cv;
+  condition_variable all_done_cv;
+  atomic<size_t> num_queued_jobs;
+  atomic<size_t> num_pending_jobs;
+  atomic<size_t> next_submit_index;
+  bool should_exit;
+
+  static thread_local WorkStealingPool* current_pool;
+  static thread_local size_t current_worker_index;
+
+  bool take_job(size_t worker_index, function<void()>& fn) {
+    // try our own queue first (newest job), then steal from the others (oldest
+    // job), starting with the next worker so steals are spread out
+    for (size_t z = 0; z < this->queues.size(); z++) {
+      auto& q = *this->queues[(worker_index + z) % this->queues.size()];
+      lock_guard<mutex> g(q.lock);
+      if (q.jobs.empty()) {
+        continue;
+      }
+      if (z == 0) {
+        fn = move(q.jobs.back());
+        q.jobs.pop_back();
+      } else {
+        fn = move(q.jobs.front());
+        q.jobs.pop_front();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void thread_fn(size_t worker_index) {
+    current_pool = this;
+    current_worker_index = worker_index;
+
+    for (;;) {
+      {
+        unique_lock<mutex> g(this->state_lock);
+        this->work_available_cv.wait(g, [&]() {
+          return this->should_exit || (this->num_queued_jobs > 0);
+        });
+        if (this->num_queued_jobs == 0) {
+          return; // should_exit is set and there's no more work
+        }
+      }
+
+      // another worker may take the job we were woken up for (or it may not
+      // be in its queue yet); if so, try again
+      function<void()> fn;
+      if (!this->take_job(worker_index, fn)) {
+        continue;
+      }
+      {
+        lock_guard<mutex> g(this->state_lock);
+        this->num_queued_jobs--;
+      }
+
+      fn();
+
+      if (--this->num_pending_jobs == 0) {
+        lock_guard<mutex> g(this->state_lock);
+        this->all_done_cv.notify_all();
+      }
+    }
+  }
+};
+
+thread_local WorkStealingPool* WorkStealingPool::current_pool = nullptr;
+thread_local size_t WorkStealingPool::current_worker_index = 0;
+
+
+
 static string output_filename(const string& out_dir, const string& base_filename,
     const ResourceFile::Resource& res, const std::string& after) {
   if (base_filename.empty()) {
@@ -77,14 +324,14 @@ void write_decoded_file(const string& out_dir, const string& base_filename,
     const ResourceFile::Resource& res, const string& after, const string& data) {
   string filename = output_filename(out_dir, base_filename, res, after);
   save_file(filename.c_str(), data);
-  fprintf(stderr, "... %s\n", filename.c_str());
+  print_log("... %s\n", filename.c_str());
 }
 
 void write_decoded_image(const string& out_dir, const string& base_filename,
     const ResourceFile::Resource& res, const string& after, const Image& img) {
   string filename = output_filename(out_dir, base_filename, res, after);
   img.save(filename.c_str(), Image::WindowsBitmap);
-  fprintf(stderr, "... %s\n", filename.c_str());
+  print_log("... %s\n", filename.c_str());
 }
 
 void write_decoded_CURS(const string& out_dir, const string& base_filename,
@@ -503,7 +750,7 @@ void write_decoded_CODE(const string& out_dir, const string& base_filename,
         }
       }
     } catch (const exception& e) {
-      fprintf(stderr, "warning: cannot decode CODE 0 for export labels: %s\n", e.what());
+      print_log("warning: cannot decode CODE 0 for export labels: %s\n", e.what());
     }
 
     if (decoded.entry_offset < 0) {
@@ -618,7 +865,7 @@ void write_decoded_peff_file(const string& out_dir, const string& base_filename,
   string filename = output_filename(out_dir, base_filename, res, ".txt");
   auto f = fopen_unique(filename, "wt");
   peff.print(f.get());
-  fprintf(stderr, "... %s\n", filename.c_str());
+  print_log("... %s\n", filename.c_str());
 }
 
 void write_decoded_ncmp(const string& out_dir, const string& base_filename,
@@ -761,7 +1008,7 @@ string generate_json_for_SONG(const string& base_filename, ResourceFile& rf,
         }
 
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to get sound metadata for instrument %hu region %hhX-%hhX from snd/csnd/esnd %hu: %s\n",
+        print_log("warning: failed to get sound metadata for instrument %hu region %hhX-%hhX from snd/csnd/esnd %hu: %s\n",
             id, rgn.key_low, rgn.key_high, rgn.snd_id, e.what());
       }
 
@@ -804,7 +1051,7 @@ string generate_json_for_SONG(const string& base_filename, ResourceFile& rf,
       try {
         add_instrument(it.first, rf.decode_INST(it.second));
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to add instrument %hu from INST %hu: %s\n",
+        print_log("warning: failed to add instrument %hu from INST %hu: %s\n",
             it.first, it.second, e.what());
       }
     }
@@ -816,7 +1063,7 @@ string generate_json_for_SONG(const string& base_filename, ResourceFile& rf,
     try {
       add_instrument(id, rf.decode_INST(id));
     } catch (const exception& e) {
-      fprintf(stderr, "warning: failed to add instrument %hu: %s\n", id, e.what());
+      print_log("warning: failed to add instrument %hu: %s\n", id, e.what());
     }
   }
 
@@ -949,12 +1196,16 @@ public:
   ResourceExporter()
     : use_data_fork(false),
       save_raw(SaveRawBehavior::IfDecodeFails),
-      decompress_flags(0) { }
+      decompress_flags(0),
+      num_threads(1),
+      num_file_threads(1) { }
   ~ResourceExporter() = default;
 
   bool use_data_fork;
   SaveRawBehavior save_raw;
   uint64_t decompress_flags;
+  size_t num_threads;
+  size_t num_file_threads;
   unordered_set<uint32_t> target_types;
   unordered_set<int16_t> target_ids;
   unordered_set<string> target_names;
@@ -962,21 +1213,29 @@ public:
   bool export_resource(const string& base_filename, const string& out_dir,
       ResourceFile& rf, const ResourceFile::Resource& res) {
 
-    if (res.flags & ResourceFlag::FLAG_DECOMPRESSION_FAILED) {
+    if (res.flags & ResourceFlag::FLAG_DECOMPRESSION_LIMIT_EXCEEDED) {
       auto type_str = string_for_resource_type(res.type);
-      fprintf(stderr, "warning: failed to decompress resource %s:%d; saving compressed data\n",
+      print_log("warning: decompressor for resource %s:%d exceeded the decompression limits; saving compressed data\n",
+          type_str.c_str(), res.id);
+    } else if (res.flags & ResourceFlag::FLAG_DECOMPRESSION_FAILED) {
+      auto type_str = string_for_resource_type(res.type);
+      print_log("warning: failed to decompress resource %s:%d; saving compressed data\n",
           type_str.c_str(), res.id);
     }
 
     bool write_raw = (this->save_raw == SaveRawBehavior::Always);
 
     // decode if possible
-    resource_decode_fn decode_fn = type_to_decode_fn[res.type];
+    // note: this can be called on multiple threads, so don't use operator[]
+    // here (it would insert into the map if the type has no decoder)
+    auto decode_fn_it = type_to_decode_fn.find(res.type);
+    resource_decode_fn decode_fn = (decode_fn_it == type_to_decode_fn.end())
+        ? nullptr : decode_fn_it->second;
     if (!(res.flags & ResourceFlag::FLAG_COMPRESSED) && decode_fn) {
       try {
         decode_fn(out_dir, base_filename, rf, res);
       } catch (const runtime_error& e) {
-        fprintf(stderr, "warning: failed to decode resource: %s\n", e.what());
+        print_log("warning: failed to decode resource: %s\n", e.what());
 
         // write the raw version if decoding failed and we didn't write it already
         if (this->save_raw == SaveRawBehavior::IfDecodeFails) {
@@ -1007,9 +1266,9 @@ public:
         } else {
           save_file(out_filename, res.data);
         }
-        fprintf(stderr, "... %s\n", out_filename.c_str());
+        print_log("... %s\n", out_filename.c_str());
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to save raw data: %s\n", e.what());
+        print_log("warning: failed to save raw data: %s\n", e.what());
       }
     }
     return true;
@@ -1025,7 +1284,7 @@ public:
     } else if (isfile(filename + "/rsrc")) {
       resource_fork_filename = filename + "/rsrc";
     } else {
-      fprintf(stderr, "failed on %s: no resource fork present\n", filename.c_str());
+      print_log("failed on %s: no resource fork present\n", filename.c_str());
       return false;
     }
 
@@ -1037,41 +1296,61 @@ public:
     // get the resources from the file
     unique_ptr<ResourceFile> rf;
     try {
-      rf.reset(new ResourceFile(load_file(resource_fork_filename)));
+      rf.reset(new ResourceFile(resource_fork_filename.c_str(), true));
     } catch (const cannot_open_file&) {
-      fprintf(stderr, "failed on %s: no resource fork present\n", filename.c_str());
+      print_log("failed on %s: no resource fork present\n", filename.c_str());
       return false;
     } catch (const io_error& e) {
-      fprintf(stderr, "failed on %s: cannot read data\n", filename.c_str());
+      print_log("failed on %s: cannot read data\n", filename.c_str());
       return false;
     } catch (const runtime_error& e) {
-      fprintf(stderr, "failed on %s: corrupt resource index (%s)\n", filename.c_str(), e.what());
+      print_log("failed on %s: corrupt resource index (%s)\n", filename.c_str(), e.what());
       return false;
     } catch (const out_of_range& e) {
-      fprintf(stderr, "failed on %s: corrupt resource index\n", filename.c_str());
+      print_log("failed on %s: corrupt resource index\n", filename.c_str());
       return false;
     }
 
     bool ret = false;
     try {
-      auto resources = rf->all_resources();
-
+      vector<pair<uint32_t, int16_t>> resources;
       bool has_INST = false;
-      for (const auto& it : resources) {
+      for (const auto& it : rf->all_resources()) {
         if (!this->target_types.empty() && !this->target_types.count(it.first)) {
           continue;
         }
         if (!this->target_ids.empty() && !this->target_ids.count(it.second)) {
           continue;
         }
-        const auto& res = rf->get_resource(it.first, it.second, this->decompress_flags);
-        if (!this->target_names.empty() && !this->target_names.count(res.name)) {
+        if (!this->target_names.empty() &&
+            !this->target_names.count(rf->get_resource_name(it.first, it.second))) {
           continue;
         }
         if (it.first == RESOURCE_TYPE_INST) {
           has_INST = true;
         }
-        ret |= export_resource(base_filename.c_str(), out_dir.c_str(), *rf, res);
+        resources.emplace_back(it);
+      }
+
+      if (this->num_threads > 1) {
+        atomic<bool> any_exported(false);
+        run_ordered_parallel(resources.size(), this->num_threads, [&](size_t index) {
+          const auto& it = resources[index];
+          const auto& res = rf->get_resource(it.first, it.second, this->decompress_flags);
+          if (export_resource(base_filename.c_str(), out_dir.c_str(), *rf, res)) {
+            any_exported = true;
+          }
+          rf->release_resource(it.first, it.second);
+        });
+        ret = any_exported;
+      } else {
+        for (const auto& it : resources) {
+          const auto& res = rf->get_resource(it.first, it.second, this->decompress_flags);
+          ret |= export_resource(base_filename.c_str(), out_dir.c_str(), *rf, res);
+          // free the resource's data if it was copied out of the file, so
+          // memory use doesn't grow with the size of the file
+          rf->release_resource(it.first, it.second);
+        }
       }
 
       // special case: if we disassembled any INSTs and the save-raw behavior is
@@ -1088,29 +1367,29 @@ public:
         try {
           string json_data = generate_json_for_SONG(base_filename, *rf, NULL);
           save_file(json_filename.c_str(), json_data);
-          fprintf(stderr, "... %s\n", json_filename.c_str());
+          print_log("... %s\n", json_filename.c_str());
 
         } catch (const exception& e) {
-          fprintf(stderr, "failed to write smssynth env template %s: %s\n",
+          print_log("failed to write smssynth env template %s: %s\n",
               json_filename.c_str(), e.what());
         }
       }
 
     } catch (const exception& e) {
-      fprintf(stderr, "failed on %s: %s\n", filename.c_str(), e.what());
+      print_log("failed on %s: %s\n", filename.c_str(), e.what());
     }
     return ret;
   }
 
   bool disassemble_path(const string& filename, const string& out_dir) {
     if (isdir(filename)) {
-      fprintf(stderr, ">>> %s (directory)\n", filename.c_str());
+      print_log(">>> %s (directory)\n", filename.c_str());
 
       unordered_set<string> items;
       try {
         items = list_directory(filename);
       } catch (const runtime_error& e) {
-        fprintf(stderr, "warning: can\'t list directory: %s\n", e.what());
+        print_log("warning: can\'t list directory: %s\n", e.what());
         return false;
       }
 
@@ -1135,10 +1414,187 @@ public:
       return ret;
 
     } else {
-      fprintf(stderr, ">>> %s\n", filename.c_str());
+      print_log(">>> %s\n", filename.c_str());
       return disassemble_file(filename, out_dir);
     }
   }
+
+  // Same as disassemble_path, but files are disassembled (and directories are
+  // listed) on num_file_threads threads. The log is the same as it would be
+  // from disassemble_path, but each file's messages appear only after the file
+  // is done.
+  bool disassemble_path_parallel(const string& filename, const string& out_dir) {
+    WorkStealingPool pool(this->num_file_threads, this->num_file_threads * 64);
+    PathJob root(nullptr, filename, out_dir);
+    this->path_job_log_cursor.clear();
+    this->path_job_log_cursor.emplace_back(&root, SIZE_MAX);
+    pool.submit([this, &pool, &root]() {
+      this->run_path_job(pool, &root);
+    });
+    pool.wait();
+    return root.exported;
+  }
+
+private:
+  // A file or directory in a parallel traversal. Directories own their
+  // children's PathJobs, so the whole tree lives until the traversal is done.
+  struct PathJob {
+    PathJob* parent;
+    string filename;
+    string out_dir;
+
+    // These are protected by path_job_log_lock. children is only filled in
+    // before log_done is set, and is in the same order as disassemble_path
+    // would process the items.
+    string log;
+    bool log_done;
+    vector<unique_ptr<PathJob>> children;
+
+    // Directories only: the output directory to delete if nothing is exported
+    // from any file within it, and the number of children that aren't done
+    string sub_out_dir;
+    atomic<size_t> children_remaining;
+    atomic<bool> exported;
+
+    PathJob(PathJob* parent, const string& filename, const string& out_dir)
+      : parent(parent),
+        filename(filename),
+        out_dir(out_dir),
+        log_done(false),
+        children_remaining(0),
+        exported(false) { }
+  };
+
+  mutex path_job_log_lock;
+  // The next log to print is the last node's, or its next child's if its own
+  // log was already printed (this is a depth-first traversal of the PathJob
+  // tree). The second field is the index of the next child to visit, or
+  // SIZE_MAX if the node's own log hasn't been printed yet.
+  vector<pair<PathJob*, size_t>> path_job_log_cursor;
+
+  void run_path_job(WorkStealingPool& pool, PathJob* job) {
+    // this may run inline within another job's submit() call, so save and
+    // restore that job's log buffer
+    string* prev_log_buffer = log_buffer;
+    string log;
+    log_buffer = &log;
+
+    vector<unique_ptr<PathJob>> children;
+    bool is_dir = false;
+    bool ret = false;
+    try {
+      if (isdir(job->filename)) {
+        is_dir = true;
+        print_log(">>> %s (directory)\n", job->filename.c_str());
+
+        unordered_set<string> items;
+        try {
+          items = list_directory(job->filename);
+        } catch (const runtime_error& e) {
+          print_log("warning: can\'t list directory: %s\n", e.what());
+          is_dir = false;
+        }
+
+        if (is_dir) {
+          vector<string> sorted_items;
+          sorted_items.insert(sorted_items.end(), items.begin(), items.end());
+          sort(sorted_items.begin(), sorted_items.end());
+
+          size_t last_slash_pos = job->filename.rfind('/');
+          string base_filename = (last_slash_pos == string::npos) ? job->filename :
+              job->filename.substr(last_slash_pos + 1);
+
+          job->sub_out_dir = job->out_dir + "/" + base_filename;
+          mkdir(job->sub_out_dir.c_str(), 0777);
+
+          for (const string& item : sorted_items) {
+            children.emplace_back(new PathJob(
+                job, job->filename + "/" + item, job->sub_out_dir));
+          }
+        }
+
+      } else {
+        print_log(">>> %s\n", job->filename.c_str());
+        ret = this->disassemble_file(job->filename, job->out_dir);
+      }
+    } catch (const exception& e) {
+      print_log("failed on %s: %s\n", job->filename.c_str(), e.what());
+    }
+    log_buffer = prev_log_buffer;
+
+    // the extra count here keeps the directory from being finished before
+    // all of its children have been submitted
+    job->children_remaining = children.size() + 1;
+    vector<PathJob*> children_to_submit;
+    for (const auto& child : children) {
+      children_to_submit.emplace_back(child.get());
+    }
+    {
+      lock_guard<mutex> g(this->path_job_log_lock);
+      job->log = move(log);
+      job->children = move(children);
+      job->log_done = true;
+    }
+    this->flush_path_job_logs();
+
+    if (is_dir) {
+      for (PathJob* child : children_to_submit) {
+        pool.submit([this, &pool, child]() {
+          this->run_path_job(pool, child);
+        });
+      }
+      this->finish_path_job_child(job);
+    } else {
+      this->finish_path_job(job, ret);
+    }
+  }
+
+  void finish_path_job(PathJob* job, bool exported) {
+    if (exported) {
+      job->exported = true;
+    }
+    if (job->parent) {
+      if (exported) {
+        job->parent->exported = true;
+      }
+      this->finish_path_job_child(job->parent);
+    }
+  }
+
+  void finish_path_job_child(PathJob* dir_job) {
+    if (--dir_job->children_remaining != 0) {
+      return;
+    }
+    // all files within this directory are done
+    if (!dir_job->exported) {
+      rmdir(dir_job->sub_out_dir.c_str());
+    }
+    this->finish_path_job(dir_job, dir_job->exported);
+  }
+
+  // Prints all logs that are ready to be printed, in order
+  void flush_path_job_logs() {
+    lock_guard<mutex> g(this->path_job_log_lock);
+    while (!this->path_job_log_cursor.empty()) {
+      PathJob* job = this->path_job_log_cursor.back().first;
+      size_t next_child_index = this->path_job_log_cursor.back().second;
+      if (next_child_index == SIZE_MAX) {
+        if (!job->log_done) {
+          return;
+        }
+        fwritex(stderr, job->log);
+        job->log.clear();
+        next_child_index = 0;
+      }
+      if (next_child_index < job->children.size()) {
+        this->path_job_log_cursor.back().second = next_child_index + 1;
+        this->path_job_log_cursor.emplace_back(
+            job->children[next_child_index].get(), SIZE_MAX);
+      } else {
+        this->path_job_log_cursor.pop_back();
+      }
+    }
+  }
 };
 
 
@@ -1176,15 +1632,48 @@ Standard options:\n\
   --no-external-decoders\n\
       Only use internal decoders. Currently, this only disables the use of\n\
       picttoppm for decoding PICT resources.\n\
+  --threads=N\n\
+      Decode and write up to N resources from each file in parallel. The output\n\
+      (including the log) is the same as with a single thread, except for the\n\
+      timings and decompressor reuse notes from --debug-decompression. The\n\
+      default is 1.\n\
+  --file-threads=N\n\
+      When input_filename is a directory, disassemble up to N files within it\n\
+      in parallel. The output (including the log) is the same as with a single\n\
+      thread (with the same exceptions as for --threads), but each file\'s log\n\
+      messages are printed only after the file is done. This can be combined\n\
+      with --threads. The default is 1.\n\
 \n\
 Decompression debugging options:\n\
   --skip-decompression\n\
       Do not attempt to decompress compressed resources; instead, export the\n\
       compressed data as-is.\n\
+  --decompression-cycle-limit=N\n\
+      Stop the emulated decompressors after N instructions for each resource,\n\
+      and export the compressed data instead. By default, there is no limit.\n\
+  --decompression-time-limit=SECONDS\n\
+      Stop the emulated decompressors after this much time for each resource,\n\
+      and export the compressed data instead. By default, there is no limit.\n\
+      When either limit is given, the number of resources that exceeded each\n\
+      limit is printed at the end.\n\
   --debug-decompression\n\
       Show memory and CPU state when running resource decompressors. This slows\n\
       them down considerably and is generally only used for finding bugs and\n\
       missing features in the emulated CPUs.\n\
+  --trace-decompression\n\
+      Record a compact execution trace of each emulated decompressor, and if\n\
+      it fails, save the most recent part of the trace to a file in the current\n\
+      directory. The traces can be printed or compared with trace_dasm. This is\n\
+      much faster than --debug-decompression.\n\
+  --profile-decompression\n\
+      Count every instruction run by the emulated decompressors, and when done,\n\
+      print a report for each decompressor showing the most frequently run\n\
+      instructions, kinds of instructions, and blocks of code. This slows the\n\
+      decompressors down somewhat.\n\
+  --profile-decompression-by-sampling\n\
+      Like --profile-decompression, but only sample the running instruction\n\
+      about once every 1000 instructions. This doesn't slow down the\n\
+      decompressors, but the report doesn't include blocks.\n\
   --skip-file-dcmp\n\
       Don\'t attempt to use any 68K decompressors from the input file.\n\
   --skip-file-ncmp\n\
@@ -1193,6 +1682,18 @@ Decompression debugging options:\n\
       Don\'t attempt to use the default 68K decompressors.\n\
   --skip-system-ncmp\n\
       Don\'t attempt to use the default PEFF decompressors.\n\
+  --skip-native-decompression\n\
+      Don\'t use the native implementations of the default decompressors;\n\
+      always run the 68K or PowerPC code instead.\n\
+  --verify-native-decompression\n\
+      Run both the native and emulated implementations of the default\n\
+      decompressors, and show a warning if their results differ. This is slow,\n\
+      since it always runs the emulated decompressors.\n\
+  --verify-emulation\n\
+      Run each instruction of 68K decompressors through both the emulator\'s\n\
+      fast path and its reference interpreter, and fail decompression if the\n\
+      results differ. This is very slow, and is generally only used for finding\n\
+      bugs in the emulator.\n\
 \n\
 Exclusive options (if any of these are given, all other options are ignored):\n\
   --decode-type=TYPE\n\
@@ -1220,6 +1721,8 @@ int main(int argc, char* argv[]) {
   bool disassemble_ppc = false;
   bool disassemble_pef = false;
   bool parse_data = false;
+  uint64_t decompression_cycle_limit = 0;
+  uint64_t decompression_time_limit_usecs = 0;
   for (int x = 1; x < argc; x++) {
     if (argv[x][0] == '-') {
       if (!strncmp(argv[x], "--decode-type=", 14)) {
@@ -1314,11 +1817,33 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "note: reading data forks as resource forks\n");
         exporter.use_data_fork = true;
 
+      } else if (!strncmp(argv[x], "--threads=", 10)) {
+        exporter.num_threads = strtoul(&argv[x][10], NULL, 0);
+        if (exporter.num_threads == 0) {
+          exporter.num_threads = 1;
+        }
+
+      } else if (!strncmp(argv[x], "--file-threads=", 15)) {
+        exporter.num_file_threads = strtoul(&argv[x][15], NULL, 0);
+        if (exporter.num_file_threads == 0) {
+          exporter.num_file_threads = 1;
+        }
+
       } else if (!strcmp(argv[x], "--skip-decompression")) {
         exporter.decompress_flags |= DecompressionFlag::DISABLED;
+      } else if (!strncmp(argv[x], "--decompression-cycle-limit=", 28)) {
+        decompression_cycle_limit = strtoull(&argv[x][28], NULL, 0);
+      } else if (!strncmp(argv[x], "--decompression-time-limit=", 27)) {
+        decompression_time_limit_usecs = strtod(&argv[x][27], NULL) * 1000000.0;
 
       } else if (!strcmp(argv[x], "--debug-decompression")) {
         exporter.decompress_flags |= DecompressionFlag::VERBOSE;
+      } else if (!strcmp(argv[x], "--trace-decompression")) {
+        exporter.decompress_flags |= DecompressionFlag::TRACE;
+      } else if (!strcmp(argv[x], "--profile-decompression")) {
+        exporter.decompress_flags |= DecompressionFlag::PROFILE;
+      } else if (!strcmp(argv[x], "--profile-decompression-by-sampling")) {
+        exporter.decompress_flags |= DecompressionFlag::PROFILE_BY_SAMPLING;
 
       } else if (!strcmp(argv[x], "--skip-file-dcmp")) {
         exporter.decompress_flags |= DecompressionFlag::SKIP_FILE_DCMP;
@@ -1328,6 +1853,12 @@ int main(int argc, char* argv[]) {
         exporter.decompress_flags |= DecompressionFlag::SKIP_SYSTEM_DCMP;
       } else if (!strcmp(argv[x], "--skip-system-ncmp")) {
         exporter.decompress_flags |= DecompressionFlag::SKIP_SYSTEM_NCMP;
+      } else if (!strcmp(argv[x], "--skip-native-decompression")) {
+        exporter.decompress_flags |= DecompressionFlag::SKIP_NATIVE;
+      } else if (!strcmp(argv[x], "--verify-native-decompression")) {
+        exporter.decompress_flags |= DecompressionFlag::VERIFY_NATIVE;
+      } else if (!strcmp(argv[x], "--verify-emulation")) {
+        exporter.decompress_flags |= DecompressionFlag::VERIFY_EMULATION;
 
       } else {
         fprintf(stderr, "unknown option: %s\n", argv[x]);
@@ -1404,7 +1935,29 @@ int main(int argc, char* argv[]) {
   }
   mkdir(out_dir.c_str(), 0777);
 
-  exporter.disassemble_path(filename, out_dir);
+  ResourceFile::set_decompression_limits(decompression_cycle_limit,
+      decompression_time_limit_usecs);
+  // Send ResourceFile's messages to the current job's log buffer, so they stay
+  // in order when exporting on multiple threads
+  ResourceFile::set_log_function([](const string& text) {
+    print_log("%s", text.c_str());
+  });
+
+  if (exporter.num_file_threads > 1) {
+    exporter.disassemble_path_parallel(filename, out_dir);
+  } else {
+    exporter.disassemble_path(filename, out_dir);
+  }
+
+  if (exporter.decompress_flags & (DecompressionFlag::PROFILE | DecompressionFlag::PROFILE_BY_SAMPLING)) {
+    ResourceFile::print_decompressor_profiles(stderr);
+  }
+
+  if (decompression_cycle_limit || decompression_time_limit_usecs) {
+    auto stats = ResourceFile::decompression_limit_stats();
+    fprintf(stderr, "note: %zu resources exceeded the decompression cycle limit, and %zu exceeded the time limit\n",
+        stats.cycle_limit_count, stats.time_limit_count);
+  }
 
   return 0;
 }
@@ -0,0 +1,204 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <string>
+#include <vector>
+
+#include "ExecutionTrace.hh"
+#include "M68KEmulator.hh"
+#include "PPC32Emulator.hh"
+
+using namespace std;
+
+
+
+static string format_record(ExecutionTrace::Architecture arch,
+    const ExecutionTrace::Record& rec) {
+  string disassembly;
+  if (arch == ExecutionTrace::Architecture::M68K) {
+    disassembly = M68KEmulator::disassemble_one(rec.opcode.data(),
+        rec.opcode.size(), rec.pc);
+  } else if (rec.opcode.size() == 4) {
+    uint32_t opcode = bswap32(*reinterpret_cast<const uint32_t*>(rec.opcode.data()));
+    disassembly = string_printf(" %08" PRIX32 "  ", opcode) +
+        PPC32Emulator::disassemble(rec.pc, opcode);
+  } else {
+    disassembly = " .incomplete";
+  }
+  if (disassembly.size() < 56) {
+    disassembly.resize(56, ' ');
+  }
+
+  string ret = string_printf("%10" PRIu64 " %08" PRIX32 " %s", rec.index,
+      rec.pc, disassembly.c_str());
+  for (const auto& it : rec.register_changes) {
+    ret += string_printf(" %s=%08" PRIX32,
+        ExecutionTrace::register_name(arch, it.first).c_str(), it.second);
+  }
+  for (const auto& mw : rec.memory_writes) {
+    ret += string_printf(" [%08" PRIX32 "]=", mw.addr);
+    if (mw.data.empty()) {
+      ret += string_printf("(%hu bytes)", mw.size);
+    } else {
+      for (char ch : mw.data) {
+        ret += string_printf("%02hhX", static_cast<uint8_t>(ch));
+      }
+    }
+  }
+  return ret;
+}
+
+static string format_registers(ExecutionTrace::Architecture arch,
+    const vector<uint32_t>& regs) {
+  string ret;
+  for (size_t x = 0; x < regs.size(); x++) {
+    ret += string_printf(" %s=%08" PRIX32,
+        ExecutionTrace::register_name(arch, x).c_str(), regs[x]);
+  }
+  return ret;
+}
+
+static bool records_equal(const ExecutionTrace::Record& a,
+    const ExecutionTrace::Record& b) {
+  if ((a.pc != b.pc) || (a.opcode != b.opcode) ||
+      (a.register_changes != b.register_changes) ||
+      (a.memory_writes.size() != b.memory_writes.size())) {
+    return false;
+  }
+  for (size_t x = 0; x < a.memory_writes.size(); x++) {
+    const auto& a_mw = a.memory_writes[x];
+    const auto& b_mw = b.memory_writes[x];
+    if ((a_mw.addr != b_mw.addr) || (a_mw.size != b_mw.size) ||
+        (a_mw.data != b_mw.data)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void print_trace(const ExecutionTrace& trace) {
+  auto arch = trace.architecture();
+  auto records = trace.records();
+  fprintf(stdout, "%s trace with %zu instructions",
+      (arch == ExecutionTrace::Architecture::M68K) ? "68K" : "PowerPC",
+      records.size());
+  if (trace.first_record_index()) {
+    fprintf(stdout, " (%" PRIu64 " earlier instructions were not kept)",
+        trace.first_record_index());
+  }
+  fprintf(stdout, "\ninitial registers:%s\n",
+      format_registers(arch, trace.initial_registers()).c_str());
+  for (const auto& rec : records) {
+    fprintf(stdout, "%s\n", format_record(arch, rec).c_str());
+  }
+}
+
+static int diff_traces(const ExecutionTrace& a, const ExecutionTrace& b,
+    size_t context) {
+  auto arch = a.architecture();
+  if (b.architecture() != arch) {
+    fprintf(stderr, "traces are for different architectures\n");
+    return 2;
+  }
+
+  // records are compared by index, so only the part of the execution that
+  // both traces still have can be compared
+  auto a_records = a.records();
+  auto b_records = b.records();
+  uint64_t a_end = a.first_record_index() + a_records.size();
+  uint64_t b_end = b.first_record_index() + b_records.size();
+  uint64_t start = max(a.first_record_index(), b.first_record_index());
+  uint64_t end = min(a_end, b_end);
+  if (start >= end) {
+    fprintf(stderr, "traces have no instructions in common\n");
+    return 2;
+  }
+  size_t a_offset = start - a.first_record_index();
+  size_t b_offset = start - b.first_record_index();
+
+  if ((a.first_record_index() == b.first_record_index()) &&
+      (a.initial_registers() != b.initial_registers())) {
+    fprintf(stdout, "initial registers differ\n< %s\n> %s\n",
+        format_registers(arch, a.initial_registers()).c_str(),
+        format_registers(arch, b.initial_registers()).c_str());
+    return 1;
+  }
+
+  uint64_t index = start;
+  for (; index < end; index++) {
+    if (!records_equal(a_records[index - start + a_offset],
+        b_records[index - start + b_offset])) {
+      break;
+    }
+  }
+  if (index == end) {
+    if (a_end == b_end) {
+      fprintf(stdout, "traces are identical\n");
+      return 0;
+    }
+    fprintf(stdout, "traces are identical up to instruction %" PRIu64
+        ", where the %s one ends\n", end, (a_end < b_end) ? "first" : "second");
+    return 1;
+  }
+
+  uint64_t context_start = (index - start > context) ? (index - context) : start;
+  for (uint64_t z = context_start; z < index; z++) {
+    fprintf(stdout, "  %s\n",
+        format_record(arch, a_records[z - start + a_offset]).c_str());
+  }
+  fprintf(stdout, "< %s\n",
+      format_record(arch, a_records[index - start + a_offset]).c_str());
+  fprintf(stdout, "> %s\n",
+      format_record(arch, b_records[index - start + b_offset]).c_str());
+  return 1;
+}
+
+void print_usage(const char* argv0) {
+  fprintf(stderr, "\
+Usage: %s [options] trace_filename [other_trace_filename]\n\
+\n\
+Prints an execution trace saved by resource_dasm --trace-decompression, one\n\
+instruction per line, with the registers and memory each instruction changed.\n\
+If two traces are given, compares them instead, and prints the first\n\
+instruction at which they differ along with the instructions before it. In that\n\
+case, the exit status is 0 if the traces are identical and 1 if not.\n\
+\n\
+Options:\n\
+  --context=N\n\
+      When comparing traces, show N instructions before the first difference.\n\
+      The default is 10.\n\
+\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  vector<const char*> filenames;
+  size_t context = 10;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--context=", 10)) {
+      context = strtoull(&argv[x][10], NULL, 0);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage(argv[0]);
+      return 2;
+    } else {
+      filenames.emplace_back(argv[x]);
+    }
+  }
+  if ((filenames.size() < 1) || (filenames.size() > 2)) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  ExecutionTrace trace(load_file(filenames[0]));
+  if (filenames.size() == 1) {
+    print_trace(trace);
+    return 0;
+  }
+  ExecutionTrace other_trace(load_file(filenames[1]));
+  return diff_traces(trace, other_trace, context);
+}